@@ -71,6 +71,11 @@ internal static class Bindings
     public static extern void led_canvas_set_pixels(IntPtr canvas, int x, int y, int width, int height,
                                                     ref Color colors);
 
+    [DllImport(Lib)]
+    public static extern int set_image_view(IntPtr canvas, int canvas_offset_x, int canvas_offset_y,
+                                            int image_width, int image_height, PixelFormat format,
+                                            IntPtr[] planes, int[] strides);
+
     [DllImport(Lib)]
     public static extern void led_canvas_clear(IntPtr canvas);
 
@@ -0,0 +1,14 @@
+namespace RPiRgbLEDMatrix;
+
+/// <summary>
+/// Pixel layouts of image buffers passed to <see cref="RGBLedCanvas.SetImage"/>.
+/// </summary>
+public enum PixelFormat
+{
+    Rgb24 = 0,
+    Bgr24 = 1,
+    Rgba32 = 2,
+    Bgra32 = 3,
+    Rgb565 = 4,
+    Gray8 = 5
+}
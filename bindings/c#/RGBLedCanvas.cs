@@ -1,3 +1,5 @@
+using System.Runtime.InteropServices;
+
 namespace RPiRgbLEDMatrix;
 
 /// <summary>
@@ -52,6 +54,43 @@ public class RGBLedCanvas
         led_canvas_set_pixels(_canvas, x, y, width, height, ref colors[0]);
     }
 
+    /// <summary>
+    /// Draws an image buffer at the specified position, cropped to the canvas.
+    /// The buffer is read in place, no conversion to <see cref="Color"/> is needed.
+    /// </summary>
+    /// <param name="x">The X coordinate of the top-left pixel of the image.</param>
+    /// <param name="y">The Y coordinate of the top-left pixel of the image.</param>
+    /// <param name="width">Width of the image.</param>
+    /// <param name="height">Height of the image.</param>
+    /// <param name="data">Buffer containing the pixels.</param>
+    /// <param name="stride">Number of bytes from the start of one row to the next.</param>
+    /// <param name="format">Layout of the pixels in the buffer.</param>
+    public void SetImage(int x, int y, int width, int height, byte[] data, int stride, PixelFormat format)
+    {
+        var bytesPerPixel = format switch
+        {
+            PixelFormat.Rgb24 or PixelFormat.Bgr24 => 3,
+            PixelFormat.Rgba32 or PixelFormat.Bgra32 => 4,
+            PixelFormat.Rgb565 => 2,
+            _ => 1
+        };
+        if (width <= 0 || height <= 0)
+            return;
+        if (stride < width * bytesPerPixel || data.Length < stride * (height - 1) + width * bytesPerPixel)
+            throw new ArgumentOutOfRangeException(nameof(data));
+
+        var handle = GCHandle.Alloc(data, GCHandleType.Pinned);
+        try
+        {
+            var planes = new[] { handle.AddrOfPinnedObject(), IntPtr.Zero, IntPtr.Zero };
+            set_image_view(_canvas, x, y, width, height, format, planes, new[] { stride, 0, 0 });
+        }
+        finally
+        {
+            handle.Free();
+        }
+    }
+
     /// <summary>
     /// Sets the color of the entire canvas.
     /// </summary>
@@ -1,7 +1,7 @@
 #include "choochoo.h"
 
 #include "common.h"
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 
 #include <unistd.h>
@@ -254,7 +254,7 @@ int **calc_smoke_matrix(int frame, int num_carts)
     return matrix;
 }
 
-rgb_matrix::FrameCanvas *draw_frame(rgb_matrix::RGBMatrix *rgb_mat, rgb_matrix::FrameCanvas *offscreen_canvas, int **lok_static, int **wheels, int **smoke, const rgb_matrix::Color &color)
+rgb_matrix::FrameCanvas *draw_frame(rgb_matrix::ProgramContext *rgb_mat, rgb_matrix::FrameCanvas *offscreen_canvas, int **lok_static, int **wheels, int **smoke, const rgb_matrix::Color &color)
 {
     for (int i = 0; i < ROWS; i++)
     {
@@ -269,7 +269,7 @@ rgb_matrix::FrameCanvas *draw_frame(rgb_matrix::RGBMatrix *rgb_mat, rgb_matrix::
     return offscreen_canvas;
 }
 
-rgb_matrix::FrameCanvas *draw_lok(rgb_matrix::RGBMatrix *rgb_mat, rgb_matrix::FrameCanvas *offscreen_canvas, int **lok_static, int **wheels, int **smoke, const rgb_matrix::Color &color)
+rgb_matrix::FrameCanvas *draw_lok(rgb_matrix::ProgramContext *rgb_mat, rgb_matrix::FrameCanvas *offscreen_canvas, int **lok_static, int **wheels, int **smoke, const rgb_matrix::Color &color)
 {
     offscreen_canvas->Clear();
     offscreen_canvas = draw_frame(rgb_mat, offscreen_canvas, lok_static, wheels, smoke, color);
@@ -281,22 +281,10 @@ static bool parseColor(rgb_matrix::Color *c, const char *str)
     return sscanf(str, "%hhu,%hhu,%hhu", &c->r, &c->g, &c->b) == 3;
 }
 
-int main(int argc, char **argv)
+extern "C" int DisplayProgramMain(rgb_matrix::ProgramContext *rgb_mat, int argc, char **argv)
 {
     srand(time(nullptr));
 
-    rgb_matrix::RGBMatrix::Options matrix_options;
-    rgb_matrix::RuntimeOptions runtime_opt;
-    matrix_options.hardware_mapping = HW_ID;
-    matrix_options.rows = LED_MATRIX_HEIGHT;
-    matrix_options.cols = LED_MATRIX_WIDTH;
-    matrix_options.chain_length = BOSS_WIDTH;
-    if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                           &matrix_options, &runtime_opt))
-    {
-        return usage(argv[0]);
-    }
-
     int num_carts = rand() % DEFAULT_MAX_NUM_CARTS + 1;
 
     int opt;
@@ -332,8 +320,7 @@ int main(int argc, char **argv)
         return usage(argv[0]);
     }
 
-    auto *rgb_mat = rgb_matrix::RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-    if (rgb_mat == nullptr)
+    if (!rgb_mat->StartDisplay())
     {
         fprintf(stderr, "Failed to initialize rgb-matrix!\n");
         return -1;
@@ -364,7 +351,7 @@ int main(int argc, char **argv)
 
     int continuum = 0;
     int anim_len = ANIM_LENGTH - (DEFAULT_MAX_NUM_CARTS - num_carts) * ANIM_CART_OFFSET;
-    for (int i = 0; i < anim_len; i++)
+    for (int i = 0; i < anim_len && !rgb_mat->interrupted(); i++)
     {
         if (rainbow)
         {
@@ -419,7 +406,16 @@ int main(int argc, char **argv)
         }
     }
 
-    delete rgb_mat;
-
     return 0;
+}
+
+int main(int argc, char **argv)
+{
+    rgb_matrix::RGBMatrix::Options matrix_options;
+    matrix_options.hardware_mapping = HW_ID;
+    matrix_options.rows = LED_MATRIX_HEIGHT;
+    matrix_options.cols = LED_MATRIX_WIDTH;
+    matrix_options.chain_length = BOSS_WIDTH;
+    return rgb_matrix::RunDisplayProgram(argc, argv, matrix_options,
+                                         DisplayProgramMain);
 }
\ No newline at end of file
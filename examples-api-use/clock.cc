@@ -5,27 +5,22 @@
 // This code is public domain
 // (but note, that the led-matrix library this depends on is GPL v2)
 
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 
 #include <getopt.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <vector>
 #include <string>
 
 using namespace rgb_matrix;
 
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo) {
-  interrupt_received = true;
-}
-
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s [options]\n", progname);
   fprintf(stderr, "Reads text from stdin and displays it. "
@@ -43,6 +38,7 @@ static int usage(const char *progname) {
           "\t-C <r,g,b>        : Color. Default 255,255,0\n"
           "\t-B <r,g,b>        : Background-Color. Default 0,0,0\n"
           "\t-O <r,g,b>        : Outline-Color, e.g. to increase contrast.\n"
+          "\t-z <factor>       : Scale font by factor 2 or 3 for big digits.\n"
           "\n"
           );
   rgb_matrix::PrintMatrixFlags(stderr);
@@ -59,14 +55,8 @@ static bool FullSaturation(const Color &c) {
     && (c.b == 0 || c.b == 255);
 }
 
-int main(int argc, char *argv[]) {
-  RGBMatrix::Options matrix_options;
-  rgb_matrix::RuntimeOptions runtime_opt;
-  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                         &matrix_options, &runtime_opt)) {
-    return usage(argv[0]);
-  }
-
+extern "C" int DisplayProgramMain(ProgramContext *context,
+                                  int argc, char *argv[]) {
   // We accept multiple format lines
 
   std::vector<std::string> format_lines;
@@ -80,9 +70,10 @@ int main(int argc, char *argv[]) {
   int y_orig = 0;
   int letter_spacing = 0;
   int line_spacing = 0;
+  int font_scale = 1;
 
   int opt;
-  while ((opt = getopt(argc, argv, "x:y:f:C:B:O:s:S:d:")) != -1) {
+  while ((opt = getopt(argc, argv, "x:y:f:C:B:O:s:S:d:z:")) != -1) {
     switch (opt) {
     case 'd': format_lines.push_back(optarg); break;
     case 'x': x_orig = atoi(optarg); break;
@@ -90,6 +81,13 @@ int main(int argc, char *argv[]) {
     case 'f': bdf_font_file = strdup(optarg); break;
     case 's': line_spacing = atoi(optarg); break;
     case 'S': letter_spacing = atoi(optarg); break;
+    case 'z':
+      font_scale = atoi(optarg);
+      if (font_scale < 1 || font_scale > 3) {
+        fprintf(stderr, "Font scale needs to be 1, 2 or 3\n");
+        return usage(argv[0]);
+      }
+      break;
     case 'C':
       if (!parseColor(&color, optarg)) {
         fprintf(stderr, "Invalid color spec: %s\n", optarg);
@@ -126,58 +124,72 @@ int main(int argc, char *argv[]) {
   /*
    * Load font. This needs to be a filename with a bdf bitmap font.
    */
-  rgb_matrix::Font font;
-  if (!font.LoadFont(bdf_font_file)) {
+  rgb_matrix::Font loaded_font;
+  if (!loaded_font.LoadFont(bdf_font_file)) {
     fprintf(stderr, "Couldn't load font '%s'\n", bdf_font_file);
     return 1;
   }
+  // Big digits: scaled glyphs are derived from the loaded font on first use.
+  rgb_matrix::Font *scaled_font = NULL;
+  if (font_scale > 1) {
+    scaled_font = loaded_font.CreateDerivedFont(font_scale == 2
+                                                ? rgb_matrix::Font::SCALE_2X
+                                                : rgb_matrix::Font::SCALE_3X);
+  }
+  const rgb_matrix::Font &font = scaled_font ? *scaled_font : loaded_font;
   rgb_matrix::Font *outline_font = NULL;
   if (with_outline) {
-    outline_font = font.CreateOutlineFont();
+    outline_font = font.CreateDerivedFont(rgb_matrix::Font::OUTLINE);
   }
 
-  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-  if (matrix == NULL)
+  if (!context->StartDisplay())
     return 1;
 
-  const bool all_extreme_colors = (matrix_options.brightness == 100)
+  const bool all_extreme_colors = (context->brightness() == 100)
     && FullSaturation(color)
     && FullSaturation(bg_color)
     && FullSaturation(outline_color);
   if (all_extreme_colors)
-    matrix->SetPWMBits(1);
+    context->SetPWMBits(1);
 
   const int x = x_orig;
   int y = y_orig;
 
-  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  FrameCanvas *offscreen = context->CreateFrameCanvas();
 
   char text_buffer[256];
+  // Most lines don't change every second (e.g. a date), so keep the laid out
+  // text of each line and only lay it out again if it changed.
+  std::vector<std::string> shown_text(format_lines.size());
+  std::vector<rgb_matrix::TextLayout> text_layouts(format_lines.size());
+  std::vector<rgb_matrix::TextLayout> outline_layouts(format_lines.size());
   struct timespec next_time;
   next_time.tv_sec = time(NULL);
   next_time.tv_nsec = 0;
   struct tm tm;
 
-  signal(SIGTERM, InterruptHandler);
-  signal(SIGINT, InterruptHandler);
-
-  while (!interrupt_received) {
+  while (!context->interrupted()) {
     offscreen->Fill(bg_color.r, bg_color.g, bg_color.b);
     localtime_r(&next_time.tv_sec, &tm);
 
     int line_offset = 0;
-    for (const std::string &line : format_lines) {
-      strftime(text_buffer, sizeof(text_buffer), line.c_str(), &tm);
+    for (size_t i = 0; i < format_lines.size(); ++i) {
+      strftime(text_buffer, sizeof(text_buffer), format_lines[i].c_str(), &tm);
+      if (shown_text[i] != text_buffer) {
+        shown_text[i] = text_buffer;
+        text_layouts[i].Layout(font, text_buffer, letter_spacing);
+        if (outline_font) {
+          outline_layouts[i].Layout(*outline_font, text_buffer,
+                                    letter_spacing - 2);
+        }
+      }
       if (outline_font) {
-        rgb_matrix::DrawText(offscreen, *outline_font,
-                             x - 1, y + font.baseline() + line_offset,
-                             outline_color, NULL, text_buffer,
-                             letter_spacing - 2);
+        outline_layouts[i].Draw(offscreen,
+                                x - 1, y + font.baseline() + line_offset,
+                                outline_color);
       }
-      rgb_matrix::DrawText(offscreen, font,
-                           x, y + font.baseline() + line_offset,
-                           color, NULL, text_buffer,
-                           letter_spacing);
+      text_layouts[i].Draw(offscreen, x, y + font.baseline() + line_offset,
+                           color);
       line_offset += font.height() + line_spacing;
     }
 
@@ -185,14 +197,17 @@ int main(int argc, char *argv[]) {
     clock_nanosleep(CLOCK_REALTIME, TIMER_ABSTIME, &next_time, NULL);
 
     // Atomic swap with double buffer
-    offscreen = matrix->SwapOnVSync(offscreen);
+    offscreen = context->SwapOnVSync(offscreen);
 
-    next_time.tv_sec += 1;
+    // Don't fall behind if we were not shown for a while.
+    next_time.tv_sec = std::max(next_time.tv_sec + 1, time(NULL));
   }
 
-  // Finished. Shut down the RGB matrix.
-  delete matrix;
-
   write(STDOUT_FILENO, "\n", 1);  // Create a fresh new line after ^C on screen
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  return RunDisplayProgram(argc, argv, RGBMatrix::Options(),
+                           DisplayProgramMain);
+}
@@ -5,7 +5,7 @@
 // covered by the GPL v2)
 //
 // This is a grab-bag of various demos and not very readable.
-#include "led-matrix.h"
+#include "display-program.h"
 
 #include "pixel-mapper.h"
 #include "graphics.h"
@@ -14,7 +14,6 @@
 #include <getopt.h>
 #include <limits.h>
 #include <math.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -30,22 +29,18 @@ using std::max;
 
 using namespace rgb_matrix;
 
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo) {
-  interrupt_received = true;
-}
-
 class DemoRunner {
 protected:
-  DemoRunner(Canvas *canvas) : canvas_(canvas) {}
+  DemoRunner(ProgramContext *canvas) : canvas_(canvas) {}
   inline Canvas *canvas() { return canvas_; }
+  inline bool interrupted() { return canvas_->interrupted(); }
 
 public:
   virtual ~DemoRunner() {}
   virtual void Run() = 0;
 
 private:
-  Canvas *const canvas_;
+  ProgramContext *const canvas_;
 };
 
 /*
@@ -56,12 +51,12 @@ private:
 // Simple generator that pulses through RGB and White.
 class ColorPulseGenerator : public DemoRunner {
 public:
-  ColorPulseGenerator(RGBMatrix *m) : DemoRunner(m), matrix_(m) {
+  ColorPulseGenerator(ProgramContext *m) : DemoRunner(m), matrix_(m) {
     off_screen_canvas_ = m->CreateFrameCanvas();
   }
   void Run() override {
     uint32_t continuum = 0;
-    while (!interrupt_received) {
+    while (!interrupted()) {
       usleep(5 * 1000);
       continuum += 1;
       continuum %= 3 * 255;
@@ -85,21 +80,21 @@ public:
   }
 
 private:
-  RGBMatrix *const matrix_;
+  ProgramContext *const matrix_;
   FrameCanvas *off_screen_canvas_;
 };
 
 // Simple generator that pulses through brightness on red, green, blue and white
 class BrightnessPulseGenerator : public DemoRunner {
 public:
-  BrightnessPulseGenerator(RGBMatrix *m)
+  BrightnessPulseGenerator(ProgramContext *m)
     : DemoRunner(m), matrix_(m) {}
   void Run() override {
     const uint8_t max_brightness = matrix_->brightness();
     const uint8_t c = 255;
     uint8_t count = 0;
 
-    while (!interrupt_received) {
+    while (!interrupted()) {
       if (matrix_->brightness() < 1) {
         matrix_->SetBrightness(max_brightness);
         count++;
@@ -119,12 +114,12 @@ public:
   }
 
 private:
-  RGBMatrix *const matrix_;
+  ProgramContext *const matrix_;
 };
 
 class SimpleSquare : public DemoRunner {
 public:
-  SimpleSquare(Canvas *m) : DemoRunner(m) {}
+  SimpleSquare(ProgramContext *m) : DemoRunner(m) {}
   void Run() override {
     const int width = canvas()->width() - 1;
     const int height = canvas()->height() - 1;
@@ -142,7 +137,7 @@ public:
 
 class GrayScaleBlock : public DemoRunner {
 public:
-  GrayScaleBlock(Canvas *m) : DemoRunner(m) {}
+  GrayScaleBlock(ProgramContext *m) : DemoRunner(m) {}
   void Run() override {
     const int sub_blocks = 16;
     const int width = canvas()->width();
@@ -150,7 +145,7 @@ public:
     const int x_step = max(1, width / sub_blocks);
     const int y_step = max(1, height / sub_blocks);
     uint8_t count = 0;
-    while (!interrupt_received) {
+    while (!interrupted()) {
       for (int y = 0; y < height; ++y) {
         for (int x = 0; x < width; ++x) {
           int c = sub_blocks * (y / y_step) + x / x_step;
@@ -171,7 +166,7 @@ public:
 // Simple class that generates a rotating block on the screen.
 class RotatingBlockGenerator : public DemoRunner {
 public:
-  RotatingBlockGenerator(Canvas *m) : DemoRunner(m) {}
+  RotatingBlockGenerator(ProgramContext *m) : DemoRunner(m) {}
 
   uint8_t scale_col(int val, int lo, int hi) {
     if (val < lo) return 0;
@@ -197,7 +192,7 @@ public:
 
     const float deg_to_rad = 2 * 3.14159265 / 360;
     int rotation = 0;
-    while (!interrupt_received) {
+    while (!interrupted()) {
       ++rotation;
       usleep(15 * 1000);
       rotation %= 360;
@@ -233,7 +228,7 @@ class ImageScroller : public DemoRunner {
 public:
   // Scroll image with "scroll_jumps" pixels every "scroll_ms" milliseconds.
   // If "scroll_ms" is negative, don't do any scrolling.
-  ImageScroller(RGBMatrix *m, int scroll_jumps, int scroll_ms = 30)
+  ImageScroller(ProgramContext *m, int scroll_jumps, int scroll_ms = 30)
     : DemoRunner(m), scroll_jumps_(scroll_jumps),
       scroll_ms_(scroll_ms),
       horizontal_position_(0),
@@ -290,7 +285,7 @@ public:
   void Run() override {
     const int screen_height = offscreen_->height();
     const int screen_width = offscreen_->width();
-    while (!interrupt_received) {
+    while (!interrupted()) {
       {
         MutexLock l(&mutex_new_image_);
         if (new_image_.IsValid()) {
@@ -368,7 +363,7 @@ private:
 
   int32_t horizontal_position_;
 
-  RGBMatrix* matrix_;
+  ProgramContext* matrix_;
   FrameCanvas* offscreen_;
 };
 
@@ -377,7 +372,7 @@ private:
 // Contributed by: Vliedel
 class Sandpile : public DemoRunner {
 public:
-  Sandpile(Canvas *m, int delay_ms=50)
+  Sandpile(ProgramContext *m, int delay_ms=50)
     : DemoRunner(m), delay_ms_(delay_ms) {
     width_ = canvas()->width() - 1; // We need an odd width
     height_ = canvas()->height() - 1; // We need an odd height
@@ -413,7 +408,7 @@ public:
   }
 
   void Run() override {
-    while (!interrupt_received) {
+    while (!interrupted()) {
       // Drop a sand grain in the centre
       values_[width_/2][height_/2]++;
       updateValues();
@@ -488,7 +483,7 @@ private:
 // Contributed by: Vliedel
 class GameLife : public DemoRunner {
 public:
-  GameLife(Canvas *m, int delay_ms=500, bool torus=true)
+  GameLife(ProgramContext *m, int delay_ms=500, bool torus=true)
     : DemoRunner(m), delay_ms_(delay_ms), torus_(torus) {
     width_ = canvas()->width();
     height_ = canvas()->height();
@@ -542,7 +537,7 @@ public:
   }
 
   void Run() override {
-    while (!interrupt_received) {
+    while (!interrupted()) {
       updateValues();
 
       for (int x=0; x<width_; ++x) {
@@ -641,7 +636,7 @@ private:
 // Contributed by: Vliedel
 class Ant : public DemoRunner {
 public:
-  Ant(Canvas *m, int delay_ms=500)
+  Ant(ProgramContext *m, int delay_ms=500)
     : DemoRunner(m), delay_ms_(delay_ms) {
     numColors_ = 4;
     width_ = canvas()->width();
@@ -670,7 +665,7 @@ public:
       }
     }
 
-    while (!interrupt_received) {
+    while (!interrupted()) {
       // LLRR
       switch (values_[antX_][antY_]) {
       case 0:
@@ -745,7 +740,7 @@ private:
 // Contributed by: Vliedel
 class VolumeBars : public DemoRunner {
 public:
-  VolumeBars(Canvas *m, int delay_ms=50, int numBars=8)
+  VolumeBars(ProgramContext *m, int delay_ms=50, int numBars=8)
     : DemoRunner(m), delay_ms_(delay_ms),
       numBars_(numBars), t_(0) {
   }
@@ -782,7 +777,7 @@ public:
     }
 
     // Start the loop
-    while (!interrupt_received) {
+    while (!interrupted()) {
       if (t_ % 8 == 0) {
         // Change the means
         for (int i=0; i<numBars_; ++i) {
@@ -854,7 +849,7 @@ private:
 /// by bbhsu2 + anonymous
 class GeneticColors : public DemoRunner {
 public:
-  GeneticColors(Canvas *m, int delay_ms = 200)
+  GeneticColors(ProgramContext *m, int delay_ms = 200)
     : DemoRunner(m), delay_ms_(delay_ms) {
     width_ = canvas()->width();
     height_ = canvas()->height();
@@ -882,7 +877,7 @@ public:
       children_[i].dna = rand() & 0xFFFFFF;
     }
 
-    while (!interrupt_received) {
+    while (!interrupted()) {
       swap();
       sort();
       mate();
@@ -1054,26 +1049,12 @@ static int usage(const char *progname) {
   return 1;
 }
 
-int main(int argc, char *argv[]) {
+extern "C" int DisplayProgramMain(ProgramContext *matrix,
+                                  int argc, char *argv[]) {
   int demo = -1;
   int scroll_ms = 30;
 
   const char *demo_parameter = NULL;
-  RGBMatrix::Options matrix_options;
-  rgb_matrix::RuntimeOptions runtime_opt;
-
-  // These are the defaults when no command-line flags are given.
-  matrix_options.rows = 32;
-  matrix_options.cols = 64;
-  matrix_options.chain_length = 3;
-  matrix_options.parallel = 1;
-  matrix_options.hardware_mapping = "adafruit-hat";
-
-  // First things first: extract the command line flags that contain
-  // relevant matrix options.
-  if (!ParseOptionsFromFlags(&argc, &argv, &matrix_options, &runtime_opt)) {
-    return usage(argv[0]);
-  }
 
   int opt;
   while ((opt = getopt(argc, argv, "dD:r:P:c:p:b:m:LR:")) != -1) {
@@ -1100,14 +1081,13 @@ int main(int argc, char *argv[]) {
     return usage(argv[0]);
   }
 
-  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-  if (matrix == NULL)
+  if (!matrix->StartDisplay())
     return 1;
 
   printf("Size: %dx%d. Hardware gpio mapping: %s\n",
-         matrix->width(), matrix->height(), matrix_options.hardware_mapping);
+         matrix->width(), matrix->height(), matrix->hardware_mapping());
 
-  Canvas *canvas = matrix;
+  ProgramContext *canvas = matrix;
 
   // The DemoRunner objects are filling
   // the matrix continuously.
@@ -1172,20 +1152,27 @@ int main(int argc, char *argv[]) {
   if (demo_runner == NULL)
     return usage(argv[0]);
 
-  // Set up an interrupt handler to be able to stop animations while they go
-  // on. Each demo tests for while (!interrupt_received) {},
-  // so they exit as soon as they get a signal.
-  signal(SIGTERM, InterruptHandler);
-  signal(SIGINT, InterruptHandler);
-
   printf("Press <CTRL-C> to exit and reset LEDs\n");
 
-  // Now, run our particular demo; it will exit when it sees interrupt_received.
+  // Now, run our particular demo. Each demo tests for
+  // while (!interrupted()) {}, so it exits as soon as it gets a signal.
   demo_runner->Run();
 
   delete demo_runner;
-  delete canvas;
 
   printf("Received CTRL-C. Exiting.\n");
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+
+  // These are the defaults when no command-line flags are given.
+  matrix_options.rows = 32;
+  matrix_options.cols = 64;
+  matrix_options.chain_length = 3;
+  matrix_options.parallel = 1;
+  matrix_options.hardware_mapping = "adafruit-hat";
+
+  return RunDisplayProgram(argc, argv, matrix_options, DisplayProgramMain);
+}
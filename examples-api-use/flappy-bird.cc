@@ -1,5 +1,5 @@
 #include "common.h"
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 
 #include <string>
@@ -11,7 +11,6 @@
 
 #include <pthread.h>
 #include <getopt.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -31,11 +30,7 @@ public:
 
 std::atomic<char> last_char;
 
-volatile bool interrupt_received = false; // atomic?
-static void InterruptHandler(int signo)
-{
-    interrupt_received = true;
-}
+volatile bool game_over = false; // atomic?
 
 static int usage(const char *progname)
 {
@@ -79,7 +74,7 @@ void *pthread_task_list_keypress(void *)
             perror("tcsetattr ICANON");
     }
 
-    while (!interrupt_received)
+    while (!game_over)
     {
         char buf = 0;
         if (read(STDIN_FILENO, &buf, 1) < 0)
@@ -136,20 +131,8 @@ vector<player_info> readHighScores(const string path){
     return highScores;
 }
 
-int main(int argc, char *argv[])
+extern "C" int DisplayProgramMain(ProgramContext *matrix, int argc, char *argv[])
 {
-    RGBMatrix::Options matrix_options;
-    rgb_matrix::RuntimeOptions runtime_opt;
-	matrix_options.hardware_mapping = HW_ID;
-	matrix_options.rows = LED_MATRIX_HEIGHT;
-	matrix_options.cols = LED_MATRIX_WIDTH;
-	matrix_options.chain_length = BOSS_WIDTH;
-    if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                           &matrix_options, &runtime_opt))
-    {
-        return usage(argv[0]);
-    }
-
     Color bird_color(255, 255, 0);
     Color sky_color(0, 255, 255);
     Color pipe_color(0, 153, 0);
@@ -218,13 +201,9 @@ int main(int argc, char *argv[])
 
     float velocity = jump_velocity;
 
-    RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-    if (matrix == NULL)
+    if (!matrix->StartDisplay())
         return 1;
 
-    signal(SIGTERM, InterruptHandler);
-    signal(SIGINT, InterruptHandler);
-
     printf("CTRL-C for exit.\n");
 
     // Create canvases to be used with led_matrix_swap_on_vsync
@@ -232,11 +211,12 @@ int main(int argc, char *argv[])
     matrix->CreateFrameCanvas();
 
     // create thread to listen for key presses
+    game_over = false;
     pthread_t thread;
     pthread_create(&thread, NULL, pthread_task_list_keypress, NULL);
 
-    const int screen_width = matrix_options.cols * matrix_options.chain_length;
-    const int screen_height = matrix_options.rows;
+    const int screen_width = matrix->width();
+    const int screen_height = matrix->height();
 
     int x = screen_width / 2;
     int y = screen_height / 2;
@@ -251,7 +231,7 @@ int main(int argc, char *argv[])
     int turns = 0;
 
     bool lost = false;
-    while (!interrupt_received) // Should probably re-arrange so all calculations happen first, would ease handling pipe crashes
+    while (!game_over && !matrix->interrupted()) // Should probably re-arrange so all calculations happen first, would ease handling pipe crashes
     {
         // Generate pipe
         if ((turns % pipe_distance) == 0)
@@ -341,7 +321,7 @@ int main(int argc, char *argv[])
         if (lost)
         {
             // std::string text;
-            interrupt_received = true;
+            game_over = true;
             if (big_font_loaded)
             {
                 rgb_matrix::DrawText(offscreen_canvas, big_font,
@@ -397,10 +377,18 @@ int main(int argc, char *argv[])
     }
 
     // pthread_cancel(thread);
+    game_over = true;
     pthread_join(thread, NULL);
 
-    // Finished. Shut down the RGB matrix.
-    delete matrix;
-
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    RGBMatrix::Options matrix_options;
+	matrix_options.hardware_mapping = HW_ID;
+	matrix_options.rows = LED_MATRIX_HEIGHT;
+	matrix_options.cols = LED_MATRIX_WIDTH;
+	matrix_options.chain_length = BOSS_WIDTH;
+    return RunDisplayProgram(argc, argv, matrix_options, DisplayProgramMain);
+}
@@ -5,9 +5,10 @@
 // at the led-image-viewer in ../utils
 //
 // Showing an image is not so complicated, essentially just copy all the
-// pixels to the canvas. How to get the pixels ? In this example we're using
-// the graphicsmagick library as universal image loader library that
-// can also deal with animated images.
+// pixels to the canvas. How to get the pixels ? For PPM, QOI and GIF images,
+// the library has simple decoders that start right away. For everything
+// else, we're using the graphicsmagick library as universal image loader
+// library that can also deal with animated images.
 // You can of course do your own image loading or use some other library.
 //
 // This requires an external dependency, so install these first before you
@@ -17,13 +18,17 @@
 //   make image-example
 
 #include "led-matrix.h"
+#include "graphics.h"
+#include "image-decoder.h"
 
 #include <math.h>
 #include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
+#include <algorithm>
 #include <exception>
+#include <vector>
 #include <Magick++.h>
 #include <magick/image.h>
 
@@ -109,6 +114,50 @@ void ShowAnimatedImage(const ImageVector &images, RGBMatrix *matrix) {
   }
 }
 
+// Show an image that the library can decode itself. Animations are
+// decoded frame by frame while they are shown, so even long ones need
+// little memory. Returns false if it is not in one of these formats.
+static bool ShowDecodedImage(const char *filename, RGBMatrix *matrix) {
+  rgb_matrix::ImageDecoder *decoder = rgb_matrix::ImageDecoder::Open(filename);
+  if (decoder == NULL)
+    return false;
+
+  // Scale to fit the matrix, keeping the aspect ratio.
+  const float fraction = std::min((float)matrix->width() / decoder->width(),
+                                  (float)matrix->height() / decoder->height());
+  const int width = std::max(1, (int)roundf(fraction * decoder->width()));
+  const int height = std::max(1, (int)roundf(fraction * decoder->height()));
+  std::vector<uint8_t> scaled(4 * width * height);
+
+  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
+  int frames = 0;  // Shown since the start.
+  int64_t delay_us;
+  while (!interrupt_received) {
+    if (!decoder->NextFrame(&delay_us)) {
+      if (frames == 0) break;   // Broken file.
+      if (frames == 1) {        // A still image: keep it until Ctrl-C.
+        while (!interrupt_received) sleep(1000);
+        break;
+      }
+      frames = 0;               // An animation: loop.
+      if (!decoder->Rewind()) break;
+      continue;
+    }
+    ++frames;
+    rgb_matrix::ScaleRGBA(decoder->rgba(), decoder->width(), decoder->height(),
+                          &scaled[0], width, height);
+    offscreen_canvas->Clear();
+    rgb_matrix::SetImage(offscreen_canvas, 0, 0,
+                         rgb_matrix::ImageView(rgb_matrix::PIXEL_RGBA32,
+                                               &scaled[0], width * 4,
+                                               width, height));
+    offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas);
+    usleep(delay_us);
+  }
+  delete decoder;
+  return true;
+}
+
 int usage(const char *progname) {
   fprintf(stderr, "Usage: %s [led-matrix-options] <image-filename>\n",
           progname);
@@ -117,8 +166,6 @@ int usage(const char *progname) {
 }
 
 int main(int argc, char *argv[]) {
-  Magick::InitializeMagick(*argv);
-
   // Initialize the RGB matrix with
   RGBMatrix::Options matrix_options;
   rgb_matrix::RuntimeOptions runtime_opt;
@@ -138,6 +185,14 @@ int main(int argc, char *argv[]) {
   if (matrix == NULL)
     return 1;
 
+  if (ShowDecodedImage(filename, matrix)) {
+    matrix->Clear();
+    delete matrix;
+    return 0;
+  }
+
+  // Anything else: let GraphicsMagick figure it out.
+  Magick::InitializeMagick(*argv);
   ImageVector images = LoadImageAndScaleImage(filename,
                                               matrix->width(),
                                               matrix->height());
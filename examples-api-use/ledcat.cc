@@ -2,81 +2,200 @@
 // A program that reads frames form STDIN as RGB24, much like
 // https://github.com/polyfloyd/ledcat does.
 //
+// Frames are shown as fast as they come in, synchronized to the refresh of
+// the matrix; e.g. pipe in raw video from ffmpeg:
+//   ffmpeg -re -i video.mp4 -vf scale=192:32 -f rawvideo -pix_fmt rgb24 - |
+//      sudo ./ledcat --led-cols=64 --led-chain=3
+//
 // This code is public domain
 // (but note, that the led-matrix library this depends on is GPL v2)
 
 #include "led-matrix.h"
+#include "graphics.h"
 
-#include <math.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdio.h>
-#include <time.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#define FPS 60
-
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::ImageView;
+using rgb_matrix::PixelFormat;
 using rgb_matrix::RGBMatrix;
-using rgb_matrix::Canvas;
+
+// Frames read with one read() at most.
+#define BUFFERED_FRAMES 8
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int signo) {
   interrupt_received = true;
 }
 
+struct FormatName {
+  const char *name;
+  PixelFormat format;
+  int bytes_per_pixel;
+};
+
+static const FormatName kFormats[] = {
+  { "rgb24",  rgb_matrix::PIXEL_RGB24,  3 },
+  { "bgr24",  rgb_matrix::PIXEL_BGR24,  3 },
+  { "rgba",   rgb_matrix::PIXEL_RGBA32, 4 },
+  { "bgra",   rgb_matrix::PIXEL_BGRA32, 4 },
+  { "rgb565", rgb_matrix::PIXEL_RGB565, 2 },
+  { "gray",   rgb_matrix::PIXEL_GRAY8,  1 },
+};
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Reads frames from stdin and shows them.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-f <format>        : Pixel format: rgb24 (default), bgr24, rgba, "
+          "bgra, rgb565, gray\n"
+          "\t-s <width>x<height>: Size of the frames. Default: matrix size.\n"
+          "\t-V <vsync-multiple>: Show each frame for this many refreshes "
+          "of the matrix.\n"
+          "\t-l                 : Live: if frames come in faster than they\n"
+          "\t                     can be shown, skip to the latest one.\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+// Read whatever is available on "fd" into "buffer", blocking only if
+// "block" is set. Returns the number of bytes read, 0 on end of file.
+static ssize_t ReadAvailable(int fd, uint8_t *buffer, size_t size,
+                             bool block) {
+  if (!block) {
+    struct pollfd p = { fd, POLLIN, 0 };
+    if (poll(&p, 1, 0) <= 0 || !(p.revents & POLLIN))
+      return -1;
+  }
+  ssize_t r;
+  do {
+    r = read(fd, buffer, size);
+  } while (r < 0 && errno == EINTR && !interrupt_received);
+  return r;
+}
+
 int main(int argc, char *argv[]) {
   RGBMatrix::Options defaults;
   defaults.hardware_mapping = "regular"; // or e.g. "adafruit-hat"
   defaults.rows = 32;
   defaults.chain_length = 1;
   defaults.parallel = 1;
-  Canvas *canvas = RGBMatrix::CreateFromFlags(&argc, &argv, &defaults);
-  if (canvas == NULL) {
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &defaults, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  const FormatName *format = &kFormats[0];
+  int width = -1, height = -1;
+  unsigned vsync_multiple = 1;
+  bool live = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "f:s:V:l")) != -1) {
+    switch (opt) {
+    case 'f':
+      format = NULL;
+      for (size_t i = 0; i < sizeof(kFormats) / sizeof(kFormats[0]); ++i) {
+        if (strcmp(optarg, kFormats[i].name) == 0) format = &kFormats[i];
+      }
+      if (format == NULL) {
+        fprintf(stderr, "Unknown pixel format %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 's':
+      if (sscanf(optarg, "%dx%d", &width, &height) != 2
+          || width <= 0 || height <= 0) {
+        fprintf(stderr, "Invalid size %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'V': {
+      const int multiple = atoi(optarg);
+      if (multiple < 1) {
+        fprintf(stderr, "Vsync multiple needs to be at least 1\n");
+        return usage(argv[0]);
+      }
+      vsync_multiple = multiple;
+      break;
+    }
+    case 'l':
+      live = true;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(defaults, runtime_opt);
+  if (matrix == NULL) {
     return 1;
   }
+  if (width < 0) {
+    width = matrix->width();
+    height = matrix->height();
+  }
 
   // It is always good to set up a signal handler to cleanly exit when we
-  // receive a CTRL-C for instance. The DrawOnCanvas() routine is looking
-  // for that.
+  // receive a CTRL-C for instance.
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
-  ssize_t frame_size = canvas->width() * canvas->height() * 3;
-  uint8_t buf[frame_size];
+  const size_t stride = width * format->bytes_per_pixel;
+  const size_t frame_size = stride * height;
+  const size_t buffer_size = BUFFERED_FRAMES * frame_size;
+  uint8_t *const buffer = new uint8_t[buffer_size];
 
-  while (1) {
-    struct timespec start;
-    timespec_get(&start, TIME_UTC);
+  // If we read from a pipe, make it large enough for a few frames, so that
+  // the writer is not blocked while we wait for the vsync.
+  fcntl(STDIN_FILENO, F_SETPIPE_SZ, (int)buffer_size);
 
-    ssize_t nread;
-    ssize_t total_nread = 0;
-    while ((nread = read(STDIN_FILENO, &buf[total_nread], frame_size - total_nread)) > 0) {
-      if (interrupt_received) {
-        return 1;
-      }
-      total_nread += nread;
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  size_t filled = 0;  // Bytes in buffer.
+  bool input_ended = false;
+  while (!interrupt_received && !input_ended) {
+    // Get at least one complete frame; in live mode also everything else
+    // that is already there.
+    bool block = true;
+    while (filled < buffer_size) {
+      const ssize_t r = ReadAvailable(STDIN_FILENO, buffer + filled,
+                                      buffer_size - filled, block);
+      if (r == 0) input_ended = true;
+      if (r <= 0) break;
+      filled += r;
+      block = (filled < frame_size);
+      if (!live && !block) break;
     }
-    if (total_nread < frame_size){
+    if (interrupt_received || filled < frame_size)
       break;
-    }
 
-    for (int y = 0; y < canvas->height(); y++) {
-      for (int x = 0; x < canvas->width(); x++) {
-        uint8_t *p = &buf[(y * canvas->width() + x) * 3];
-        uint8_t r = *(p+0), g = *(p+1), b = *(p+2);
-        canvas->SetPixel(x, y, r, g, b);
-      }
+    const size_t frames = filled / frame_size;
+    for (size_t i = live ? frames - 1 : 0; i < frames; ++i) {
+      const ImageView image(format->format, buffer + i * frame_size, stride,
+                            width, height);
+      rgb_matrix::SetImage(offscreen, 0, 0, image);
+      offscreen = matrix->SwapOnVSync(offscreen, vsync_multiple);
+      if (interrupt_received) break;
     }
 
-    struct timespec end;
-    timespec_get(&end, TIME_UTC);
-    long tudiff = (end.tv_nsec / 1000 + end.tv_sec * 1000000) - (start.tv_nsec / 1000 + start.tv_sec * 1000000);
-    if (tudiff < 1000000l / FPS) {
-      usleep(1000000l / FPS - tudiff);
-    }
+    // Keep the beginning of the next frame.
+    filled -= frames * frame_size;
+    memmove(buffer, buffer + frames * frame_size, filled);
   }
 
+  delete [] buffer;
+
   // Animation finished. Shut down the RGB matrix.
-  canvas->Clear();
-  delete canvas;
+  matrix->Clear();
+  delete matrix;
   return 0;
 }
@@ -1,4 +1,4 @@
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 #include "common.h"
 
@@ -9,7 +9,6 @@
 #include <chrono>
 #include <thread>
 
-#include <signal.h>
 #include <stdio.h>
 #include <unistd.h>
 
@@ -20,12 +19,6 @@ using namespace rgb_matrix;
 int height;
 int width;
 
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo)
-{
-	interrupt_received = true;
-}
-
 static int usage(const char *progname)
 {
 	fprintf(stderr, "usage: %s [options]\n", progname);
@@ -240,20 +233,8 @@ void draw_deep(FrameCanvas *offscreen_canvas, double x_start, double x_fin, doub
 	}
 }
 
-int main(int argc, char **argv)
+extern "C" int DisplayProgramMain(ProgramContext *canvas, int argc, char **argv)
 {
-	RGBMatrix::Options matrix_options;
-	matrix_options.hardware_mapping = HW_ID;
-	matrix_options.rows = LED_MATRIX_HEIGHT;
-	matrix_options.cols = LED_MATRIX_WIDTH;
-	matrix_options.chain_length = BOSS_WIDTH;
-	rgb_matrix::RuntimeOptions runtime_opt;
-	if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-										   &matrix_options, &runtime_opt))
-	{
-		return usage(argv[0]);
-	}
-
 	int delay = 16;
 	int iter = 250;
 	int color_threshold = 169;
@@ -291,13 +272,9 @@ int main(int argc, char **argv)
 		}
 	}
 
-	RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-	if (canvas == nullptr)
+	if (!canvas->StartDisplay())
 		return -1;
 
-	signal(SIGTERM, InterruptHandler);
-	signal(SIGINT, InterruptHandler);
-
 	// Create array new canvas to be used with led_matrix_swap_on_vsync
 	FrameCanvas *offscreen_canvas = canvas->CreateFrameCanvas();
 
@@ -314,7 +291,7 @@ int main(int argc, char **argv)
 	auto delay_until = std::chrono::steady_clock::now() + increment;
 	for (int i = 0; i < iter; i++)
 	{
-		if (interrupt_received)
+		if (canvas->interrupted())
 		{
 			break;
 		}
@@ -341,11 +318,11 @@ int main(int argc, char **argv)
 		ms_log[i] = ms_diff;
 		#endif
 		std::this_thread::sleep_until(delay_until);
-		delay_until += increment;
+		// Continue from now if we were paused by the program host.
+		delay_until = std::max(delay_until + increment,
+		                       std::chrono::steady_clock::now());
 	}
 
-	delete canvas;
-
 	#ifdef DEBUG
 	for (int i = 0; i < iter; i++){
 		std::cout << i << ": " << ms_log[i].count() << std::endl;
@@ -354,3 +331,13 @@ int main(int argc, char **argv)
 
 	return 0;
 }
+
+int main(int argc, char **argv)
+{
+	RGBMatrix::Options matrix_options;
+	matrix_options.hardware_mapping = HW_ID;
+	matrix_options.rows = LED_MATRIX_HEIGHT;
+	matrix_options.cols = LED_MATRIX_WIDTH;
+	matrix_options.chain_length = BOSS_WIDTH;
+	return RunDisplayProgram(argc, argv, matrix_options, DisplayProgramMain);
+}
@@ -7,13 +7,12 @@
 // For a utility with a few more features see
 // ../utils/text-scroller.cc
 
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 
 #include <string>
 
 #include <getopt.h>
-#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -21,11 +20,6 @@
 
 using namespace rgb_matrix;
 
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo) {
-  interrupt_received = true;
-}
-
 static int usage(const char *progname) {
   fprintf(stderr, "usage: %s [options] <text>\n", progname);
   fprintf(stderr, "Takes text and scrolls it with speed -s\n");
@@ -58,23 +52,16 @@ static bool FullSaturation(const Color &c) {
     && (c.b == 0 || c.b == 255);
 }
 
-int main(int argc, char *argv[]) {
-  RGBMatrix::Options matrix_options;
-  rgb_matrix::RuntimeOptions runtime_opt;
-  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                         &matrix_options, &runtime_opt)) {
-    return usage(argv[0]);
-  }
-
+extern "C" int DisplayProgramMain(ProgramContext *canvas,
+                                  int argc, char *argv[]) {
   Color color(255, 255, 0);
   Color bg_color(0, 0, 0);
 
   const char *bdf_font_file = NULL;
   std::string line;
   /* x_origin is set by default just right of the screen */
-  const int x_default_start = (matrix_options.chain_length
-                               * matrix_options.cols) + 5;
-  int x_orig = x_default_start;
+  bool x_default_start = true;
+  int x_orig = 0;
   int y_orig = 0;
   int letter_spacing = 0;
   float speed = 7.0f;
@@ -85,7 +72,7 @@ int main(int argc, char *argv[]) {
     switch (opt) {
     case 's': speed = atof(optarg); break;
     case 'l': loops = atoi(optarg); break;
-    case 'x': x_orig = atoi(optarg); break;
+    case 'x': x_orig = atoi(optarg); x_default_start = false; break;
     case 'y': y_orig = atoi(optarg); break;
     case 'f': bdf_font_file = strdup(optarg); break;
     case 't': letter_spacing = atoi(optarg); break;
@@ -129,19 +116,15 @@ int main(int argc, char *argv[]) {
     return 1;
   }
 
-  RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-  if (canvas == NULL)
+  if (!canvas->StartDisplay())
     return 1;
 
-  const bool all_extreme_colors = (matrix_options.brightness == 100)
+  const bool all_extreme_colors = (canvas->brightness() == 100)
     && FullSaturation(color)
     && FullSaturation(bg_color);
   if (all_extreme_colors)
     canvas->SetPWMBits(1);
 
-  signal(SIGTERM, InterruptHandler);
-  signal(SIGINT, InterruptHandler);
-
   printf("CTRL-C for exit.\n");
 
   // Create a new canvas to be used with led_matrix_swap_on_vsync
@@ -150,16 +133,18 @@ int main(int argc, char *argv[]) {
   int delay_speed_usec = 1000000;
   if (speed > 0) {
     delay_speed_usec = 1000000 / speed / font.CharacterWidth('W');
-  } else if (x_orig == x_default_start) {
+  } else if (x_default_start) {
     // There would be no scrolling, so text would never appear. Move to front.
-    x_orig = 0;
+    x_default_start = false;
   }
+  if (x_default_start)
+    x_orig = canvas->width() + 5;
 
   int x = x_orig;
   int y = y_orig;
   int length = 0;
 
-  while (!interrupt_received && loops != 0) {
+  while (!canvas->interrupted() && loops != 0) {
     offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
     // length = holds how many pixels our text takes up
     length = rgb_matrix::DrawText(offscreen_canvas, font,
@@ -177,8 +162,10 @@ int main(int argc, char *argv[]) {
     usleep(delay_speed_usec);
   }
 
-  // Finished. Shut down the RGB matrix.
-  delete canvas;
-
   return 0;
 }
+
+int main(int argc, char *argv[]) {
+  return RunDisplayProgram(argc, argv, RGBMatrix::Options(),
+                           DisplayProgramMain);
+}
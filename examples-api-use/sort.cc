@@ -1,4 +1,4 @@
-#include "led-matrix.h"
+#include "display-program.h"
 #include "graphics.h"
 #include "common.h"
 
@@ -8,7 +8,6 @@
 #include <unistd.h>
 #include <math.h>
 #include <stdio.h>
-#include <signal.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -26,12 +25,6 @@ Color background_color;
 bool **matrix; // create array ROWS x COLS matrix in main
 // bool matrix = [32][192];    //doesn't fit in the stack
 
-volatile bool interrupt_received = false;
-static void InterruptHandler(int signo)
-{
-    interrupt_received = true;
-}
-
 static int usage(const char *progname)
 {
     fprintf(stderr, "usage: %s [options]\n", progname);
@@ -57,7 +50,7 @@ void initMatrix()
     }
 }
 
-FrameCanvas *drawArray(int data[], int size, RGBMatrix *canvas, FrameCanvas *offscreen_canvas){
+FrameCanvas *drawArray(int data[], int size, ProgramContext *canvas, FrameCanvas *offscreen_canvas){
     offscreen_canvas->Fill(background_color.r, background_color.g, background_color.b);
     for(int c = 0; c < cols; c++){
         //printf("%d ", data[c]);
@@ -83,11 +76,11 @@ void swap(int &a, int &b)
     b = tmp;
 }
 
-void insertionSort(int array[], int size, RGBMatrix *canvas, FrameCanvas *offscreen_canvas)
+void insertionSort(int array[], int size, ProgramContext *canvas, FrameCanvas *offscreen_canvas)
 {
     for (int step = 1; step < size; step++)
     {
-        if (interrupt_received)
+        if (canvas->interrupted())
         {
             return;
         }
@@ -107,7 +100,7 @@ void insertionSort(int array[], int size, RGBMatrix *canvas, FrameCanvas *offscr
     }
 }
 
-void cocktailSort(int array[], int n, RGBMatrix *canvas, FrameCanvas *offscreen_canvas)
+void cocktailSort(int array[], int n, ProgramContext *canvas, FrameCanvas *offscreen_canvas)
 {
     bool swapped = true;
     int start = 0;
@@ -115,7 +108,7 @@ void cocktailSort(int array[], int n, RGBMatrix *canvas, FrameCanvas *offscreen_
 
     while (swapped)
     {
-        if (interrupt_received)
+        if (canvas->interrupted())
         {
             return;
         }
@@ -152,21 +145,8 @@ void cocktailSort(int array[], int n, RGBMatrix *canvas, FrameCanvas *offscreen_
     }
 }
 
-int main(int argc, char *argv[])
+extern "C" int DisplayProgramMain(ProgramContext *canvas, int argc, char *argv[])
 {
-    //no idea why default options don't work
-    RGBMatrix::Options matrix_options;
-    matrix_options.hardware_mapping = HW_ID;
-    matrix_options.rows = LED_MATRIX_HEIGHT;
-    matrix_options.cols = LED_MATRIX_WIDTH;
-    matrix_options.chain_length = BOSS_WIDTH;
-    rgb_matrix::RuntimeOptions runtime_opt;
-    if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
-                                           &matrix_options, &runtime_opt))
-    {
-        return usage(argv[0]);
-    }
-
     foreground_color = Color(74, 46, 102);
     background_color = Color(0, 0, 0);
 
@@ -203,13 +183,9 @@ int main(int argc, char *argv[])
         }
     }
 
-    RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
-    if (canvas == NULL)
+    if (!canvas->StartDisplay())
         return 1;
 
-    signal(SIGTERM, InterruptHandler);
-    signal(SIGINT, InterruptHandler);
-
     // Create array new canvas to be used with led_matrix_swap_on_vsync
     FrameCanvas *offscreen_canvas = canvas->CreateFrameCanvas();
 
@@ -255,7 +231,17 @@ int main(int argc, char *argv[])
     }
 
     delete[] matrix;
-    delete canvas;
 
     return 0;
 }
+
+int main(int argc, char *argv[])
+{
+    //no idea why default options don't work
+    RGBMatrix::Options matrix_options;
+    matrix_options.hardware_mapping = HW_ID;
+    matrix_options.rows = LED_MATRIX_HEIGHT;
+    matrix_options.cols = LED_MATRIX_WIDTH;
+    matrix_options.chain_length = BOSS_WIDTH;
+    return RunDisplayProgram(argc, argv, matrix_options, DisplayProgramMain);
+}
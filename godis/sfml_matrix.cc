@@ -1,87 +1,195 @@
 #include "led-matrix.h"
-
+#include "content-streamer.h"
+#include "pixel-mapper.h"
+#include "refresh-timing.h"
+#include "../lib/framebuffer-internal.h"
+#include "../lib/multiplex-mappers-internal.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
 #include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
 #include <thread>
 #include <mutex>
 #include <vector>
 #include <iostream>
 #include <cstdlib>
 #include <SFML/Graphics.hpp>
+#include <cstdio>
 #include <cstring>
+#include <string>
 
 #define SFML_WINDOW_WIDTH 1280
 #define SFML_WINDOW_HEIGHT 720
 
-#define LED_RADIUS_PIXELS 2
+// The window is only redrawn when a frame changed, and at most this often.
+#define MAX_FRAMES_PER_SECOND 60
+
+// Where the LEDs are on the picture of boss, and the largest distance
+// between them; bigger walls get closer LEDs to still fit.
+#define LED_AREA_X 71
+#define LED_AREA_Y 262
+#define LED_AREA_WIDTH 1152
+#define LED_AREA_HEIGHT 192
+#define LED_PITCH_PIXELS 6
+
+// Raspberry Pi model of boss, for the refresh rate; GODIS_PI_MODEL
+// overrides it.
+#define DEFAULT_PI_MODEL 3
 
 namespace rgb_matrix
 {
-
-    class SFMLCanvas : public FrameCanvas
+    using internal::Framebuffer;
+    using internal::PixelDesignator;
+    using internal::PixelDesignatorMap;
+
+    // Stands in for the panels: turns the bitplanes of a frame, as they
+    // would be sent out to the GPIO pins, into the light of each LED.
+    // Like on the real panels, every bitplane lights up for the length of
+    // its output enable pulse, lower bitplanes are left out of dithered
+    // frames, and the result is linear light that is encoded as sRGB for
+    // the screen. So PWM quantization, CIE1931 mapping, brightness and the
+    // pixel and multiplex mappers all show as they would on boss.
+    class PanelDecoder
     {
     public:
-        SFMLCanvas(int height, int width) : FrameCanvas(nullptr), w(width), h(height)
+        PanelDecoder(const RGBMatrix::Options &params, PixelDesignatorMap *const *map)
+            : columns(params.cols * params.chain_length),
+              buffer_size((size_t)params.rows / 2 * columns * Framebuffer::kBitPlanes * sizeof(gpio_bits_t)),
+              pwm_lsb_nanoseconds(params.pwm_lsb_nanoseconds),
+              dither_bits(std::max(0, std::min(2, params.pwm_dither_bits))),
+              inverse(params.inverse_colors ? ~(gpio_bits_t)0 : 0),
+              mapper(map), encode(kEncodeSteps)
         {
-            for (int i = 0; i < w; i++)
+            for (int i = 0; i < kEncodeSteps; i++)
             {
-                led_matrix.emplace_back();
-                for (int j = 0; j < h; j++)
-                {
-                    sf::CircleShape c(LED_RADIUS_PIXELS, 20);
-                    led_matrix[i].push_back(c);
-                    int offset = LED_RADIUS_PIXELS + 20;
-                    led_matrix[i][j].setPosition(50 + offset + i * (LED_RADIUS_PIXELS + 1) * 2, 240 + offset + j * (LED_RADIUS_PIXELS + 1) * 2 + 1);
-                    led_matrix[i][j].setOutlineColor(sf::Color(32, 32, 32));
-                    led_matrix[i][j].setOutlineThickness(1);
-                }
+                const float v = (float)i / (kEncodeSteps - 1);
+                const float srgb = v <= 0.0031308f ? 12.92f * v : 1.055f * std::pow(v, 1 / 2.4f) - 0.055f;
+                encode[i] = (uint8_t)std::lround(srgb * 255);
             }
         }
 
-        virtual ~SFMLCanvas() = default;
+        // The size of the logical canvas, after all mappers. Changes when a
+        // pixel mapper is applied later on.
+        int width() const { return std::max(0, (*mapper)->width()); }
+        int height() const { return std::max(0, (*mapper)->height()); }
 
-        int width() const override { return w; }
-        int height() const override { return h; }
+        // The size of the bitplanes of a frame, see FrameCanvas::Serialize().
+        size_t bitplanes_size() const { return buffer_size; }
 
-        void SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue) override
+        // Decode "bitplanes" shown with "pwm_bits" into width() * height()
+        // pixels of r, g, b at "rgb".
+        void Decode(const char *bitplanes, int pwm_bits, uint8_t *rgb) const
         {
-            if (x < 0 || x >= w || y < 0 || y >= h)
+            // As the refresh thread in led-matrix.cc does: the first bitplane
+            // shown in each of four frames when dithering, and the pulse
+            // lengths, which double with every bitplane above the dither bits.
+            static const int kDitherStartBits[3][4] = {{0, 0, 0, 0}, {0, 1, 0, 1}, {0, 1, 2, 2}};
+            float weight[Framebuffer::kBitPlanes];
+            float total = 0;
+            float pulse_ns = pwm_lsb_nanoseconds;
+            for (int b = 0; b < Framebuffer::kBitPlanes; b++)
             {
-                return;
+                int shown = 0;
+                for (int frame = 0; frame < 4; frame++)
+                {
+                    if (b >= std::max(kDitherStartBits[dither_bits][frame], Framebuffer::kBitPlanes - pwm_bits))
+                        shown++;
+                }
+                weight[b] = pulse_ns * shown;
+                total += weight[b];
+                if (b >= dither_bits)
+                    pulse_ns *= 2;
             }
-            led_matrix[x][y].setFillColor({red, green, blue, alpha});
-        }
+            for (int b = 0; b < Framebuffer::kBitPlanes; b++)
+                weight[b] *= (kEncodeSteps - 1) / total;
 
-        void SetPixels(int x, int y, int width, int height, Color *colors) override {}
-        void Clear() override
-        {
-            Fill(0, 0, 0);
-        }
-        void Fill(uint8_t red, uint8_t green, uint8_t blue) override
-        {
-            for (int i = 0; i < w; i++)
+            const gpio_bits_t *planes = reinterpret_cast<const gpio_bits_t *>(bitplanes);
+            const int width = this->width();
+            const int height = this->height();
+            for (int y = 0; y < height; y++)
             {
-                for (int j = 0; j < h; j++)
+                for (int x = 0; x < width; x++, rgb += 3)
                 {
-                    SetPixel(i, j, red, green, blue);
+                    const PixelDesignator *d = (*mapper)->get(x, y);
+                    if (d == nullptr || d->gpio_word < 0)
+                    {
+                        rgb[0] = rgb[1] = rgb[2] = 0;
+                        continue;
+                    }
+                    float r = 0, g = 0, b = 0;
+                    const gpio_bits_t *word = planes + d->gpio_word;
+                    for (int plane = 0; plane < Framebuffer::kBitPlanes; plane++, word += columns)
+                    {
+                        const gpio_bits_t bits = *word ^ inverse;
+                        if (bits & d->r_bit)
+                            r += weight[plane];
+                        if (bits & d->g_bit)
+                            g += weight[plane];
+                        if (bits & d->b_bit)
+                            b += weight[plane];
+                    }
+                    rgb[0] = Encode(r);
+                    rgb[1] = Encode(g);
+                    rgb[2] = Encode(b);
                 }
             }
         }
 
-        const std::vector<std::vector<sf::CircleShape>> &matrix() { return led_matrix; }
+    private:
+        static constexpr int kEncodeSteps = 4096;
 
-        void setAlpha(uint8_t val) { alpha = val; }
+        uint8_t Encode(float light) const
+        {
+            return encode[std::min(kEncodeSteps - 1, (int)(light + 0.5f))];
+        }
 
-    private:
-        int w;
-        int h;
-        uint8_t alpha{255};
-        std::vector<std::vector<sf::CircleShape>> led_matrix{};
+        const int columns;
+        const size_t buffer_size;
+        const int pwm_lsb_nanoseconds;
+        const int dither_bits;
+        const gpio_bits_t inverse;
+        PixelDesignatorMap *const *const mapper;
+        std::vector<uint8_t> encode;
     };
 
-    class SFMLThread
+    // A copy of the bitplanes of a frame, to see if it changed.
+    static bool TakeSnapshot(FrameCanvas *frame, std::vector<char> *snapshot)
+    {
+        const char *data;
+        size_t len;
+        frame->Serialize(&data, &len);
+        if (snapshot->size() == len && memcmp(snapshot->data(), data, len) == 0)
+            return false;
+        snapshot->assign(data, data + len);
+        return true;
+    }
+
+    // Where the frames end up: the window, or files for headless runs.
+    class Display
     {
     public:
-        SFMLThread(int w, int h, const RuntimeOptions& rt_opt) : th(&SFMLThread::run, this), next_canvas(nullptr), rt_options(rt_opt)
+        virtual ~Display() = default;
+
+        // Show "other" from the vertical sync at "time_us" on.
+        virtual FrameCanvas *SwapOnVSync(FrameCanvas *other, int64_t time_us) = 0;
+
+        // Run "change" of the pixel mapping, and with it maybe the size,
+        // while no frame is decoded.
+        virtual void ChangeMapping(const std::function<void()> &change) { change(); }
+    };
+
+    class SFMLThread : public Display
+    {
+    public:
+        SFMLThread(const PanelDecoder &d, FrameCanvas *initial, const RuntimeOptions& rt_opt)
+            : decoder(d), current_canvas(initial), rt_options(rt_opt)
         {
             tex.loadFromFile("godis.jpg");
             s.setTexture(tex, true);
@@ -90,11 +198,16 @@ namespace rgb_matrix
             r.setFillColor({60, 60, 60});
             r.setPosition(45, 257);
             r.setSize({1200, 200});
+            th = std::thread(&SFMLThread::run, this);
         }
 
-        ~SFMLThread()
+        ~SFMLThread() override
         {
-            running = false;
+            {
+                std::lock_guard<std::mutex> l(sync);
+                running = false;
+            }
+            frame_changed.notify_one();
             th.join();
         }
 
@@ -102,11 +215,26 @@ namespace rgb_matrix
         {
             sf::RenderWindow window;
             window.create(sf::VideoMode(SFML_WINDOW_WIDTH, SFML_WINDOW_HEIGHT), "Godis");
-
-            sf::Event event;
-            while (window.isOpen() && running)
+            window.setFramerateLimit(MAX_FRAMES_PER_SECOND);
+
+            // All LEDs are one texture with a texel per LED, scaled up to
+            // the LED pitch. On top of that, a mask repeated for every LED
+            // makes them round, with a dark rim.
+            sf::Texture leds;
+            sf::Sprite led_sprite;
+            sf::Texture mask;
+            sf::Sprite mask_sprite;
+
+            std::vector<char> bitplanes;
+            int pwm_bits = 0;
+            int width = -1, height = -1;
+            std::vector<uint8_t> rgb;
+            std::vector<uint8_t> rgba;
+            bool redraw = true;
+            while (window.isOpen())
             {
                 // Handle events
+                sf::Event event;
                 while (window.pollEvent(event))
                 {
                     switch (event.type)
@@ -114,60 +242,125 @@ namespace rgb_matrix
                     case sf::Event::Closed:
                         window.close();
                         break;
+                    case sf::Event::Resized:
+                    case sf::Event::GainedFocus:
+                        redraw = true;
+                        break;
                     default:
                         break;
                     }
                 }
 
-                if (current_canvas == nullptr)
-                    continue;
-
-                window.clear();
-
-                window.draw(s);
-                window.draw(r);
-                sync.lock();
-                for (int i = 0; i < current_canvas->width(); i++)
+                bool resized = false;
                 {
-                    for (int j = 0; j < current_canvas->height(); j++)
+                    std::unique_lock<std::mutex> l(sync);
+                    if (!running)
+                        break;
+                    // Programs that draw on the matrix directly instead of
+                    // swapping are shown by looking for changed bitplanes.
+                    const bool changed = TakeSnapshot(current_canvas, &bitplanes) || current_canvas->pwmbits() != pwm_bits;
+                    if (!changed && !redraw && !mapping_changed)
                     {
-                        window.draw(current_canvas->matrix()[i][j]);
+                        // Nothing new; wait for the next frame, but not
+                        // too long to still handle window events.
+                        frame_changed.wait_for(l, std::chrono::milliseconds(1000 / MAX_FRAMES_PER_SECOND));
+                        continue;
                     }
+                    pwm_bits = current_canvas->pwmbits();
+                    mapping_changed = false;
+                    if (decoder.width() != width || decoder.height() != height)
+                    {
+                        width = decoder.width();
+                        height = decoder.height();
+                        rgb.assign(width * height * 3, 0);
+                        resized = true;
+                    }
+                    // The mapping only changes while we hold the lock.
+                    if (bitplanes.size() == decoder.bitplanes_size())
+                        decoder.Decode(bitplanes.data(), pwm_bits, rgb.data());
                 }
-                sync.unlock();
+                redraw = false;
 
-                if (next_canvas != nullptr)
+                if (resized)
+                {
+                    const int led_pitch = std::max(1, std::min(LED_PITCH_PIXELS, std::min(LED_AREA_WIDTH / std::max(1, width), LED_AREA_HEIGHT / std::max(1, height))));
+                    leds.create(width, height);
+                    leds.setSmooth(false);
+                    led_sprite.setTexture(leds, true);
+                    led_sprite.setPosition(LED_AREA_X, LED_AREA_Y);
+                    led_sprite.setScale(led_pitch, led_pitch);
+                    mask.loadFromImage(CreateLedMask(led_pitch));
+                    mask.setRepeated(true);
+                    mask_sprite.setTexture(mask);
+                    mask_sprite.setTextureRect(sf::IntRect(0, 0, width * led_pitch, height * led_pitch));
+                    mask_sprite.setPosition(LED_AREA_X, LED_AREA_Y);
+                    rgba.assign(width * height * 4, 255);
+                }
+                for (size_t i = 0, j = 0; i < rgba.size(); i += 4, j += 3)
                 {
-                    current_canvas = next_canvas;
-                    next_canvas = nullptr;
+                    rgba[i] = rgb[j];
+                    rgba[i + 1] = rgb[j + 1];
+                    rgba[i + 2] = rgb[j + 2];
                 }
+                leds.update(rgba.data());
 
+                window.clear();
+                window.draw(s);
+                window.draw(r);
+                window.draw(led_sprite);
+                window.draw(mask_sprite);
                 window.display();
             }
         }
 
-        void setCanvas(SFMLCanvas *c)
+        FrameCanvas *SwapOnVSync(FrameCanvas *other, int64_t time_us) override
         {
-            sync.lock();
-            current_canvas = c;
-            sync.unlock();
+            std::lock_guard<std::mutex> l(sync);
+            FrameCanvas *prev = current_canvas;
+            current_canvas = other;
+            frame_changed.notify_one();
+            return prev;
         }
 
-        SFMLCanvas *SwapOnVSync(SFMLCanvas *other)
+        void ChangeMapping(const std::function<void()> &change) override
         {
-            sync.lock();
-            SFMLCanvas *prev = current_canvas;
-            next_canvas = other;
-            sync.unlock();
-            return prev;
+            std::lock_guard<std::mutex> l(sync);
+            change();
+            mapping_changed = true;
+            frame_changed.notify_one();
         }
 
     private:
+        // A tile of "pitch" pixels square for one LED: see-through in the
+        // middle, then the rim of the LED, then the background.
+        static sf::Image CreateLedMask(int pitch)
+        {
+            sf::Image result;
+            result.create(pitch, pitch, sf::Color(0, 0, 0, 0));
+            const float center = pitch / 2.f;
+            const float radius = pitch / 3.f;
+            for (int y = 0; y < pitch; y++)
+            {
+                for (int x = 0; x < pitch; x++)
+                {
+                    const float dx = x + 0.5f - center;
+                    const float dy = y + 0.5f - center;
+                    const float distance = std::sqrt(dx * dx + dy * dy);
+                    if (distance <= radius)
+                        continue;
+                    result.setPixel(x, y, distance <= center ? sf::Color(32, 32, 32) : sf::Color(60, 60, 60));
+                }
+            }
+            return result;
+        }
+
+        const PanelDecoder &decoder;
         bool running{true};
         std::thread th;
         std::mutex sync;
-        SFMLCanvas *current_canvas;
-        SFMLCanvas *next_canvas;
+        std::condition_variable frame_changed;
+        FrameCanvas *current_canvas;
+        bool mapping_changed{false};
 
         sf::Texture tex;
         sf::Sprite s;
@@ -176,63 +369,339 @@ namespace rgb_matrix
         RuntimeOptions rt_options;
     };
 
+    // Renders without a window, for tests and batch rendering. Frames are
+    // captured at every SwapOnVSync() with the time of the vertical sync
+    // they are shown at, and written as one of:
+    //   ppm:<dir>     one frame-NNNNNN.ppm per frame and an index.txt with
+    //                 the frame number, time in microseconds and file name.
+    //   png:<dir>     the same as PNG files.
+    //   raw:<file>    RGB24 frames back to back; "-" is stdout.
+    //   stream:<file> a version 3 content stream, see content-streamer.h.
+    // With the virtual clock (virtual_clock.cc), waiting for the vertical
+    // syncs takes no time at all.
+    class HeadlessDisplay : public Display
+    {
+    public:
+        static HeadlessDisplay *Create(const char *output, const PanelDecoder &d, FrameCanvas *initial, int64_t refresh_us)
+        {
+            const char *colon = strchr(output, ':');
+            if (colon == nullptr || colon[1] == '\0')
+                return nullptr;
+            const std::string kind(output, colon - output);
+            const std::string path(colon + 1);
+            Format format;
+            if (kind == "ppm")
+                format = PPM;
+            else if (kind == "png")
+                format = PNG;
+            else if (kind == "raw")
+                format = RAW;
+            else if (kind == "stream")
+                format = STREAM;
+            else
+                return nullptr;
+
+            HeadlessDisplay *result = new HeadlessDisplay(format, path, d, initial, refresh_us);
+            if (!result->Open())
+            {
+                delete result;
+                return nullptr;
+            }
+            return result;
+        }
+
+        ~HeadlessDisplay() override
+        {
+            Finish();
+        }
+
+        FrameCanvas *SwapOnVSync(FrameCanvas *other, int64_t time_us) override
+        {
+            FrameCanvas *prev = current_canvas;
+            current_canvas = other;
+            Capture(time_us);
+            return prev;
+        }
+
+    private:
+        enum Format
+        {
+            PPM,
+            PNG,
+            RAW,
+            STREAM
+        };
+
+        HeadlessDisplay(Format f, const std::string &p, const PanelDecoder &d, FrameCanvas *initial, int64_t refresh_us)
+            : format(f), path(p), decoder(d), refresh_us(refresh_us), current_canvas(initial)
+        {
+            const char *frames = getenv("GODIS_FRAMES");
+            max_frames = frames != nullptr ? atoi(frames) : 0;
+        }
+
+        bool Open()
+        {
+            switch (format)
+            {
+            case PPM:
+            case PNG:
+                index = fopen((path + "/index.txt").c_str(), "w");
+                if (index == nullptr)
+                {
+                    perror(path.c_str());
+                    return false;
+                }
+                return true;
+            case RAW:
+                out = path == "-" ? stdout : fopen(path.c_str(), "wb");
+                if (out == nullptr)
+                {
+                    perror(path.c_str());
+                    return false;
+                }
+                return true;
+            case STREAM:
+                stream_fd = open(path.c_str(), O_CREAT | O_TRUNC | O_WRONLY, 0644);
+                if (stream_fd < 0)
+                {
+                    perror(path.c_str());
+                    return false;
+                }
+                stream_io = new FileStreamIO(stream_fd);
+                stream_writer = new StreamWriter(stream_io, 3);
+                return true;
+            }
+            return false;
+        }
+
+        // Write what the panels show of the current canvas.
+        void Capture(int64_t time_us)
+        {
+            if (finished)
+                return;
+            // A pixel mapper applied in between changes the size.
+            const int width = decoder.width();
+            const int height = decoder.height();
+            frame.resize(width * height * 3);
+            TakeSnapshot(current_canvas, &bitplanes);
+            if (bitplanes.size() == decoder.bitplanes_size())
+                decoder.Decode(bitplanes.data(), current_canvas->pwmbits(), frame.data());
+
+            char name[32];
+            switch (format)
+            {
+            case PPM:
+            {
+                snprintf(name, sizeof(name), "frame-%06d.ppm", frame_count);
+                FILE *f = fopen((path + "/" + name).c_str(), "wb");
+                if (f == nullptr)
+                {
+                    perror(name);
+                    break;
+                }
+                fprintf(f, "P6\n%d %d\n255\n", width, height);
+                fwrite(frame.data(), 1, frame.size(), f);
+                fclose(f);
+                fprintf(index, "%d %lld %s\n", frame_count, (long long)time_us, name);
+                break;
+            }
+            case PNG:
+            {
+                snprintf(name, sizeof(name), "frame-%06d.png", frame_count);
+                std::vector<uint8_t> rgba(width * height * 4, 255);
+                for (size_t i = 0, j = 0; j < frame.size(); i += 4, j += 3)
+                {
+                    rgba[i] = frame[j];
+                    rgba[i + 1] = frame[j + 1];
+                    rgba[i + 2] = frame[j + 2];
+                }
+                sf::Image image;
+                image.create(width, height, rgba.data());
+                if (!image.saveToFile(path + "/" + name))
+                    break;
+                fprintf(index, "%d %lld %s\n", frame_count, (long long)time_us, name);
+                break;
+            }
+            case RAW:
+                fwrite(frame.data(), 1, frame.size(), out);
+                break;
+            case STREAM:
+                // A frame is held until the next one, so it is written once
+                // the next one arrives.
+                if (have_pending)
+                    WritePending(time_us - pending_time_us);
+                pending.swap(frame);
+                pending_width = width;
+                pending_height = height;
+                pending_time_us = time_us;
+                have_pending = true;
+                break;
+            }
+            last_time_us = time_us;
+
+            if (++frame_count == max_frames)
+            {
+                // Complete the output, and have the program quit as on
+                // Ctrl-C, so that it cleans up as it normally would.
+                Finish();
+                raise(SIGTERM);
+            }
+        }
+
+        void WritePending(int64_t hold_us)
+        {
+            stream_writer->Stream(ImageView(PIXEL_RGB24, pending.data(), pending_width * 3,
+                                            pending_width, pending_height),
+                                  hold_us);
+        }
+
+        // Programs that draw on the matrix directly instead of swapping still
+        // get their last picture written.
+        void Finish()
+        {
+            if (finished)
+                return;
+            std::vector<char> last_captured(bitplanes);
+            if (TakeSnapshot(current_canvas, &last_captured))
+            {
+                max_frames = 0;
+                Capture(frame_count == 0 ? 0 : last_time_us + refresh_us);
+            }
+            finished = true;
+            if (have_pending)
+                WritePending(refresh_us);
+            delete stream_writer;  // Writes the index.
+            delete stream_io;
+            if (stream_fd >= 0)
+                close(stream_fd);
+            if (out == stdout)
+                fflush(out);
+            else if (out != nullptr)
+                fclose(out);
+            if (index != nullptr)
+                fclose(index);
+        }
+
+        const Format format;
+        const std::string path;
+        const PanelDecoder &decoder;
+        const int64_t refresh_us;
+
+        FrameCanvas *current_canvas;
+        std::vector<char> bitplanes;
+        std::vector<uint8_t> frame;
+        int frame_count{0};
+        int max_frames;
+        int64_t last_time_us{0};
+        bool finished{false};
+
+        FILE *index{nullptr};
+        FILE *out{nullptr};
+        int stream_fd{-1};
+        StreamIO *stream_io{nullptr};
+        StreamWriter *stream_writer{nullptr};
+        std::vector<uint8_t> pending;
+        int pending_width{0};
+        int pending_height{0};
+        int64_t pending_time_us{0};
+        bool have_pending{false};
+    };
+
+    // The window, or the headless display if GODIS_OUTPUT is set.
+    static Display *CreateDisplay(const RuntimeOptions &rt_opt, int64_t refresh_us,
+                                  const PanelDecoder &decoder, FrameCanvas *initial)
+    {
+        const char *output = getenv("GODIS_OUTPUT");
+        if (output == nullptr || *output == '\0')
+            return new SFMLThread(decoder, initial, rt_opt);
+        Display *result = HeadlessDisplay::Create(output, decoder, initial, refresh_us);
+        if (result == nullptr)
+            fprintf(stderr, "GODIS_OUTPUT=%s: expected ppm:<dir>, png:<dir>, raw:<file> or stream:<file>\n", output);
+        return result;
+    }
+
+    // The frames are the library's Framebuffer with the bitplanes for the
+    // panels, set up with the multiplex and pixel mappers as in
+    // led-matrix.cc; only the GPIO and its refresh thread are replaced by
+    // the display.
     class RGBMatrix::Impl
     {
     public:
-        Impl(const Options &options);
         Impl(const Options &options, const RuntimeOptions &rt_options);
         ~Impl();
 
         FrameCanvas *CreateFrameCanvas();
         FrameCanvas *SwapOnVSync(FrameCanvas *other, unsigned framerate_fraction);
+        bool ApplyPixelMapper(const PixelMapper *mapper);
 
-        void SetBrightness(uint8_t val);
-        uint8_t brightness();
+        bool SetPWMBits(uint8_t value);
+        uint8_t pwmbits();
 
-        void Clear();
+        void set_luminance_correct(bool on);
+        bool luminance_correct() const;
 
-        void CanvasCheck()
-        {
-            if (active_canvas == nullptr)
-            {
-                CreateFrameCanvas();
-            }
-        }
+        void SetBrightness(uint8_t brightness);
+        uint8_t brightness();
 
     private:
         friend class RGBMatrix; // Necessary evil
 
-        // Brightness
-        uint8_t alpha{255};
+        void ApplyNamedPixelMappers(const char *pixel_mapper_config, int chain, int parallel);
 
-        Options options;
+        Options params;
         RuntimeOptions rt_options;
+        bool do_luminance_correct;
 
-        SFMLThread *th;
-        SFMLCanvas *active_canvas;
-        std::vector<SFMLCanvas *> canvases{};
+        FrameCanvas *active_canvas;
+        std::vector<FrameCanvas *> canvases{};
+        PixelDesignatorMap *shared_pixel_mapper{nullptr};
 
-        std::chrono::time_point<std::chrono::steady_clock> last_vsync_swap{};
+        PanelDecoder *decoder{nullptr};
+        Display *th{nullptr};
+
+        // The vertical syncs come every refresh_period from start on, as
+        // fast as the panels would refresh on boss; see refresh-timing.h
+        std::chrono::steady_clock::time_point start;
+        std::chrono::nanoseconds refresh_period;
     };
 
-    RGBMatrix::Impl::Impl(const Options &opt) : options(opt)
+    RGBMatrix::Impl::Impl(const Options &opt, const RuntimeOptions &rt_opt) : params(opt), rt_options(rt_opt)
     {
-        th = new SFMLThread(options.rows, options.cols * options.chain_length, {});
-    }
+        const internal::MultiplexMapper *multiplex_mapper = nullptr;
+        if (params.multiplexing > 0)
+        {
+            const internal::MuxMapperList &multiplexers = internal::GetRegisteredMultiplexMappers();
+            if (params.multiplexing <= (int)multiplexers.size())
+                multiplex_mapper = multiplexers[params.multiplexing - 1];
+        }
+        if (multiplex_mapper != nullptr)
+            multiplex_mapper->EditColsRows(&params.cols, &params.rows);
 
-    RGBMatrix::Impl::Impl(const Options &opt, const RuntimeOptions &rt_opt) : options(opt), rt_options(rt_opt)
-    {
-        th = new SFMLThread(options.rows, options.cols * options.chain_length, rt_opt);
-    }
+        Framebuffer::InitHardwareMapping(params.hardware_mapping);
 
-    void RGBMatrix::Impl::Clear()
-    {
+        active_canvas = CreateFrameCanvas();
         active_canvas->Clear();
+
+        ApplyPixelMapper(multiplex_mapper);
+        ApplyNamedPixelMappers(opt.pixel_mapper_config, params.chain_length, params.parallel);
+
+        const char *pi_model = getenv("GODIS_PI_MODEL");
+        const RefreshTiming timing = EstimateRefreshTiming(opt, rt_opt.gpio_slowdown,
+                                                           pi_model != nullptr ? atoi(pi_model) : DEFAULT_PI_MODEL);
+        refresh_period = std::chrono::nanoseconds((int64_t)(timing.frame_us * 1000));
+        start = std::chrono::steady_clock::now();
+
+        decoder = new PanelDecoder(params, &shared_pixel_mapper);
+        th = CreateDisplay(rt_opt, refresh_period.count() / 1000, *decoder, active_canvas);
     }
 
     RGBMatrix::Impl::~Impl()
     {
         delete th;
+        delete decoder;
+        for (FrameCanvas *c : canvases)
+            delete c;
+        delete shared_pixel_mapper;
     }
 
     RGBMatrix::~RGBMatrix()
@@ -240,49 +709,132 @@ namespace rgb_matrix
         delete impl_;
     }
 
+    void RGBMatrix::Impl::ApplyNamedPixelMappers(const char *pixel_mapper_config, int chain, int parallel)
+    {
+        if (pixel_mapper_config == nullptr || strlen(pixel_mapper_config) == 0)
+            return;
+        char *const writeable_copy = strdup(pixel_mapper_config);
+        const char *const end = writeable_copy + strlen(writeable_copy);
+        char *s = writeable_copy;
+        while (s < end)
+        {
+            char *const semicolon = strchrnul(s, ';');
+            *semicolon = '\0';
+            char *optional_param_start = strchr(s, ':');
+            if (optional_param_start)
+                *optional_param_start++ = '\0';
+            if (*s == '\0' && optional_param_start && *optional_param_start != '\0')
+                fprintf(stderr, "Stray parameter ':%s' without mapper name ?\n", optional_param_start);
+            if (*s)
+                ApplyPixelMapper(FindPixelMapper(s, chain, parallel, optional_param_start));
+            s = semicolon + 1;
+        }
+        free(writeable_copy);
+    }
+
     FrameCanvas *RGBMatrix::Impl::CreateFrameCanvas()
     {
-        SFMLCanvas *c = new SFMLCanvas(options.rows, options.cols * options.chain_length);
-        c->Fill(255, 255, 255);
+        FrameCanvas *c = new FrameCanvas(new Framebuffer(params.rows, params.cols * params.chain_length,
+                                                         params.parallel, params.scan_mode,
+                                                         params.led_rgb_sequence, params.inverse_colors,
+                                                         &shared_pixel_mapper));
+        if (canvases.empty())
+            do_luminance_correct = c->framebuffer()->luminance_correct();
+        c->framebuffer()->SetPWMBits(params.pwm_bits);
+        c->framebuffer()->set_luminance_correct(do_luminance_correct);
+        c->framebuffer()->SetBrightness(params.brightness);
         canvases.push_back(c);
-        active_canvas = c;
-        th->setCanvas(c);
-
         return c;
     }
 
     FrameCanvas *RGBMatrix::Impl::SwapOnVSync(FrameCanvas *other, unsigned frame_fraction)
     {
-        if (frame_fraction > 1) // Shouldn't really be used tbh
+        // Like the refresh thread, swap at the end of the next refresh whose
+        // number is a multiple of the frame fraction.
+        if (frame_fraction == 0)
+            frame_fraction = 1;
+        const int64_t refreshes = (std::chrono::steady_clock::now() - start) / refresh_period;
+        const int64_t vsync = (refreshes / frame_fraction + 1) * frame_fraction;
+        std::this_thread::sleep_until(start + vsync * refresh_period);
+
+        const int64_t time_us = std::chrono::duration_cast<std::chrono::microseconds>(vsync * refresh_period).count();
+        FrameCanvas *prev = th->SwapOnVSync(other, time_us);
+        if (other != nullptr)
+            active_canvas = other;
+        return prev;
+    }
+
+    bool RGBMatrix::Impl::ApplyPixelMapper(const PixelMapper *mapper)
+    {
+        if (mapper == nullptr)
+            return true;
+        const int old_width = shared_pixel_mapper->width();
+        const int old_height = shared_pixel_mapper->height();
+        int new_width, new_height;
+        if (!mapper->GetSizeMapping(old_width, old_height, &new_width, &new_height))
+            return false;
+        PixelDesignatorMap *new_mapper = new PixelDesignatorMap(new_width, new_height, shared_pixel_mapper->GetFillColorBits());
+        for (int y = 0; y < new_height; ++y)
         {
-            const auto sleep_delay_ms = std::chrono::milliseconds((unsigned)((1.f / (float)frame_fraction) * 1000));
-            std::this_thread::sleep_until(last_vsync_swap + sleep_delay_ms);
-            last_vsync_swap = std::chrono::steady_clock::now();
+            for (int x = 0; x < new_width; ++x)
+            {
+                int orig_x = -1, orig_y = -1;
+                mapper->MapVisibleToMatrix(old_width, old_height, x, y, &orig_x, &orig_y);
+                if (orig_x < 0 || orig_y < 0 || orig_x >= old_width || orig_y >= old_height)
+                {
+                    fprintf(stderr, "Error in PixelMapper: (%d, %d) -> (%d, %d) [range: %dx%d]\n",
+                            x, y, orig_x, orig_y, old_width, old_height);
+                    continue;
+                }
+                *new_mapper->get(x, y) = *shared_pixel_mapper->get(orig_x, orig_y);
+            }
         }
-        else if (rt_options.gpio_slowdown > 0)
+        auto replace = [this, new_mapper]()
         {
-            // Crude estimation of the slowdown-gpio flag for boss hw
-            const auto sleep_delay_ms = std::chrono::milliseconds((unsigned)(((float)rt_options.gpio_slowdown) * 2.5f));
-            std::this_thread::sleep_until(last_vsync_swap + sleep_delay_ms);
-            last_vsync_swap = std::chrono::steady_clock::now();
-        }
+            delete shared_pixel_mapper;
+            shared_pixel_mapper = new_mapper;
+        };
+        if (th != nullptr)
+            th->ChangeMapping(replace);
+        else
+            replace();
+        return true;
+    }
 
-        FrameCanvas *prev = th->SwapOnVSync((SFMLCanvas *)other);
-        return prev;
+    bool RGBMatrix::Impl::SetPWMBits(uint8_t value)
+    {
+        const bool success = active_canvas->framebuffer()->SetPWMBits(value);
+        if (success)
+            params.pwm_bits = value;
+        return success;
+    }
+
+    uint8_t RGBMatrix::Impl::pwmbits()
+    {
+        return params.pwm_bits;
+    }
+
+    void RGBMatrix::Impl::set_luminance_correct(bool on)
+    {
+        active_canvas->framebuffer()->set_luminance_correct(on);
+        do_luminance_correct = on;
+    }
+
+    bool RGBMatrix::Impl::luminance_correct() const
+    {
+        return do_luminance_correct;
     }
 
     void RGBMatrix::Impl::SetBrightness(uint8_t brightness)
     {
-        alpha = (uint8_t)(((float)brightness / 100.f) * 255);
-        for (auto *it : canvases)
-        {
-            it->setAlpha(alpha);
-        }
+        for (FrameCanvas *c : canvases)
+            c->framebuffer()->SetBrightness(brightness);
+        params.brightness = brightness;
     }
 
     uint8_t RGBMatrix::Impl::brightness()
     {
-        return alpha;
+        return params.brightness;
     }
 
     RGBMatrix *RGBMatrix::CreateFromOptions(const RGBMatrix::Options &options,
@@ -314,6 +866,11 @@ namespace rgb_matrix
         //   }
 
         RGBMatrix::Impl *result = new RGBMatrix::Impl(options, runtime_options);
+        if (result->th == nullptr)
+        {
+            delete result;
+            return NULL;
+        }
         // Allowing daemon also means we are allowed to start the thread now.
         // const bool allow_daemon = !(runtime_options.daemon < 0);
         // if (runtime_options.do_gpio_init)
@@ -361,29 +918,25 @@ namespace rgb_matrix
     }
     bool RGBMatrix::ApplyPixelMapper(const PixelMapper *mapper)
     {
-        // return impl_->ApplyPixelMapper(mapper);
-        return false;
+        return impl_->ApplyPixelMapper(mapper);
     }
     bool RGBMatrix::SetPWMBits(uint8_t value)
     {
-        // return impl_->SetPWMBits(value);
-        return false;
+        return impl_->SetPWMBits(value);
     }
     uint8_t RGBMatrix::pwmbits()
     {
-        // return impl_->pwmbits();
-        return 0;
+        return impl_->pwmbits();
     }
 
     void RGBMatrix::set_luminance_correct(bool on)
     {
-        // return impl_->set_luminance_correct(on);
+        impl_->set_luminance_correct(on);
     }
 
     bool RGBMatrix::luminance_correct() const
     {
-        // return impl_->luminance_correct();
-        return false;
+        return impl_->luminance_correct();
     }
 
     void RGBMatrix::SetBrightness(uint8_t brightness)
@@ -422,122 +975,154 @@ namespace rgb_matrix
     // -- Implementation of RGBMatrix Canvas: delegation to ContentBuffer
     int RGBMatrix::width() const
     {
-        impl_->CanvasCheck();
         return impl_->active_canvas->width();
     }
 
     int RGBMatrix::height() const
     {
-        impl_->CanvasCheck();
         return impl_->active_canvas->height();
     }
 
     void RGBMatrix::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
     {
-        impl_->CanvasCheck();
         impl_->active_canvas->SetPixel(x, y, red, green, blue);
     }
 
     void RGBMatrix::Clear()
     {
-        impl_->Clear();
+        impl_->active_canvas->Clear();
     }
 
     void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue)
     {
-        impl_->CanvasCheck();
         impl_->active_canvas->Fill(red, green, blue);
     }
 
-    // Makes linker shut up
+    void RGBMatrix::FillRect(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        impl_->active_canvas->FillRect(x, y, width, height, red, green, blue);
+    }
+
+    void RGBMatrix::HLine(int x, int y, int width, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        impl_->active_canvas->HLine(x, y, width, red, green, blue);
+    }
+
+    void RGBMatrix::VLine(int x, int y, int height, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        impl_->active_canvas->VLine(x, y, height, red, green, blue);
+    }
+
+    void RGBMatrix::SetPixelsSpan(int x, int y, int count, const uint8_t *rgb)
+    {
+        impl_->active_canvas->SetPixelsSpan(x, y, count, rgb);
+    }
 
     // FrameCanvas implementation of Canvas
     FrameCanvas::~FrameCanvas()
     {
-        // delete frame_;
+        delete frame_;
     }
 
     int FrameCanvas::width() const
     {
-        return 0;
-        // return frame_->width();
+        return frame_->width();
     }
 
     int FrameCanvas::height() const
     {
-        return 0;
-        // return frame_->height();
+        return frame_->height();
     }
 
     void FrameCanvas::SetPixel(int x, int y, uint8_t red, uint8_t green, uint8_t blue)
     {
-        // frame_->SetPixel(x, y, red, green, blue);
+        frame_->SetPixel(x, y, red, green, blue);
     }
 
     void FrameCanvas::SetPixels(int x, int y, int width, int height, Color *colors)
     {
-        // frame_->SetPixels(x, y, width, height, colors);
+        frame_->SetPixels(x, y, width, height, colors);
     }
 
     void FrameCanvas::Clear()
     {
-        // return frame_->Clear();
+        return frame_->Clear();
     }
 
     void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue)
     {
-        // frame_->Fill(red, green, blue);
+        frame_->Fill(red, green, blue);
+    }
+
+    void FrameCanvas::FillRect(int x, int y, int width, int height, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        frame_->FillRect(x, y, width, height, red, green, blue);
+    }
+
+    void FrameCanvas::HLine(int x, int y, int width, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        frame_->FillRect(x, y, width, 1, red, green, blue);
+    }
+
+    void FrameCanvas::VLine(int x, int y, int height, uint8_t red, uint8_t green, uint8_t blue)
+    {
+        frame_->FillRect(x, y, 1, height, red, green, blue);
+    }
+
+    void FrameCanvas::SetPixelsSpan(int x, int y, int count, const uint8_t *rgb)
+    {
+        frame_->SetPixelsSpan(x, y, count, rgb);
     }
 
     bool FrameCanvas::SetPWMBits(uint8_t value)
     {
-        // return frame_->SetPWMBits(value);
-        return false;
+        return frame_->SetPWMBits(value);
     }
 
     uint8_t FrameCanvas::pwmbits()
     {
-        // return frame_->pwmbits();
-        return 0;
+        return frame_->pwmbits();
     }
 
     // Map brightness of output linearly to input with CIE1931 profile.
     void FrameCanvas::set_luminance_correct(bool on)
     {
-        //    frame_->set_luminance_correct(on);
+        frame_->set_luminance_correct(on);
     }
 
     bool FrameCanvas::luminance_correct() const
     {
-        // return frame_->luminance_correct();
-        return false;
+        return frame_->luminance_correct();
     }
 
     void FrameCanvas::SetBrightness(uint8_t brightness)
     {
-        // frame_->SetBrightness(brightness);
+        frame_->SetBrightness(brightness);
     }
 
     uint8_t FrameCanvas::brightness()
     {
-        // return frame_->brightness();
-        return 0;
+        return frame_->brightness();
     }
 
     void FrameCanvas::Serialize(const char **data, size_t *len) const
     {
-        // frame_->Serialize(data, len);
+        frame_->Serialize(data, len);
     }
 
     bool FrameCanvas::Deserialize(const char *data, size_t len)
     {
-        // return frame_->Deserialize(data, len);
-        return false;
+        return frame_->Deserialize(data, len);
+    }
+
+    bool FrameCanvas::DeserializeZeroCopy(const char *data, size_t len)
+    {
+        return frame_->DeserializeZeroCopy(data, len);
     }
 
     void FrameCanvas::CopyFrom(const FrameCanvas &other)
     {
-        // frame_->CopyFrom(other.frame_);
+        frame_->CopyFrom(other.frame_);
     }
 
     typedef char **argv_iterator;
@@ -777,8 +1362,20 @@ namespace rgb_matrix
         return true;
     }
 
-    RuntimeOptions::RuntimeOptions() {}
-    RGBMatrix::Options::Options() {}
+    // The same defaults as the library.
+    RuntimeOptions::RuntimeOptions()
+        : gpio_slowdown(1), daemon(0), drop_privileges(1), do_gpio_init(true),
+          drop_priv_user("daemon"), drop_priv_group("daemon")
+    {
+    }
+    RGBMatrix::Options::Options()
+        : hardware_mapping("regular"), rows(32), cols(32), chain_length(1), parallel(1),
+          pwm_bits(11), pwm_lsb_nanoseconds(130), pwm_dither_bits(0), brightness(100),
+          scan_mode(0), row_address_type(0), multiplexing(0), disable_hardware_pulsing(false),
+          show_refresh_rate(false), inverse_colors(false), led_rgb_sequence("RGB"),
+          pixel_mapper_config(NULL), panel_type(NULL), limit_refresh_rate_hz(0)
+    {
+    }
     bool ParseOptionsFromFlags(int *argc, char ***argv, rgb_matrix::RGBMatrix::Options *m_opt_in, rgb_matrix::RuntimeOptions *rt_opt_in, bool remove_consumed_options)
     {
         if (argc == NULL || argv == NULL)
@@ -0,0 +1,281 @@
+// A virtual clock for headless runs, enabled with GODIS_VIRTUAL_CLOCK=1.
+// Time only passes when the program sleeps, and sleeping returns right away,
+// so programs run as fast as they can compute their frames, while seeing the
+// same time go by as they would in real time.
+//
+// Each thread has its own virtual time, which starts at the time of the
+// thread that created it, and moves on when it sleeps, or when it joins a
+// thread or looks at the clock after another thread moved it on. The clock
+// is at the latest time any thread woke up at; so two threads that each
+// sleep one second at the same time only advance it by one second.
+//
+// Timed waits on condition variables and semaphores wait for real for a
+// short while, to give other threads the chance to wake them. If none does,
+// they time out as if they had slept until their deadline. Their deadline
+// is taken to be on CLOCK_REALTIME, the default of condition variables.
+//
+// This works by replacing the sleep, wait and clock functions of the C
+// library; without the virtual clock, they just call the real ones.
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+
+namespace
+{
+    // Latest virtual time any thread woke up at, as time slept since the
+    // start. A thread's own time is -1 until it first uses the clock.
+    std::atomic<int64_t> slept_ns{0};
+    thread_local int64_t thread_slept_ns = -1;
+
+    // The thread's time, caught up with what other threads slept.
+    int64_t ThreadNanos()
+    {
+        thread_slept_ns = std::max(thread_slept_ns, slept_ns.load());
+        return thread_slept_ns;
+    }
+
+    // The thread's own time, without catching up.
+    int64_t OwnNanos()
+    {
+        if (thread_slept_ns < 0)
+            thread_slept_ns = slept_ns;
+        return thread_slept_ns;
+    }
+
+    struct ThreadStart
+    {
+        void *(*routine)(void *);
+        void *arg;
+        int64_t slept_ns;
+    };
+
+    void *StartThread(void *start_arg)
+    {
+        const ThreadStart start = *(ThreadStart *)start_arg;
+        delete (ThreadStart *)start_arg;
+        thread_slept_ns = start.slept_ns;
+        return start.routine(start.arg);
+    }
+
+    bool VirtualClockEnabled()
+    {
+        static const bool enabled = getenv("GODIS_VIRTUAL_CLOCK") != nullptr && strcmp(getenv("GODIS_VIRTUAL_CLOCK"), "0") != 0;
+        return enabled;
+    }
+
+    template <typename Fn>
+    Fn RealFunction(const char *name)
+    {
+        return (Fn)dlsym(RTLD_NEXT, name);
+    }
+
+    int RealClockGettime(clockid_t clock, struct timespec *ts)
+    {
+        static auto real = RealFunction<int (*)(clockid_t, struct timespec *)>("clock_gettime");
+        return real(clock, ts);
+    }
+
+    int64_t ToNanos(const struct timespec &ts)
+    {
+        return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    }
+
+    struct timespec FromNanos(int64_t nanos)
+    {
+        struct timespec ts;
+        ts.tv_sec = nanos / 1000000000LL;
+        ts.tv_nsec = nanos % 1000000000LL;
+        return ts;
+    }
+
+    // Virtual time of "clock" in nanoseconds: where the real clock was at
+    // the start, plus the time slept since as seen by this thread.
+    bool VirtualNanos(clockid_t clock, int64_t *nanos)
+    {
+        static const int64_t realtime_start = []
+        {
+            struct timespec ts;
+            RealClockGettime(CLOCK_REALTIME, &ts);
+            return ToNanos(ts);
+        }();
+        static const int64_t monotonic_start = []
+        {
+            struct timespec ts;
+            RealClockGettime(CLOCK_MONOTONIC, &ts);
+            return ToNanos(ts);
+        }();
+        switch (clock)
+        {
+        case CLOCK_REALTIME:
+        case CLOCK_REALTIME_COARSE:
+            *nanos = realtime_start + ThreadNanos();
+            return true;
+        case CLOCK_MONOTONIC:
+        case CLOCK_MONOTONIC_COARSE:
+        case CLOCK_MONOTONIC_RAW:
+        case CLOCK_BOOTTIME:
+            *nanos = monotonic_start + ThreadNanos();
+            return true;
+        default: // CPU time clocks keep running for real.
+            return false;
+        }
+    }
+
+    // Sleeping counts from the thread's own time, not from where other
+    // threads moved the clock meanwhile.
+    void Sleep(int64_t nanos)
+    {
+        if (nanos <= 0)
+            return;
+        thread_slept_ns = OwnNanos() + nanos;
+        int64_t latest = slept_ns;
+        while (latest < thread_slept_ns && !slept_ns.compare_exchange_weak(latest, thread_slept_ns))
+        {
+        }
+    }
+
+    // Real time a timed wait gives other threads to wake it up.
+    constexpr int64_t kRealWaitNs = 10000000;
+
+    // Wait until the virtual CLOCK_REALTIME "deadline" with "wait", which
+    // takes a deadline on the real CLOCK_MONOTONIC and returns 0 or an error
+    // number.
+    template <typename Wait>
+    int VirtualTimedWait(const struct timespec *deadline, Wait wait)
+    {
+        int64_t now;
+        VirtualNanos(CLOCK_REALTIME, &now);
+        const int64_t timeout = ToNanos(*deadline) - now;
+        struct timespec real_now;
+        RealClockGettime(CLOCK_MONOTONIC, &real_now);
+        const struct timespec real_deadline =
+            FromNanos(ToNanos(real_now) + std::clamp<int64_t>(timeout, 0, kRealWaitNs));
+        const int error = wait(&real_deadline);
+        if (error == ETIMEDOUT)
+            Sleep(timeout);
+        else
+            ThreadNanos(); // Not before the thread that woke us.
+        return error;
+    }
+}
+
+extern "C"
+{
+    int clock_gettime(clockid_t clock, struct timespec *ts) noexcept
+    {
+        int64_t nanos;
+        if (!VirtualClockEnabled() || !VirtualNanos(clock, &nanos))
+            return RealClockGettime(clock, ts);
+        *ts = FromNanos(nanos);
+        return 0;
+    }
+
+    int gettimeofday(struct timeval *tv, void * /*tz*/) noexcept
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        tv->tv_sec = ts.tv_sec;
+        tv->tv_usec = ts.tv_nsec / 1000;
+        return 0;
+    }
+
+    time_t time(time_t *result) noexcept
+    {
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        if (result != nullptr)
+            *result = ts.tv_sec;
+        return ts.tv_sec;
+    }
+
+    int clock_nanosleep(clockid_t clock, int flags, const struct timespec *request, struct timespec *remain)
+    {
+        static auto real = RealFunction<int (*)(clockid_t, int, const struct timespec *, struct timespec *)>("clock_nanosleep");
+        int64_t now;
+        if (!VirtualClockEnabled() || !VirtualNanos(clock, &now))
+            return real(clock, flags, request, remain);
+        Sleep((flags & TIMER_ABSTIME) ? ToNanos(*request) - now : ToNanos(*request));
+        return 0;
+    }
+
+    int nanosleep(const struct timespec *request, struct timespec *remain)
+    {
+        static auto real = RealFunction<int (*)(const struct timespec *, struct timespec *)>("nanosleep");
+        if (!VirtualClockEnabled())
+            return real(request, remain);
+        Sleep(ToNanos(*request));
+        return 0;
+    }
+
+    int usleep(useconds_t usec)
+    {
+        static auto real = RealFunction<int (*)(useconds_t)>("usleep");
+        if (!VirtualClockEnabled())
+            return real(usec);
+        Sleep(usec * 1000LL);
+        return 0;
+    }
+
+    int pthread_create(pthread_t *thread, const pthread_attr_t *attr, void *(*routine)(void *), void *arg)
+    {
+        static auto real = RealFunction<int (*)(pthread_t *, const pthread_attr_t *, void *(*)(void *), void *)>("pthread_create");
+        if (!VirtualClockEnabled())
+            return real(thread, attr, routine, arg);
+        ThreadStart *start = new ThreadStart{routine, arg, OwnNanos()};
+        const int result = real(thread, attr, StartThread, start);
+        if (result != 0)
+            delete start;
+        return result;
+    }
+
+    int pthread_join(pthread_t thread, void **result)
+    {
+        static auto real = RealFunction<int (*)(pthread_t, void **)>("pthread_join");
+        const int error = real(thread, result);
+        if (error == 0 && VirtualClockEnabled())
+            ThreadNanos(); // Not before the joined thread ended.
+        return error;
+    }
+
+    int pthread_cond_timedwait(pthread_cond_t *cond, pthread_mutex_t *mutex, const struct timespec *deadline)
+    {
+        static auto real = RealFunction<int (*)(pthread_cond_t *, pthread_mutex_t *, const struct timespec *)>("pthread_cond_timedwait");
+        if (!VirtualClockEnabled())
+            return real(cond, mutex, deadline);
+        return VirtualTimedWait(deadline, [&](const struct timespec *real_deadline)
+                                { return pthread_cond_clockwait(cond, mutex, CLOCK_MONOTONIC, real_deadline); });
+    }
+
+    int sem_timedwait(sem_t *sem, const struct timespec *deadline)
+    {
+        static auto real = RealFunction<int (*)(sem_t *, const struct timespec *)>("sem_timedwait");
+        if (!VirtualClockEnabled())
+            return real(sem, deadline);
+        const int error = VirtualTimedWait(deadline, [&](const struct timespec *real_deadline)
+                                           { return sem_clockwait(sem, CLOCK_MONOTONIC, real_deadline) == 0 ? 0 : errno; });
+        if (error == 0)
+            return 0;
+        errno = error;
+        return -1;
+    }
+
+    unsigned int sleep(unsigned int seconds)
+    {
+        static auto real = RealFunction<unsigned int (*)(unsigned int)>("sleep");
+        if (!VirtualClockEnabled())
+            return real(seconds);
+        Sleep(seconds * 1000000000LL);
+        return 0;
+    }
+}
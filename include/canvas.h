@@ -46,6 +46,44 @@ public:
 
   // Fill screen with given 24bpp color.
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) = 0;
+
+  // -- Span operations.
+  // The following have default implementations that fall back to SetPixel(),
+  // so existing Canvas implementations keep working. Implementations that
+  // can do better (such as the FrameCanvas) override these.
+  // Pixels outside the canvas are silently clipped.
+
+  // Fill the rectangle with the top left corner at "x","y" and the given
+  // "width" and "height" with the color.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    for (int iy = y; iy < y + height; ++iy) {
+      for (int ix = x; ix < x + width; ++ix) {
+        SetPixel(ix, iy, red, green, blue);
+      }
+    }
+  }
+
+  // Horizontal line of "width" pixels starting at "x","y" going right.
+  virtual void HLine(int x, int y, int width,
+                     uint8_t red, uint8_t green, uint8_t blue) {
+    FillRect(x, y, width, 1, red, green, blue);
+  }
+
+  // Vertical line of "height" pixels starting at "x","y" going down.
+  virtual void VLine(int x, int y, int height,
+                     uint8_t red, uint8_t green, uint8_t blue) {
+    FillRect(x, y, 1, height, red, green, blue);
+  }
+
+  // Set "count" pixels in row "y" starting at "x" going right. The colors
+  // are given in "rgb" as consecutive red, green, blue bytes, so
+  // "rgb" needs to contain 3 * count bytes.
+  virtual void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+    for (int i = 0; i < count; ++i, rgb += 3) {
+      SetPixel(x + i, y, rgb[0], rgb[1], rgb[2]);
+    }
+  }
 };
 
 }  // namespace rgb_matrix
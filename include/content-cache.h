@@ -0,0 +1,78 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A directory of content streams (see content-streamer.h) rendered from
+// videos or animations, so that playing the same file again does not need
+// to decode and scale it again, but just reads the stream.
+//
+// Entries are keyed by a hash of the file content and a "variant" string
+// that describes everything else the rendered frames depend on, such as
+// the display size and scaling options. Hashing the content of a large
+// file is not free, so the content hash of a file is remembered by its
+// path, inode, size and modification time.
+//
+// The total size of the directory is kept below a limit by removing the
+// least recently used entries.
+//
+// Typical use:
+//   const std::string key = cache->Key(filename, variant);
+//   int fd = cache->Open(key);
+//   if (fd >= 0) {
+//     ... play the stream in fd
+//   } else if ((fd = cache->BeginEntry(key, &pending)) >= 0) {
+//     ... write frames to a StreamWriter on fd while playing, close fd.
+//     cache->CommitEntry(key, pending);  // or AbortEntry(pending) on error.
+//   }
+
+#ifndef RPI_CONTENT_CACHE_H
+#define RPI_CONTENT_CACHE_H
+
+#include <stdint.h>
+
+#include <string>
+
+namespace rgb_matrix {
+
+class ContentCache {
+public:
+  // Keep cached streams in "directory", which is created if needed, and
+  // keep their total size below "max_bytes".
+  // Returns NULL if the directory can't be used.
+  static ContentCache *Create(const char *directory, uint64_t max_bytes);
+
+  // Cache key for the content of "filename", rendered with the given
+  // "variant". Returns an empty string if the file can't be cached, e.g.
+  // because it is not a regular file.
+  std::string Key(const char *filename, const std::string &variant);
+
+  // Open the stream cached for "key" and mark it as recently used.
+  // Returns a file descriptor to read from, or -1 if not cached.
+  int Open(const std::string &key);
+
+  // Start a new entry for "key". Returns a file descriptor to write the
+  // stream to, or -1 on error. "*pending" is set to the file written; each
+  // call gets its own, so several threads or processes can fill the same
+  // entry at the same time. The entry only becomes visible with
+  // CommitEntry(), which needs to be called after the file descriptor is
+  // closed; AbortEntry() discards it, e.g. if playing was interrupted or
+  // the content could not be decoded to the end.
+  int BeginEntry(const std::string &key, std::string *pending);
+  bool CommitEntry(const std::string &key, const std::string &pending);
+  void AbortEntry(const std::string &pending);
+
+private:
+  ContentCache(const std::string &directory, uint64_t max_bytes);
+
+  std::string ContentHash(const char *filename);
+  std::string EntryPath(const std::string &key) const;
+
+  // Remove the least recently used files until the directory is below
+  // max_bytes_. The entry "keep" is never removed.
+  void Evict(const std::string &keep);
+
+  const std::string directory_;
+  const uint64_t max_bytes_;
+};
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_CONTENT_CACHE_H
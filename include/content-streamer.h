@@ -6,7 +6,17 @@
 // the Pi to avoid stuttering or brightness glitches.
 //
 // The disadvantage is, that this represents the full expanded internal
-// representation of a frame, so is very large memory wise.
+// representation of a frame, so is very large memory wise. To keep that in
+// check, the default stream format (version 2) compresses frames, stores
+// frames that only partially change as difference to the previous frame and
+// unchanged frames as a mere repeat marker. It ends with an index of the
+// frames, so that readers can seek. Version 1 streams, which store each frame
+// uncompressed, can still be read and written.
+//
+// Both of these store the internal GPIO representation, so they only play
+// back on a matrix with the same panel and hardware mapping settings. Version 3
+// streams instead store plain RGB images with the same compression; they are
+// converted when played, so they work with any matrix configuration.
 //
 // These abstractions are used in util/led-image-viewer.cc to read and
 // write such animations to disk. It is also used in util/video-viewer.cc
@@ -17,10 +27,16 @@
 #include <stdlib.h>
 #include <sys/types.h>
 
+#include <deque>
 #include <string>
+#include <vector>
+
+#include "graphics.h"
+#include "thread.h"
 
 namespace rgb_matrix {
 class FrameCanvas;
+class RGBMatrix;
 
 // An abstraction of a data stream.
 class StreamIO {
@@ -36,6 +52,18 @@ public:
   // Write bytes from buffer. Similar to Posix behavior that allows short
   // writes.
   virtual ssize_t Append(const void *buf, size_t count) = 0;
+
+  // Optional: if the stream is available in memory, return a pointer to the
+  // next "count" bytes and advance as if they were read. The data stays
+  // valid as long as this StreamIO exists. Returns NULL if not supported or
+  // if fewer than "count" bytes are left; use Read() then.
+  virtual const char *ReadInPlace(size_t count) { return NULL; }
+
+  // Optional: position the stream at "offset" bytes from the beginning and
+  // return the total size of the stream. Return false or -1 respectively
+  // if not supported, e.g. for pipes. Needed for seeking in a StreamReader.
+  virtual bool Seek(off_t offset) { return false; }
+  virtual off_t Size() { return -1; }
 };
 
 class FileStreamIO : public StreamIO {
@@ -46,9 +74,43 @@ public:
   virtual void Rewind();
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual bool Seek(off_t offset);
+  virtual off_t Size();
+
+private:
+  const int fd_;
+};
+
+// Read-only stream of a memory mapped file. Frames are handed out in place,
+// so a StreamReader can have a FrameCanvas display uncompressed frames (see
+// StreamWriter) directly from the mapped pages without copying. The kernel
+// is advised to read ahead and to drop pages that are played, so even long
+// streams only keep a small window resident.
+class MmapStreamIO : public StreamIO {
+public:
+  // Map the file "fd". Returns NULL if it can't be mapped, e.g. because it
+  // is a pipe; the file descriptor is still open then. On success, the
+  // MmapStreamIO takes ownership of the file descriptor.
+  static MmapStreamIO *Create(int fd);
+  ~MmapStreamIO();
+
+  virtual void Rewind();
+  virtual ssize_t Read(void *buf, size_t count);
+  virtual ssize_t Append(const void *buf, size_t count);  // Not supported.
+  virtual const char *ReadInPlace(size_t count);
+  virtual bool Seek(off_t offset);
+  virtual off_t Size();
 
 private:
+  MmapStreamIO(int fd, const char *data, size_t size);
+  void Advance(size_t count);
+
   const int fd_;
+  const char *const data_;
+  const size_t size_;
+  size_t pos_;
+  size_t read_ahead_end_;  // Up to here, WILLNEED was advised.
+  size_t released_end_;    // Up to here, DONTNEED was advised.
 };
 
 class MemStreamIO : public StreamIO {
@@ -56,6 +118,8 @@ public:
   virtual void Rewind();
   virtual ssize_t Read(void *buf, size_t count);
   virtual ssize_t Append(const void *buf, size_t count);
+  virtual bool Seek(off_t offset);
+  virtual off_t Size();
 
 private:
   std::string buffer_;  // super simplistic.
@@ -65,19 +129,64 @@ private:
 class StreamWriter {
 public:
   // Does not take ownership of StreamIO
-  StreamWriter(StreamIO *io);
+  // The "format_version" is 2 (compressed) or 1 (uncompressed, readable by
+  // older versions of this library).
+  // Version 3 streams store RGB images instead of the matrix representation.
+  // They are a fraction of the size and play on any matrix, independent of
+  // GPIO mapping, pixel mapper or PWM settings, but need to be converted to
+  // the matrix representation while playing. To keep this cost off
+  // playback, a version 3 stream can be converted to a version 2 stream
+  // once for a particular setup (see led-image-viewer -O).
+  // Version 2 frames are compressed unless "compress" is false. Only
+  // uncompressed frames can be shown straight from a MmapStreamIO without
+  // copying, so that is worth it for streams that are played a lot, if
+  // there is the disk space. Frames that repeat the previous one are still
+  // stored as such.
+  StreamWriter(StreamIO *io, int format_version = 2, bool compress = true);
+
+  // Version 2 streams end with an index of all frames that allows readers
+  // to seek. It is appended when the StreamWriter is destroyed.
+  ~StreamWriter();
 
   // Stream out given canvas at the given time. "hold_time_us" indicates
   // for how long this frame is to be shown in microseconds.
+  // Not possible for version 3 streams.
   bool Stream(const FrameCanvas &frame, uint32_t hold_time_us);
 
+  // Stream out an image to a version 3 stream. All images need to have the
+  // same size.
+  bool Stream(const ImageView &image, uint32_t hold_time_us);
+
 private:
-  void WriteFileHeader(const FrameCanvas &frame, size_t len);
+  void WriteFileHeader(int width, int height, size_t len);
+  bool StreamData(const char *data, size_t len, uint32_t hold_time_us);
+  bool WriteFrame(uint32_t type, uint32_t hold_time_us,
+                  const void *data, size_t len);
 
   StreamIO *const io_;
+  const int format_version_;
+  const bool compress_;
   bool header_written_;
+
+  // Version 2: previous frame and scratch space to encode the next.
+  std::string previous_frame_;
+  std::string encoded_;
+  std::string delta_;
+  int frames_since_keyframe_;
+
+  // Version 2: the frame index, and bookkeeping to create it.
+  std::string index_;
+  uint64_t bytes_written_;
+  uint64_t time_written_us_;
+
+  // Version 3: image size and the image converted to RGB.
+  int rgb_width_;
+  int rgb_height_;
+  std::string rgb_frame_;
 };
 
+// Reads a stream. Streams that are concatenated, e.g. with 'cat', are
+// read one after another.
 class StreamReader {
 public:
   // Does not take ownership of StreamIO
@@ -91,18 +200,125 @@ public:
   // or end of stream reached..
   bool GetNext(FrameCanvas *frame, uint32_t* hold_time_us);
 
+  // Position the stream so that the next GetNext() returns the frame with
+  // the given number, counting from zero; or the frame that is shown
+  // "time_us" microseconds after the start of the stream.
+  // This uses the index at the end of the stream. For streams without one,
+  // an index is created once by scanning over the frame headers.
+  // Returns 'false' if the StreamIO does not support seeking, or if the
+  // frame is not in the stream; the stream is rewound then.
+  bool Seek(int frame);
+  bool SeekTime(uint64_t time_us);
+
 private:
   enum State {
     STREAM_AT_BEGIN,
     STREAM_READING,
     STREAM_ERROR,
   };
-  bool ReadFileHeader(const FrameCanvas &frame);
+  bool ReadFileHeader();
+  bool StartStream(const char *file_header);
+  bool DecodeNextFrame(uint32_t *hold_time_us);
+  bool DecodeFrame(uint32_t type, const char *payload, size_t len);
+  bool LoadIndex();
+  bool ReadIndexTrailer();
+  void ScanIndex();
 
   StreamIO *io_;
   size_t frame_buf_size_;
   State state_;
+  bool is_rgb_;  // Version 3 stream.
+  int width_;
+  int height_;
 
   char *header_frame_buffer_;
+
+  // The last decoded frame, which delta frames are applied to. Points to
+  // current_frame_ or, for raw frames, in place into the StreamIO.
+  char *current_frame_;
+  const char *current_data_;
+
+  // Frame index; loaded on first seek.
+  std::string index_;
+  bool index_loaded_;
+};
+
+// Reads frames on a background thread ahead of the time they are shown,
+// into a bounded ring of FrameCanvases. This way, storage latency does not
+// stretch the time frames are shown.
+//
+// Streams are played in the order they are queued with Enqueue(); while one
+// is shown, the next one already is read ahead.
+//
+// Typical use:
+//   reader.Enqueue(stream_io);
+//   while ((frame = reader.GetNext(&hold_time_us)) != NULL) {
+//     reader.Release(matrix->SwapOnVSync(frame));
+//     usleep(hold_time_us);
+//   }
+class AsyncStreamReader : private Thread {
+public:
+  // Read up to "depth" frames ahead into FrameCanvases created by "matrix".
+  AsyncStreamReader(RGBMatrix *matrix, int depth);
+  ~AsyncStreamReader();
+
+  // Queue a stream to be read after the previously queued ones. It is read
+  // "loops" times (forever if < 0); only the time range
+  // [begin_us, end_us) of the stream.
+  // Does not take ownership of "io"; it needs to stay valid until all its
+  // frames have been shown, or until SkipCurrent() skipped it.
+  void Enqueue(StreamIO *io, int loops = 1,
+               uint64_t begin_us = 0, uint64_t end_us = UINT64_MAX);
+
+  // Get the next frame of the current stream and for how long to show it.
+  // Waits until the frame is read. Returns NULL once the current stream is
+  // finished or if nothing is queued; the next call returns the first frame
+  // of the next queued stream.
+  //
+  // The FrameCanvas needs to be handed back with Release() once it is not
+  // shown anymore, e.g. what SwapOnVSync() returns.
+  FrameCanvas *GetNext(uint32_t *hold_time_us);
+
+  // Hand back a FrameCanvas to read upcoming frames into.
+  void Release(FrameCanvas *canvas);
+
+  // Finish the current stream before its end; the next GetNext() returns
+  // the first frame of the next queued stream. Returns once the reader
+  // thread is done with the StreamIO of the skipped stream.
+  void SkipCurrent();
+
+private:
+  struct QueuedStream {
+    StreamIO *io;
+    int loops;
+    uint64_t begin_us;
+    uint64_t end_us;
+  };
+  struct ReadFrame {
+    FrameCanvas *canvas;  // NULL marks the end of a stream.
+    uint32_t hold_time_us;
+    int stream;
+  };
+
+  virtual void Run();
+  void ReadStream(const QueuedStream &stream, int serial);
+  FrameCanvas *AcquireCanvas(int serial);
+  bool Publish(FrameCanvas *canvas, uint32_t hold_time_us, int serial);
+
+  Mutex mutex_;
+  pthread_cond_t changed_;
+  bool running_;
+
+  // Streams are numbered in the order they are queued. The reader thread
+  // works on the next stream in queued_; GetNext() returns frames of
+  // stream number current_stream_. Frames of streams before that are
+  // abandoned.
+  std::deque<QueuedStream> queued_;
+  int streams_queued_;
+  int current_stream_;
+  int reading_stream_;  // Stream the reader thread reads from, or -1.
+
+  std::deque<ReadFrame> ready_;      // Read frames, in display order.
+  std::vector<FrameCanvas*> free_;  // Canvases to read upcoming frames into.
 };
 }
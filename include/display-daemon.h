@@ -0,0 +1,157 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A long running display daemon that owns the RGBMatrix, and the client
+// programs use to show their frames.
+//
+// Starting a program that creates its own RGBMatrix re-does all the hardware
+// and pixel-mapper initialization, and the display goes dark in between
+// programs. Instead, the DisplayServer keeps the matrix running and listens on
+// a Unix socket. Clients connect with DisplayClient and get a ring of frame
+// buffers in shared memory. They draw into a buffer and submit it; the
+// server shows it with SwapOnVSync(), without copying the frame around.
+//
+// The most recently connected client is shown. When it disconnects (or
+// crashes), its remaining submitted frames are shown, the display keeps the
+// last one, and the previous client takes over again. Clients that are not
+// shown can continue to submit frames until their ring is full; they then
+// block until they are shown again.
+//
+// The socket is only accessible to the user and group the daemon runs as.
+//
+// The utils/led-display-daemon.cc program runs a DisplayServer.
+
+#ifndef RPI_DISPLAY_DAEMON_H
+#define RPI_DISPLAY_DAEMON_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <deque>
+#include <vector>
+
+namespace rgb_matrix {
+class Canvas;
+class FrameCanvas;
+class RGBMatrix;
+namespace internal {
+class RGBBufferCanvas;
+}
+
+// Socket the display daemon listens on if not configured otherwise.
+extern const char kDefaultDisplaySocket[];
+
+// Connection of a program to the display daemon.
+class DisplayClient {
+public:
+  enum FrameFormat {
+    // Frames are width() * height() RGB pixels with three bytes each,
+    // row by row. The daemon converts them while showing.
+    RGB_FRAMES,
+
+    // Frames are in the internal representation of the daemon's matrix, as
+    // returned by FrameCanvas::Serialize(). These are shown straight out of
+    // the shared memory, but need to be created with exactly the same
+    // matrix options (e.g. from a content stream).
+    NATIVE_FRAMES,
+  };
+
+  // Connect to the daemon listening on "socket_path" and set up a ring of
+  // "slots" frame buffers (1..16) in the given format.
+  // Returns NULL on failure.
+  static DisplayClient *Connect(const char *socket_path,
+                                FrameFormat format, int slots = 3);
+  ~DisplayClient();
+
+  // Size of the matrix of the daemon.
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Size of a frame in bytes.
+  size_t frame_size() const { return frame_size_; }
+
+  // Get the buffer of frame_size() bytes to draw the next frame into. Blocks
+  // until the daemon handed back a buffer if all of them are in use.
+  // Calling it again without Submit() returns the same buffer.
+  // Returns NULL if the connection to the daemon is lost.
+  char *NextFrame();
+
+  // Like NextFrame(), but returns a Canvas that draws into that buffer, so
+  // that all the graphics functions can be used. Only for RGB_FRAMES; the
+  // buffer still contains whatever was drawn into it last time.
+  Canvas *NextCanvas();
+
+  // Hand the frame returned by NextFrame() or NextCanvas() to the daemon to
+  // be shown for "hold_time_us" microseconds before the next frame in the
+  // ring. Returns false if the connection to the daemon is lost.
+  bool Submit(uint32_t hold_time_us = 0);
+
+  // Set the brightness of the matrix in percent. Like in RGBMatrix, this only
+  // affects frames set after that, so RGB_FRAMES.
+  bool SetBrightness(uint8_t percent);
+
+private:
+  DisplayClient(int fd, FrameFormat format, int width, int height,
+                size_t frame_size, size_t slot_stride, int slots,
+                char *ring, size_t ring_size);
+
+  // Wait until the daemon hands back a buffer.
+  bool WaitForRelease();
+
+  const int fd_;
+  const FrameFormat format_;
+  const int width_;
+  const int height_;
+  const size_t frame_size_;
+  const size_t slot_stride_;
+  char *const ring_;
+  const size_t ring_size_;
+
+  std::deque<int> free_slots_;
+  int current_slot_;  // Slot handed out by NextFrame(), or -1.
+  internal::RGBBufferCanvas *canvas_;
+};
+
+// Owns the matrix and shows the frames submitted by DisplayClients.
+class DisplayServer {
+public:
+  // Listen on a Unix socket at "socket_path". Returns NULL on failure.
+  static DisplayServer *Create(RGBMatrix *matrix, const char *socket_path);
+  ~DisplayServer();
+
+  // Serve clients until "*interrupt_received" becomes true, e.g. set from a
+  // signal handler.
+  void Run(volatile bool *interrupt_received);
+
+private:
+  struct Client;
+
+  DisplayServer(RGBMatrix *matrix, int listen_fd);
+
+  void AcceptClient();
+  bool HandleMessage(Client *client);
+  bool SetupRing(Client *client, uint32_t format, uint32_t slots);
+  void RemoveClient(Client *client);
+  void RemoveHungUpClients();
+
+  Client *ShownClient();
+  void ShowNextFrame();
+  void SwapCanvases();
+  void SendRelease(Client *client, uint32_t slot);
+  void FlushReleases(Client *client);
+
+  RGBMatrix *const matrix_;
+  const int listen_fd_;
+  size_t native_frame_size_;
+  std::vector<Client*> clients_;  // In connection order.
+
+  FrameCanvas *shown_;         // Canvas currently on the matrix.
+  FrameCanvas *offscreen_;     // Canvas to prepare the next frame in.
+  Client *shown_owner_;        // Owner of zero-copy frame in shown_ or NULL.
+  uint32_t shown_slot_;
+  uint64_t next_frame_us_;     // Monotonic time the next frame is due.
+  uint8_t brightness_;         // For RGB frames.
+};
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_DISPLAY_DAEMON_H
@@ -0,0 +1,105 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Display programs: programs that draw on the matrix through a ProgramContext
+// instead of an RGBMatrix they create themselves. That way, the same program
+// can run as a standalone binary or be loaded as a plugin (a shared object)
+// into utils/led-program-host, which keeps the matrix running and switches
+// between many programs without re-initializing anything.
+//
+// A display program exports
+//
+//   extern "C" int DisplayProgramMain(rgb_matrix::ProgramContext *context,
+//                                     int argc, char *argv[]);
+//
+// which is like main(), just without the --led options in argv. For the
+// standalone binary, main() then only calls RunDisplayProgram().
+
+#ifndef RPI_DISPLAY_PROGRAM_H
+#define RPI_DISPLAY_PROGRAM_H
+
+#include <stdint.h>
+
+#include "canvas.h"
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+// What a display program uses instead of an RGBMatrix. Like the RGBMatrix,
+// it is a Canvas to draw on what is currently shown.
+class ProgramContext : public Canvas {
+public:
+  virtual ~ProgramContext() {}
+
+  // To be called once the program parsed its options and is about to draw.
+  // In a standalone program, this initializes the matrix hardware. Returns
+  // false on failure. Drawing or creating canvases before starts it, too.
+  virtual bool StartDisplay() = 0;
+
+  // Like RGBMatrix::CreateFrameCanvas()
+  virtual FrameCanvas *CreateFrameCanvas() = 0;
+
+  // Like RGBMatrix::SwapOnVSync(). In the program host, this also waits while
+  // other programs are shown.
+  virtual FrameCanvas *SwapOnVSync(FrameCanvas *other,
+                                   unsigned framerate_fraction = 1) = 0;
+
+  // Like the RGBMatrix functions, but in the program host only for the
+  // canvases of this program.
+  virtual bool SetPWMBits(uint8_t value) = 0;
+  virtual void SetBrightness(uint8_t brightness) = 0;
+  virtual uint8_t brightness() = 0;
+
+  // True if the program should finish, e.g. after Ctrl-C.
+  virtual bool interrupted() = 0;
+
+  // The --led-gpio-mapping the matrix runs with.
+  virtual const char *hardware_mapping() const = 0;
+
+  // -- Canvas interface, drawing on what DrawTarget() returns.
+  virtual int width() const { return DrawTarget()->width(); }
+  virtual int height() const { return DrawTarget()->height(); }
+  virtual void SetPixel(int x, int y,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    DrawTarget()->SetPixel(x, y, red, green, blue);
+  }
+  virtual void Clear() { DrawTarget()->Clear(); }
+  virtual void Fill(uint8_t red, uint8_t green, uint8_t blue) {
+    DrawTarget()->Fill(red, green, blue);
+  }
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+    DrawTarget()->FillRect(x, y, width, height, red, green, blue);
+  }
+  virtual void HLine(int x, int y, int width,
+                     uint8_t red, uint8_t green, uint8_t blue) {
+    DrawTarget()->HLine(x, y, width, red, green, blue);
+  }
+  virtual void VLine(int x, int y, int height,
+                     uint8_t red, uint8_t green, uint8_t blue) {
+    DrawTarget()->VLine(x, y, height, red, green, blue);
+  }
+  virtual void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+    DrawTarget()->SetPixelsSpan(x, y, count, rgb);
+  }
+
+protected:
+  // The canvas the program currently shows.
+  virtual Canvas *DrawTarget() const = 0;
+};
+
+typedef int (*DisplayProgramMainFn)(ProgramContext *context,
+                                    int argc, char *argv[]);
+
+// Name of the function a display program plugin exports.
+#define DISPLAY_PROGRAM_MAIN_SYMBOL "DisplayProgramMain"
+
+// Run "program" as a standalone binary. The --led options in argv are applied
+// on top of "defaults"; then "program" is called with the remaining arguments
+// and a context for an RGBMatrix that is created in StartDisplay().
+// Returns what "program" returns.
+int RunDisplayProgram(int argc, char *argv[],
+                      const RGBMatrix::Options &defaults,
+                      DisplayProgramMainFn program);
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_DISPLAY_PROGRAM_H
@@ -13,6 +13,7 @@
 #include <stddef.h>
 
 #include <map>
+#include <vector>
 
 namespace rgb_matrix {
 struct Color {
@@ -33,8 +34,22 @@ public:
   Font();
   ~Font();
 
+  // Load a font in BDF format. If a compiled version of the font, as created
+  // by CompileFont(), is next to it and up to date, that is used instead.
   bool LoadFont(const char *path);
 
+  // Load a font compiled with CompileFont(). The file is mapped read-only,
+  // so loading is nearly instant and processes using the same font share
+  // its memory.
+  bool LoadCompiled(const char *path);
+
+  // Parse the BDF font in "bdf_path" and write it in the compiled format
+  // to "compiled_path" or, if that is NULL, to the file LoadFont() looks for
+  // (the BDF path with ".compiled" appended).
+  // Returns 'false' if the font could not be read or written.
+  static bool CompileFont(const char *bdf_path,
+                          const char *compiled_path = NULL);
+
   // Return height of font in pixels. Returns -1 if font has not been loaded.
   int height() const { return font_height_; }
 
@@ -69,19 +84,129 @@ public:
   // The ownership of the returned pointer is passed to the caller.
   Font *CreateOutlineFont() const;
 
+  // Styles of fonts that can be derived from a font with CreateDerivedFont().
+  enum DerivedStyle {
+    OUTLINE,    // Outline of the letters, as with CreateOutlineFont().
+    BOLD,       // Synthetic bold: letters are one pixel wider.
+    SCALE_2X,   // Every pixel becomes 2x2 pixels.
+    SCALE_3X,   // Every pixel becomes 3x3 pixels.
+  };
+
+  // Create a font derived from this font in the given "style". Unlike
+  // CreateOutlineFont(), only Latin-1 is created up front: any other glyph
+  // is derived on its first use and then cached, so only the characters
+  // that are actually shown cost time and memory. Derived fonts can be derived
+  // from again, e.g. for the outline of a scaled font. Like any font, a
+  // derived font may be used by several threads at once.
+  // The derived font refers to this font, which needs to stay alive as long
+  // as the derived font is used.
+  // The ownership of the returned pointer is passed to the caller.
+  Font *CreateDerivedFont(DerivedStyle style) const;
+
 private:
+  friend class TextLayout;
   Font(const Font& x);  // No copy constructor. Use references or pointer instead.
 
   struct Glyph;
-  typedef std::map<uint32_t, Glyph*> CodepointGlyphMap;
+  struct LoadedGlyph;
+  typedef std::map<uint32_t, LoadedGlyph> LoadedGlyphMap;
 
   const Glyph *FindGlyph(uint32_t codepoint) const;
+  const uint32_t *GlyphRow(const Glyph *glyph, int row) const;
+
+  bool ParseBDF(const char *path);
+  // A compiled font remembers size and modification time of its BDF source;
+  // MapCompiled() only accepts a matching file unless these are -1.
+  bool MapCompiled(const char *path, int64_t bdf_size, int64_t bdf_mtime);
+  bool WriteCompiled(const char *path,
+                     int64_t bdf_size, int64_t bdf_mtime) const;
+
+  // Replace the atlas with one containing the given glyphs.
+  void BuildAtlas(const LoadedGlyphMap &glyphs);
+  void AddToLoadedGlyphs(LoadedGlyphMap *glyphs) const;
+  void SetAtlasPointers(const char *atlas, int glyph_count);
+  static size_t AtlasSize(size_t glyph_count, size_t bitmap_words);
+
+  // Derive a glyph in "style" from "glyph" with given bitmap.
+  static void DeriveGlyph(DerivedStyle style, const Glyph &glyph,
+                          const uint32_t *bitmap, LoadedGlyph *result);
+  const Glyph *FindDerivedGlyph(uint32_t codepoint) const;
+  void ReleaseAtlas();
 
   int font_height_;
   int base_line_;
-  CodepointGlyphMap glyphs_;
+
+  // All glyphs live in one contiguous allocation, the atlas: glyph metrics
+  // sorted by codepoint, the codepoints themselves for binary search and
+  // the bitmaps as rows of 32 bit words, as wide as each glyph needs.
+  // The atlas is either allocated (atlas_) or mapped from a compiled font.
+  char *atlas_;
+  void *mapped_;
+  size_t mapped_size_;
+  int glyph_count_;
+  const Glyph *glyphs_;
+  const uint32_t *codepoints_;
+  const uint32_t *bitmap_words_;
+  int16_t latin1_index_[256];  // Glyph index for codepoints < 256, or -1.
+
+  // Only set for fonts created with CreateDerivedFont(): the font we derive
+  // from and the glyphs derived so far.
+  struct DerivedGlyphs;
+  DerivedGlyphs *derived_;
 };
 
+// A line of text that is decoded and laid out once and can then be drawn
+// many times, e.g. in every frame of a scrolling ticker. All glyphs are
+// combined into one bitmap up front, so drawing does no UTF-8 decoding or
+// glyph lookup and sends each horizontal run of set pixels to the canvas
+// with Canvas::HLine().
+class TextLayout {
+public:
+  // Empty layout; call Layout() before drawing anything.
+  TextLayout();
+
+  // Same as calling Layout() on an empty layout.
+  TextLayout(const Font &font, const char *utf8_text, int kerning_offset = 0);
+
+  // Lay out the UTF-8 text with given font and "kerning_offset" (see
+  // DrawText()). The font is not referenced after this call.
+  void Layout(const Font &font, const char *utf8_text, int kerning_offset = 0);
+
+  // Pixels we advance on the screen; same as what DrawText() returns.
+  int width() const { return advance_; }
+
+  // Draw the text with its baseline at "x","y" with "color". If
+  // "background_color" is not NULL, the box of each glyph is filled with it
+  // first; where boxes overlap, the later glyph covers the earlier one, as
+  // with DrawText().
+  // Returns how many pixels we advanced on the screen.
+  int Draw(Canvas *c, int x, int y, const Color &color,
+           const Color *background_color = NULL) const;
+
+private:
+  struct Box {
+    int x, y, width, height;
+  };
+
+  int advance_;
+  int mask_x_;        // Position of bitmap relative to the start of the text.
+  int mask_y_;        // Position of bitmap relative to the baseline.
+  int mask_width_;
+  int mask_height_;
+  int words_per_row_;
+  std::vector<uint32_t> mask_;   // One bit per pixel, rows of words.
+  // Same, but what shows of each glyph on a background; only set if it
+  // differs from mask_.
+  std::vector<uint32_t> background_mask_;
+  std::vector<Box> boxes_;       // Glyph boxes, for the background.
+};
+
+// Return the number of pixels the UTF-8 text would advance on the screen
+// when drawn with DrawText() with the same "font" and "kerning_offset",
+// without drawing anything.
+int MeasureText(const Font &font, const char *utf8_text,
+                int kerning_offset = 0);
+
 // -- Some utility functions.
 
 // Utility function: set an image from the given buffer containting pixels.
@@ -108,6 +233,56 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
               int image_width, int image_height,
               bool is_bgr);
 
+// Pixel layouts understood by ImageView.
+enum PixelFormat {
+  PIXEL_RGB24,    // 3 bytes per pixel: r, g, b.
+  PIXEL_BGR24,    // 3 bytes per pixel: b, g, r.
+  PIXEL_RGBA32,   // 4 bytes per pixel: r, g, b, a. Alpha is ignored.
+  PIXEL_BGRA32,   // 4 bytes per pixel: b, g, r, a. Alpha is ignored.
+  PIXEL_RGB565,   // 16 bit little endian, red in the most significant bits.
+  PIXEL_GRAY8,    // 1 byte luminance per pixel.
+  PIXEL_YUV420P,  // Planar Y, U, V; chroma subsampled 2x2 (BT.601, 16..235).
+  PIXEL_NV12,     // Planar Y, then interleaved U/V plane subsampled 2x2.
+  PIXEL_YUV444P,  // Planar Y, U, V; full resolution chroma (BT.601, 16..235).
+};
+
+// A non-owning description of an image in memory: up to three planes, each
+// with its own pointer and stride (bytes between the start of two rows;
+// can be larger than the row or negative for bottom-up images).
+// Packed formats only use plane 0. This maps directly to the data/linesize
+// arrays of decoded video frames, so these can be shown without a copy.
+struct ImageView {
+  ImageView(PixelFormat fmt, const uint8_t *data, int stride,
+            int image_width, int image_height)
+    : format(fmt), width(image_width), height(image_height) {
+    planes[0] = data; planes[1] = planes[2] = NULL;
+    strides[0] = stride; strides[1] = strides[2] = 0;
+  }
+  ImageView(PixelFormat fmt, const uint8_t *const plane_data[3],
+            const int plane_strides[3], int image_width, int image_height)
+    : format(fmt), width(image_width), height(image_height) {
+    for (int i = 0; i < 3; ++i) {
+      planes[i] = plane_data[i];
+      strides[i] = plane_strides[i];
+    }
+  }
+
+  PixelFormat format;
+  int width;
+  int height;
+  const uint8_t *planes[3];
+  int strides[3];
+};
+
+// Show the image at canvas-offset "canvas_offset_x", "canvas_offset_y",
+// cropped to the canvas like the SetImage() above, but for any of the
+// supported pixel formats and strides. Rows are converted on the fly and
+// handed to the canvas with Canvas::SetPixelsSpan(); RGB24 rows are passed
+// without any conversion.
+// Returns 'true' if any part of the image was shown within canvas.
+bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
+              const ImageView &image);
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // "color" always needs to be set (hence it is a reference),
@@ -135,15 +310,30 @@ int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
                      const Color &color, const Color *background_color,
                      const char *utf8_text, int kerning_offset = 0);
 
+// Note: the following primitives clip to the canvas before drawing and
+// send horizontal or vertical spans to the canvas (see Canvas::HLine() and
+// friends), so they stay fast even for large shapes mostly outside the canvas.
+
 // Draw a circle centered at "x", "y", with a radius of "radius" and with "color"
 void DrawCircle(Canvas *c, int x, int y, int radius, const Color &color);
 
+// Draw a circle centered at "x", "y", with a radius of "radius" and filled
+// with "color".
+void FillCircle(Canvas *c, int x, int y, int radius, const Color &color);
+
 // Draw a line from "x0", "y0" to "x1", "y1" and with "color"
 void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color);
 
 // Draw a rectangle from "x0", "y0" to "x1", "y1" and filled with "color"
 void DrawRectangle(Canvas *c, int x0, int y0, int x1, int y1, const Color &color);
 
+// Fill the polygon with "num_points" corners given in the "xs" and "ys"
+// arrays with "color". The polygon is closed implicitly, self-intersecting
+// polygons are filled using the even-odd rule.
+// A pixel is filled if its center (x + 0.5, y + 0.5) is inside the polygon.
+void FillPolygon(Canvas *c, const int *xs, const int *ys, int num_points,
+                 const Color &color);
+
 }  // namespace rgb_matrix
 
 #endif  // RPI_GRAPHICS_H
@@ -0,0 +1,64 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Decoders for image formats simple enough to not need an image library:
+// PPM/PGM (binary and ASCII), QOI and GIF, including animated GIFs. They
+// start up instantly and are small, so they are a good first choice before
+// falling back to a general library such as GraphicsMagick.
+//
+// Frames are decoded one at a time into an RGBA image of the full size. For
+// animations, the previous frames and their disposal are already applied,
+// so playing an animation of any length only needs memory for a frame or two.
+//
+// Colors are premultiplied with alpha, i.e. fully transparent pixels are all
+// 0 and partially transparent ones are as dark as they look on black.
+
+#ifndef RPI_IMAGE_DECODER_H
+#define RPI_IMAGE_DECODER_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <vector>
+
+namespace rgb_matrix {
+
+class ImageDecoder {
+public:
+  // Open "filename" if it is in one of the supported formats. Returns NULL
+  // if it is not, or if the file can't be read.
+  static ImageDecoder *Open(const char *filename);
+
+  virtual ~ImageDecoder();
+
+  int width() const { return width_; }
+  int height() const { return height_; }
+
+  // Decode the next frame, the first one on the first call. Returns false
+  // after the last frame or if the file is broken. "delay_us" is how long
+  // an animation wants to show the frame; 0 for still images.
+  virtual bool NextFrame(int64_t *delay_us) = 0;
+
+  // Start over at the first frame.
+  virtual bool Rewind() = 0;
+
+  // The current frame: width() * height() pixels of r, g, b, a.
+  const uint8_t *rgba() const { return &rgba_[0]; }
+
+protected:
+  ImageDecoder(FILE *file, int width, int height);
+
+  FILE *const file_;
+  const int width_;
+  const int height_;
+  std::vector<uint8_t> rgba_;
+};
+
+// Scale the RGBA image "src" to "dst" of the given sizes. Each destination
+// pixel is the average of the source area it covers, so small details are
+// blended instead of dropped when scaling down.
+void ScaleRGBA(const uint8_t *src, int src_width, int src_height,
+               uint8_t *dst, int dst_width, int dst_height);
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_IMAGE_DECODER_H
@@ -376,6 +376,30 @@ void set_image(struct LedCanvas *c, int canvas_offset_x, int canvas_offset_y,
                int image_width, int image_height,
                char is_bgr);
 
+// Pixel layouts for set_image_view(). Same as rgb_matrix::PixelFormat.
+enum LedPixelFormat {
+  LED_PIXEL_RGB24,    // 3 bytes per pixel: r, g, b.
+  LED_PIXEL_BGR24,    // 3 bytes per pixel: b, g, r.
+  LED_PIXEL_RGBA32,   // 4 bytes per pixel: r, g, b, a. Alpha is ignored.
+  LED_PIXEL_BGRA32,   // 4 bytes per pixel: b, g, r, a. Alpha is ignored.
+  LED_PIXEL_RGB565,   // 16 bit little endian, red in the most significant bits.
+  LED_PIXEL_GRAY8,    // 1 byte luminance per pixel.
+  LED_PIXEL_YUV420P,  // Planar Y, U, V; chroma subsampled 2x2.
+  LED_PIXEL_NV12,     // Planar Y, then interleaved U/V plane subsampled 2x2.
+  LED_PIXEL_YUV444P,  // Planar Y, U, V; full resolution chroma.
+};
+
+// Like set_image(), but the image is described by up to three "planes" with
+// their "strides" (bytes from one row to the next) in the given "format".
+// Packed formats only use planes[0] and strides[0]. The image is read in
+// place, so e.g. buffers from image or video decoders can be passed directly.
+// Returns 1 if any part of the image was shown on the canvas.
+int set_image_view(struct LedCanvas *c, int canvas_offset_x,
+                   int canvas_offset_y,
+                   int image_width, int image_height,
+                   enum LedPixelFormat format,
+                   const uint8_t *const planes[3], const int strides[3]);
+
 // Load a font given a path to a font file containing a bdf font.
 struct LedFont *load_font(const char *bdf_font_file);
 
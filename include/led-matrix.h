@@ -199,6 +199,13 @@ public:
                         uint8_t red, uint8_t green, uint8_t blue);
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void HLine(int x, int y, int width,
+                     uint8_t red, uint8_t green, uint8_t blue);
+  virtual void VLine(int x, int y, int height,
+                     uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb);
 
   // -- Double- and Multibuffering.
 
@@ -370,6 +377,16 @@ public:
   // This method should only be called if FrameCanvas is off-screen.
   bool Deserialize(const char *data, size_t len);
 
+  // Like Deserialize(), but the FrameCanvas shows the data in place instead
+  // of copying it, e.g. a frame in a memory mapped file (see MmapStreamIO).
+  // The data must stay valid and unchanged for as long as this FrameCanvas
+  // shows it; drawing on the canvas first makes a private copy. Clear(),
+  // Deserialize() and DeserializeZeroCopy() replace it without reading it:
+  // once the canvas is off-screen, the data may go away if one of these is
+  // called before anything else is done with the canvas.
+  // Returns 'false' if size or alignment is unexpected.
+  bool DeserializeZeroCopy(const char *data, size_t len);
+
   // Copy content from other FrameCanvas owned by the same RGBMatrix.
   void CopyFrom(const FrameCanvas &other);
 
@@ -383,6 +400,17 @@ public:
   virtual void Clear();
   virtual void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Span operations. These convert the color to the bitplane representation
+  // only once per call and are considerably faster than the equivalent
+  // sequence of SetPixel() calls.
+  virtual void FillRect(int x, int y, int width, int height,
+                        uint8_t red, uint8_t green, uint8_t blue);
+  virtual void HLine(int x, int y, int width,
+                     uint8_t red, uint8_t green, uint8_t blue);
+  virtual void VLine(int x, int y, int height,
+                     uint8_t red, uint8_t green, uint8_t blue);
+  virtual void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb);
+
 protected:
   FrameCanvas(internal::Framebuffer *frame) : frame_(frame){}
   virtual ~FrameCanvas();   // Any FrameCanvas is owned by RGBMatrix.
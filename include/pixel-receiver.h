@@ -0,0 +1,137 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// Receiving frames from lighting controllers over UDP.
+//
+// Supported are the common pixel protocols
+//   - DDP (Distributed Display Protocol), port 4048. Data is addressed by
+//     byte offset into the frame; the packet with the 'push' flag completes
+//     the frame.
+//   - E1.31 (sACN), port 5568, and Art-Net (ArtDmx), port 6454. The frame is
+//     split into consecutive DMX universes. A frame is complete once all
+//     universes covering the display arrived, or with the synchronization
+//     packet if the sender uses them. An Art-Net sender that stops sending
+//     ArtSync for four seconds is taken as unsynchronized again.
+//
+// The pixel data are RGB, row by row, starting at the top left.
+// Received data are converted into the canvas right away with
+// Canvas::SetPixelsSpan(), so a frame is ready to be swapped as soon as its
+// last packet arrived.
+
+#ifndef RPI_PIXEL_RECEIVER_H
+#define RPI_PIXEL_RECEIVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+struct mmsghdr;
+struct iovec;
+
+namespace rgb_matrix {
+class Canvas;
+
+class PixelReceiver {
+public:
+  enum Protocol {
+    DDP,
+    E131,
+    ARTNET,
+  };
+
+  struct Options {
+    Options();
+
+    Protocol protocol;
+
+    // UDP port to listen on. Default 0: the standard port of the protocol.
+    int port;
+
+    // E1.31 and Art-Net: universe with the first pixels of the frame.
+    // Default -1: 1 for E1.31, 0 for Art-Net.
+    int first_universe;
+
+    // E1.31 and Art-Net: channels used in each universe. The default of
+    // 510 fits 170 RGB pixels, so that no pixel is split across universes.
+    int channels_per_universe;
+  };
+
+  // Listen for packets for a display of "width" x "height" pixels.
+  // For E1.31, this also joins the multicast groups of the universes.
+  // Returns NULL on failure.
+  static PixelReceiver *Create(const Options &options, int width, int height);
+  ~PixelReceiver();
+
+  // Receive packets, converting their pixels into "canvas", until a frame is
+  // complete. Returns true then; it can be shown with SwapOnVSync().
+  // Packets that already belong to the next frame are kept for the next
+  // call. Returns false if no packet arrived for "timeout_ms" milliseconds.
+  //
+  // Frames don't need to update every pixel, so the canvas passed in
+  // should contain the previous frame, e.g. with FrameCanvas::CopyFrom().
+  bool ReceiveFrame(Canvas *canvas, int timeout_ms);
+
+  // Packets received in total and packets ignored as invalid or not for us.
+  uint64_t packets_received() const { return packets_received_; }
+  uint64_t packets_ignored() const { return packets_ignored_; }
+
+private:
+  // What a packet means for the frame that is currently received.
+  enum PacketResult {
+    PACKET_DATA,          // Part of the current frame.
+    PACKET_ENDS_FRAME,    // Completes the current frame.
+    PACKET_STARTS_FRAME,  // Belongs to the next frame; current is complete.
+    PACKET_IGNORED,
+  };
+
+  PixelReceiver(const Options &options, int fd, int width, int height);
+
+  PacketResult HandlePacket(Canvas *canvas, const uint8_t *data, size_t len);
+  PacketResult HandleDDP(Canvas *canvas, const uint8_t *data, size_t len);
+  PacketResult HandleE131(Canvas *canvas, const uint8_t *data, size_t len);
+  PacketResult HandleArtNet(Canvas *canvas, const uint8_t *data, size_t len);
+  PacketResult HandleUniverse(Canvas *canvas, int universe,
+                              const uint8_t *data, size_t len);
+  PacketResult EndFrameOnSync();
+  void WriteChannels(Canvas *canvas, size_t offset,
+                     const uint8_t *data, size_t len);
+  void StartNewFrame();
+
+  const Options options_;
+  const int fd_;
+  const int width_;
+  const int height_;
+  const size_t frame_bytes_;
+  const int universe_count_;
+
+  // All received channels, so that pixels that are split across packets
+  // can be completed.
+  uint8_t *const frame_;
+
+  // Batch of packets read with one recvmmsg(); "next_packet_" is the first
+  // one not handled yet.
+  uint8_t *const packet_buffers_;
+  struct mmsghdr *const packets_;
+  struct iovec *const packet_iovs_;
+  int packets_read_;
+  int next_packet_;
+
+  // Universes received for the current frame.
+  std::vector<bool> universe_received_;
+  int universes_received_;
+  bool frame_started_;
+
+  // The sender sends synchronization packets: the frame is complete only
+  // with these. For E1.31, the universe they are sent for; for Art-Net,
+  // when the last one arrived.
+  bool synchronized_;
+  int sync_universe_;
+  uint64_t last_sync_us_;
+
+  uint64_t packets_received_;
+  uint64_t packets_ignored_;
+};
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_PIXEL_RECEIVER_H
@@ -0,0 +1,51 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// A timing model of the panel refresh, to choose the PWM options without
+// trial and error on the wall. It follows what one refresh of all rows
+// costs in the refresh thread (see Framebuffer::DumpToMatrix()):
+//   - clocking in the columns of each bitplane, three GPIO writes per
+//     column, each repeated for --led-slowdown-gpio,
+//   - the output enable pulse that lights each bitplane, --led-pwm-lsb-
+//     nanoseconds doubled for every bitplane above the dither bits. With
+//     the hardware pulse generator, the next bitplane is clocked in while
+//     the previous one is lit; otherwise, one after the other.
+//   - switching rows, which depends on the --led-row-addr-type.
+//
+// The GPIO speeds are rough figures for each Raspberry Pi model. The real
+// refresh rate also depends on the kernel and the load of the system, so
+// take the result as an estimate and check with --led-show-refresh.
+//
+// The --led-scan-mode only changes the order of the rows, not the time
+// they take.
+
+#ifndef RPI_REFRESH_TIMING_H
+#define RPI_REFRESH_TIMING_H
+
+#include "led-matrix.h"
+
+namespace rgb_matrix {
+
+struct RefreshTiming {
+  double frame_us;      // One refresh of all rows; average with dithering.
+  double refresh_hz;    // Refreshes per second.
+  double clock_in_us;   // Time per refresh the LEDs are dark while the
+                        // next bitplane is clocked in and latched.
+  double lit_fraction;  // Fraction of the time the current row is lit.
+                        // The brightness scales with it.
+};
+
+// Estimate the refresh of the panels configured in "options" on a
+// Raspberry Pi "pi_model" (1 to 4; 1 is also the Zero) with
+// --led-slowdown-gpio="gpio_slowdown". A --led-limit-refresh is included.
+RefreshTiming EstimateRefreshTiming(const RGBMatrix::Options &options,
+                                    int gpio_slowdown, int pi_model);
+
+// Find the most PWM bits that still refresh at "target_hz" or faster, with
+// as few dither bits as possible, and set pwm_bits and pwm_dither_bits in
+// "options" accordingly. Returns false if even a single bit is too slow.
+bool TuneForRefreshRate(RGBMatrix::Options *options,
+                        int gpio_slowdown, int pi_model, double target_hz);
+
+}  // namespace rgb_matrix
+
+#endif  // RPI_REFRESH_TIMING_H
@@ -20,31 +20,116 @@
 #include <inttypes.h>
 
 #include "graphics.h"
+#include "thread.h"
+#include "utf8-internal.h"
 
+#include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include <algorithm>
-#include <bitset>
+#include <map>
+#include <string>
 #include <vector>
 
 // The little question-mark box "�" for unknown code.
 static const uint32_t kUnicodeReplacementCodepoint = 0xFFFD;
 
+// LoadFont() looks for a compiled font with this suffix next to the BDF file.
+static const char kCompiledSuffix[] = ".compiled";
+static const uint32_t kCompiledMagic = 0x46424752;  // "RGBF" little endian.
+static const uint32_t kCompiledVersion = 1;
+
 namespace rgb_matrix {
-// Bitmap for one row. This limits the number of available columns.
+// Bitmap rows are stored as 32 bit words, column x in bit (x % 32) of word
+// (x / 32). This limits the number of available columns.
 // Make wider if running into trouble.
 static constexpr int kMaxFontWidth = 196;
-typedef std::bitset<kMaxFontWidth> rowbitmap_t;
 
 struct Font::Glyph {
-  int device_width, device_height;
-  int width, height;
-  int x_offset, y_offset;
-  std::vector<rowbitmap_t> bitmap;  // contains 'height' elements.
+  int16_t device_width, device_height;
+  int16_t width, height;
+  int16_t x_offset, y_offset;
+  uint16_t words_per_row;
+  uint16_t unused;
+  uint32_t bitmap_offset;  // First word of the bitmap in bitmap_words_.
+};
+
+// Header of a compiled font file, which is followed by the atlas exactly as
+// it is laid out in memory. Values are in native byte order; files from a
+// machine with different byte order are rejected by the magic number.
+struct CompiledFontHeader {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t glyph_size;     // sizeof(Font::Glyph), to detect layout changes.
+  int32_t font_height;
+  int32_t base_line;
+  uint32_t glyph_count;
+  uint64_t bitmap_words;
+  int64_t bdf_size;        // Size and modification time of the BDF file
+  int64_t bdf_mtime;       // this was compiled from.
+};
+
+// A glyph while reading the font, before it is packed into the atlas.
+struct Font::LoadedGlyph {
+  Glyph metrics;
+  std::vector<uint32_t> bitmap;  // metrics.height rows of words_per_row.
 };
 
+// Glyphs of a font created with CreateDerivedFont(). Drawing only reads the
+// font, so several threads may draw with the same derived font. Latin-1 is
+// derived up front and looked up without locking; other glyphs are derived
+// on first use, with the cache guarded by "mutex". Each derived glyph is one
+// allocation of its metrics followed by its bitmap, so it never moves once
+// returned.
+struct Font::DerivedGlyphs {
+  ~DerivedGlyphs() {
+    for (std::map<uint32_t, const Glyph*>::iterator it = glyphs.begin();
+         it != glyphs.end(); ++it) {
+      delete [] (const uint32_t*) it->second;
+    }
+  }
+
+  // Derive the glyph of "codepoint" from the base font and add it to
+  // "glyphs". Returns NULL if the base font doesn't have it.
+  const Glyph *Derive(uint32_t codepoint);
+
+  const Font *base;
+  DerivedStyle style;
+  Mutex mutex;
+  const Glyph *latin1[256];  // Derived glyphs for codepoints < 256.
+  std::map<uint32_t, const Glyph*> glyphs;  // All derived glyphs; owned.
+};
+
+static inline bool TestBit(const uint32_t *row, int x) {
+  return row[x / 32] & (1u << (x % 32));
+}
+
+static inline void SetBit(uint32_t *row, int x) {
+  row[x / 32] |= 1u << (x % 32);
+}
+
+static inline void ClearBit(uint32_t *row, int x) {
+  row[x / 32] &= ~(1u << (x % 32));
+}
+
+// Return first position in [from, end) with a bit that is "set" (or not set
+// if !set) or "end" if there is none.
+static int FindBit(const uint32_t *row, int from, int end, bool set) {
+  while (from < end) {
+    uint32_t word = row[from / 32];
+    if (!set) word = ~word;
+    word &= ~0u << (from % 32);   // Ignore bits before 'from'.
+    if (word) return std::min(end, (from & ~31) + __builtin_ctz(word));
+    from = (from & ~31) + 32;
+  }
+  return end;
+}
+
 static bool readNibble(char c, uint8_t* val) {
   if (c >= '0' && c <= '9') { *val = c - '0'; return true; }
   if (c >= 'a' && c <= 'f') { *val = c - 'a' + 0xa; return true; }
@@ -52,39 +137,185 @@ static bool readNibble(char c, uint8_t* val) {
   return false;
 }
 
-static bool parseBitmap(const char *buffer, rowbitmap_t* result) {
+static bool parseBitmap(const char *buffer, int columns, uint32_t *result) {
   // Read the bitmap left-aligned to our buffer.
-  for (int pos = result->size() - 1; *buffer && pos >= 3; buffer+=1) {
+  for (int pos = 0; *buffer && pos + 4 <= columns; buffer+=1) {
     uint8_t val;
     if (!readNibble(*buffer, &val))
       break;
-    (*result)[pos--] = val & 0x8;
-    (*result)[pos--] = val & 0x4;
-    (*result)[pos--] = val & 0x2;
-    (*result)[pos--] = val & 0x1;
+    if (val & 0x8) SetBit(result, pos);
+    if (val & 0x4) SetBit(result, pos + 1);
+    if (val & 0x2) SetBit(result, pos + 2);
+    if (val & 0x1) SetBit(result, pos + 3);
+    pos += 4;
   }
   return true;
 }
 
-Font::Font() : font_height_(-1), base_line_(0) {}
+size_t Font::AtlasSize(size_t glyph_count, size_t bitmap_words) {
+  return glyph_count * (sizeof(Glyph) + sizeof(uint32_t))
+    + bitmap_words * sizeof(uint32_t);
+}
+
+Font::Font()
+  : font_height_(-1), base_line_(0), atlas_(NULL), mapped_(NULL),
+    mapped_size_(0), glyph_count_(0),
+    glyphs_(NULL), codepoints_(NULL), bitmap_words_(NULL), derived_(NULL) {
+  std::fill(latin1_index_, latin1_index_ + 256, -1);
+}
+
 Font::~Font() {
-  for (CodepointGlyphMap::iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    delete it->second;
-  }
+  ReleaseAtlas();
+  delete derived_;
+}
+
+void Font::ReleaseAtlas() {
+  delete [] atlas_;
+  atlas_ = NULL;
+  if (mapped_) munmap(mapped_, mapped_size_);
+  mapped_ = NULL;
+  mapped_size_ = 0;
 }
 
-// TODO: that might not be working for all input files yet.
 bool Font::LoadFont(const char *path) {
   if (!path || !*path) return false;
+  struct stat bdf;
+  if (glyph_count_ == 0 && stat(path, &bdf) == 0) {
+    const std::string compiled = std::string(path) + kCompiledSuffix;
+    if (MapCompiled(compiled.c_str(), bdf.st_size, bdf.st_mtime))
+      return true;
+  }
+  return ParseBDF(path);
+}
+
+bool Font::LoadCompiled(const char *path) {
+  if (!path || !*path) return false;
+  return MapCompiled(path, -1, -1);
+}
+
+bool Font::CompileFont(const char *bdf_path, const char *compiled_path) {
+  if (!bdf_path || !*bdf_path) return false;
+  struct stat bdf;
+  if (stat(bdf_path, &bdf) != 0) return false;
+  Font font;
+  if (!font.ParseBDF(bdf_path)) return false;
+  const std::string out = compiled_path
+    ? compiled_path
+    : std::string(bdf_path) + kCompiledSuffix;
+  return font.WriteCompiled(out.c_str(), bdf.st_size, bdf.st_mtime);
+}
+
+bool Font::MapCompiled(const char *path, int64_t bdf_size, int64_t bdf_mtime) {
+  const int fd = open(path, O_RDONLY);
+  if (fd < 0) return false;
+  struct stat st;
+  if (fstat(fd, &st) != 0 || st.st_size < (off_t)sizeof(CompiledFontHeader)) {
+    close(fd);
+    return false;
+  }
+  void *const map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) return false;
+
+  // The file might be damaged or not written by us: nothing in it may point
+  // outside of it. Counts are limited first, so the sizes can't overflow.
+  const CompiledFontHeader *header = (const CompiledFontHeader*) map;
+  const uint64_t file_size = st.st_size;
+  bool valid = header->magic == kCompiledMagic
+    && header->version == kCompiledVersion
+    && header->glyph_size == sizeof(Glyph)
+    && (bdf_size < 0 || header->bdf_size == bdf_size)
+    && (bdf_mtime < 0 || header->bdf_mtime == bdf_mtime)
+    && header->glyph_count <= file_size / sizeof(Glyph)
+    && header->bitmap_words <= file_size / sizeof(uint32_t)
+    && file_size == sizeof(CompiledFontHeader)
+       + header->glyph_count * (sizeof(Glyph) + sizeof(uint32_t))
+       + header->bitmap_words * sizeof(uint32_t);
+  if (valid) {
+    const Glyph *const glyphs = (const Glyph*) (header + 1);
+    const uint32_t *const codepoints =
+      (const uint32_t*) (glyphs + header->glyph_count);
+    for (uint32_t i = 0; valid && i < header->glyph_count; ++i) {
+      const Glyph &g = glyphs[i];
+      // Drawing reads the rows up to device_width; lookups need the
+      // codepoints sorted.
+      valid = g.height >= 0
+        && g.device_width <= 32 * g.words_per_row
+        && g.bitmap_offset + (uint64_t)g.height * g.words_per_row
+           <= header->bitmap_words
+        && (i == 0 || codepoints[i - 1] < codepoints[i]);
+    }
+  }
+  if (!valid) {
+    munmap(map, st.st_size);
+    return false;
+  }
+
+  ReleaseAtlas();
+  mapped_ = map;
+  mapped_size_ = st.st_size;
+  font_height_ = header->font_height;
+  base_line_ = header->base_line;
+  SetAtlasPointers((const char*) (header + 1), header->glyph_count);
+  return true;
+}
+
+bool Font::WriteCompiled(const char *path,
+                         int64_t bdf_size, int64_t bdf_mtime) const {
+  uint64_t bitmap_words = 0;
+  for (int i = 0; i < glyph_count_; ++i) {
+    bitmap_words = std::max(bitmap_words,
+                            (uint64_t)glyphs_[i].bitmap_offset
+                            + glyphs_[i].height * glyphs_[i].words_per_row);
+  }
+  CompiledFontHeader header;
+  memset(&header, 0, sizeof(header));
+  header.magic = kCompiledMagic;
+  header.version = kCompiledVersion;
+  header.glyph_size = sizeof(Glyph);
+  header.font_height = font_height_;
+  header.base_line = base_line_;
+  header.glyph_count = glyph_count_;
+  header.bitmap_words = bitmap_words;
+  header.bdf_size = bdf_size;
+  header.bdf_mtime = bdf_mtime;
+
+  // Write to a temporary file first, so that processes that map the font
+  // at the same time never see a partially written file.
+  const std::string tmp_path = std::string(path) + ".tmp";
+  FILE *f = fopen(tmp_path.c_str(), "wb");
+  if (f == NULL) return false;
+  bool success = fwrite(&header, sizeof(header), 1, f) == 1;
+  if (glyph_count_ > 0) {
+    success &= fwrite(glyphs_, sizeof(Glyph), glyph_count_, f)
+      == (size_t)glyph_count_;
+    success &= fwrite(codepoints_, sizeof(uint32_t), glyph_count_, f)
+      == (size_t)glyph_count_;
+    success &= fwrite(bitmap_words_, sizeof(uint32_t), bitmap_words, f)
+      == bitmap_words;
+  }
+  success &= (fclose(f) == 0);
+  if (!success || rename(tmp_path.c_str(), path) != 0) {
+    unlink(tmp_path.c_str());
+    return false;
+  }
+  return true;
+}
+
+// TODO: that might not be working for all input files yet.
+bool Font::ParseBDF(const char *path) {
   FILE *f = fopen(path, "r");
   if (f == NULL)
     return false;
+  LoadedGlyphMap loaded;
+  AddToLoadedGlyphs(&loaded);  // Fonts loaded earlier are extended.
   uint32_t codepoint;
   char buffer[1024];
   int dummy;
-  Glyph tmp;
-  Glyph *current_glyph = NULL;
+  int device_width, device_height, width, height, x_offset, y_offset;
+  LoadedGlyph tmp;
+  tmp.metrics = Glyph();
+  LoadedGlyph *current_glyph = NULL;
   int row = 0;
 
   while (fgets(buffer, sizeof(buffer), f)) {
@@ -95,84 +326,289 @@ bool Font::LoadFont(const char *path) {
     else if (sscanf(buffer, "ENCODING %ud", &codepoint) == 1) {
       // parsed.
     }
-    else if (sscanf(buffer, "DWIDTH %d %d", &tmp.device_width, &tmp.device_height
+    else if (sscanf(buffer, "DWIDTH %d %d", &device_width, &device_height
                     ) == 2) {
-      // Limit to width we can actually display, limited by rowbitmap_t
-      tmp.device_width = std::min(tmp.device_width, kMaxFontWidth);
+      // Limit to width we can actually display, limited by kMaxFontWidth
+      tmp.metrics.device_width = std::min(device_width, kMaxFontWidth);
+      tmp.metrics.device_height = device_height;
       // parsed.
     }
-    else if (sscanf(buffer, "BBX %d %d %d %d", &tmp.width, &tmp.height,
-                    &tmp.x_offset, &tmp.y_offset) == 4) {
-      current_glyph = new Glyph();
-      *current_glyph = tmp;
-      current_glyph->bitmap.resize(tmp.height);
+    else if (sscanf(buffer, "BBX %d %d %d %d", &width, &height,
+                    &x_offset, &y_offset) == 4) {
+      tmp.metrics.width = width;
+      tmp.metrics.height = std::max(height, 0);
+      tmp.metrics.x_offset = x_offset;
+      tmp.metrics.y_offset = y_offset;
+      // Rows are as wide as needed for the bitmap and the advance.
+      const int columns = std::min(kMaxFontWidth,
+                                   std::max(width,
+                                            (int)tmp.metrics.device_width));
+      tmp.metrics.words_per_row = (std::max(columns, 1) + 31) / 32;
+      current_glyph = &tmp;
+      current_glyph->bitmap.assign(
+        tmp.metrics.words_per_row * tmp.metrics.height, 0);
       row = -1;  // let's not start yet, wait for BITMAP
     }
     else if (strncmp(buffer, "BITMAP", strlen("BITMAP")) == 0) {
       row = 0;
     }
-    else if (current_glyph && row >= 0 && row < current_glyph->height
-             && parseBitmap(buffer, &current_glyph->bitmap[row])) {
+    else if (current_glyph && row >= 0 && row < current_glyph->metrics.height
+             && parseBitmap(buffer,
+                            std::min(kMaxFontWidth,
+                                     32 * current_glyph->metrics.words_per_row),
+                            &current_glyph->bitmap[
+                              row * current_glyph->metrics.words_per_row])) {
       row++;
     }
     else if (strncmp(buffer, "ENDCHAR", strlen("ENDCHAR")) == 0) {
-      if (current_glyph && row == current_glyph->height) {
-        delete glyphs_[codepoint];  // just in case there was one.
-        glyphs_[codepoint] = current_glyph;
+      if (current_glyph && row == current_glyph->metrics.height) {
+        loaded[codepoint] = *current_glyph;  // replaces an earlier one.
         current_glyph = NULL;
       }
     }
   }
   fclose(f);
+  BuildAtlas(loaded);
   return true;
 }
 
-Font *Font::CreateOutlineFont() const {
-  Font *r = new Font();
-  const int kBorder = 1;
-  r->font_height_ = font_height_ + 2*kBorder;
-  r->base_line_ = base_line_ + kBorder;
-  for (CodepointGlyphMap::const_iterator it = glyphs_.begin();
-       it != glyphs_.end(); ++it) {
-    const Glyph *orig = it->second;
-    const int height = orig->height + 2 * kBorder;
-    Glyph *const tmp_glyph = new Glyph();
-    tmp_glyph->bitmap.resize(height);
-    tmp_glyph->width  = orig->width  + 2*kBorder;
-    tmp_glyph->height = height;
-    tmp_glyph->device_width  = orig->device_width + 2*kBorder;
-    tmp_glyph->device_height = height;
-    tmp_glyph->y_offset = orig->y_offset - kBorder;
+void Font::AddToLoadedGlyphs(LoadedGlyphMap *glyphs) const {
+  for (int i = 0; i < glyph_count_; ++i) {
+    LoadedGlyph &g = (*glyphs)[codepoints_[i]];
+    g.metrics = glyphs_[i];
+    const uint32_t *bitmap = GlyphRow(&glyphs_[i], 0);
+    g.bitmap.assign(bitmap,
+                    bitmap + glyphs_[i].height * glyphs_[i].words_per_row);
+  }
+}
+
+void Font::BuildAtlas(const LoadedGlyphMap &glyphs) {
+  size_t bitmap_words = 0;
+  for (LoadedGlyphMap::const_iterator it = glyphs.begin();
+       it != glyphs.end(); ++it) {
+    bitmap_words += it->second.bitmap.size();
+  }
+  const size_t count = glyphs.size();
+  char *const atlas = new char[AtlasSize(count, bitmap_words)];
+  Glyph *const glyph_out = (Glyph*) atlas;
+  uint32_t *const codepoint_out = (uint32_t*) (glyph_out + count);
+  uint32_t *const bitmap_out = codepoint_out + count;
+
+  size_t i = 0;
+  uint32_t offset = 0;
+  // The map is ordered by codepoint, so the codepoints come out sorted.
+  for (LoadedGlyphMap::const_iterator it = glyphs.begin();
+       it != glyphs.end(); ++it, ++i) {
+    glyph_out[i] = it->second.metrics;
+    glyph_out[i].bitmap_offset = offset;
+    codepoint_out[i] = it->first;
+    std::copy(it->second.bitmap.begin(), it->second.bitmap.end(),
+              bitmap_out + offset);
+    offset += it->second.bitmap.size();
+  }
+
+  ReleaseAtlas();
+  atlas_ = atlas;
+  SetAtlasPointers(atlas, count);
+}
+
+void Font::SetAtlasPointers(const char *atlas, int glyph_count) {
+  glyph_count_ = glyph_count;
+  glyphs_ = (const Glyph*) atlas;
+  codepoints_ = (const uint32_t*) (glyphs_ + glyph_count);
+  bitmap_words_ = codepoints_ + glyph_count;
+  std::fill(latin1_index_, latin1_index_ + 256, -1);
+  for (int i = 0; i < glyph_count && codepoints_[i] < 256; ++i) {
+    latin1_index_[codepoints_[i]] = i;
+  }
+}
+
+void Font::DeriveGlyph(DerivedStyle style, const Glyph &orig,
+                       const uint32_t *orig_bitmap, LoadedGlyph *result) {
+  const int orig_columns = 32 * orig.words_per_row;
+  const int orig_stride = orig.words_per_row;
+  Glyph &metrics = result->metrics;
+  int columns;
+  switch (style) {
+  case OUTLINE: {
+    const int kBorder = 1;
+    metrics = Glyph();
+    metrics.width  = orig.width  + 2*kBorder;
+    metrics.height = orig.height + 2*kBorder;
+    metrics.device_width  = orig.device_width + 2*kBorder;
+    metrics.device_height = metrics.height;
+    metrics.y_offset = orig.y_offset - kBorder;
     // TODO: we don't really need bounding box, right ?
-    const rowbitmap_t fill_pattern = 0b111;
-    const rowbitmap_t start_mask   = 0b010;
-    // Fill the border
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t fill = fill_pattern;
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      for (rowbitmap_t m = start_mask; m.any(); m <<= 1, fill <<= 1) {
-        if ((orig_bitmap & m).any()) {
-          tmp_glyph->bitmap[h+kBorder-1] |= fill;
-          tmp_glyph->bitmap[h+kBorder+0] |= fill;
-          tmp_glyph->bitmap[h+kBorder+1] |= fill;
+    columns = std::min(kMaxFontWidth, orig_columns + 2*kBorder);
+    metrics.words_per_row = (columns + 31) / 32;
+    result->bitmap.assign(metrics.words_per_row * metrics.height, 0);
+    uint32_t *const bitmap = &result->bitmap[0];
+    const int stride = metrics.words_per_row;
+    // Fill the border: each pixel of the original sets the 3x3 block around
+    // its position in the bigger glyph.
+    for (int h = 0; h < orig.height; ++h) {
+      const uint32_t *orig_row = orig_bitmap + h * orig_stride;
+      for (int x = 0; x < orig_columns; ++x) {
+        if (!TestBit(orig_row, x)) continue;
+        for (int dx = 0; dx <= 2*kBorder && x + dx < columns; ++dx) {
+          SetBit(&bitmap[(h + 0) * stride], x + dx);
+          SetBit(&bitmap[(h + 1) * stride], x + dx);
+          SetBit(&bitmap[(h + 2) * stride], x + dx);
         }
       }
     }
     // Remove original font again.
-    for (int h = 0; h < orig->height; ++h) {
-      rowbitmap_t orig_bitmap = orig->bitmap[h] >> kBorder;
-      tmp_glyph->bitmap[h+kBorder] &= ~orig_bitmap;
+    for (int h = 0; h < orig.height; ++h) {
+      const uint32_t *orig_row = orig_bitmap + h * orig_stride;
+      for (int x = 0; x < orig_columns; ++x) {
+        if (TestBit(orig_row, x) && x + kBorder < columns)
+          ClearBit(&bitmap[(h + kBorder) * stride], x + kBorder);
+      }
     }
-    r->glyphs_[it->first] = tmp_glyph;
+    break;
+  }
+
+  case BOLD: {
+    metrics = orig;
+    metrics.width = orig.width + 1;
+    metrics.device_width = std::min(kMaxFontWidth, orig.device_width + 1);
+    columns = std::min(kMaxFontWidth, orig_columns + 1);
+    metrics.words_per_row = (columns + 31) / 32;
+    result->bitmap.assign(metrics.words_per_row * metrics.height, 0);
+    for (int h = 0; h < orig.height; ++h) {
+      const uint32_t *orig_row = orig_bitmap + h * orig_stride;
+      uint32_t *row = &result->bitmap[h * metrics.words_per_row];
+      for (int x = 0; x < orig_columns; ++x) {
+        if (!TestBit(orig_row, x)) continue;
+        SetBit(row, x);
+        if (x + 1 < columns) SetBit(row, x + 1);
+      }
+    }
+    break;
+  }
+
+  case SCALE_2X:
+  case SCALE_3X: {
+    const int factor = (style == SCALE_2X) ? 2 : 3;
+    metrics = orig;
+    metrics.width = orig.width * factor;
+    metrics.height = orig.height * factor;
+    metrics.device_width = std::min(kMaxFontWidth,
+                                    orig.device_width * factor);
+    metrics.device_height = orig.device_height * factor;
+    metrics.x_offset = orig.x_offset * factor;
+    metrics.y_offset = orig.y_offset * factor;
+    columns = std::min(kMaxFontWidth, orig_columns * factor);
+    metrics.words_per_row = (columns + 31) / 32;
+    result->bitmap.assign(metrics.words_per_row * metrics.height, 0);
+    for (int h = 0; h < metrics.height; ++h) {
+      const uint32_t *orig_row = orig_bitmap + (h / factor) * orig_stride;
+      uint32_t *row = &result->bitmap[h * metrics.words_per_row];
+      for (int x = 0; x < columns; ++x) {
+        if (TestBit(orig_row, x / factor)) SetBit(row, x);
+      }
+    }
+    break;
+  }
+  }
+  metrics.bitmap_offset = 0;
+}
+
+Font *Font::CreateOutlineFont() const {
+  Font *r = new Font();
+  const int kBorder = 1;
+  r->font_height_ = font_height_ + 2*kBorder;
+  r->base_line_ = base_line_ + kBorder;
+  // A derived font doesn't list its glyphs; it has the ones of the font it
+  // is derived from in the end.
+  const Font *loaded = this;
+  while (loaded->derived_) loaded = loaded->derived_->base;
+  LoadedGlyphMap outlined;
+  for (int i = 0; i < loaded->glyph_count_; ++i) {
+    const uint32_t codepoint = loaded->codepoints_[i];
+    const Glyph *g = FindGlyph(codepoint);
+    DeriveGlyph(OUTLINE, *g, GlyphRow(g, 0), &outlined[codepoint]);
   }
+  r->BuildAtlas(outlined);
   return r;
 }
 
+Font *Font::CreateDerivedFont(DerivedStyle style) const {
+  Font *r = new Font();
+  switch (style) {
+  case OUTLINE:
+    r->font_height_ = font_height_ + 2;
+    r->base_line_ = base_line_ + 1;
+    break;
+  case BOLD:
+    r->font_height_ = font_height_;
+    r->base_line_ = base_line_;
+    break;
+  case SCALE_2X:
+  case SCALE_3X: {
+    const int factor = (style == SCALE_2X) ? 2 : 3;
+    r->font_height_ = font_height_ * factor;
+    r->base_line_ = base_line_ * factor;
+    break;
+  }
+  }
+  r->derived_ = new DerivedGlyphs();
+  r->derived_->base = this;
+  r->derived_->style = style;
+  for (uint32_t codepoint = 0; codepoint < 256; ++codepoint) {
+    r->derived_->latin1[codepoint] = r->derived_->Derive(codepoint);
+  }
+  return r;
+}
+
+const Font::Glyph *Font::FindDerivedGlyph(uint32_t unicode_codepoint) const {
+  if (unicode_codepoint < 256)
+    return derived_->latin1[unicode_codepoint];  // Never changes.
+  MutexLock l(&derived_->mutex);
+  std::map<uint32_t, const Glyph*>::const_iterator found
+    = derived_->glyphs.find(unicode_codepoint);
+  if (found != derived_->glyphs.end())
+    return found->second;
+  return derived_->Derive(unicode_codepoint);  // First use.
+}
+
+const Font::Glyph *Font::DerivedGlyphs::Derive(uint32_t codepoint) {
+  const Glyph *orig = base->FindGlyph(codepoint);
+  if (orig == NULL)
+    return NULL;
+  LoadedGlyph derived_glyph;
+  DeriveGlyph(style, *orig, base->GlyphRow(orig, 0), &derived_glyph);
+  static_assert(sizeof(Glyph) % sizeof(uint32_t) == 0,
+                "Bitmap needs to be aligned after the glyph");
+  const size_t glyph_words = sizeof(Glyph) / sizeof(uint32_t);
+  uint32_t *storage = new uint32_t[glyph_words + derived_glyph.bitmap.size()];
+  memcpy(storage, &derived_glyph.metrics, sizeof(Glyph));
+  std::copy(derived_glyph.bitmap.begin(), derived_glyph.bitmap.end(),
+            storage + glyph_words);
+  const Glyph *result = (const Glyph*) storage;
+  glyphs[codepoint] = result;
+  return result;
+}
+
 const Font::Glyph *Font::FindGlyph(uint32_t unicode_codepoint) const {
-  CodepointGlyphMap::const_iterator found = glyphs_.find(unicode_codepoint);
-  if (found == glyphs_.end())
+  if (derived_) return FindDerivedGlyph(unicode_codepoint);
+  if (unicode_codepoint < 256) {
+    const int index = latin1_index_[unicode_codepoint];
+    return index < 0 ? NULL : &glyphs_[index];
+  }
+  const uint32_t *end = codepoints_ + glyph_count_;
+  const uint32_t *found = std::lower_bound(codepoints_, end,
+                                           unicode_codepoint);
+  if (found == end || *found != unicode_codepoint)
     return NULL;
-  return found->second;
+  return &glyphs_[found - codepoints_];
+}
+
+const uint32_t *Font::GlyphRow(const Glyph *g, int row) const {
+  const uint32_t *words = derived_
+    ? (const uint32_t*) (g + 1)   // Right after the derived glyph.
+    : bitmap_words_;
+  return words + g->bitmap_offset + row * g->words_per_row;
 }
 
 int Font::CharacterWidth(uint32_t unicode_codepoint) const {
@@ -188,19 +624,29 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos,
   if (g == NULL) return 0;
   y_pos = y_pos - g->height - g->y_offset;
 
-  if (x_pos + g->device_width < 0 || x_pos > c->width() ||
-      y_pos + g->height < 0 || y_pos > c->height()) {
+  // Only the part within the canvas.
+  const int x_begin = std::max(0, -x_pos);
+  const int x_end = std::min((int)g->device_width, c->width() - x_pos);
+  const int y_begin = std::max(0, -y_pos);
+  const int y_end = std::min((int)g->height, c->height() - y_pos);
+  if (x_begin >= x_end || y_begin >= y_end) {
     return g->device_width;  // Outside canvas border. Bail out early.
   }
 
-  for (int y = 0; y < g->height; ++y) {
-    const rowbitmap_t& row = g->bitmap[y];
-    for (int x = 0; x < g->device_width; ++x) {
-      if (row.test(kMaxFontWidth - 1 - x)) {
-        c->SetPixel(x_pos + x, y_pos + y, color.r, color.g, color.b);
-      } else if (bgcolor) {
-        c->SetPixel(x_pos + x, y_pos + y, bgcolor->r, bgcolor->g, bgcolor->b);
+  // Alternating runs of unset and set pixels become horizontal lines.
+  for (int y = y_begin; y < y_end; ++y) {
+    const uint32_t *row = GlyphRow(g, y);
+    int x = x_begin;
+    while (x < x_end) {
+      const int set_begin = FindBit(row, x, x_end, true);
+      if (bgcolor && set_begin > x) {
+        c->HLine(x_pos + x, y_pos + y, set_begin - x,
+                 bgcolor->r, bgcolor->g, bgcolor->b);
       }
+      if (set_begin >= x_end) break;
+      x = FindBit(row, set_begin, x_end, false);
+      c->HLine(x_pos + set_begin, y_pos + y, x - set_begin,
+               color.r, color.g, color.b);
     }
   }
   return g->device_width;
@@ -211,4 +657,136 @@ int Font::DrawGlyph(Canvas *c, int x_pos, int y_pos, const Color &color,
   return DrawGlyph(c, x_pos, y_pos, color, NULL, unicode_codepoint);
 }
 
+int MeasureText(const Font &font, const char *utf8_text, int kerning_offset) {
+  int advance = 0;
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    const int width = font.CharacterWidth(cp);
+    if (width >= 0) {
+      advance += width;
+    } else {
+      advance += std::max(0, font.CharacterWidth(kUnicodeReplacementCodepoint));
+    }
+    advance += kerning_offset;
+  }
+  return advance;
+}
+
+TextLayout::TextLayout()
+  : advance_(0), mask_x_(0), mask_y_(0), mask_width_(0), mask_height_(0),
+    words_per_row_(0) {
+}
+
+TextLayout::TextLayout(const Font &font, const char *utf8_text,
+                       int kerning_offset) {
+  Layout(font, utf8_text, kerning_offset);
+}
+
+void TextLayout::Layout(const Font &font, const char *utf8_text,
+                        int kerning_offset) {
+  // First pass: resolve glyphs, place them and determine the bounding box.
+  std::vector<std::pair<const Font::Glyph *, int> > placed;
+  int x = 0;
+  int min_x = 0, max_x = 0, min_y = 0, max_y = 0;
+  boxes_.clear();
+  while (*utf8_text) {
+    const uint32_t cp = utf8_next_codepoint(utf8_text);
+    const Font::Glyph *g = font.FindGlyph(cp);
+    if (g == NULL) g = font.FindGlyph(kUnicodeReplacementCodepoint);
+    if (g != NULL) {
+      const Box box = { x, -g->height - g->y_offset,
+                        g->device_width, g->height };
+      if (placed.empty()) {
+        min_x = box.x; min_y = box.y;
+        max_x = box.x + box.width; max_y = box.y + box.height;
+      } else {
+        min_x = std::min(min_x, box.x);
+        min_y = std::min(min_y, box.y);
+        max_x = std::max(max_x, box.x + box.width);
+        max_y = std::max(max_y, box.y + box.height);
+      }
+      placed.push_back(std::make_pair(g, x));
+      boxes_.push_back(box);
+      x += g->device_width;
+    }
+    x += kerning_offset;
+  }
+  advance_ = x;
+  mask_x_ = min_x;
+  mask_y_ = min_y;
+  mask_width_ = max_x - min_x;
+  mask_height_ = max_y - min_y;
+  words_per_row_ = (mask_width_ + 31) / 32;
+  mask_.assign(words_per_row_ * mask_height_, 0);
+  // Boxes only overlap with a negative kerning_offset.
+  if (kerning_offset < 0) {
+    background_mask_.assign(mask_.size(), 0);
+  } else {
+    background_mask_.clear();
+  }
+
+  // Second pass: merge all glyph bitmaps into one. For the background mask,
+  // each glyph first clears its box, as DrawText() paints over the glyphs
+  // before with the background.
+  for (size_t i = 0; i < placed.size(); ++i) {
+    const Font::Glyph *g = placed[i].first;
+    const int left = placed[i].second - mask_x_;
+    const int top = boxes_[i].y - mask_y_;
+    for (int y = 0; y < g->height; ++y) {
+      const uint32_t *row = font.GlyphRow(g, y);
+      uint32_t *const mask_row = &mask_[(top + y) * words_per_row_];
+      uint32_t *const background_row = background_mask_.empty()
+        ? NULL : &background_mask_[(top + y) * words_per_row_];
+      if (background_row) {
+        for (int gx = 0; gx < g->device_width; ++gx) {
+          ClearBit(background_row, left + gx);
+        }
+      }
+      for (int gx = FindBit(row, 0, g->device_width, true);
+           gx < g->device_width;
+           gx = FindBit(row, gx + 1, g->device_width, true)) {
+        SetBit(mask_row, left + gx);
+        if (background_row) SetBit(background_row, left + gx);
+      }
+    }
+  }
+}
+
+int TextLayout::Draw(Canvas *c, int x, int y, const Color &color,
+                     const Color *background_color) const {
+  if (background_color) {
+    for (size_t i = 0; i < boxes_.size(); ++i) {
+      const Box &b = boxes_[i];
+      const int x0 = std::max(0, x + b.x);
+      const int y0 = std::max(0, y + b.y);
+      const int x1 = std::min(c->width(), x + b.x + b.width);
+      const int y1 = std::min(c->height(), y + b.y + b.height);
+      if (x0 < x1 && y0 < y1) {
+        c->FillRect(x0, y0, x1 - x0, y1 - y0, background_color->r,
+                    background_color->g, background_color->b);
+      }
+    }
+  }
+
+  const std::vector<uint32_t> &mask =
+    (background_color && !background_mask_.empty()) ? background_mask_ : mask_;
+  const int left = x + mask_x_;
+  const int top = y + mask_y_;
+  const int col_begin = std::max(0, -left);
+  const int col_end = std::min(mask_width_, c->width() - left);
+  const int row_begin = std::max(0, -top);
+  const int row_end = std::min(mask_height_, c->height() - top);
+  for (int row = row_begin; row < row_end; ++row) {
+    const uint32_t *bits = &mask[row * words_per_row_];
+    int col = FindBit(bits, col_begin, col_end, true);
+    while (col < col_end) {
+      const int run_end = FindBit(bits, col, col_end, false);
+      c->HLine(left + col, top + row, run_end - col,
+               color.r, color.g, color.b);
+      col = FindBit(bits, run_end, col_end, true);
+    }
+  }
+  return advance_;
+}
+
 }  // namespace rgb_matrix
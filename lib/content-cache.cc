@@ -0,0 +1,277 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "content-cache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+namespace rgb_matrix {
+namespace {
+static const char kEntrySuffix[] = ".stream";
+static const char kContentHashSuffix[] = ".id";  // Remembered content hash.
+static const int kHashHexLen = 32;
+
+// Entries that are still written after this time are left over from a
+// crashed process.
+static const time_t kStaleTempSeconds = 24 * 3600;
+
+// A fast 128 bit hash, two 64 bit lanes over the data as 64 bit words.
+// Not cryptographic, but plenty to tell files apart.
+class Hasher {
+public:
+  Hasher() : a_(0x9e3779b97f4a7c15ULL), b_(0xc2b2ae3d27d4eb4fULL),
+             pending_(0), pending_bytes_(0), length_(0) {}
+
+  void Update(const void *data, size_t len) {
+    const uint8_t *p = (const uint8_t*) data;
+    length_ += len;
+    while (len && pending_bytes_) {
+      AddByte(*p++);
+      --len;
+    }
+    for (; len >= 8; p += 8, len -= 8) {
+      uint64_t word;
+      memcpy(&word, p, 8);
+      AddWord(word);
+    }
+    while (len--) AddByte(*p++);
+  }
+
+  void Update(const std::string &s) { Update(s.data(), s.size()); }
+
+  std::string HexDigest() {
+    if (pending_bytes_) AddWord(pending_);
+    AddWord(length_);
+    const uint64_t lanes[2] = { Mix(a_ ^ b_), Mix(b_ + a_) };
+    char hex[kHashHexLen + 1];
+    snprintf(hex, sizeof(hex), "%016llx%016llx",
+             (unsigned long long)lanes[0], (unsigned long long)lanes[1]);
+    return hex;
+  }
+
+private:
+  static uint64_t Mix(uint64_t h) {
+    h ^= h >> 33; h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33; h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+  }
+
+  void AddByte(uint8_t byte) {
+    pending_ |= (uint64_t)byte << (8 * pending_bytes_);
+    if (++pending_bytes_ == 8) {
+      AddWord(pending_);
+      pending_ = 0;
+      pending_bytes_ = 0;
+    }
+  }
+
+  void AddWord(uint64_t word) {
+    a_ = (a_ ^ word) * 0x100000001b3ULL;
+    a_ ^= a_ >> 29;
+    b_ = (b_ + word) * 0x9fb21c651e98df25ULL;
+    b_ ^= b_ >> 32;
+  }
+
+  uint64_t a_, b_;
+  uint64_t pending_;
+  int pending_bytes_;
+  uint64_t length_;
+};
+
+static bool HasSuffix(const char *s, const char *suffix) {
+  const size_t len = strlen(s), suffix_len = strlen(suffix);
+  return len >= suffix_len && strcmp(s + len - suffix_len, suffix) == 0;
+}
+
+// Create a new file next to "path" to be renamed to it once written.
+// Returns the file descriptor and sets "*tmp" to its name, or returns -1.
+static int CreateTempFile(const std::string &path, std::string *tmp) {
+  std::vector<char> name(path.begin(), path.end());
+  const char kUnique[] = ".XXXXXX";
+  name.insert(name.end(), kUnique, kUnique + sizeof(kUnique));
+  const int fd = mkstemp(&name[0]);
+  if (fd < 0) return -1;
+  fchmod(fd, 0644);
+  tmp->assign(&name[0]);
+  return fd;
+}
+
+// Write "content" to "path", replacing it atomically.
+static bool WriteFileAtomically(const std::string &path,
+                                const std::string &content) {
+  std::string tmp;
+  const int fd = CreateTempFile(path, &tmp);
+  if (fd < 0) return false;
+  const bool written = (write(fd, content.data(), content.size())
+                        == (ssize_t)content.size());
+  close(fd);
+  if (!written || rename(tmp.c_str(), path.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
+
+struct CacheFile {
+  std::string name;
+  off_t size;
+  int64_t last_used_ns;  // Modification time, updated whenever used.
+
+  bool operator<(const CacheFile &other) const {
+    return last_used_ns < other.last_used_ns;
+  }
+};
+}  // anonymous namespace
+
+ContentCache *ContentCache::Create(const char *directory, uint64_t max_bytes) {
+  if (mkdir(directory, 0755) != 0 && errno != EEXIST)
+    return NULL;
+  if (access(directory, R_OK|W_OK|X_OK) != 0)
+    return NULL;
+  ContentCache *result = new ContentCache(directory, max_bytes);
+  result->Evict("");  // In case the limit was lowered.
+  return result;
+}
+
+ContentCache::ContentCache(const std::string &directory, uint64_t max_bytes)
+  : directory_(directory), max_bytes_(max_bytes) {
+}
+
+std::string ContentCache::Key(const char *filename,
+                              const std::string &variant) {
+  const std::string content_hash = ContentHash(filename);
+  if (content_hash.empty()) return "";
+  Hasher hasher;
+  hasher.Update(content_hash);
+  hasher.Update("\n", 1);
+  hasher.Update(variant);
+  return hasher.HexDigest();
+}
+
+std::string ContentCache::ContentHash(const char *filename) {
+  const int fd = open(filename, O_RDONLY);
+  if (fd < 0) return "";
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+    close(fd);
+    return "";
+  }
+
+  // The same file hashed before ? Its identity is enough then.
+  char identity[256];
+  snprintf(identity, sizeof(identity), "%llu:%llu:%lld:%lld.%09ld:",
+           (unsigned long long)sb.st_dev, (unsigned long long)sb.st_ino,
+           (long long)sb.st_size, (long long)sb.st_mtim.tv_sec,
+           (long)sb.st_mtim.tv_nsec);
+  Hasher identity_hasher;
+  identity_hasher.Update(identity, strlen(identity));
+  identity_hasher.Update(filename, strlen(filename));
+  const std::string id_path = directory_ + "/" + identity_hasher.HexDigest()
+    + kContentHashSuffix;
+  const int id_fd = open(id_path.c_str(), O_RDONLY);
+  if (id_fd >= 0) {
+    char hex[kHashHexLen];
+    const bool valid = (read(id_fd, hex, sizeof(hex)) == kHashHexLen);
+    futimens(id_fd, NULL);  // Recently used.
+    close(id_fd);
+    if (valid) {
+      close(fd);
+      return std::string(hex, kHashHexLen);
+    }
+  }
+
+  posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  Hasher hasher;
+  char buffer[65536];
+  ssize_t r;
+  while ((r = read(fd, buffer, sizeof(buffer))) > 0) {
+    hasher.Update(buffer, r);
+  }
+  close(fd);
+  if (r < 0) return "";
+  const std::string result = hasher.HexDigest();
+  WriteFileAtomically(id_path, result);
+  return result;
+}
+
+std::string ContentCache::EntryPath(const std::string &key) const {
+  return directory_ + "/" + key + kEntrySuffix;
+}
+
+int ContentCache::Open(const std::string &key) {
+  if (key.empty()) return -1;
+  const int fd = open(EntryPath(key).c_str(), O_RDONLY);
+  if (fd >= 0) futimens(fd, NULL);
+  return fd;
+}
+
+int ContentCache::BeginEntry(const std::string &key, std::string *pending) {
+  if (key.empty()) return -1;
+  return CreateTempFile(EntryPath(key), pending);
+}
+
+bool ContentCache::CommitEntry(const std::string &key,
+                               const std::string &pending) {
+  if (rename(pending.c_str(), EntryPath(key).c_str()) != 0) {
+    unlink(pending.c_str());
+    return false;
+  }
+  Evict(key + kEntrySuffix);
+  return true;
+}
+
+void ContentCache::AbortEntry(const std::string &pending) {
+  unlink(pending.c_str());
+}
+
+void ContentCache::Evict(const std::string &keep) {
+  DIR *const dir = opendir(directory_.c_str());
+  if (dir == NULL) return;
+  std::vector<CacheFile> files;
+  uint64_t total = 0;
+  const time_t now = time(NULL);
+  struct dirent *entry;
+  while ((entry = readdir(dir)) != NULL) {
+    struct stat sb;
+    if (fstatat(dirfd(dir), entry->d_name, &sb, 0) != 0
+        || !S_ISREG(sb.st_mode)) {
+      continue;
+    }
+    if (!HasSuffix(entry->d_name, kEntrySuffix)
+        && !HasSuffix(entry->d_name, kContentHashSuffix)) {
+      // Not ours, or an entry still being written.
+      if (strstr(entry->d_name, kEntrySuffix) != NULL
+          && sb.st_mtime < now - kStaleTempSeconds) {
+        unlinkat(dirfd(dir), entry->d_name, 0);
+      }
+      continue;
+    }
+    const CacheFile file = { entry->d_name, sb.st_size,
+                             (int64_t)sb.st_mtim.tv_sec * 1000000000
+                             + sb.st_mtim.tv_nsec };
+    files.push_back(file);
+    total += sb.st_size;
+  }
+  closedir(dir);
+
+  std::sort(files.begin(), files.end());
+  for (size_t i = 0; i < files.size() && total > max_bytes_; ++i) {
+    if (files[i].name == keep) continue;
+    if (unlink((directory_ + "/" + files[i].name).c_str()) == 0)
+      total -= files[i].size;
+  }
+}
+
+}  // namespace rgb_matrix
@@ -2,10 +2,12 @@
 
 #include "content-streamer.h"
 #include "led-matrix.h"
+#include "graphics.h"
 
 #include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
@@ -13,6 +15,7 @@
 #include <algorithm>
 
 #include "gpio-bits.h"
+#include "rgb-canvas-internal.h"
 
 namespace rgb_matrix {
 
@@ -30,7 +33,8 @@ struct FileHeader {
   uint32_t buf_size;
   uint32_t width;
   uint32_t height;
-  uint64_t future_use1;
+  uint32_t version;  // Stream format version. 0 in old files means 1.
+  uint32_t future_use1;
   uint64_t is_wide_gpio : 1;
   uint64_t flags_future_use : 63;
 };
@@ -41,11 +45,173 @@ struct FrameHeader {
   uint32_t magic;  // kFrameMagic
   uint32_t size;
   uint32_t hold_time_us;  // How long this frame lasts in usec.
-  uint32_t future_use1;
+  uint32_t type;          // One of the frame types below. Always 0 in v1.
   uint64_t future_use2;
   uint64_t future_use3;
 };
 STATIC_ASSERT(file_header_size_changed, sizeof(FrameHeader) == 32);
+STATIC_ASSERT(headers_same_size, sizeof(FileHeader) == sizeof(FrameHeader));
+
+// Frame types. Version 1 streams only contain raw frames.
+static const uint32_t kRawFrame = 0;     // Uncompressed frame buffer.
+static const uint32_t kKeyFrame = 1;     // Compressed frame buffer.
+static const uint32_t kDeltaFrame = 2;   // Compressed xor with previous frame.
+static const uint32_t kRepeatFrame = 3;  // Same as previous frame. No payload.
+
+// Maximum number of frames between two frames that don't depend on their
+// predecessor; a stream can only start to be decoded at such a frame.
+static const int kMaxKeyframeDistance = 100;
+
+// Compressed frames are a sequence of control words, each followed by data
+// words. If the top bit is set in the control word, the remaining bits are a
+// count of how often the following single word repeats. Otherwise, the
+// control word contains the count of literal words that follow.
+// Frame buffers tend to have long runs of the same word: black pixels or
+// areas of the same color. Xor-ed with the previous frame, unchanged parts
+// of delta frames become runs of zero.
+// Words are gpio_bits_t for matrix representation frames and uint32_t for
+// RGB frames.
+static const size_t kMinRun = 3;  // Shorter repetitions stored as literals.
+
+// Version 3 streams contain RGB frames instead of the matrix representation.
+// Frames are padded to a multiple of this.
+static const size_t kRGBWordSize = sizeof(uint32_t);
+
+// Version 2 streams end with an index of all frames, to allow seeking. It
+// starts with a FrameHeader with kIndexMagicValue, so that sequential
+// readers stop there. It is followed by an IndexEntry per frame and the
+// IndexFooter, which is at the very end of the stream to be found from there.
+static const uint32_t kIndexMagicValue = 0x58444E49;  // "INDX"
+struct IndexEntry {
+  uint64_t offset;         // Position of the FrameHeader in the stream.
+  uint64_t start_time_us;  // Sum of hold times of all previous frames.
+  uint32_t hold_time_us;
+  uint32_t type;
+};
+STATIC_ASSERT(index_entry_size_changed, sizeof(IndexEntry) == 24);
+
+struct IndexFooter {
+  uint64_t index_offset;  // Position of the index FrameHeader.
+  uint32_t frame_count;
+  uint32_t magic;         // kIndexMagicValue
+};
+STATIC_ASSERT(index_footer_size_changed, sizeof(IndexFooter) == 16);
+
+// MmapStreamIO asks the kernel to read this far ahead of the current
+// position and releases pages this far behind it.
+static const size_t kMmapWindow = 4 << 20;
+}
+
+template <typename Word> static Word RunFlag() {
+  return (Word)1 << (8*sizeof(Word)-1);
+}
+
+template <typename Word> static void AppendWord(Word word, std::string *out) {
+  out->append((const char*)&word, sizeof(word));
+}
+
+template <typename Word>
+static void CompressWords(const Word *in, size_t count, std::string *out) {
+  const Word kRunFlag = RunFlag<Word>();
+  out->clear();
+  size_t literal_start = 0;
+  size_t pos = 0;
+  while (pos < count) {
+    size_t run_end = pos + 1;
+    while (run_end < count && in[run_end] == in[pos] &&
+           run_end - pos < (size_t)(Word)~kRunFlag) {
+      ++run_end;
+    }
+    if (run_end - pos < kMinRun && run_end < count) {
+      pos = run_end;
+      continue;
+    }
+    const bool is_run = (run_end - pos >= kMinRun);
+    const size_t literal_end = is_run ? pos : run_end;
+    if (literal_end > literal_start) {
+      AppendWord<Word>(literal_end - literal_start, out);
+      out->append((const char*)(in + literal_start),
+                  (literal_end - literal_start) * sizeof(Word));
+    }
+    if (is_run) {
+      AppendWord<Word>(kRunFlag | (run_end - pos), out);
+      AppendWord<Word>(in[pos], out);
+    }
+    literal_start = pos = run_end;
+  }
+}
+
+// Decode "in" into "out" with exactly "out_count" words. With "apply_xor",
+// the words are xor-ed onto the existing content of "out" (delta frames).
+// Returns false if the input is malformed.
+template <typename Word>
+static bool DecompressWords(const char *in, size_t in_len,
+                            Word *out, size_t out_count,
+                            bool apply_xor) {
+  const Word kRunFlag = RunFlag<Word>();
+  const char *const in_end = in + in_len;
+  Word *const out_end = out + out_count;
+  while (in + sizeof(Word) <= in_end) {
+    Word control;
+    memcpy(&control, in, sizeof(control));
+    in += sizeof(control);
+    const size_t count = control & ~kRunFlag;
+    if (count > (size_t)(out_end - out)) return false;
+    if (control & kRunFlag) {
+      if (in + sizeof(Word) > in_end) return false;
+      Word word;
+      memcpy(&word, in, sizeof(word));
+      in += sizeof(word);
+      if (!apply_xor) {
+        std::fill(out, out + count, word);
+      } else if (word != 0) {
+        for (size_t i = 0; i < count; ++i) out[i] ^= word;
+      }
+    } else {
+      const size_t bytes = count * sizeof(Word);
+      if (bytes > (size_t)(in_end - in)) return false;
+      if (!apply_xor) {
+        memcpy(out, in, bytes);
+      } else {
+        for (size_t i = 0; i < count; ++i) {
+          Word word;
+          memcpy(&word, in + i * sizeof(word), sizeof(word));
+          out[i] ^= word;
+        }
+      }
+      in += bytes;
+    }
+    out += count;
+  }
+  return in == in_end && out == out_end;
+}
+
+// Compress or decompress a frame of "len" bytes made of words of the size
+// used for its kind of stream.
+static void CompressFrame(const char *data, size_t len, bool is_rgb,
+                          std::string *out) {
+  if (is_rgb) {
+    CompressWords((const uint32_t*)data, len / sizeof(uint32_t), out);
+  } else {
+    CompressWords((const gpio_bits_t*)data, len / sizeof(gpio_bits_t), out);
+  }
+}
+
+static bool DecompressFrame(const char *in, size_t in_len,
+                            char *out, size_t out_len, bool is_rgb,
+                            bool apply_xor) {
+  if (is_rgb) {
+    return DecompressWords(in, in_len, (uint32_t*)out,
+                           out_len / sizeof(uint32_t), apply_xor);
+  }
+  return DecompressWords(in, in_len, (gpio_bits_t*)out,
+                         out_len / sizeof(gpio_bits_t), apply_xor);
+}
+
+// Size of an RGB frame in version 3 streams.
+static size_t RGBFrameSize(int width, int height) {
+  const size_t bytes = (size_t)width * height * 3;
+  return (bytes + kRGBWordSize - 1) / kRGBWordSize * kRGBWordSize;
 }
 
 FileStreamIO::FileStreamIO(int fd) : fd_(fd) {
@@ -63,6 +229,88 @@ ssize_t FileStreamIO::Append(const void *buf, const size_t count) {
   return write(fd_, buf, count);
 }
 
+bool FileStreamIO::Seek(off_t offset) {
+  return lseek(fd_, offset, SEEK_SET) == offset;
+}
+
+off_t FileStreamIO::Size() {
+  struct stat sb;
+  if (fstat(fd_, &sb) != 0 || !S_ISREG(sb.st_mode)) return -1;
+  return sb.st_size;
+}
+
+MmapStreamIO *MmapStreamIO::Create(int fd) {
+  struct stat sb;
+  if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode) || sb.st_size == 0)
+    return NULL;
+  void *data = mmap(NULL, sb.st_size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) return NULL;
+  madvise(data, sb.st_size, MADV_SEQUENTIAL);
+  return new MmapStreamIO(fd, (const char*)data, sb.st_size);
+}
+
+MmapStreamIO::MmapStreamIO(int fd, const char *data, size_t size)
+  : fd_(fd), data_(data), size_(size), released_end_(0) {
+  Rewind();
+}
+
+MmapStreamIO::~MmapStreamIO() {
+  munmap((void*)data_, size_);
+  close(fd_);
+}
+
+void MmapStreamIO::Rewind() { Seek(0); }
+
+bool MmapStreamIO::Seek(off_t offset) {
+  if (offset < 0 || (size_t)offset > size_) return false;
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  pos_ = offset;
+  read_ahead_end_ = pos_;
+  // Going back, pages from here on might have been released already.
+  released_end_ = std::min(released_end_, pos_ / page_size * page_size);
+  Advance(0);
+  return true;
+}
+
+off_t MmapStreamIO::Size() { return size_; }
+
+// Keep a window of pages ahead of the position in flight and let go of
+// pages well behind it. Frames still shown are at most a few frames back,
+// and dropped pages are just mapped again from the page cache if needed.
+void MmapStreamIO::Advance(size_t count) {
+  pos_ += count;
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  if (pos_ + kMmapWindow / 2 > read_ahead_end_ && read_ahead_end_ < size_) {
+    const size_t start = read_ahead_end_ / page_size * page_size;
+    read_ahead_end_ = std::min(pos_ + kMmapWindow, size_);
+    madvise((void*)(data_ + start), read_ahead_end_ - start, MADV_WILLNEED);
+  }
+  if (pos_ > released_end_ + 2 * kMmapWindow) {
+    const size_t end = (pos_ - kMmapWindow) / page_size * page_size;
+    madvise((void*)(data_ + released_end_), end - released_end_,
+            MADV_DONTNEED);
+    released_end_ = end;
+  }
+}
+
+ssize_t MmapStreamIO::Read(void *buf, size_t count) {
+  const size_t amount = std::min(count, size_ - pos_);
+  memcpy(buf, data_ + pos_, amount);
+  Advance(amount);
+  return amount;
+}
+
+const char *MmapStreamIO::ReadInPlace(size_t count) {
+  if (count > size_ - pos_) return NULL;
+  const char *result = data_ + pos_;
+  Advance(count);
+  return result;
+}
+
+ssize_t MmapStreamIO::Append(const void *buf, size_t count) {
+  return -1;
+}
+
 void MemStreamIO::Rewind() { pos_ = 0; }
 ssize_t MemStreamIO::Read(void *buf, size_t count) {
   const size_t amount = std::min(count, buffer_.size() - pos_);
@@ -74,6 +322,12 @@ ssize_t MemStreamIO::Append(const void *buf, size_t count) {
   buffer_.append((const char*)buf, count);
   return count;
 }
+bool MemStreamIO::Seek(off_t offset) {
+  if (offset < 0 || (size_t)offset > buffer_.size()) return false;
+  pos_ = offset;
+  return true;
+}
+off_t MemStreamIO::Size() { return buffer_.size(); }
 
 // Read exactly count bytes including retries. Returns success.
 static bool FullRead(StreamIO *io, void *buf, const size_t count) {
@@ -100,104 +354,626 @@ static bool FullAppend(StreamIO *io, const void *buf, const size_t count) {
   return remaining == 0;
 }
 
-StreamWriter::StreamWriter(StreamIO *io) : io_(io), header_written_(false) {}
+StreamWriter::StreamWriter(StreamIO *io, int format_version, bool compress)
+  : io_(io), format_version_(format_version), compress_(compress),
+    header_written_(false),
+    frames_since_keyframe_(0), bytes_written_(0), time_written_us_(0),
+    rgb_width_(0), rgb_height_(0) {}
+
+StreamWriter::~StreamWriter() {
+  if (format_version_ < 2 || index_.empty()) return;
+  const uint64_t index_offset = bytes_written_;
+  IndexFooter footer;
+  footer.index_offset = index_offset;
+  footer.frame_count = index_.size() / sizeof(IndexEntry);
+  footer.magic = kIndexMagicValue;
+  index_.append((const char*)&footer, sizeof(footer));
+
+  FrameHeader h = {};
+  h.magic = kIndexMagicValue;
+  h.size = index_.size();
+  if (FullAppend(io_, &h, sizeof(h)))
+    FullAppend(io_, index_.data(), index_.size());
+}
+
 bool StreamWriter::Stream(const FrameCanvas &frame, uint32_t hold_time_us) {
+  if (format_version_ >= 3) return false;  // Needs RGB images.
   const char *data;
   size_t len;
   frame.Serialize(&data, &len);
 
   if (!header_written_) {
-    WriteFileHeader(frame, len);
+    WriteFileHeader(frame.width(), frame.height(), len);
   }
+  return StreamData(data, len, hold_time_us);
+}
+
+bool StreamWriter::Stream(const ImageView &image, uint32_t hold_time_us) {
+  if (format_version_ < 3) return false;  // Needs the matrix representation.
+  if (!header_written_) {
+    rgb_width_ = image.width;
+    rgb_height_ = image.height;
+    rgb_frame_.assign(RGBFrameSize(image.width, image.height), 0);
+    WriteFileHeader(image.width, image.height, rgb_frame_.size());
+  }
+  if (image.width != rgb_width_ || image.height != rgb_height_)
+    return false;
+  internal::RGBBufferCanvas collector(rgb_width_, rgb_height_, &rgb_frame_[0]);
+  SetImage(&collector, 0, 0, image);
+  return StreamData(rgb_frame_.data(), rgb_frame_.size(), hold_time_us);
+}
+
+bool StreamWriter::StreamData(const char *data, size_t len,
+                              uint32_t hold_time_us) {
+  if (format_version_ < 2) {
+    return WriteFrame(kRawFrame, hold_time_us, data, len);
+  }
+
+  const bool is_rgb = (format_version_ >= 3);
+  const bool have_previous = (previous_frame_.size() == len);
+  if (have_previous && memcmp(previous_frame_.data(), data, len) == 0) {
+    ++frames_since_keyframe_;
+    return WriteFrame(kRepeatFrame, hold_time_us, NULL, 0);
+  }
+
+  if (!compress_) {
+    previous_frame_.assign(data, len);
+    frames_since_keyframe_ = 0;
+    return WriteFrame(kRawFrame, hold_time_us, data, len);
+  }
+
+  // Choose the smallest representation; but regularly write a frame that
+  // does not depend on the previous one.
+  CompressFrame(data, len, is_rgb, &encoded_);
+  uint32_t type = kKeyFrame;
+  if (have_previous && frames_since_keyframe_ < kMaxKeyframeDistance) {
+    std::string &xored = previous_frame_;  // Not needed after this anymore.
+    uint32_t *const words = (uint32_t*) &xored[0];
+    const uint32_t *current = (const uint32_t*) data;
+    for (size_t i = 0; i < len / sizeof(uint32_t); ++i) words[i] ^= current[i];
+    CompressFrame(xored.data(), len, is_rgb, &delta_);
+    if (delta_.size() < encoded_.size()) {
+      encoded_.swap(delta_);
+      type = kDeltaFrame;
+    }
+  }
+  previous_frame_.assign(data, len);
+
+  // An incompressible frame is stored as-is, which doesn't depend on the
+  // previous frame either, even if the delta was the smaller encoding.
+  const bool raw = (encoded_.size() >= len);
+  if (type == kDeltaFrame && !raw) {
+    ++frames_since_keyframe_;
+  } else {
+    frames_since_keyframe_ = 0;
+  }
+  if (raw) {
+    return WriteFrame(kRawFrame, hold_time_us, data, len);
+  }
+  return WriteFrame(type, hold_time_us, encoded_.data(), encoded_.size());
+}
+
+bool StreamWriter::WriteFrame(uint32_t type, uint32_t hold_time_us,
+                              const void *data, size_t len) {
+  if (format_version_ >= 2) {
+    IndexEntry entry;
+    entry.offset = bytes_written_;
+    entry.start_time_us = time_written_us_;
+    entry.hold_time_us = hold_time_us;
+    entry.type = type;
+    index_.append((const char*)&entry, sizeof(entry));
+  }
+  bytes_written_ += sizeof(FrameHeader) + len;
+  time_written_us_ += hold_time_us;
+
   FrameHeader h = {};
   h.magic = kFrameMagicValue;
   h.size = len;
   h.hold_time_us = hold_time_us;
-  FullAppend(io_, &h, sizeof(h));
-  return FullAppend(io_, data, len) == (ssize_t)len;
+  h.type = type;
+  if (!FullAppend(io_, &h, sizeof(h))) return false;
+  return FullAppend(io_, data, len);
 }
 
-void StreamWriter::WriteFileHeader(const FrameCanvas &frame, size_t len) {
+void StreamWriter::WriteFileHeader(int width, int height, size_t len) {
   FileHeader header = {};
   header.magic = kFileMagicValue;
-  header.width = frame.width();
-  header.height = frame.height();
+  header.width = width;
+  header.height = height;
   header.buf_size = len;
-  header.is_wide_gpio = (sizeof(gpio_bits_t) > 4);
+  header.version = format_version_;
+  header.is_wide_gpio = (format_version_ < 3 && sizeof(gpio_bits_t) > 4);
   FullAppend(io_, &header, sizeof(header));
+  bytes_written_ += sizeof(header);
   header_written_ = true;
 }
 
 StreamReader::StreamReader(StreamIO *io)
-  : io_(io), state_(STREAM_AT_BEGIN), header_frame_buffer_(NULL) {
+  : io_(io), state_(STREAM_AT_BEGIN), is_rgb_(false),
+    header_frame_buffer_(NULL), current_frame_(NULL), current_data_(NULL),
+    index_loaded_(false) {
   io_->Rewind();
 }
-StreamReader::~StreamReader() { delete [] header_frame_buffer_; }
+StreamReader::~StreamReader() {
+  delete [] header_frame_buffer_;
+  delete [] current_frame_;
+}
 
 void StreamReader::Rewind() {
   io_->Rewind();
   state_ = STREAM_AT_BEGIN;
+  current_data_ = NULL;
+}
+
+// Get the next "count" bytes: in place if the StreamIO supports that,
+// otherwise read into "buffer". Returns NULL on a short read.
+static const char *ReadData(StreamIO *io, size_t count, char *buffer,
+                            bool *in_place) {
+  const char *data = io->ReadInPlace(count);
+  *in_place = (data != NULL);
+  if (data) return data;
+  return FullRead(io, buffer, count) ? buffer : NULL;
+}
+
+// Skip "count" bytes, using "buffer" of "buffer_size" as scratch space.
+static bool SkipData(StreamIO *io, size_t count,
+                     char *buffer, size_t buffer_size) {
+  if (io->ReadInPlace(count)) return true;
+  while (count > 0) {
+    const size_t chunk = std::min(count, buffer_size);
+    if (!FullRead(io, buffer, chunk)) return false;
+    count -= chunk;
+  }
+  return true;
 }
 
 bool StreamReader::GetNext(FrameCanvas *frame, uint32_t* hold_time_us) {
-  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader(*frame)) return false;
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
   if (state_ != STREAM_READING) return false;
+  if (!is_rgb_ && (width_ != frame->width() || height_ != frame->height())) {
+    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
+            "Please use the same settings for record/replay\n",
+            width_, height_, frame->width(), frame->height());
+    state_ = STREAM_ERROR;
+    return false;
+  }
 
-  // Read header and expected buffer size.
-  if (!FullRead(io_, header_frame_buffer_,
-                sizeof(FrameHeader) + frame_buf_size_)) {
+  if (!DecodeNextFrame(hold_time_us))
     return false;
+  if (is_rgb_) {
+    // Convert to the matrix representation. Centered if the stream was
+    // made for a different size. Clearing first also lets go of a frame
+    // the canvas showed in place, which might not be around anymore.
+    const int x = (frame->width() - width_) / 2;
+    const int y = (frame->height() - height_) / 2;
+    frame->Clear();
+    SetImage(frame, x, y, ImageView(PIXEL_RGB24, (const uint8_t*)current_data_,
+                                    width_ * 3, width_, height_));
+    return true;
+  }
+  // current_frame_ is changed by the next delta frame, so only frames
+  // that are in place can be shown without copying.
+  if (current_data_ != current_frame_ &&
+      frame->DeserializeZeroCopy(current_data_, frame_buf_size_)) {
+    return true;
   }
+  return frame->Deserialize(current_data_, frame_buf_size_);
+}
 
-  const FrameHeader &h = *reinterpret_cast<FrameHeader*>(header_frame_buffer_);
+// Read the next frame and decode it to current_data_. Version 1 streams
+// are just a sequence of raw frames, so this works for both versions.
+bool StreamReader::DecodeNextFrame(uint32_t *hold_time_us) {
+  for (;;) {
+    // Frames vary in size: read the header first, then the payload.
+    bool in_place;
+    const char *header = ReadData(io_, sizeof(FrameHeader),
+                                  header_frame_buffer_, &in_place);
+    if (!header)
+      return false;
+    FrameHeader h;
+    memcpy(&h, header, sizeof(h));
 
-  // TODO: we might allow for this to be a kFileMagicValue, to allow people
-  // to just concatenate streams. In that case, we just would need to read
-  // ahead past this header (both headers are designed to be same size)
-  if (h.magic != kFrameMagicValue) {
-    state_ = STREAM_ERROR;
+    if (h.magic == kFileMagicValue) {
+      // Streams can be concatenated; this starts the next one. Both headers
+      // are designed to be the same size.
+      if (!StartStream(header))
+        return false;
+      continue;
+    }
+    if (h.magic == kIndexMagicValue) {
+      // End of a version 2 stream; another one might be concatenated.
+      if (!SkipData(io_, h.size, header_frame_buffer_,
+                    sizeof(FrameHeader) + frame_buf_size_)) {
+        return false;
+      }
+      continue;
+    }
+    if (h.magic != kFrameMagicValue || h.size > frame_buf_size_) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+
+    // Raw frames are read right where they are decoded to.
+    char *const buffer = (h.type == kRawFrame)
+      ? current_frame_
+      : header_frame_buffer_ + sizeof(FrameHeader);
+    const char *const payload = ReadData(io_, h.size, buffer, &in_place);
+    if (!payload)
+      return false;
+    if (!DecodeFrame(h.type, payload, h.size)) {
+      state_ = STREAM_ERROR;
+      return false;
+    }
+    if (hold_time_us) *hold_time_us = h.hold_time_us;
+    return true;
+  }
+}
+
+// Raw frames are not copied: "payload" is either in place in the StreamIO or
+// already read into current_frame_.
+bool StreamReader::DecodeFrame(uint32_t type, const char *payload, size_t len) {
+  switch (type) {
+  case kRawFrame:
+    if (len != frame_buf_size_) return false;
+    current_data_ = payload;
+    return true;
+  case kKeyFrame:
+    if (!DecompressFrame(payload, len, current_frame_, frame_buf_size_,
+                         is_rgb_, false)) {
+      return false;
+    }
+    break;
+  case kDeltaFrame:
+    if (!current_data_) return false;
+    if (current_data_ != current_frame_)
+      memcpy(current_frame_, current_data_, frame_buf_size_);
+    if (!DecompressFrame(payload, len, current_frame_, frame_buf_size_,
+                         is_rgb_, true)) {
+      return false;
+    }
+    break;
+  case kRepeatFrame:
+    if (!current_data_ || len != 0) return false;
+    return true;
+  default:
     return false;
   }
+  current_data_ = current_frame_;
+  return true;
+}
 
-  // In the future, we might allow larger buffers (audio?), but never smaller.
-  // For now, we need to make sure to exactly match the size, as our assumption
-  // above is that we can read the full header + frame in one FullRead().
-  if (h.size != frame_buf_size_)
+bool StreamReader::Seek(int frame) {
+  if (!LoadIndex()) return false;
+  const IndexEntry *const index = (const IndexEntry*) index_.data();
+  const int frame_count = index_.size() / sizeof(IndexEntry);
+  if (frame < 0 || frame >= frame_count) {
+    Rewind();
     return false;
+  }
 
-  if (hold_time_us) *hold_time_us = h.hold_time_us;
-  return frame->Deserialize(header_frame_buffer_ + sizeof(FrameHeader),
-                            frame_buf_size_);
+  // Start decoding at the closest frame that does not depend on the
+  // previous one.
+  int start = frame;
+  while (start > 0 && (index[start].type == kDeltaFrame ||
+                       index[start].type == kRepeatFrame)) {
+    --start;
+  }
+  if (!io_->Seek(index[start].offset)) {
+    Rewind();
+    return false;
+  }
+  state_ = STREAM_READING;
+  current_data_ = NULL;
+  for (int i = start; i < frame; ++i) {
+    if (!DecodeNextFrame(NULL)) {
+      Rewind();
+      return false;
+    }
+  }
+  return true;
 }
 
-bool StreamReader::ReadFileHeader(const FrameCanvas &frame) {
-  FileHeader header;
-  FullRead(io_, &header, sizeof(header));
-  if (header.magic != kFileMagicValue) {
-    state_ = STREAM_ERROR;
+bool StreamReader::SeekTime(uint64_t time_us) {
+  if (!LoadIndex()) return false;
+  const IndexEntry *const index = (const IndexEntry*) index_.data();
+  const int frame_count = index_.size() / sizeof(IndexEntry);
+  // Binary search for the last frame that starts at or before time_us.
+  int lo = 0, hi = frame_count;
+  while (lo < hi) {
+    const int mid = (lo + hi) / 2;
+    if (index[mid].start_time_us <= time_us) {
+      lo = mid + 1;
+    } else {
+      hi = mid;
+    }
+  }
+  const int frame = lo - 1;
+  if (frame >= 0 &&
+      time_us >= index[frame].start_time_us + index[frame].hold_time_us) {
+    Rewind();  // Past the end.
     return false;
   }
-  if ((int)header.width != frame.width()
-      || (int)header.height != frame.height()) {
-    fprintf(stderr, "This stream is for %dx%d, can't play on %dx%d. "
-            "Please use the same settings for record/replay\n",
-            header.width, header.height, frame.width(), frame.height());
+  return Seek(frame);
+}
+
+bool StreamReader::LoadIndex() {
+  if (index_loaded_) return true;
+  if (!io_->Seek(0)) return false;
+  if (state_ == STREAM_AT_BEGIN && !ReadFileHeader()) return false;
+  if (state_ == STREAM_ERROR) return false;
+  if (!ReadIndexTrailer()) {
+    ScanIndex();
+  }
+  index_loaded_ = true;
+  return true;
+}
+
+bool StreamReader::ReadIndexTrailer() {
+  const off_t size = io_->Size();
+  IndexFooter footer;
+  if (size < (off_t)(sizeof(FileHeader) + sizeof(FrameHeader)
+                     + sizeof(footer))) {
+    return false;
+  }
+  if (!io_->Seek(size - sizeof(footer)) ||
+      !FullRead(io_, &footer, sizeof(footer)) ||
+      footer.magic != kIndexMagicValue) {
+    return false;
+  }
+  // The index needs to span up to the end, otherwise this was not written
+  // for this stream, e.g. for a stream concatenated to it.
+  const size_t index_size = footer.frame_count * sizeof(IndexEntry);
+  FrameHeader h;
+  if (footer.index_offset + sizeof(h) + index_size + sizeof(footer)
+      != (uint64_t)size) {
+    return false;
+  }
+  if (!io_->Seek(footer.index_offset) || !FullRead(io_, &h, sizeof(h)) ||
+      h.magic != kIndexMagicValue) {
+    return false;
+  }
+  index_.resize(index_size);
+  return FullRead(io_, &index_[0], index_size);
+}
+
+// Streams without index: collect it from the frame headers.
+void StreamReader::ScanIndex() {
+  index_.clear();
+  IndexEntry entry;
+  entry.offset = sizeof(FileHeader);
+  entry.start_time_us = 0;
+  FrameHeader h;
+  while (io_->Seek(entry.offset) && FullRead(io_, &h, sizeof(h))) {
+    if (h.magic == kFileMagicValue) {  // Concatenated stream.
+      entry.offset += sizeof(FileHeader);
+      continue;
+    }
+    if (h.magic == kIndexMagicValue) {
+      entry.offset += sizeof(h) + h.size;
+      continue;
+    }
+    if (h.magic != kFrameMagicValue)
+      break;
+    entry.hold_time_us = h.hold_time_us;
+    entry.type = h.type;
+    index_.append((const char*)&entry, sizeof(entry));
+    entry.offset += sizeof(h) + h.size;
+    entry.start_time_us += h.hold_time_us;
+  }
+}
+
+bool StreamReader::ReadFileHeader() {
+  FileHeader header;
+  if (!FullRead(io_, &header, sizeof(header)) ||
+      header.magic != kFileMagicValue) {
     state_ = STREAM_ERROR;
     return false;
   }
-  if (header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
+  return StartStream((const char*)&header);
+}
+
+// Check and apply the FileHeader at the start of a stream.
+bool StreamReader::StartStream(const char *file_header) {
+  FileHeader header;
+  memcpy(&header, file_header, sizeof(header));
+  state_ = STREAM_ERROR;
+  const int format_version = (header.version == 0) ? 1 : header.version;
+  const bool is_rgb = (format_version >= 3);
+  if (!is_rgb && header.is_wide_gpio != (sizeof(gpio_bits_t) == 8)) {
     fprintf(stderr, "This stream was written with %s GPIO width support but "
             "this library is compiled with %d bit GPIO width (see "
             "ENABLE_WIDE_GPIO_COMPUTE_MODULE setting in lib/Makefile)\n",
             header.is_wide_gpio ? "wide (64-bit)" : "narrow (32-bit)",
             int(sizeof(gpio_bits_t) * 8));
-    state_ = STREAM_ERROR;
+    return false;
+  }
+  if (format_version > 3) {
+    fprintf(stderr, "Stream format version %d is not supported by this "
+            "version of the library.\n", format_version);
+    return false;
+  }
+  if (is_rgb && (header.width == 0 || header.height == 0 ||
+                 header.buf_size != RGBFrameSize(header.width,
+                                                 header.height))) {
+    return false;
+  }
+  if (header_frame_buffer_ && (header.buf_size != frame_buf_size_ ||
+                               is_rgb != is_rgb_ ||
+                               (int)header.width != width_ ||
+                               (int)header.height != height_)) {
+    fprintf(stderr, "Concatenated streams need to be created with the same "
+            "settings.\n");
     return false;
   }
   state_ = STREAM_READING;
+  is_rgb_ = is_rgb;
+  width_ = header.width;
+  height_ = header.height;
   frame_buf_size_ = header.buf_size;
-  if (!header_frame_buffer_)
+  current_data_ = NULL;
+  if (!header_frame_buffer_) {
     header_frame_buffer_ = new char [ sizeof(FrameHeader) + header.buf_size ];
+    current_frame_ = new char [ header.buf_size ];
+  }
+  return true;
+}
+
+AsyncStreamReader::AsyncStreamReader(RGBMatrix *matrix, int depth)
+  : running_(true), streams_queued_(0), current_stream_(0),
+    reading_stream_(-1) {
+  pthread_cond_init(&changed_, NULL);
+  for (int i = 0; i < depth; ++i) {
+    free_.push_back(matrix->CreateFrameCanvas());
+  }
+  Start();
+}
+
+AsyncStreamReader::~AsyncStreamReader() {
+  {
+    MutexLock l(&mutex_);
+    running_ = false;
+    pthread_cond_broadcast(&changed_);
+  }
+  WaitStopped();
+  pthread_cond_destroy(&changed_);
+  // The FrameCanvases are owned by the RGBMatrix.
+}
+
+void AsyncStreamReader::Enqueue(StreamIO *io, int loops,
+                                uint64_t begin_us, uint64_t end_us) {
+  QueuedStream stream;
+  stream.io = io;
+  stream.loops = loops;
+  stream.begin_us = begin_us;
+  stream.end_us = end_us;
+  MutexLock l(&mutex_);
+  queued_.push_back(stream);
+  ++streams_queued_;
+  pthread_cond_broadcast(&changed_);
+}
+
+FrameCanvas *AsyncStreamReader::GetNext(uint32_t *hold_time_us) {
+  MutexLock l(&mutex_);
+  while (current_stream_ < streams_queued_) {
+    if (ready_.empty()) {
+      mutex_.WaitOn(&changed_);
+      continue;
+    }
+    const ReadFrame frame = ready_.front();
+    ready_.pop_front();
+    if (frame.canvas == NULL) {  // End of this stream.
+      ++current_stream_;
+      return NULL;
+    }
+    if (hold_time_us) *hold_time_us = frame.hold_time_us;
+    return frame.canvas;
+  }
+  return NULL;
+}
+
+void AsyncStreamReader::Release(FrameCanvas *canvas) {
+  MutexLock l(&mutex_);
+  free_.push_back(canvas);
+  pthread_cond_broadcast(&changed_);
+}
+
+void AsyncStreamReader::SkipCurrent() {
+  MutexLock l(&mutex_);
+  if (current_stream_ >= streams_queued_) return;
+  // All read frames belong to the current stream or the ones after it.
+  while (!ready_.empty() && ready_.front().stream == current_stream_) {
+    if (ready_.front().canvas) free_.push_back(ready_.front().canvas);
+    ready_.pop_front();
+  }
+  const int skipped = current_stream_++;
+  pthread_cond_broadcast(&changed_);
+
+  // The reader might be in the middle of reading a frame; it gives up on
+  // the stream right after.
+  while (reading_stream_ >= 0 && reading_stream_ <= skipped) {
+    mutex_.WaitOn(&changed_);
+  }
+}
+
+void AsyncStreamReader::Run() {
+  for (int serial = 0; /**/; ++serial) {
+    QueuedStream stream;
+    {
+      MutexLock l(&mutex_);
+      while (running_ && queued_.empty()) {
+        mutex_.WaitOn(&changed_);
+      }
+      if (!running_) return;
+      stream = queued_.front();
+      queued_.pop_front();
+      if (serial < current_stream_)
+        continue;  // Skipped already; its StreamIO might be gone.
+      reading_stream_ = serial;
+    }
+    ReadStream(stream, serial);
+
+    MutexLock l(&mutex_);
+    reading_stream_ = -1;
+    pthread_cond_broadcast(&changed_);
+    if (serial >= current_stream_) {
+      ReadFrame end_marker = { NULL, 0, serial };
+      ready_.push_back(end_marker);
+      pthread_cond_broadcast(&changed_);
+    }
+  }
+}
+
+void AsyncStreamReader::ReadStream(const QueuedStream &stream, int serial) {
+  StreamReader reader(stream.io);
+  for (int loop = 0; stream.loops < 0 || loop < stream.loops; ++loop) {
+    if (stream.begin_us > 0 && !reader.SeekTime(stream.begin_us))
+      return;
+    uint64_t stream_time_us = stream.begin_us;
+    bool any_frame = false;
+    while (stream_time_us < stream.end_us) {
+      FrameCanvas *canvas = AcquireCanvas(serial);
+      if (canvas == NULL)
+        return;  // Stopped or abandoned.
+      uint32_t hold_time_us;
+      if (!reader.GetNext(canvas, &hold_time_us)) {
+        Release(canvas);
+        break;
+      }
+      if (!Publish(canvas, hold_time_us, serial))
+        return;
+      any_frame = true;
+      stream_time_us += hold_time_us;
+    }
+    if (!any_frame)
+      return;  // Don't loop over a stream without frames forever.
+    reader.Rewind();
+  }
+}
+
+// Wait for a free canvas. Returns NULL if we're stopped or if the stream
+// has been skipped in the meantime.
+FrameCanvas *AsyncStreamReader::AcquireCanvas(int serial) {
+  MutexLock l(&mutex_);
+  while (running_ && serial >= current_stream_ && free_.empty()) {
+    mutex_.WaitOn(&changed_);
+  }
+  if (!running_ || serial < current_stream_)
+    return NULL;
+  FrameCanvas *canvas = free_.back();
+  free_.pop_back();
+  return canvas;
+}
+
+bool AsyncStreamReader::Publish(FrameCanvas *canvas, uint32_t hold_time_us,
+                                int serial) {
+  MutexLock l(&mutex_);
+  if (serial < current_stream_) {  // Skipped while we were reading.
+    free_.push_back(canvas);
+    return false;
+  }
+  ReadFrame frame = { canvas, hold_time_us, serial };
+  ready_.push_back(frame);
+  pthread_cond_broadcast(&changed_);
   return true;
 }
 }  // namespace rgb_matrix
@@ -0,0 +1,505 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "display-daemon.h"
+#include "led-matrix.h"
+#include "graphics.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "rgb-canvas-internal.h"
+
+namespace rgb_matrix {
+
+const char kDefaultDisplaySocket[] = "/tmp/led-matrix.sock";
+
+namespace {
+static const int kMaxSlots = 16;
+
+// Frames in the ring start at multiples of this, so that native frames can
+// be shown in place.
+static const size_t kSlotAlignment = 64;
+
+// Messages on the socket. Each is one packet of a SOCK_SEQPACKET socket.
+enum MessageType {
+  kHello = 1,   // Client: frame format, number of slots.
+  kWelcome,     // Daemon: width, height, frame size, slot stride; ring fd.
+  kSubmit,      // Client: slot, hold time in microseconds.
+  kRelease,     // Daemon: slot that can be used again.
+  kBrightness,  // Client: brightness in percent.
+};
+
+struct Message {
+  uint32_t type;
+  uint32_t value[4];
+};
+
+static uint64_t GetMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static bool FillAddress(const char *socket_path, struct sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (strlen(socket_path) >= sizeof(addr->sun_path)) return false;
+  strncpy(addr->sun_path, socket_path, sizeof(addr->sun_path) - 1);
+  return true;
+}
+
+// Send "msg", passing along file descriptor "pass_fd" if it is not -1.
+static bool SendMessage(int fd, const Message &msg, int pass_fd = -1) {
+  struct iovec iov;
+  iov.iov_base = const_cast<Message*>(&msg);
+  iov.iov_len = sizeof(msg);
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  if (pass_fd >= 0) {
+    memset(&control, 0, sizeof(control));
+    hdr.msg_control = control.buf;
+    hdr.msg_controllen = sizeof(control.buf);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &pass_fd, sizeof(int));
+  }
+  // The daemon must never block on a slow client; a message that doesn't
+  // fit right now fails with EAGAIN and is up to the caller to send again.
+  ssize_t w;
+  do {
+    w = sendmsg(fd, &hdr, MSG_NOSIGNAL | MSG_DONTWAIT);
+  } while (w < 0 && errno == EINTR);
+  return w == (ssize_t)sizeof(msg);
+}
+
+// Receive a message. A file descriptor passed along is stored in
+// "received_fd" if given, otherwise closed.
+static bool ReadMessage(int fd, Message *msg, int *received_fd) {
+  struct iovec iov;
+  iov.iov_base = msg;
+  iov.iov_len = sizeof(*msg);
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_iov = &iov;
+  hdr.msg_iovlen = 1;
+  hdr.msg_control = control.buf;
+  hdr.msg_controllen = sizeof(control.buf);
+  ssize_t r;
+  do {
+    r = recvmsg(fd, &hdr, MSG_CMSG_CLOEXEC);
+  } while (r < 0 && errno == EINTR);
+  for (struct cmsghdr *cmsg = CMSG_FIRSTHDR(&hdr); cmsg != NULL;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if (cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS)
+      continue;
+    int passed_fd;
+    memcpy(&passed_fd, CMSG_DATA(cmsg), sizeof(int));
+    if (received_fd && r == (ssize_t)sizeof(*msg))
+      *received_fd = passed_fd;
+    else
+      close(passed_fd);
+  }
+  return r == (ssize_t)sizeof(*msg);
+}
+
+// Shared memory that is only reachable through the returned file descriptor.
+static int CreateSharedMemory(size_t size) {
+  static int counter = 0;
+  char name[64];
+  snprintf(name, sizeof(name), "/led-display-%d-%d", getpid(), counter++);
+  int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0600);
+  if (fd < 0) return -1;
+  shm_unlink(name);
+  if (ftruncate(fd, size) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+}  // namespace
+
+DisplayClient::DisplayClient(int fd, FrameFormat format,
+                             int width, int height,
+                             size_t frame_size, size_t slot_stride, int slots,
+                             char *ring, size_t ring_size)
+  : fd_(fd), format_(format), width_(width), height_(height),
+    frame_size_(frame_size), slot_stride_(slot_stride),
+    ring_(ring), ring_size_(ring_size), current_slot_(-1),
+    canvas_(new internal::RGBBufferCanvas(width, height, ring)) {
+  for (int i = 0; i < slots; ++i) free_slots_.push_back(i);
+}
+
+DisplayClient::~DisplayClient() {
+  delete canvas_;
+  munmap(ring_, ring_size_);
+  close(fd_);
+}
+
+DisplayClient *DisplayClient::Connect(const char *socket_path,
+                                      FrameFormat format, int slots) {
+  struct sockaddr_un addr;
+  if (slots < 1 || slots > kMaxSlots) return NULL;
+  if (!FillAddress(socket_path, &addr)) return NULL;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) return NULL;
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  const Message hello = { kHello, { (uint32_t)format, (uint32_t)slots } };
+  Message welcome;
+  int ring_fd = -1;
+  if (!SendMessage(fd, hello) || !ReadMessage(fd, &welcome, &ring_fd)
+      || welcome.type != kWelcome || ring_fd < 0) {
+    if (ring_fd >= 0) close(ring_fd);
+    close(fd);
+    return NULL;
+  }
+  const size_t slot_stride = welcome.value[3];
+  const size_t ring_size = slot_stride * slots;
+  void *ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                    ring_fd, 0);
+  close(ring_fd);
+  if (ring == MAP_FAILED) {
+    close(fd);
+    return NULL;
+  }
+  return new DisplayClient(fd, format, welcome.value[0], welcome.value[1],
+                           welcome.value[2], slot_stride, slots,
+                           (char*)ring, ring_size);
+}
+
+bool DisplayClient::WaitForRelease() {
+  Message msg;
+  if (!ReadMessage(fd_, &msg, NULL)) return false;
+  if (msg.type == kRelease && msg.value[0] < ring_size_ / slot_stride_)
+    free_slots_.push_back(msg.value[0]);
+  return true;
+}
+
+char *DisplayClient::NextFrame() {
+  if (current_slot_ < 0) {
+    while (free_slots_.empty()) {
+      if (!WaitForRelease()) return NULL;
+    }
+    current_slot_ = free_slots_.front();
+    free_slots_.pop_front();
+  }
+  return ring_ + current_slot_ * slot_stride_;
+}
+
+Canvas *DisplayClient::NextCanvas() {
+  if (format_ != RGB_FRAMES) return NULL;
+  char *frame = NextFrame();
+  if (frame == NULL) return NULL;
+  canvas_->set_buffer(frame);
+  return canvas_;
+}
+
+bool DisplayClient::Submit(uint32_t hold_time_us) {
+  if (current_slot_ < 0) return false;
+  const Message submit = { kSubmit, { (uint32_t)current_slot_, hold_time_us } };
+  current_slot_ = -1;
+  return SendMessage(fd_, submit);
+}
+
+bool DisplayClient::SetBrightness(uint8_t percent) {
+  const Message brightness = { kBrightness, { percent } };
+  return SendMessage(fd_, brightness);
+}
+
+struct DisplayServer::Client {
+  struct Submission {
+    uint32_t slot;
+    uint32_t hold_time_us;
+  };
+
+  explicit Client(int fd) : fd(fd), hung_up(false), format(0), slots(0),
+                            frame_size(0), slot_stride(0),
+                            ring(NULL), ring_size(0) {}
+
+  const int fd;
+  bool hung_up;       // Disconnected; kept until its frames are shown.
+  uint32_t format;
+  uint32_t slots;
+  size_t frame_size;
+  size_t slot_stride;
+  const char *ring;   // Our read-only mapping of the shared memory.
+  size_t ring_size;
+  std::deque<Submission> queue;  // Frames to be shown.
+  std::deque<uint32_t> unsent_releases;  // Sent once the socket has room.
+};
+
+DisplayServer *DisplayServer::Create(RGBMatrix *matrix,
+                                     const char *socket_path) {
+  struct sockaddr_un addr;
+  if (!FillAddress(socket_path, &addr)) return NULL;
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) return NULL;
+  unlink(socket_path);  // Left over from a previous run.
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0
+      || listen(fd, 8) < 0) {
+    close(fd);
+    return NULL;
+  }
+  // Users of our group can show content; others need to be added to it.
+  chmod(socket_path, 0660);
+  return new DisplayServer(matrix, fd);
+}
+
+DisplayServer::DisplayServer(RGBMatrix *matrix, int listen_fd)
+  : matrix_(matrix), listen_fd_(listen_fd),
+    shown_(NULL), offscreen_(matrix->CreateFrameCanvas()),
+    shown_owner_(NULL), shown_slot_(0), next_frame_us_(0),
+    brightness_(matrix->brightness()) {
+  const char *data;
+  offscreen_->Serialize(&data, &native_frame_size_);
+}
+
+DisplayServer::~DisplayServer() {
+  while (!clients_.empty()) RemoveClient(clients_.back());
+  struct sockaddr_un addr;
+  socklen_t len = sizeof(addr);
+  if (getsockname(listen_fd_, (struct sockaddr*)&addr, &len) == 0)
+    unlink(addr.sun_path);
+  close(listen_fd_);
+}
+
+void DisplayServer::Run(volatile bool *interrupt_received) {
+  std::vector<struct pollfd> fds;
+  while (!*interrupt_received) {
+    fds.resize(clients_.size() + 1);
+    fds[0].fd = listen_fd_;
+    fds[0].events = POLLIN;
+    for (size_t i = 0; i < clients_.size(); ++i) {
+      fds[i + 1].fd = clients_[i]->hung_up ? -1 : clients_[i]->fd;
+      fds[i + 1].events = POLLIN;
+      if (!clients_[i]->unsent_releases.empty())
+        fds[i + 1].events |= POLLOUT;
+    }
+
+    // Sleep until there is something to read or the next frame is due.
+    struct timespec timeout;
+    struct timespec *wait_time = NULL;
+    Client *client = ShownClient();
+    if (client && !client->queue.empty()) {
+      const uint64_t now = GetMicros();
+      const uint64_t wait_us = next_frame_us_ > now ? next_frame_us_ - now : 0;
+      timeout.tv_sec = wait_us / 1000000;
+      timeout.tv_nsec = (wait_us % 1000000) * 1000;
+      wait_time = &timeout;
+    }
+    if (ppoll(&fds[0], fds.size(), wait_time, NULL) < 0) {
+      if (errno == EINTR) continue;
+      perror("ppoll");
+      break;
+    }
+
+    for (size_t i = 1; i < fds.size(); ++i) {
+      if (fds[i].revents & POLLOUT)
+        FlushReleases(clients_[i - 1]);
+      if ((fds[i].revents & (POLLIN | POLLHUP | POLLERR))
+          && !HandleMessage(clients_[i - 1]))
+        clients_[i - 1]->hung_up = true;
+    }
+    if (fds[0].revents & POLLIN) AcceptClient();
+
+    client = ShownClient();
+    if (client && !client->queue.empty() && GetMicros() >= next_frame_us_)
+      ShowNextFrame();
+    RemoveHungUpClients();
+  }
+}
+
+// Clients that went away are removed once there is nothing more to show
+// from them. Frames they submitted just before exiting are still shown.
+void DisplayServer::RemoveHungUpClients() {
+  const std::vector<Client*> clients(clients_);
+  for (size_t i = 0; i < clients.size(); ++i) {
+    Client *client = clients[i];
+    if (client->hung_up
+        && (client->queue.empty() || client != ShownClient())) {
+      RemoveClient(client);
+    }
+  }
+}
+
+void DisplayServer::AcceptClient() {
+  int fd = accept4(listen_fd_, NULL, NULL, SOCK_CLOEXEC);
+  if (fd < 0) return;
+  clients_.push_back(new Client(fd));
+}
+
+bool DisplayServer::HandleMessage(Client *client) {
+  Message msg;
+  if (!ReadMessage(client->fd, &msg, NULL)) return false;
+  switch (msg.type) {
+  case kHello:
+    return client->ring == NULL
+      && SetupRing(client, msg.value[0], msg.value[1]);
+  case kSubmit: {
+    if (client->ring == NULL || msg.value[0] >= client->slots) return false;
+    const Client::Submission submission = { msg.value[0], msg.value[1] };
+    client->queue.push_back(submission);
+    return true;
+  }
+  case kBrightness:
+    brightness_ = std::min(msg.value[0], 100u);
+    return true;
+  }
+  return false;  // Unknown message. Nothing we can talk to.
+}
+
+bool DisplayServer::SetupRing(Client *client,
+                              uint32_t format, uint32_t slots) {
+  size_t frame_size;
+  switch (format) {
+  case DisplayClient::RGB_FRAMES:
+    frame_size = offscreen_->width() * offscreen_->height() * 3;
+    break;
+  case DisplayClient::NATIVE_FRAMES:
+    frame_size = native_frame_size_;
+    break;
+  default:
+    return false;
+  }
+  if (slots < 1 || slots > (uint32_t)kMaxSlots) return false;
+
+  const size_t slot_stride = (frame_size + kSlotAlignment - 1)
+    / kSlotAlignment * kSlotAlignment;
+  const size_t ring_size = slot_stride * slots;
+  const int ring_fd = CreateSharedMemory(ring_size);
+  if (ring_fd < 0) return false;
+  void *ring = mmap(NULL, ring_size, PROT_READ, MAP_SHARED, ring_fd, 0);
+  if (ring == MAP_FAILED) {
+    close(ring_fd);
+    return false;
+  }
+  client->format = format;
+  client->slots = slots;
+  client->frame_size = frame_size;
+  client->slot_stride = slot_stride;
+  client->ring = (const char*)ring;
+  client->ring_size = ring_size;
+
+  const Message welcome = { kWelcome, {
+      (uint32_t)offscreen_->width(), (uint32_t)offscreen_->height(),
+      (uint32_t)frame_size, (uint32_t)slot_stride } };
+  const bool success = SendMessage(client->fd, welcome, ring_fd);
+  close(ring_fd);
+  next_frame_us_ = 0;  // The new client is shown right away.
+  return success;
+}
+
+void DisplayServer::RemoveClient(Client *client) {
+  if (shown_owner_ == client) {
+    // The frame on the matrix is in the memory of this client. Keep showing
+    // a copy of it.
+    offscreen_->CopyFrom(*shown_);
+    SwapCanvases();
+  }
+  if (client->ring) munmap((void*)client->ring, client->ring_size);
+  close(client->fd);
+  clients_.erase(std::find(clients_.begin(), clients_.end(), client));
+  delete client;
+}
+
+// The most recently connected client is shown.
+DisplayServer::Client *DisplayServer::ShownClient() {
+  for (size_t i = clients_.size(); i > 0; --i) {
+    if (clients_[i - 1]->ring != NULL) return clients_[i - 1];
+  }
+  return NULL;
+}
+
+void DisplayServer::ShowNextFrame() {
+  Client *client = ShownClient();
+  const Client::Submission submission = client->queue.front();
+  client->queue.pop_front();
+  const char *frame = client->ring + submission.slot * client->slot_stride;
+
+  bool zero_copy = false;
+  if (client->format == DisplayClient::NATIVE_FRAMES) {
+    zero_copy = offscreen_->DeserializeZeroCopy(frame, client->frame_size);
+    if (!zero_copy && !offscreen_->Deserialize(frame, client->frame_size)) {
+      SendRelease(client, submission.slot);  // Can't be shown at all.
+      return;
+    }
+  } else {
+    offscreen_->SetBrightness(brightness_);
+    SetImage(offscreen_, 0, 0,
+             ImageView(PIXEL_RGB24, (const uint8_t*)frame,
+                       offscreen_->width() * 3,
+                       offscreen_->width(), offscreen_->height()));
+  }
+  if (!zero_copy) {
+    // Converted into our own canvas; the client can have it back.
+    SendRelease(client, submission.slot);
+  }
+  SwapCanvases();
+  if (zero_copy) {
+    shown_owner_ = client;
+    shown_slot_ = submission.slot;
+  }
+  next_frame_us_ = std::max(next_frame_us_ + submission.hold_time_us,
+                            GetMicros());
+}
+
+// Show offscreen_; the previously shown canvas becomes the new offscreen_.
+void DisplayServer::SwapCanvases() {
+  FrameCanvas *previous = matrix_->SwapOnVSync(offscreen_);
+  if (shown_owner_ != NULL) {
+    // Not on the matrix anymore: the client can have its buffer back, and
+    // the canvas goes back to its own memory.
+    previous->Clear();
+    SendRelease(shown_owner_, shown_slot_);
+    shown_owner_ = NULL;
+  }
+  shown_ = offscreen_;
+  offscreen_ = previous;
+}
+
+// A client waits for its slots to come back, so a release must not get
+// lost if its socket buffer happens to be full.
+void DisplayServer::SendRelease(Client *client, uint32_t slot) {
+  client->unsent_releases.push_back(slot);
+  FlushReleases(client);
+}
+
+void DisplayServer::FlushReleases(Client *client) {
+  while (!client->unsent_releases.empty()) {
+    const Message release = { kRelease, { client->unsent_releases.front() } };
+    if (!SendMessage(client->fd, release)) {
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+        client->unsent_releases.clear();  // Gone; noticed when reading.
+      return;
+    }
+    client->unsent_releases.pop_front();
+  }
+}
+
+}  // namespace rgb_matrix
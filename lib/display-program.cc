@@ -0,0 +1,86 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "display-program.h"
+
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+namespace rgb_matrix {
+namespace {
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+// The context of a standalone program: the program has the matrix to itself.
+class MatrixProgramContext : public ProgramContext {
+public:
+  MatrixProgramContext(const RGBMatrix::Options &options,
+                       const RuntimeOptions &runtime_options)
+    : options_(options), runtime_options_(runtime_options), matrix_(NULL) {}
+  virtual ~MatrixProgramContext() { delete matrix_; }
+
+  virtual bool StartDisplay() {
+    if (matrix_ != NULL) return true;
+    matrix_ = RGBMatrix::CreateFromOptions(options_, runtime_options_);
+    if (matrix_ == NULL) return false;
+    signal(SIGTERM, InterruptHandler);
+    signal(SIGINT, InterruptHandler);
+    return true;
+  }
+
+  virtual FrameCanvas *CreateFrameCanvas() {
+    return Matrix()->CreateFrameCanvas();
+  }
+  virtual FrameCanvas *SwapOnVSync(FrameCanvas *other,
+                                   unsigned framerate_fraction) {
+    return Matrix()->SwapOnVSync(other, framerate_fraction);
+  }
+  virtual bool SetPWMBits(uint8_t value) { return Matrix()->SetPWMBits(value); }
+  virtual void SetBrightness(uint8_t brightness) {
+    Matrix()->SetBrightness(brightness);
+  }
+  virtual uint8_t brightness() { return Matrix()->brightness(); }
+  virtual bool interrupted() { return interrupt_received; }
+  virtual const char *hardware_mapping() const {
+    return options_.hardware_mapping;
+  }
+
+protected:
+  virtual Canvas *DrawTarget() const {
+    return const_cast<MatrixProgramContext*>(this)->Matrix();
+  }
+
+private:
+  // The matrix; started here if the program uses it before StartDisplay().
+  // There is nothing to draw on without it, so that is the end.
+  RGBMatrix *Matrix() {
+    if (!StartDisplay()) {
+      fprintf(stderr, "Can't start the display.\n");
+      exit(1);
+    }
+    return matrix_;
+  }
+
+  const RGBMatrix::Options options_;
+  const RuntimeOptions runtime_options_;
+  RGBMatrix *matrix_;
+};
+}  // namespace
+
+int RunDisplayProgram(int argc, char *argv[],
+                      const RGBMatrix::Options &defaults,
+                      DisplayProgramMainFn program) {
+  RGBMatrix::Options matrix_options = defaults;
+  RuntimeOptions runtime_opt;
+  if (!ParseOptionsFromFlags(&argc, &argv, &matrix_options, &runtime_opt)) {
+    fprintf(stderr, "usage: %s <options>\n", argv[0]);
+    PrintMatrixFlags(stderr);
+    return 1;
+  }
+  MatrixProgramContext context(matrix_options, runtime_opt);
+  return program(&context, argc, argv);
+}
+
+}  // namespace rgb_matrix
@@ -17,6 +17,7 @@
 
 #include <stdint.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include "hardware-mapping.h"
 #include "../include/graphics.h"
@@ -120,6 +121,9 @@ public:
 
   void Serialize(const char **data, size_t *len) const;
   bool Deserialize(const char *data, size_t len);
+  // Show "data" in place instead of copying it. See
+  // FrameCanvas::DeserializeZeroCopy()
+  bool DeserializeZeroCopy(const char *data, size_t len);
   void CopyFrom(const Framebuffer *other);
 
   // Canvas-inspired methods, but we're not implementing this interface to not
@@ -131,7 +135,27 @@ public:
   void Clear();
   void Fill(uint8_t red, uint8_t green, uint8_t blue);
 
+  // Span operations. Coordinates are clipped to the visible area.
+  void FillRect(int x, int y, int width, int height,
+                uint8_t red, uint8_t green, uint8_t blue);
+  void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb);
+
 private:
+  // A color mapped to the bitplanes: for each plane, a mask that selects
+  // the red, green and blue bits of a PixelDesignator if that color bit is
+  // set. Computed once per color, then applied to many pixels.
+  struct PlanePattern {
+    gpio_bits_t r_sel[kBitPlanes];
+    gpio_bits_t g_sel[kBitPlanes];
+    gpio_bits_t b_sel[kBitPlanes];
+  };
+  inline void MapPlanePattern(uint8_t r, uint8_t g, uint8_t b,
+                              PlanePattern *pattern);
+  inline void WritePlanePattern(const PixelDesignator *designator,
+                                const PlanePattern &pattern);
+  inline void WriteMappedColor(const PixelDesignator *designator,
+                               uint16_t red, uint16_t green, uint16_t blue);
+
   static const struct HardwareMapping *hardware_mapping_;
   static RowAddressSetter *row_setter_;
 
@@ -170,6 +194,17 @@ private:
   gpio_bits_t *bitplane_buffer_;
   inline gpio_bits_t *ValueAt(int double_row, int column, int bit);
 
+  // The buffer that is displayed and serialized. Usually bitplane_buffer_,
+  // but after DeserializeZeroCopy() memory owned by someone else. Before
+  // any modification, the content is copied back into bitplane_buffer_;
+  // Clear() and Deserialize() drop it without reading it.
+  const gpio_bits_t *shown_buffer_;
+  inline void UnshareBuffer() {
+    if (shown_buffer_ == bitplane_buffer_) return;
+    memcpy(bitplane_buffer_, shown_buffer_, buffer_size_);
+    shown_buffer_ = bitplane_buffer_;
+  }
+
   PixelDesignatorMap **shared_mapper_;  // Storage in RGBMatrix.
 };
 }  // namespace internal
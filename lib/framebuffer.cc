@@ -311,6 +311,7 @@ Framebuffer::Framebuffer(int rows, int columns, int parallel,
   assert(parallel >= 1 && parallel <= 6);
 
   bitplane_buffer_ = new gpio_bits_t[double_rows_ * columns_ * kBitPlanes];
+  shown_buffer_ = bitplane_buffer_;
 
   // If we're the first Framebuffer created, the shared PixelMapper is
   // still NULL, so create one.
@@ -580,6 +581,7 @@ inline gpio_bits_t *Framebuffer::ValueAt(int double_row, int column, int bit) {
 }
 
 void Framebuffer::Clear() {
+  shown_buffer_ = bitplane_buffer_;  // All overwritten; no need to copy.
   if (inverse_color_) {
     Fill(0, 0, 0);
   } else  {
@@ -648,6 +650,7 @@ void Framebuffer::Fill(uint8_t r, uint8_t g, uint8_t b) {
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
   const PixelDesignator &fill = (*shared_mapper_)->GetFillColorBits();
+  UnshareBuffer();
 
   for (int b = kBitPlanes - pwm_bits_; b < kBitPlanes; ++b) {
     uint16_t mask = 1 << b;
@@ -671,13 +674,18 @@ int Framebuffer::height() const { return (*shared_mapper_)->height(); }
 void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   const PixelDesignator *designator = (*shared_mapper_)->get(x, y);
   if (designator == NULL) return;
-  const long pos = designator->gpio_word;
-  if (pos < 0) return;  // non-used pixel marker.
+  if (designator->gpio_word < 0) return;  // non-used pixel marker.
 
   uint16_t red, green, blue;
   MapColors(r, g, b, &red, &green, &blue);
+  UnshareBuffer();
+  WriteMappedColor(designator, red, green, blue);
+}
 
-  gpio_bits_t *bits = bitplane_buffer_ + pos;
+inline void Framebuffer::WriteMappedColor(const PixelDesignator *designator,
+                                          uint16_t red, uint16_t green,
+                                          uint16_t blue) {
+  gpio_bits_t *bits = bitplane_buffer_ + designator->gpio_word;
   const int min_bit_plane = kBitPlanes - pwm_bits_;
   bits += (columns_ * min_bit_plane);
   const gpio_bits_t r_bits = designator->r_bit;
@@ -694,6 +702,74 @@ void Framebuffer::SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
   }
 }
 
+inline void Framebuffer::MapPlanePattern(uint8_t r, uint8_t g, uint8_t b,
+                                         PlanePattern *pattern) {
+  uint16_t red, green, blue;
+  MapColors(r, g, b, &red, &green, &blue);
+  for (int plane = kBitPlanes - pwm_bits_; plane < kBitPlanes; ++plane) {
+    const uint16_t mask = 1 << plane;
+    pattern->r_sel[plane] = (red & mask)   ? ~(gpio_bits_t)0 : 0;
+    pattern->g_sel[plane] = (green & mask) ? ~(gpio_bits_t)0 : 0;
+    pattern->b_sel[plane] = (blue & mask)  ? ~(gpio_bits_t)0 : 0;
+  }
+}
+
+inline void Framebuffer::WritePlanePattern(const PixelDesignator *designator,
+                                           const PlanePattern &pattern) {
+  const long pos = designator->gpio_word;
+  if (pos < 0) return;  // non-used pixel marker.
+  const int min_bit_plane = kBitPlanes - pwm_bits_;
+  gpio_bits_t *bits = bitplane_buffer_ + pos + (columns_ * min_bit_plane);
+  const gpio_bits_t r_bits = designator->r_bit;
+  const gpio_bits_t g_bits = designator->g_bit;
+  const gpio_bits_t b_bits = designator->b_bit;
+  const gpio_bits_t designator_mask = designator->mask;
+  for (int plane = min_bit_plane; plane < kBitPlanes; ++plane) {
+    *bits = ((*bits & designator_mask)
+             | (r_bits & pattern.r_sel[plane])
+             | (g_bits & pattern.g_sel[plane])
+             | (b_bits & pattern.b_sel[plane]));
+    bits += columns_;
+  }
+}
+
+void Framebuffer::FillRect(int x, int y, int width, int height,
+                           uint8_t r, uint8_t g, uint8_t b) {
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  if (x < 0) { width += x; x = 0; }
+  if (y < 0) { height += y; y = 0; }
+  width = std::min(width, mapper->width() - x);
+  height = std::min(height, mapper->height() - y);
+  if (width <= 0 || height <= 0) return;
+
+  PlanePattern pattern;
+  MapPlanePattern(r, g, b, &pattern);
+  UnshareBuffer();
+  for (int iy = y; iy < y + height; ++iy) {
+    const PixelDesignator *designator = mapper->get(x, iy);
+    for (int ix = 0; ix < width; ++ix) {
+      WritePlanePattern(designator++, pattern);
+    }
+  }
+}
+
+void Framebuffer::SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+  PixelDesignatorMap *const mapper = *shared_mapper_;
+  if (y < 0 || y >= mapper->height()) return;
+  if (x < 0) { rgb += 3 * -x; count += x; x = 0; }
+  count = std::min(count, mapper->width() - x);
+  if (count <= 0) return;
+
+  UnshareBuffer();
+  const PixelDesignator *designator = mapper->get(x, y);
+  for (int i = 0; i < count; ++i, ++designator, rgb += 3) {
+    if (designator->gpio_word < 0) continue;
+    uint16_t red, green, blue;
+    MapColors(rgb[0], rgb[1], rgb[2], &red, &green, &blue);
+    WriteMappedColor(designator, red, green, blue);
+  }
+}
+
 void Framebuffer::SetPixels(int x, int y, int width, int height, Color *colors) {
   for (int iy = 0; iy < height; ++iy) {
     for (int ix = 0; ix < width; ++ix) {
@@ -801,19 +877,28 @@ void Framebuffer::InitDefaultDesignator(int x, int y, const char *seq,
 }
 
 void Framebuffer::Serialize(const char **data, size_t *len) const {
-  *data = reinterpret_cast<const char*>(bitplane_buffer_);
+  *data = reinterpret_cast<const char*>(shown_buffer_);
   *len = buffer_size_;
 }
 
 bool Framebuffer::Deserialize(const char *data, size_t len) {
   if (len != buffer_size_) return false;
   memcpy(bitplane_buffer_, data, len);
+  shown_buffer_ = bitplane_buffer_;
+  return true;
+}
+
+bool Framebuffer::DeserializeZeroCopy(const char *data, size_t len) {
+  if (len != buffer_size_) return false;
+  if ((uintptr_t)data % sizeof(gpio_bits_t) != 0) return false;
+  shown_buffer_ = reinterpret_cast<const gpio_bits_t*>(data);
   return true;
 }
 
 void Framebuffer::CopyFrom(const Framebuffer *other) {
   if (other == this) return;
-  memcpy(bitplane_buffer_, other->bitplane_buffer_, buffer_size_);
+  memcpy(bitplane_buffer_, other->shown_buffer_, buffer_size_);
+  shown_buffer_ = bitplane_buffer_;
 }
 
 void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
@@ -859,7 +944,8 @@ void Framebuffer::DumpToMatrix(GPIO *io, int pwm_low_bit) {
     // Rows can't be switched very quickly without ghosting, so we do the
     // full PWM of one row before switching rows.
     for (int b = start_bit; b < kBitPlanes; ++b) {
-      gpio_bits_t *row_data = ValueAt(d_row, 0, b);
+      const gpio_bits_t *row_data = shown_buffer_
+        + d_row * (columns_ * kBitPlanes) + b * columns_;
       // While the output enable is still on, we can already clock in the next
       // data.
       for (int col = 0; col < columns_; ++col) {
@@ -16,9 +16,11 @@
 #include "graphics.h"
 #include "utf8-internal.h"
 
+#include <math.h>
 #include <stdlib.h>
 #include <functional>
 #include <algorithm>
+#include <vector>
 
 namespace rgb_matrix {
 Color trueHSV(unsigned angle)
@@ -73,52 +75,116 @@ bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
               bool is_bgr) {
   if (3 * width * height != (int)size)   // Sanity check
     return false;
+  return SetImage(c, canvas_offset_x, canvas_offset_y,
+                  ImageView(is_bgr ? PIXEL_BGR24 : PIXEL_RGB24,
+                            buffer, 3 * width, width, height));
+}
 
-  int image_display_w = width;
-  int image_display_h = height;
+static inline uint8_t ClampColor(int value) {
+  return value < 0 ? 0 : (value > 255 ? 255 : value);
+}
 
-  size_t skip_start_row = 0;   // Bytes to skip before each row
-  if (canvas_offset_x < 0) {
-    skip_start_row = -canvas_offset_x * 3;
-    image_display_w += canvas_offset_x;
-    if (image_display_w <= 0) return false;  // Done. outside canvas.
-    canvas_offset_x = 0;
-  }
-  if (canvas_offset_y < 0) {
-    // Skip buffer to the first row we'll be showing
-    buffer += 3 * width * -canvas_offset_y;
-    image_display_h += canvas_offset_y;
-    if (image_display_h <= 0) return false;  // Done. outside canvas.
-    canvas_offset_y = 0;
+// BT.601 with video range (Y: 16..235, U/V: 16..240), 8 bit fixed point.
+static inline void YUVToRGB(int y, int u, int v, uint8_t *rgb) {
+  const int luma = 298 * (y - 16) + 128;
+  u -= 128;
+  v -= 128;
+  rgb[0] = ClampColor((luma + 409 * v) >> 8);
+  rgb[1] = ClampColor((luma - 100 * u - 208 * v) >> 8);
+  rgb[2] = ClampColor((luma + 516 * u) >> 8);
+}
+
+// Convert "count" pixels starting at column "x" of row "y" into packed RGB.
+// Returns a pointer to the converted pixels; this is either "scratch" or,
+// if the image already is RGB24, a pointer into the image itself.
+static const uint8_t *ImageRowToRGB(const ImageView &image, int x, int y,
+                                    int count, uint8_t *scratch) {
+  const uint8_t *src = image.planes[0] + (ptrdiff_t)y * image.strides[0];
+  uint8_t *out = scratch;
+  switch (image.format) {
+  case PIXEL_RGB24:
+    return src + 3 * x;
+  case PIXEL_BGR24:
+    src += 3 * x;
+    for (int i = 0; i < count; ++i, src += 3, out += 3) {
+      out[0] = src[2]; out[1] = src[1]; out[2] = src[0];
+    }
+    break;
+  case PIXEL_RGBA32:
+    src += 4 * x;
+    for (int i = 0; i < count; ++i, src += 4, out += 3) {
+      out[0] = src[0]; out[1] = src[1]; out[2] = src[2];
+    }
+    break;
+  case PIXEL_BGRA32:
+    src += 4 * x;
+    for (int i = 0; i < count; ++i, src += 4, out += 3) {
+      out[0] = src[2]; out[1] = src[1]; out[2] = src[0];
+    }
+    break;
+  case PIXEL_RGB565:
+    src += 2 * x;
+    for (int i = 0; i < count; ++i, src += 2, out += 3) {
+      const uint16_t value = src[0] | (src[1] << 8);
+      const uint8_t r = (value >> 11) & 0x1f;
+      const uint8_t g = (value >> 5) & 0x3f;
+      const uint8_t b = value & 0x1f;
+      out[0] = (r << 3) | (r >> 2);
+      out[1] = (g << 2) | (g >> 4);
+      out[2] = (b << 3) | (b >> 2);
+    }
+    break;
+  case PIXEL_GRAY8:
+    src += x;
+    for (int i = 0; i < count; ++i, ++src, out += 3) {
+      out[0] = out[1] = out[2] = *src;
+    }
+    break;
+  case PIXEL_YUV420P: {
+    const uint8_t *u = image.planes[1] + (ptrdiff_t)(y / 2) * image.strides[1];
+    const uint8_t *v = image.planes[2] + (ptrdiff_t)(y / 2) * image.strides[2];
+    for (int i = x; i < x + count; ++i, out += 3) {
+      YUVToRGB(src[i], u[i / 2], v[i / 2], out);
+    }
+    break;
   }
-  const int w = std::min(c->width(), canvas_offset_x + image_display_w);
-  const int h = std::min(c->height(), canvas_offset_y + image_display_h);
-
-  // Bytes to skip for wider than canvas image at the end of a row
-  const size_t skip_end_row = (canvas_offset_x + image_display_w > w)
-    ? (canvas_offset_x + image_display_w - w) * 3
-    : 0;
-
-  // Let's make this a combined skip per row and ajust where we start.
-  const size_t next_row_skip = skip_start_row + skip_end_row;
-  buffer += skip_start_row;
-
-  if (is_bgr) {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[2], buffer[1], buffer[0]);
-        buffer += 3;
-      }
-      buffer += next_row_skip;
+  case PIXEL_NV12: {
+    const uint8_t *uv = image.planes[1] + (ptrdiff_t)(y / 2) * image.strides[1];
+    for (int i = x; i < x + count; ++i, out += 3) {
+      YUVToRGB(src[i], uv[i & ~1], uv[i | 1], out);
     }
-  } else {
-    for (int y = canvas_offset_y; y < h; ++y) {
-      for (int x = canvas_offset_x; x < w; ++x) {
-        c->SetPixel(x, y, buffer[0], buffer[1], buffer[2]);
-        buffer += 3;
-      }
-      buffer += next_row_skip;
+    break;
+  }
+  case PIXEL_YUV444P: {
+    const uint8_t *u = image.planes[1] + (ptrdiff_t)y * image.strides[1];
+    const uint8_t *v = image.planes[2] + (ptrdiff_t)y * image.strides[2];
+    for (int i = x; i < x + count; ++i, out += 3) {
+      YUVToRGB(src[i], u[i], v[i], out);
     }
+    break;
+  }
+  }
+  return scratch;
+}
+
+bool SetImage(Canvas *c, int canvas_offset_x, int canvas_offset_y,
+              const ImageView &image) {
+  if (image.planes[0] == NULL) return false;
+  const int x_begin = std::max(0, -canvas_offset_x);
+  const int y_begin = std::max(0, -canvas_offset_y);
+  const int x_end = std::min(image.width, c->width() - canvas_offset_x);
+  const int y_end = std::min(image.height, c->height() - canvas_offset_y);
+  if (x_begin >= x_end || y_begin >= y_end)
+    return false;  // Done. outside canvas.
+
+  const int count = x_end - x_begin;
+  std::vector<uint8_t> scratch;
+  if (image.format != PIXEL_RGB24) scratch.resize(3 * count);
+  for (int y = y_begin; y < y_end; ++y) {
+    const uint8_t *rgb = ImageRowToRGB(image, x_begin, y, count,
+                                       scratch.data());
+    c->SetPixelsSpan(canvas_offset_x + x_begin, canvas_offset_y + y,
+                     count, rgb);
   }
   return true;
 }
@@ -163,31 +229,93 @@ int VerticalDrawText(Canvas *c, const Font &font, int x, int y,
   return y - start_y;
 }
 
-void DrawCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
+// Clipping helpers: primitives clip to the canvas before handing spans to it,
+// so that canvas implementations never see out-of-range coordinates.
+static void ClippedHLine(Canvas *c, int x0, int x1, int y, const Color &color) {
+  if (y < 0 || y >= c->height()) return;
+  if (x1 < x0) std::swap(x0, x1);
+  x0 = std::max(x0, 0);
+  x1 = std::min(x1, c->width() - 1);
+  if (x1 < x0) return;
+  c->HLine(x0, y, x1 - x0 + 1, color.r, color.g, color.b);
+}
+
+static void ClippedVLine(Canvas *c, int x, int y0, int y1, const Color &color) {
+  if (x < 0 || x >= c->width()) return;
+  if (y1 < y0) std::swap(y0, y1);
+  y0 = std::max(y0, 0);
+  y1 = std::min(y1, c->height() - 1);
+  if (y1 < y0) return;
+  c->VLine(x, y0, y1 - y0 + 1, color.r, color.g, color.b);
+}
+
+// Returns true if the box (inclusive corners) does not touch the canvas.
+static bool OutsideCanvas(const Canvas *c, int x0, int y0, int x1, int y1) {
+  return x1 < 0 || y1 < 0 || x0 >= c->width() || y0 >= c->height();
+}
+
+// The midpoint circle algorithm walks the octant from (radius, 0) to the
+// diagonal. While its x stays the same, the points form a run which, mirrored
+// into all octants, is a vertical or horizontal span. Calls
+// emit(x, y_from, y_to) for each of these runs.
+template <typename RunEmitter>
+static void WalkCircleRuns(int radius, const RunEmitter &emit) {
   int x = radius, y = 0;
   int radiusError = 1 - x;
+  int run_start = 0;
 
   while (y <= x) {
-    c->SetPixel(x + x0, y + y0, color.r, color.g, color.b);
-    c->SetPixel(y + x0, x + y0, color.r, color.g, color.b);
-    c->SetPixel(-x + x0, y + y0, color.r, color.g, color.b);
-    c->SetPixel(-y + x0, x + y0, color.r, color.g, color.b);
-    c->SetPixel(-x + x0, -y + y0, color.r, color.g, color.b);
-    c->SetPixel(-y + x0, -x + y0, color.r, color.g, color.b);
-    c->SetPixel(x + x0, -y + y0, color.r, color.g, color.b);
-    c->SetPixel(y + x0, -x + y0, color.r, color.g, color.b);
+    const int run_x = x;
     y++;
-    if (radiusError<0){
+    if (radiusError < 0) {
       radiusError += 2 * y + 1;
     } else {
       x--;
-      radiusError+= 2 * (y - x + 1);
+      radiusError += 2 * (y - x + 1);
+    }
+    if (x != run_x || y > x) {
+      emit(run_x, run_start, y - 1);
+      run_start = y;
     }
   }
 }
 
+void DrawCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
+  if (OutsideCanvas(c, x0 - radius, y0 - radius, x0 + radius, y0 + radius))
+    return;
+  WalkCircleRuns(radius, [&](int x, int y_from, int y_to) {
+      ClippedVLine(c, x0 + x, y0 + y_from, y0 + y_to, color);
+      ClippedVLine(c, x0 - x, y0 + y_from, y0 + y_to, color);
+      ClippedVLine(c, x0 + x, y0 - y_to, y0 - y_from, color);
+      ClippedVLine(c, x0 - x, y0 - y_to, y0 - y_from, color);
+      ClippedHLine(c, x0 + y_from, x0 + y_to, y0 + x, color);
+      ClippedHLine(c, x0 - y_to, x0 - y_from, y0 + x, color);
+      ClippedHLine(c, x0 + y_from, x0 + y_to, y0 - x, color);
+      ClippedHLine(c, x0 - y_to, x0 - y_from, y0 - x, color);
+    });
+}
+
+void FillCircle(Canvas *c, int x0, int y0, int radius, const Color &color) {
+  if (OutsideCanvas(c, x0 - radius, y0 - radius, x0 + radius, y0 + radius))
+    return;
+  WalkCircleRuns(radius, [&](int x, int y_from, int y_to) {
+      // Rows close to the center: one line per y of the run.
+      for (int y = y_from; y <= y_to; ++y) {
+        ClippedHLine(c, x0 - x, x0 + x, y0 + y, color);
+        if (y != 0) ClippedHLine(c, x0 - x, x0 + x, y0 - y, color);
+      }
+      // Top and bottom cap rows; unless already covered above.
+      if (x > y_to) {
+        ClippedHLine(c, x0 - y_to, x0 + y_to, y0 + x, color);
+        ClippedHLine(c, x0 - y_to, x0 + y_to, y0 - x, color);
+      }
+    });
+}
+
 void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
   int dy = y1 - y0, dx = x1 - x0, gradient, x, y, shift = 0x10;
+  const int width = c->width();
+  const int height = c->height();
 
   if (abs(dx) > abs(dy)) {
     // x variation is bigger than y variation
@@ -195,43 +323,95 @@ void DrawLine(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
       std::swap(x0, x1);
       std::swap(y0, y1);
     }
+    if (OutsideCanvas(c, x0, std::min(y0, y1), x1, std::max(y0, y1)))
+      return;
     gradient = (dy << shift) / dx ;
 
-    for (x = x0 , y = 0x8000 + (y0 << shift); x <= x1; ++x, y += gradient) {
-      c->SetPixel(x, y >> shift, color.r, color.g, color.b);
+    // Only walk the part within the canvas columns. Pixels on the same row
+    // are collected into one horizontal span.
+    const int x_start = std::max(x0, 0);
+    const int x_end = std::min(x1, width - 1);
+    y = 0x8000 + (y0 << shift) + gradient * (x_start - x0);
+    int span_start = x_start;
+    int span_y = y >> shift;
+    for (x = x_start; x <= x_end; ++x, y += gradient) {
+      if ((y >> shift) != span_y) {
+        ClippedHLine(c, span_start, x - 1, span_y, color);
+        span_start = x;
+        span_y = y >> shift;
+      }
     }
+    ClippedHLine(c, span_start, x_end, span_y, color);
   } else if (dy != 0) {
     // y variation is bigger than x variation
     if (y1 < y0) {
       std::swap(x0, x1);
       std::swap(y0, y1);
     }
+    if (OutsideCanvas(c, std::min(x0, x1), y0, std::max(x0, x1), y1))
+      return;
     gradient = (dx << shift) / dy;
-    for (y = y0 , x = 0x8000 + (x0 << shift); y <= y1; ++y, x += gradient) {
-      c->SetPixel(x >> shift, y, color.r, color.g, color.b);
+
+    const int y_start = std::max(y0, 0);
+    const int y_end = std::min(y1, height - 1);
+    x = 0x8000 + (x0 << shift) + gradient * (y_start - y0);
+    int span_start = y_start;
+    int span_x = x >> shift;
+    for (y = y_start; y <= y_end; ++y, x += gradient) {
+      if ((x >> shift) != span_x) {
+        ClippedVLine(c, span_x, span_start, y - 1, color);
+        span_start = y;
+        span_x = x >> shift;
+      }
     }
-  } else {
+    ClippedVLine(c, span_x, span_start, y_end, color);
+  } else if (x0 >= 0 && x0 < width && y0 >= 0 && y0 < height) {
     c->SetPixel(x0, y0, color.r, color.g, color.b);
   }
 }
 
-  void DrawRectangle(Canvas *c, int x0, int y0, int x1, int y1, const Color &color)
-  {
-    if (x1 < x0)
-    {
-      std::swap(x0, x1);
-    }
-    if (y1 < y0)
-    {
-      std::swap(y0, y1);
+void DrawRectangle(Canvas *c, int x0, int y0, int x1, int y1, const Color &color) {
+  if (x1 < x0) std::swap(x0, x1);
+  if (y1 < y0) std::swap(y0, y1);
+  x0 = std::max(x0, 0);
+  y0 = std::max(y0, 0);
+  x1 = std::min(x1, c->width() - 1);
+  y1 = std::min(y1, c->height() - 1);
+  if (x1 < x0 || y1 < y0) return;
+  c->FillRect(x0, y0, x1 - x0 + 1, y1 - y0 + 1, color.r, color.g, color.b);
+}
+
+void FillPolygon(Canvas *c, const int *xs, const int *ys, int num_points,
+                 const Color &color) {
+  if (num_points < 3) return;
+  int min_y = ys[0], max_y = ys[0];
+  for (int i = 1; i < num_points; ++i) {
+    min_y = std::min(min_y, ys[i]);
+    max_y = std::max(max_y, ys[i]);
+  }
+  min_y = std::max(min_y, 0);
+  max_y = std::min(max_y, c->height() - 1);
+
+  std::vector<float> crossings;
+  crossings.reserve(num_points);
+  for (int y = min_y; y <= max_y; ++y) {
+    // Sample at the center of the pixel row.
+    const float sample_y = y + 0.5f;
+    crossings.clear();
+    for (int i = 0, j = num_points - 1; i < num_points; j = i++) {
+      if ((ys[i] <= sample_y) == (ys[j] <= sample_y))
+        continue;  // Edge does not cross this row.
+      crossings.push_back(xs[i] + (sample_y - ys[i]) * (xs[j] - xs[i])
+                          / (float)(ys[j] - ys[i]));
     }
-    for (int x = x0; x <= x1; x++)
-    {
-      for (int y = y0; y <= y1; y++)
-      {
-        c->SetPixel(x, y, color.r, color.g, color.b);
-      }
+    std::sort(crossings.begin(), crossings.end());
+    // Even-odd rule: fill pixels whose center is between pairs of crossings.
+    for (size_t k = 0; k + 1 < crossings.size(); k += 2) {
+      const int from = (int)ceilf(crossings[k] - 0.5f);
+      const int to = (int)ceilf(crossings[k+1] - 0.5f) - 1;
+      if (from <= to) ClippedHLine(c, from, to, y, color);
     }
   }
+}
 
 }//namespace
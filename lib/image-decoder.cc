@@ -0,0 +1,575 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "image-decoder.h"
+
+#include <ctype.h>
+#include <string.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+namespace {
+// Larger images are not worth it on a LED matrix and likely broken files.
+static const int kMaxDimension = 16384;
+static const int64_t kMaxPixels = 1 << 26;
+
+static bool ReasonableSize(int64_t width, int64_t height) {
+  return width > 0 && height > 0
+    && width <= kMaxDimension && height <= kMaxDimension
+    && width * height <= kMaxPixels;
+}
+
+static int ReadLE16(FILE *f) {
+  const int lo = getc(f);
+  const int hi = getc(f);
+  return (lo < 0 || hi < 0) ? -1 : lo | (hi << 8);
+}
+
+static int64_t ReadBE32(FILE *f) {
+  uint8_t b[4];
+  if (fread(b, 1, 4, f) != 4) return -1;
+  return ((uint32_t)b[0] << 24) | (b[1] << 16) | (b[2] << 8) | b[3];
+}
+
+// -- PPM (P6, P3) and PGM (P5, P2).
+class PnmDecoder : public ImageDecoder {
+public:
+  static PnmDecoder *Create(FILE *f) {
+    if (getc(f) != 'P') return NULL;
+    const int type = getc(f);
+    if (type != '2' && type != '3' && type != '5' && type != '6')
+      return NULL;
+    int width, height, maxval;
+    if (!ReadNumber(f, &width) || !ReadNumber(f, &height)
+        || !ReadNumber(f, &maxval)) {
+      return NULL;
+    }
+    if (!ReasonableSize(width, height) || maxval < 1 || maxval > 65535)
+      return NULL;
+    return new PnmDecoder(f, width, height, type, maxval);
+  }
+
+  virtual bool NextFrame(int64_t *delay_us) {
+    if (decoded_) return false;
+    *delay_us = 0;
+    const bool gray = (type_ == '2' || type_ == '5');
+    const bool ascii = (type_ == '2' || type_ == '3');
+    const int channels = gray ? 1 : 3;
+    const int bytes_per_value = (maxval_ > 255) ? 2 : 1;
+    std::vector<uint8_t> row(width_ * channels * bytes_per_value);
+    uint8_t *out = &rgba_[0];
+    for (int y = 0; y < height_; ++y) {
+      if (!ascii && fread(&row[0], 1, row.size(), file_) != row.size())
+        return false;
+      for (int x = 0; x < width_; ++x, out += 4) {
+        for (int c = 0; c < channels; ++c) {
+          int value;
+          if (ascii) {
+            if (!ReadNumber(file_, &value)) return false;
+          } else if (bytes_per_value == 2) {
+            const uint8_t *v = &row[2 * (x * channels + c)];
+            value = (v[0] << 8) | v[1];
+          } else {
+            value = row[x * channels + c];
+          }
+          if (maxval_ != 255)
+            value = std::min(value, maxval_) * 255 / maxval_;
+          out[c] = value;
+        }
+        if (gray) out[1] = out[2] = out[0];
+        out[3] = 0xff;
+      }
+    }
+    decoded_ = true;
+    return true;
+  }
+
+  virtual bool Rewind() {
+    decoded_ = false;
+    return fseek(file_, data_start_, SEEK_SET) == 0;
+  }
+
+private:
+  PnmDecoder(FILE *f, int width, int height, int type, int maxval)
+    : ImageDecoder(f, width, height), type_(type), maxval_(maxval),
+      data_start_(ftell(f)), decoded_(false) {}
+
+  // Read a decimal number, skipping whitespace and # comments before it.
+  // The single whitespace after the header's last number is consumed too.
+  static bool ReadNumber(FILE *f, int *result) {
+    int c = getc(f);
+    for (;;) {
+      if (c == '#') {
+        while (c != '\n' && c != EOF) c = getc(f);
+      } else if (isspace(c)) {
+        c = getc(f);
+      } else {
+        break;
+      }
+    }
+    if (!isdigit(c)) return false;
+    int value = 0;
+    for (; isdigit(c); c = getc(f)) {
+      if (value > 100000000) return false;
+      value = value * 10 + (c - '0');
+    }
+    *result = value;
+    return true;
+  }
+
+  const int type_;
+  const int maxval_;
+  const long data_start_;
+  bool decoded_;
+};
+
+// -- QOI, the "Quite OK Image format" (https://qoiformat.org/)
+class QoiDecoder : public ImageDecoder {
+public:
+  static QoiDecoder *Create(FILE *f) {
+    char magic[4];
+    if (fread(magic, 1, 4, f) != 4 || memcmp(magic, "qoif", 4) != 0)
+      return NULL;
+    const int64_t width = ReadBE32(f);
+    const int64_t height = ReadBE32(f);
+    const int channels = getc(f);
+    const int colorspace = getc(f);
+    if (!ReasonableSize(width, height) || (channels != 3 && channels != 4)
+        || colorspace < 0) {
+      return NULL;
+    }
+    return new QoiDecoder(f, width, height);
+  }
+
+  virtual bool NextFrame(int64_t *delay_us) {
+    if (decoded_) return false;
+    *delay_us = 0;
+    uint8_t index[64][4];
+    memset(index, 0, sizeof(index));
+    uint8_t px[4] = { 0, 0, 0, 255 };
+    int run = 0;
+    uint8_t *out = &rgba_[0];
+    for (int i = width_ * height_; i > 0; --i, out += 4) {
+      if (run > 0) {
+        --run;
+      } else {
+        const int b1 = getc(file_);
+        if (b1 < 0) return false;
+        if (b1 == 0xfe) {         // QOI_OP_RGB
+          if (fread(px, 1, 3, file_) != 3) return false;
+        } else if (b1 == 0xff) {  // QOI_OP_RGBA
+          if (fread(px, 1, 4, file_) != 4) return false;
+        } else {
+          switch (b1 & 0xc0) {
+          case 0x00:              // QOI_OP_INDEX
+            memcpy(px, index[b1], 4);
+            break;
+          case 0x40:              // QOI_OP_DIFF
+            px[0] += ((b1 >> 4) & 0x03) - 2;
+            px[1] += ((b1 >> 2) & 0x03) - 2;
+            px[2] += (b1 & 0x03) - 2;
+            break;
+          case 0x80: {            // QOI_OP_LUMA
+            const int b2 = getc(file_);
+            if (b2 < 0) return false;
+            const int vg = (b1 & 0x3f) - 32;
+            px[0] += vg - 8 + ((b2 >> 4) & 0x0f);
+            px[1] += vg;
+            px[2] += vg - 8 + (b2 & 0x0f);
+            break;
+          }
+          case 0xc0:              // QOI_OP_RUN
+            run = b1 & 0x3f;
+            break;
+          }
+        }
+        memcpy(index[(px[0] * 3 + px[1] * 5 + px[2] * 7 + px[3] * 11) % 64],
+               px, 4);
+      }
+      out[0] = px[0] * px[3] / 255;
+      out[1] = px[1] * px[3] / 255;
+      out[2] = px[2] * px[3] / 255;
+      out[3] = px[3];
+    }
+    decoded_ = true;
+    return true;
+  }
+
+  virtual bool Rewind() {
+    decoded_ = false;
+    return fseek(file_, 14, SEEK_SET) == 0;  // After the header.
+  }
+
+private:
+  QoiDecoder(FILE *f, int width, int height)
+    : ImageDecoder(f, width, height), decoded_(false) {}
+
+  bool decoded_;
+};
+
+// -- GIF, still or animated.
+
+// The image data of a GIF comes in sub-blocks of up to 255 bytes; this reads
+// them as one sequence of bytes.
+class SubBlockReader {
+public:
+  explicit SubBlockReader(FILE *f) : file_(f), left_(0), ended_(false) {}
+
+  // Next byte, or -1 at the end of the data.
+  int Next() {
+    while (left_ == 0) {
+      if (ended_) return -1;
+      const int len = getc(file_);
+      if (len <= 0) {
+        ended_ = true;
+        return -1;
+      }
+      left_ = len;
+    }
+    --left_;
+    const int result = getc(file_);
+    if (result < 0) {
+      ended_ = true;
+      left_ = 0;
+    }
+    return result;
+  }
+
+  void SkipRest() {
+    while (!ended_) {
+      if (left_ && fseek(file_, left_, SEEK_CUR) != 0) break;
+      left_ = 0;
+      Next();
+    }
+  }
+
+private:
+  FILE *const file_;
+  int left_;
+  bool ended_;
+};
+
+class GifDecoder : public ImageDecoder {
+public:
+  static GifDecoder *Create(FILE *f) {
+    char magic[6];
+    if (fread(magic, 1, 6, f) != 6
+        || (memcmp(magic, "GIF87a", 6) != 0 && memcmp(magic, "GIF89a", 6) != 0))
+      return NULL;
+    const int width = ReadLE16(f);
+    const int height = ReadLE16(f);
+    const int flags = getc(f);
+    getc(f);  // Background color; we show transparent instead.
+    if (getc(f) < 0 || !ReasonableSize(width, height))  // Aspect ratio.
+      return NULL;
+    GifDecoder *result = new GifDecoder(f, width, height);
+    if (flags & 0x80) {
+      result->global_colors_ = 2 << (flags & 0x07);
+      if (fread(result->global_palette_, 3, result->global_colors_, f)
+          != (size_t)result->global_colors_) {
+        delete result;
+        return NULL;
+      }
+    }
+    result->first_block_ = ftell(f);
+    return result;
+  }
+
+  virtual bool NextFrame(int64_t *delay_us) {
+    DisposePrevious();
+    int delay_centiseconds = 0;
+    int disposal = 0;
+    int transparent = -1;
+    for (;;) {
+      switch (getc(file_)) {
+      case 0x21: {  // Extension
+        if (getc(file_) == 0xf9) {  // Graphic control for the next image.
+          int size = getc(file_);
+          if (size >= 4) {
+            const int flags = getc(file_);
+            delay_centiseconds = ReadLE16(file_);
+            const int transparent_index = getc(file_);
+            disposal = (flags >> 2) & 0x07;
+            transparent = (flags & 0x01) ? transparent_index : -1;
+            size -= 4;
+          }
+          if (size > 0) fseek(file_, size, SEEK_CUR);
+        }
+        SubBlockReader(file_).SkipRest();
+        break;
+      }
+      case 0x2c:    // Image
+        if (!DecodeImage(transparent, disposal))
+          return false;
+        *delay_us = delay_centiseconds * 10000LL;
+        return true;
+      default:      // Trailer, end of file or garbage.
+        return false;
+      }
+    }
+  }
+
+  virtual bool Rewind() {
+    std::fill(rgba_.begin(), rgba_.end(), 0);
+    disposal_ = 0;
+    return fseek(file_, first_block_, SEEK_SET) == 0;
+  }
+
+private:
+  GifDecoder(FILE *f, int width, int height)
+    : ImageDecoder(f, width, height), global_colors_(0), first_block_(0),
+      disposal_(0), frame_x_(0), frame_y_(0), frame_width_(0),
+      frame_height_(0) {}
+
+  // Before the next image, undo the previous one as it asked for.
+  void DisposePrevious() {
+    if (disposal_ == 2) {         // Restore to background.
+      for (int y = frame_y_; y < frame_y_ + frame_height_; ++y) {
+        memset(&rgba_[4 * (y * width_ + frame_x_)], 0, 4 * frame_width_);
+      }
+    } else if (disposal_ == 3) {  // Restore to previous.
+      rgba_.swap(previous_);
+    }
+    disposal_ = 0;
+  }
+
+  bool DecodeImage(int transparent, int disposal) {
+    const int left = ReadLE16(file_);
+    const int top = ReadLE16(file_);
+    const int width = ReadLE16(file_);
+    const int height = ReadLE16(file_);
+    const int flags = getc(file_);
+    if (flags < 0) return false;
+    const bool interlaced = flags & 0x40;
+    uint8_t local_palette[256 * 3];
+    const uint8_t *palette = global_palette_;
+    int colors = global_colors_;
+    if (flags & 0x80) {
+      colors = 2 << (flags & 0x07);
+      if (fread(local_palette, 3, colors, file_) != (size_t)colors)
+        return false;
+      palette = local_palette;
+    }
+
+    // Clip to the screen, remembering what to dispose afterwards.
+    frame_x_ = std::min(left, width_);
+    frame_y_ = std::min(top, height_);
+    frame_width_ = std::min(width, width_ - frame_x_);
+    frame_height_ = std::min(height, height_ - frame_y_);
+    disposal_ = disposal;
+    if (disposal_ == 3) previous_ = rgba_;
+
+    const int min_code_size = getc(file_);
+    if (min_code_size < 1 || min_code_size > 11) return false;
+
+    // LZW, decoded as the data comes in; each code is a previous code plus
+    // one more pixel, so strings are put together backwards on a stack.
+    SubBlockReader in(file_);
+    const int clear_code = 1 << min_code_size;
+    const int end_code = clear_code + 1;
+    uint16_t prefix[4096];
+    uint8_t suffix[4096];
+    uint8_t stack[4096 + 1];
+    for (int i = 0; i < clear_code; ++i) suffix[i] = i;
+    int code_size = min_code_size + 1;
+    int next_code = clear_code + 2;
+    int previous = -1;
+    uint8_t first = 0;
+    uint32_t bits = 0;
+    int bit_count = 0;
+
+    int x = 0, y = 0, pass = 0;
+    uint8_t *row = RowAt(top, left);
+    int64_t pixels_left = (int64_t)width * height;
+    while (pixels_left > 0) {
+      while (bit_count < code_size) {
+        const int byte = in.Next();
+        if (byte < 0) return true;   // Truncated; show what we have.
+        bits |= byte << bit_count;
+        bit_count += 8;
+      }
+      const int code = bits & ((1 << code_size) - 1);
+      bits >>= code_size;
+      bit_count -= code_size;
+
+      if (code == clear_code) {
+        code_size = min_code_size + 1;
+        next_code = clear_code + 2;
+        previous = -1;
+        continue;
+      }
+      if (code == end_code)
+        break;
+
+      int sp = 0;
+      if (previous < 0) {
+        if (code > clear_code) return false;
+        stack[sp++] = code;
+        first = code;
+      } else {
+        if (code > next_code) return false;
+        int c = code;
+        if (code == next_code) {
+          stack[sp++] = first;
+          c = previous;
+        }
+        while (c > clear_code) {
+          stack[sp++] = suffix[c];
+          c = prefix[c];
+        }
+        stack[sp++] = c;
+        first = c;
+        if (next_code < 4096) {
+          prefix[next_code] = previous;
+          suffix[next_code] = first;
+          if (++next_code == (1 << code_size) && code_size < 12)
+            ++code_size;
+        }
+      }
+      previous = code;
+
+      while (sp > 0 && pixels_left > 0) {
+        const int index = stack[--sp];
+        --pixels_left;
+        if (row && x < frame_width_ && index != transparent
+            && index < colors) {
+          uint8_t *pixel = row + 4 * x;
+          memcpy(pixel, &palette[3 * index], 3);
+          pixel[3] = 0xff;
+        }
+        if (++x == width) {
+          x = 0;
+          y = NextRow(y, height, interlaced, &pass);
+          row = RowAt(top + y, left);
+        }
+      }
+    }
+    in.SkipRest();
+    return true;
+  }
+
+  // Start of the image row "y" at "x" on the screen, NULL if off-screen.
+  uint8_t *RowAt(int y, int x) {
+    if (y >= height_ || x >= width_) return NULL;
+    return &rgba_[4 * (y * width_ + x)];
+  }
+
+  // Interlaced images come in four passes: every 8th row starting at 0,
+  // every 8th starting at 4, every 4th starting at 2, every 2nd from 1.
+  static int NextRow(int y, int height, bool interlaced, int *pass) {
+    if (!interlaced) return y + 1;
+    static const int kStart[] = { 0, 4, 2, 1 };
+    static const int kStep[] = { 8, 8, 4, 2 };
+    y += kStep[*pass];
+    while (y >= height && *pass < 3) {
+      y = kStart[++*pass];
+    }
+    return y;
+  }
+
+  uint8_t global_palette_[256 * 3];
+  int global_colors_;
+  long first_block_;
+
+  // The previous image and how to dispose it.
+  int disposal_;
+  int frame_x_, frame_y_, frame_width_, frame_height_;
+  std::vector<uint8_t> previous_;
+};
+
+// Weights of the source pixels, scaled to sum up to 1 << 16, that make up
+// each destination pixel when scaling "src" pixels to "dst" pixels.
+struct AxisWeights {
+  std::vector<int> first;       // First source pixel for each destination.
+  std::vector<int> count;       // Number of source pixels.
+  std::vector<int> offset;      // Offset of its weights in "weights".
+  std::vector<uint32_t> weights;
+};
+
+static void ComputeWeights(int src, int dst, AxisWeights *result) {
+  // Positions are in units of 1/dst source pixels, so that everything is
+  // an exact integer: destination pixel d covers [d * src, (d+1) * src).
+  for (int d = 0; d < dst; ++d) {
+    const int64_t begin = (int64_t)d * src;
+    const int64_t end = begin + src;
+    const int first = begin / dst;
+    const int last = (end + dst - 1) / dst;   // Exclusive.
+    result->first.push_back(first);
+    result->count.push_back(last - first);
+    result->offset.push_back(result->weights.size());
+    uint32_t total = 0;
+    for (int i = first; i < last; ++i) {
+      const int64_t overlap = std::min(end, (int64_t)(i + 1) * dst)
+        - std::max(begin, (int64_t)i * dst);
+      const uint32_t weight = (overlap << 16) / src;
+      result->weights.push_back(weight);
+      total += weight;
+    }
+    result->weights.back() += (1 << 16) - total;  // Rounding leftovers.
+  }
+}
+}  // anonymous namespace
+
+ImageDecoder *ImageDecoder::Open(const char *filename) {
+  FILE *f = fopen(filename, "rb");
+  if (f == NULL) return NULL;
+  ImageDecoder *result = NULL;
+  const int first = getc(f);
+  rewind(f);
+  switch (first) {
+  case 'P': result = PnmDecoder::Create(f); break;
+  case 'q': result = QoiDecoder::Create(f); break;
+  case 'G': result = GifDecoder::Create(f); break;
+  }
+  if (result == NULL) fclose(f);
+  return result;
+}
+
+ImageDecoder::ImageDecoder(FILE *file, int width, int height)
+  : file_(file), width_(width), height_(height),
+    rgba_(4 * width * height, 0) {
+}
+
+ImageDecoder::~ImageDecoder() {
+  fclose(file_);
+}
+
+void ScaleRGBA(const uint8_t *src, int src_width, int src_height,
+               uint8_t *dst, int dst_width, int dst_height) {
+  AxisWeights horizontal, vertical;
+  ComputeWeights(src_width, dst_width, &horizontal);
+  ComputeWeights(src_height, dst_height, &vertical);
+
+  // First horizontally, into values with 8 more bits of precision.
+  std::vector<uint16_t> rows(4 * dst_width * src_height);
+  for (int y = 0; y < src_height; ++y) {
+    const uint8_t *const src_row = src + 4 * y * src_width;
+    uint16_t *out = &rows[4 * y * dst_width];
+    for (int x = 0; x < dst_width; ++x, out += 4) {
+      const uint8_t *in = src_row + 4 * horizontal.first[x];
+      const uint32_t *weight = &horizontal.weights[horizontal.offset[x]];
+      uint32_t sum[4] = { 0, 0, 0, 0 };
+      for (int i = horizontal.count[x]; i > 0; --i, in += 4, ++weight) {
+        for (int c = 0; c < 4; ++c) sum[c] += in[c] * *weight;
+      }
+      for (int c = 0; c < 4; ++c) out[c] = (sum[c] + 0x80) >> 8;
+    }
+  }
+
+  // Then vertically.
+  std::vector<uint32_t> sum(4 * dst_width);
+  for (int y = 0; y < dst_height; ++y) {
+    std::fill(sum.begin(), sum.end(), 0);
+    const uint32_t *weight = &vertical.weights[vertical.offset[y]];
+    for (int i = 0; i < vertical.count[y]; ++i, ++weight) {
+      const uint16_t *in = &rows[4 * (vertical.first[y] + i) * dst_width];
+      for (int x = 0; x < 4 * dst_width; ++x) sum[x] += in[x] * *weight;
+    }
+    uint8_t *out = dst + 4 * y * dst_width;
+    for (int x = 0; x < 4 * dst_width; ++x) {
+      out[x] = (sum[x] + (1 << 23)) >> 24;
+    }
+  }
+}
+
+}  // namespace rgb_matrix
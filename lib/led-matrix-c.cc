@@ -275,6 +275,16 @@ void set_image(struct LedCanvas *c, int canvas_offset_x, int canvas_offset_y,
            is_bgr);
 }
 
+int set_image_view(struct LedCanvas *c, int canvas_offset_x,
+                   int canvas_offset_y,
+                   int image_width, int image_height,
+                   enum LedPixelFormat format,
+                   const uint8_t *const planes[3], const int strides[3]) {
+  const rgb_matrix::ImageView view((rgb_matrix::PixelFormat)format,
+                                   planes, strides, image_width, image_height);
+  return SetImage(to_canvas(c), canvas_offset_x, canvas_offset_y, view);
+}
+
 // Draw text, a standard NUL terminated C-string encoded in UTF-8,
 // with given "font" at "x","y" with "color".
 // "color" always needs to be set (hence it is a reference),
@@ -756,6 +756,25 @@ void RGBMatrix::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   impl_->active_->Fill(red, green, blue);
 }
 
+void RGBMatrix::FillRect(int x, int y, int width, int height,
+                         uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->FillRect(x, y, width, height, red, green, blue);
+}
+
+void RGBMatrix::HLine(int x, int y, int width,
+                      uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->HLine(x, y, width, red, green, blue);
+}
+
+void RGBMatrix::VLine(int x, int y, int height,
+                      uint8_t red, uint8_t green, uint8_t blue) {
+  impl_->active_->VLine(x, y, height, red, green, blue);
+}
+
+void RGBMatrix::SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+  impl_->active_->SetPixelsSpan(x, y, count, rgb);
+}
+
 // FrameCanvas implementation of Canvas
 FrameCanvas::~FrameCanvas() { delete frame_; }
 int FrameCanvas::width() const { return frame_->width(); }
@@ -772,6 +791,21 @@ void FrameCanvas::Clear() { return frame_->Clear(); }
 void FrameCanvas::Fill(uint8_t red, uint8_t green, uint8_t blue) {
   frame_->Fill(red, green, blue);
 }
+void FrameCanvas::FillRect(int x, int y, int width, int height,
+                           uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, height, red, green, blue);
+}
+void FrameCanvas::HLine(int x, int y, int width,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, width, 1, red, green, blue);
+}
+void FrameCanvas::VLine(int x, int y, int height,
+                        uint8_t red, uint8_t green, uint8_t blue) {
+  frame_->FillRect(x, y, 1, height, red, green, blue);
+}
+void FrameCanvas::SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+  frame_->SetPixelsSpan(x, y, count, rgb);
+}
 bool FrameCanvas::SetPWMBits(uint8_t value) { return frame_->SetPWMBits(value); }
 uint8_t FrameCanvas::pwmbits() { return frame_->pwmbits(); }
 
@@ -788,6 +822,9 @@ void FrameCanvas::Serialize(const char **data, size_t *len) const {
 bool FrameCanvas::Deserialize(const char *data, size_t len) {
   return frame_->Deserialize(data, len);
 }
+bool FrameCanvas::DeserializeZeroCopy(const char *data, size_t len) {
+  return frame_->DeserializeZeroCopy(data, len);
+}
 void FrameCanvas::CopyFrom(const FrameCanvas &other) {
   frame_->CopyFrom(other.frame_);
 }
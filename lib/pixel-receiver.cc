@@ -0,0 +1,335 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "pixel-receiver.h"
+#include "canvas.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+namespace rgb_matrix {
+namespace {
+// Largest packet we accept. DDP carries up to 1440 bytes of data,
+// E1.31 and Art-Net up to 512 channels.
+static const size_t kMaxPacketSize = 2048;
+
+// Number of packets read with one system call.
+static const int kPacketBatch = 32;
+
+static const int kDDPPort = 4048;
+static const int kE131Port = 5568;
+static const int kArtNetPort = 6454;
+
+static const uint8_t kDDPVersionMask = 0xc0;
+static const uint8_t kDDPVersion1 = 0x40;
+static const uint8_t kDDPTimecode = 0x10;
+static const uint8_t kDDPQuery = 0x02;
+static const uint8_t kDDPPush = 0x01;
+static const uint8_t kDDPFirstControlId = 246;  // Config, status etc.
+static const uint8_t kDDPAllDevices = 255;
+
+static const uint32_t kE131RootData = 0x04;
+static const uint32_t kE131RootExtended = 0x08;
+static const uint32_t kE131FramingData = 0x02;
+static const uint32_t kE131FramingSync = 0x01;
+static const uint8_t kE131OptionPreview = 0x80;
+static const uint8_t kE131OptionTerminated = 0x40;
+static const size_t kE131DataOffset = 126;
+static const size_t kE131SyncPacketSize = 49;
+
+static const uint16_t kArtNetOpDmx = 0x5000;
+static const uint16_t kArtNetOpSync = 0x5200;
+static const size_t kArtNetDataOffset = 18;
+// Without ArtSync for this long, frames are shown as soon as they are
+// complete again, as the Art-Net specification asks for.
+static const uint64_t kArtNetSyncTimeoutUs = 4000000;
+
+static uint64_t GetMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static uint16_t ReadBE16(const uint8_t *p) { return (p[0] << 8) | p[1]; }
+static uint32_t ReadBE32(const uint8_t *p) {
+  return ((uint32_t)p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+}  // namespace
+
+PixelReceiver::Options::Options()
+  : protocol(DDP), port(0), first_universe(-1), channels_per_universe(510) {}
+
+PixelReceiver *PixelReceiver::Create(const Options &options,
+                                     int width, int height) {
+  if (width <= 0 || height <= 0 || options.channels_per_universe <= 0
+      || options.channels_per_universe > 512) {
+    return NULL;
+  }
+  Options opts = options;
+  if (opts.first_universe < 0) {
+    opts.first_universe = (opts.protocol == E131) ? 1 : 0;
+  }
+  if (opts.port <= 0) {
+    switch (opts.protocol) {
+    case DDP:    opts.port = kDDPPort; break;
+    case E131:   opts.port = kE131Port; break;
+    case ARTNET: opts.port = kArtNetPort; break;
+    }
+  }
+
+  const int fd = socket(AF_INET, SOCK_DGRAM, 0);
+  if (fd < 0) return NULL;
+  int on = 1;
+  setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  // Senders push a whole frame at once; don't drop the tail of it while
+  // we're busy with the beginning.
+  int buffer_size = 1 << 20;
+  setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer_size, sizeof(buffer_size));
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_addr.s_addr = htonl(INADDR_ANY);
+  addr.sin_port = htons(opts.port);
+  if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+    close(fd);
+    return NULL;
+  }
+
+  PixelReceiver *result = new PixelReceiver(opts, fd, width, height);
+  if (opts.protocol == E131) {
+    // Each universe has its own multicast group. The number of groups a
+    // socket can join is limited by the system; senders can still send
+    // unicast.
+    for (int i = 0; i < result->universe_count_; ++i) {
+      const int universe = opts.first_universe + i;
+      struct ip_mreq mreq;
+      memset(&mreq, 0, sizeof(mreq));
+      mreq.imr_multiaddr.s_addr = htonl(0xefff0000 | (universe & 0xffff));
+      mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+      if (setsockopt(fd, IPPROTO_IP, IP_ADD_MEMBERSHIP,
+                     &mreq, sizeof(mreq)) < 0) {
+        break;
+      }
+    }
+  }
+  return result;
+}
+
+PixelReceiver::PixelReceiver(const Options &options, int fd,
+                             int width, int height)
+  : options_(options), fd_(fd), width_(width), height_(height),
+    frame_bytes_(3 * width * height),
+    universe_count_((frame_bytes_ + options.channels_per_universe - 1)
+                    / options.channels_per_universe),
+    frame_(new uint8_t[frame_bytes_]),
+    packet_buffers_(new uint8_t[kPacketBatch * kMaxPacketSize]),
+    packets_(new struct mmsghdr[kPacketBatch]),
+    packet_iovs_(new struct iovec[kPacketBatch]),
+    packets_read_(0), next_packet_(0),
+    universe_received_(universe_count_, false), universes_received_(0),
+    frame_started_(false), synchronized_(false), sync_universe_(0),
+    last_sync_us_(0), packets_received_(0), packets_ignored_(0) {
+  memset(frame_, 0, frame_bytes_);
+  memset(packets_, 0, kPacketBatch * sizeof(*packets_));
+  for (int i = 0; i < kPacketBatch; ++i) {
+    packet_iovs_[i].iov_base = packet_buffers_ + i * kMaxPacketSize;
+    packet_iovs_[i].iov_len = kMaxPacketSize;
+    packets_[i].msg_hdr.msg_iov = &packet_iovs_[i];
+    packets_[i].msg_hdr.msg_iovlen = 1;
+  }
+}
+
+PixelReceiver::~PixelReceiver() {
+  close(fd_);
+  delete [] packet_iovs_;
+  delete [] packets_;
+  delete [] packet_buffers_;
+  delete [] frame_;
+}
+
+bool PixelReceiver::ReceiveFrame(Canvas *canvas, int timeout_ms) {
+  for (;;) {
+    while (next_packet_ < packets_read_) {
+      const int i = next_packet_++;
+      const struct mmsghdr &packet = packets_[i];
+      if (packet.msg_hdr.msg_flags & MSG_TRUNC) {
+        ++packets_ignored_;
+        continue;
+      }
+      switch (HandlePacket(canvas, packet_buffers_ + i * kMaxPacketSize,
+                           packet.msg_len)) {
+      case PACKET_DATA:
+        break;
+      case PACKET_IGNORED:
+        ++packets_ignored_;
+        break;
+      case PACKET_STARTS_FRAME:
+        --next_packet_;  // Handle again for the next frame.
+        StartNewFrame();
+        return true;
+      case PACKET_ENDS_FRAME:
+        StartNewFrame();
+        return true;
+      }
+    }
+
+    struct pollfd p = { fd_, POLLIN, 0 };
+    const int ready = poll(&p, 1, timeout_ms);
+    if (ready < 0 && errno == EINTR)
+      continue;
+    if (ready <= 0)
+      return false;
+    const int count = recvmmsg(fd_, packets_, kPacketBatch, MSG_DONTWAIT,
+                               NULL);
+    if (count < 0) {
+      if (errno == EINTR || errno == EAGAIN) continue;
+      return false;
+    }
+    packets_received_ += count;
+    packets_read_ = count;
+    next_packet_ = 0;
+  }
+}
+
+void PixelReceiver::StartNewFrame() {
+  std::fill(universe_received_.begin(), universe_received_.end(), false);
+  universes_received_ = 0;
+  frame_started_ = false;
+}
+
+PixelReceiver::PacketResult PixelReceiver::HandlePacket(Canvas *canvas,
+                                                        const uint8_t *data,
+                                                        size_t len) {
+  switch (options_.protocol) {
+  case DDP:    return HandleDDP(canvas, data, len);
+  case E131:   return HandleE131(canvas, data, len);
+  case ARTNET: return HandleArtNet(canvas, data, len);
+  }
+  return PACKET_IGNORED;
+}
+
+PixelReceiver::PacketResult PixelReceiver::HandleDDP(Canvas *canvas,
+                                                     const uint8_t *data,
+                                                     size_t len) {
+  if (len < 10) return PACKET_IGNORED;
+  const uint8_t flags = data[0];
+  if ((flags & kDDPVersionMask) != kDDPVersion1 || (flags & kDDPQuery))
+    return PACKET_IGNORED;
+  const uint8_t id = data[3];
+  if (id >= kDDPFirstControlId && id != kDDPAllDevices)
+    return PACKET_IGNORED;
+  const size_t header_size = (flags & kDDPTimecode) ? 14 : 10;
+  if (len < header_size) return PACKET_IGNORED;
+  const size_t length = std::min<size_t>(ReadBE16(data + 8),
+                                         len - header_size);
+  WriteChannels(canvas, ReadBE32(data + 4), data + header_size, length);
+  frame_started_ = true;
+  return (flags & kDDPPush) ? PACKET_ENDS_FRAME : PACKET_DATA;
+}
+
+PixelReceiver::PacketResult PixelReceiver::HandleE131(Canvas *canvas,
+                                                      const uint8_t *data,
+                                                      size_t len) {
+  static const char kAcnId[12] = {
+    'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+  if (len < kE131SyncPacketSize || ReadBE16(data) != 0x0010
+      || memcmp(data + 4, kAcnId, sizeof(kAcnId)) != 0) {
+    return PACKET_IGNORED;
+  }
+  const uint32_t root_vector = ReadBE32(data + 18);
+  const uint32_t framing_vector = ReadBE32(data + 40);
+  if (root_vector == kE131RootExtended && framing_vector == kE131FramingSync) {
+    if (!synchronized_ || ReadBE16(data + 45) != sync_universe_)
+      return PACKET_IGNORED;
+    return EndFrameOnSync();
+  }
+  if (root_vector != kE131RootData || framing_vector != kE131FramingData
+      || len < kE131DataOffset)
+    return PACKET_IGNORED;
+  if (data[112] & (kE131OptionPreview | kE131OptionTerminated))
+    return PACKET_IGNORED;
+  if (data[125] != 0)  // Only DMX data, no other start codes.
+    return PACKET_IGNORED;
+  sync_universe_ = ReadBE16(data + 109);
+  synchronized_ = (sync_universe_ != 0);
+  const size_t value_count = ReadBE16(data + 123);
+  if (value_count < 1) return PACKET_IGNORED;
+  const size_t channels = std::min(value_count - 1, len - kE131DataOffset);
+  return HandleUniverse(canvas, ReadBE16(data + 113),
+                        data + kE131DataOffset, channels);
+}
+
+PixelReceiver::PacketResult PixelReceiver::HandleArtNet(Canvas *canvas,
+                                                        const uint8_t *data,
+                                                        size_t len) {
+  if (len < 10 || memcmp(data, "Art-Net", 8) != 0)
+    return PACKET_IGNORED;
+  const uint16_t opcode = data[8] | (data[9] << 8);
+  if (opcode == kArtNetOpSync) {
+    // Once the sender uses ArtSync, frames end with it.
+    synchronized_ = true;
+    last_sync_us_ = GetMicros();
+    return EndFrameOnSync();
+  }
+  if (opcode != kArtNetOpDmx || len < kArtNetDataOffset)
+    return PACKET_IGNORED;
+  if (synchronized_ && GetMicros() - last_sync_us_ > kArtNetSyncTimeoutUs)
+    synchronized_ = false;  // The sender stopped sending ArtSync.
+  const int universe = data[14] | ((data[15] & 0x7f) << 8);
+  const size_t channels = std::min<size_t>(ReadBE16(data + 16),
+                                           len - kArtNetDataOffset);
+  return HandleUniverse(canvas, universe, data + kArtNetDataOffset, channels);
+}
+
+PixelReceiver::PacketResult PixelReceiver::HandleUniverse(Canvas *canvas,
+                                                          int universe,
+                                                          const uint8_t *data,
+                                                          size_t len) {
+  const int index = universe - options_.first_universe;
+  if (index < 0 || index >= universe_count_)
+    return PACKET_IGNORED;
+  // Seeing a universe again means we missed the end of the frame, or the
+  // sender doesn't fill the whole display.
+  if (universe_received_[index])
+    return PACKET_STARTS_FRAME;
+  const size_t channels = options_.channels_per_universe;
+  WriteChannels(canvas, index * channels, data, std::min(len, channels));
+  universe_received_[index] = true;
+  ++universes_received_;
+  frame_started_ = true;
+  if (!synchronized_ && universes_received_ == universe_count_)
+    return PACKET_ENDS_FRAME;
+  return PACKET_DATA;
+}
+
+PixelReceiver::PacketResult PixelReceiver::EndFrameOnSync() {
+  return frame_started_ ? PACKET_ENDS_FRAME : PACKET_IGNORED;
+}
+
+void PixelReceiver::WriteChannels(Canvas *canvas, size_t offset,
+                                  const uint8_t *data, size_t len) {
+  if (offset >= frame_bytes_) return;
+  len = std::min(len, frame_bytes_ - offset);
+  memcpy(frame_ + offset, data, len);
+
+  // Update all pixels touched, including the ones only partially in this
+  // packet; the rest of them is already in frame_.
+  const int end_pixel = (offset + len + 2) / 3;
+  for (int pixel = offset / 3; pixel < end_pixel; /**/) {
+    const int x = pixel % width_;
+    const int count = std::min(end_pixel - pixel, width_ - x);
+    canvas->SetPixelsSpan(x, pixel / width_, count, frame_ + 3 * pixel);
+    pixel += count;
+  }
+}
+
+}  // namespace rgb_matrix
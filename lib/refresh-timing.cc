@@ -0,0 +1,183 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+
+#include "refresh-timing.h"
+
+#include <strings.h>
+
+#include <algorithm>
+
+#include "framebuffer-internal.h"
+#include "hardware-mapping.h"
+#include "multiplex-mappers-internal.h"
+
+#define GPIO_BIT(b) ((uint64_t)1<<(b))
+
+#ifdef ONLY_SINGLE_SUB_PANEL
+#  define SUB_PANELS_ 1
+#else
+#  define SUB_PANELS_ 2
+#endif
+
+namespace rgb_matrix {
+namespace {
+struct PiTiming {
+  double write_ns;           // One write to the GPIO registers.
+  double pulse_overhead_ns;  // Starting and waiting for an OE pulse.
+};
+
+// Pi 1 (and Zero), 2, 3 and 4. Ballpark figures; the writes include the
+// loop around them and the slowdown repeats them.
+static const PiTiming kPiTimings[] = {
+  { 45, 2000 },
+  { 25, 1000 },
+  { 15, 1000 },
+  {  8,  500 },
+};
+
+// As in the refresh thread: the first bitplane shown in each of four
+// successive refreshes, for 0, 1 and 2 dither bits.
+static const int kDitherStartBits[3][4] = {
+  { 0, 0, 0, 0 },
+  { 0, 1, 0, 1 },
+  { 0, 1, 2, 2 },
+};
+
+static const HardwareMapping *FindHardwareMapping(const char *name) {
+  if (name == NULL || *name == '\0') name = "regular";
+  for (HardwareMapping *it = matrix_hardware_mappings; it->name; ++it) {
+    if (strcasecmp(it->name, name) == 0) return it;
+  }
+  return matrix_hardware_mappings;  // The refresh fails anyway; just guess.
+}
+
+// GPIO writes for the RowAddressSetter of the given type, when the row
+// changes and on every bitplane.
+static void RowAddressWrites(int row_address_type, int double_rows,
+                             int *on_row_change, int *on_every_plane) {
+  *on_row_change = 0;
+  *on_every_plane = 0;
+  switch (row_address_type) {
+  case 1:  // Shift register: clock, data and clock again for each row.
+    *on_row_change = 3 * double_rows + 2;
+    break;
+  case 3:  // ABC shift register: the same, but it doesn't remember the row.
+    *on_every_plane = 3 * double_rows + 2;
+    break;
+  case 4:  // SM5266: eight bits shifted in.
+    *on_row_change = 1 + 8 * 4 + 1 + 2;
+    break;
+  default:  // Direct and ABCD: one masked write.
+    *on_row_change = 2;
+    break;
+  }
+}
+}  // anonymous namespace
+
+// Worked out by hand for "make -C utils check": three 64x32 panels on a
+// Pi 3 with the hardware pulser, --led-slowdown-gpio=2, 11 bits, 130ns.
+//   write 3 * 15ns = 45ns; clocking in (3 * 192 + 1) * 45ns = 25965ns.
+//   pulses 130ns << b plus 1000ns: bitplane 0..7 are shorter than clocking
+//   in, so per row the waits are 134120ns (for bitplane 10 of the row
+//   before), 8 * 25965ns, 34280ns, 67560ns = 443680ns, plus 11 latches and
+//   one row change of 2 writes: 444760ns. 16 rows: 7116us per refresh.
+RefreshTiming EstimateRefreshTiming(const RGBMatrix::Options &options,
+                                    int gpio_slowdown, int pi_model) {
+  const int kBitPlanes = internal::Framebuffer::kBitPlanes;
+
+  int cols = options.cols;
+  int rows = options.rows;
+  if (options.multiplexing > 0) {
+    const internal::MuxMapperList &multiplexers
+      = internal::GetRegisteredMultiplexMappers();
+    if (options.multiplexing <= (int) multiplexers.size()) {
+      multiplexers[options.multiplexing - 1]->EditColsRows(&cols, &rows);
+    }
+  }
+  const int columns = cols * options.chain_length;
+  const int double_rows = rows / SUB_PANELS_;
+  const int pwm_bits = std::max(1, std::min(kBitPlanes, options.pwm_bits));
+  const int dither_bits = std::max(0, std::min(2, options.pwm_dither_bits));
+
+  const PiTiming &pi = kPiTimings[std::max(1, std::min(4, pi_model)) - 1];
+  const double write_ns = pi.write_ns * (1 + std::max(0, gpio_slowdown));
+
+  // Same condition as PinPulser::Create()
+  const HardwareMapping *h = FindHardwareMapping(options.hardware_mapping);
+  bool hardware_pulse = !options.disable_hardware_pulsing
+    && (h->output_enable == GPIO_BIT(18) || h->output_enable == GPIO_BIT(12));
+#ifdef DISABLE_HARDWARE_PULSES
+  hardware_pulse = false;
+#endif
+
+  double pulse_ns[kBitPlanes];
+  double timing_ns = options.pwm_lsb_nanoseconds;
+  for (int b = 0; b < kBitPlanes; ++b) {
+    pulse_ns[b] = timing_ns;
+    if (b >= dither_bits) timing_ns *= 2;
+  }
+
+  int row_change_writes, plane_writes;
+  RowAddressWrites(options.row_address_type, double_rows,
+                   &row_change_writes, &plane_writes);
+  // Each column: color bits and clock low, then clock high. The clock is
+  // taken low once more at the end. Then the row address and the strobe.
+  const double clock_in_ns = (3.0 * columns + 1) * write_ns;
+  const double latch_ns = (plane_writes + 2) * write_ns;
+
+  double total_ns = 0, dark_ns = 0, lit_ns = 0;
+  for (int frame = 0; frame < 4; ++frame) {
+    const int start_bit = std::max(kDitherStartBits[dither_bits][frame],
+                                   kBitPlanes - pwm_bits);
+    // The last pulse of the previous refresh.
+    double previous_pulse_ns = pulse_ns[kBitPlanes - 1] + pi.pulse_overhead_ns;
+    for (int row = 0; row < double_rows; ++row) {
+      for (int b = start_bit; b < kBitPlanes; ++b) {
+        double dark = latch_ns;
+        if (b == start_bit) dark += row_change_writes * write_ns;
+        const double pulse = pulse_ns[b] + pi.pulse_overhead_ns;
+        if (hardware_pulse) {
+          // Clocked in while the previous bitplane is still lit; only what
+          // takes longer than that pulse is dark.
+          total_ns += dark + std::max(clock_in_ns, previous_pulse_ns);
+          dark += std::max(0.0, clock_in_ns - previous_pulse_ns);
+        } else {
+          dark += clock_in_ns;
+          total_ns += dark + pulse;
+        }
+        dark_ns += dark;
+        lit_ns += pulse_ns[b];
+        previous_pulse_ns = pulse;
+      }
+    }
+  }
+
+  RefreshTiming result;
+  result.frame_us = total_ns / 4 / 1000;
+  result.clock_in_us = dark_ns / 4 / 1000;
+  if (options.limit_refresh_rate_hz > 0) {
+    result.frame_us = std::max(result.frame_us,
+                               1e6 / options.limit_refresh_rate_hz);
+  }
+  result.refresh_hz = 1e6 / result.frame_us;
+  result.lit_fraction = lit_ns / 4 / 1000 / result.frame_us;
+  return result;
+}
+
+bool TuneForRefreshRate(RGBMatrix::Options *options,
+                        int gpio_slowdown, int pi_model, double target_hz) {
+  for (int bits = internal::Framebuffer::kBitPlanes; bits >= 1; --bits) {
+    for (int dither = 0; dither <= 2; ++dither) {
+      RGBMatrix::Options candidate = *options;
+      candidate.pwm_bits = bits;
+      candidate.pwm_dither_bits = dither;
+      if (EstimateRefreshTiming(candidate, gpio_slowdown, pi_model).refresh_hz
+          >= target_hz) {
+        *options = candidate;
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+}  // namespace rgb_matrix
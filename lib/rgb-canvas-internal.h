@@ -0,0 +1,62 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+// Copyright (C) 2013 Henner Zeller <h.zeller@acm.org>
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+#ifndef RPI_RGBMATRIX_RGB_CANVAS_INTERNAL_H
+#define RPI_RGBMATRIX_RGB_CANVAS_INTERNAL_H
+
+#include <stdint.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "../include/canvas.h"
+
+namespace rgb_matrix {
+namespace internal {
+// A canvas that draws into a plain buffer of width * height RGB pixels,
+// e.g. to collect images for a stream or to fill shared memory frames.
+class RGBBufferCanvas : public Canvas {
+public:
+  RGBBufferCanvas(int width, int height, char *rgb)
+    : width_(width), height_(height), rgb_((uint8_t*)rgb) {}
+
+  // Draw into a different buffer of the same size from now on.
+  void set_buffer(char *rgb) { rgb_ = (uint8_t*)rgb; }
+
+  virtual int width() const { return width_; }
+  virtual int height() const { return height_; }
+  virtual void SetPixel(int x, int y, uint8_t r, uint8_t g, uint8_t b) {
+    const uint8_t color[3] = { r, g, b };
+    SetPixelsSpan(x, y, 1, color);
+  }
+  virtual void Clear() { memset(rgb_, 0, width_ * height_ * 3); }
+  virtual void Fill(uint8_t r, uint8_t g, uint8_t b) {
+    for (int y = 0; y < height_; ++y) FillRect(0, y, width_, 1, r, g, b);
+  }
+  virtual void SetPixelsSpan(int x, int y, int count, const uint8_t *rgb) {
+    if (y < 0 || y >= height_) return;
+    if (x < 0) { rgb += 3 * -x; count += x; x = 0; }
+    count = std::min(count, width_ - x);
+    if (count <= 0) return;
+    memcpy(rgb_ + 3 * (y * width_ + x), rgb, 3 * count);
+  }
+
+private:
+  const int width_;
+  const int height_;
+  uint8_t *rgb_;
+};
+}  // namespace internal
+}  // namespace rgb_matrix
+#endif  // RPI_RGBMATRIX_RGB_CANVAS_INTERNAL_H
@@ -0,0 +1,57 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Compile BDF fonts into the binary format that Font::LoadFont() picks up
+// automatically if it is next to the BDF file.
+
+#include "graphics.h"
+
+#include <getopt.h>
+#include <stdio.h>
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <bdf-font> [<bdf-font>...]\n",
+          progname);
+  fprintf(stderr, "Compiles BDF fonts for fast loading. By default, the "
+          "compiled font is written next to the\nBDF file as "
+          "<bdf-font>.compiled, where it is used by all programs loading "
+          "that font.\n"
+          "Options:\n"
+          "\t-o <file> : Output file. Only with a single input font.\n");
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  const char *output = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:")) != -1) {
+    switch (opt) {
+    case 'o': output = optarg; break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc || (output && argc - optind != 1))
+    return usage(argv[0]);
+
+  int errors = 0;
+  for (int i = optind; i < argc; ++i) {
+    if (!rgb_matrix::Font::CompileFont(argv[i], output)) {
+      fprintf(stderr, "Couldn't compile font '%s'\n", argv[i]);
+      ++errors;
+    }
+  }
+  return errors == 0 ? 0 : 1;
+}
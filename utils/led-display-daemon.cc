@@ -0,0 +1,91 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Keeps the matrix running and shows frames that client programs send
+// through a DisplayClient. See display-daemon.h
+
+#include "led-matrix.h"
+#include "display-daemon.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+using rgb_matrix::DisplayServer;
+using rgb_matrix::RGBMatrix;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Shows frames submitted by client programs on the matrix.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-S <socket>        : Unix socket clients connect to (Default: %s).\n",
+          rgb_matrix::kDefaultDisplaySocket);
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  const char *socket_path = rgb_matrix::kDefaultDisplaySocket;
+  int opt;
+  while ((opt = getopt(argc, argv, "S:")) != -1) {
+    switch (opt) {
+    case 'S':
+      socket_path = optarg;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  // Created after the matrix dropped privileges, so that we can remove the
+  // socket again when done.
+  DisplayServer *server = DisplayServer::Create(matrix, socket_path);
+  if (server == NULL) {
+    perror("Creating socket");
+    delete matrix;
+    return 1;
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  fprintf(stderr, "Listening on %s; CTRL-C for exit.\n", socket_path);
+  server->Run(&interrupt_received);
+
+  delete server;
+  matrix->Clear();
+  delete matrix;
+  return 0;
+}
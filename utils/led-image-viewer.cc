@@ -13,7 +13,8 @@
 // You should have received a copy of the GNU General Public License
 // along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
 
-// To use this image viewer, first get image-magick development files
+// PPM/PGM, QOI and GIF images are read without any dependencies. For all
+// other formats, first get image-magick development files
 // $ sudo apt-get install libgraphicsmagick++-dev libwebp-dev
 //
 // Then compile with
@@ -21,10 +22,15 @@
 
 #include "led-matrix.h"
 #include "pixel-mapper.h"
+#include "content-cache.h"
 #include "content-streamer.h"
+#include "image-decoder.h"
+#include "thread.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <math.h>
+#include <pthread.h>
 #include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -35,35 +41,76 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <deque>
 #include <map>
 #include <string>
 #include <vector>
 
+#ifdef HAVE_MAGICK
 #include <Magick++.h>
 #include <magick/image.h>
+#endif
 
 using rgb_matrix::Canvas;
+using rgb_matrix::ContentCache;
 using rgb_matrix::FrameCanvas;
+using rgb_matrix::Mutex;
+using rgb_matrix::MutexLock;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::StreamReader;
 
 typedef int64_t tmillis_t;
 static const tmillis_t distant_future = (1LL<<40); // that is a while.
 
+// Number of frames read ahead while showing animations.
+static const int kReadAheadFrames = 8;
+
+// Default size limit of the cache of animations (-K).
+static const int kDefaultCacheMegabytes = 256;
+
+// Files loaded ahead of the one shown, and the most that are kept loaded;
+// the least recently shown ones are unloaded and loaded again when needed.
+static const size_t kLoadAheadFiles = 8;
+static const size_t kMaxLoadedFiles = 16;
+
 struct ImageParams {
   ImageParams() : anim_duration_ms(distant_future), wait_ms(1500),
-                  anim_delay_ms(-1), loops(-1), vsync_multiple(1) {}
+                  anim_delay_ms(-1), anim_begin_ms(0),
+                  anim_end_ms(distant_future), loops(-1), vsync_multiple(1) {}
   tmillis_t anim_duration_ms;  // If this is an animation, duration to show.
   tmillis_t wait_ms;           // Regular image: duration to show.
   tmillis_t anim_delay_ms;     // Animation delay override.
+  tmillis_t anim_begin_ms;     // Animation: play range within the animation.
+  tmillis_t anim_end_ms;
   int loops;
   int vsync_multiple;
 };
 
 struct FileInfo {
+  enum LoadState { UNLOADED, QUEUED, LOADING, LOADED, FAILED };
+
+  FileInfo() : filename(NULL), is_multi_frame(false), content_stream(NULL),
+               state(UNLOADED), pins(0), last_used(0) {}
+  const char *filename;
   ImageParams params;      // Each file might have specific timing settings
   bool is_multi_frame;
   rgb_matrix::StreamIO *content_stream;
+
+  // Managed by the FileLoader.
+  LoadState state;
+  int pins;                // Shown or queued to be shown: keep loaded.
+  uint64_t last_used;
+};
+
+// Everything that determines how files are loaded.
+struct LoadSettings {
+  int width;
+  int height;
+  bool do_center;
+  bool fill_width;
+  bool fill_height;
+  ContentCache *cache;          // Animations are cached here if not NULL.
+  std::string cache_variant;
 };
 
 volatile bool interrupt_received = false;
@@ -85,25 +132,40 @@ static void SleepMillis(tmillis_t milli_seconds) {
   nanosleep(&ts, NULL);
 }
 
-static void StoreInStream(const Magick::Image &img, int delay_time_us,
-                          bool do_center,
+// Place the RGBA image "rgba" of "columns" x "rows" into "rgb", of size
+// "width" x "height". Fully transparent pixels are left black.
+static void PlaceImage(const uint8_t *rgba, int columns, int rows,
+                       bool do_center, int width, int height,
+                       std::vector<uint8_t> *rgb) {
+  rgb->assign(width * height * 3, 0);
+  const int x_offset = do_center ? (width - columns) / 2 : 0;
+  const int y_offset = do_center ? (height - rows) / 2 : 0;
+  for (int y = 0; y < rows; ++y) {
+    const int py = y + y_offset;
+    if (py < 0 || py >= height) continue;
+    const uint8_t *src = &rgba[4 * y * columns];
+    for (int x = 0; x < columns; ++x, src += 4) {
+      const int px = x + x_offset;
+      if (px < 0 || px >= width || src[3] == 0) continue;
+      uint8_t *pixel = &(*rgb)[3 * (py * width + px)];
+      pixel[0] = src[0];
+      pixel[1] = src[1];
+      pixel[2] = src[2];
+    }
+  }
+}
+
+// Store either the RGB image (portable streams) or its matrix representation.
+static void StoreInStream(const rgb_matrix::ImageView &image,
+                          int delay_time_us, bool as_rgb,
                           rgb_matrix::FrameCanvas *scratch,
                           rgb_matrix::StreamWriter *output) {
-  scratch->Clear();
-  const int x_offset = do_center ? (scratch->width() - img.columns()) / 2 : 0;
-  const int y_offset = do_center ? (scratch->height() - img.rows()) / 2 : 0;
-  for (size_t y = 0; y < img.rows(); ++y) {
-    for (size_t x = 0; x < img.columns(); ++x) {
-      const Magick::Color &c = img.pixelColor(x, y);
-      if (c.alphaQuantum() < 255) {
-        scratch->SetPixel(x + x_offset, y + y_offset,
-                          ScaleQuantumToChar(c.redQuantum()),
-                          ScaleQuantumToChar(c.greenQuantum()),
-                          ScaleQuantumToChar(c.blueQuantum()));
-      }
-    }
+  if (as_rgb) {
+    output->Stream(image, delay_time_us);
+  } else {
+    rgb_matrix::SetImage(scratch, 0, 0, image);
+    output->Stream(*scratch, delay_time_us);
   }
-  output->Stream(*scratch, delay_time_us);
 }
 
 static void CopyStream(rgb_matrix::StreamReader *r,
@@ -115,6 +177,81 @@ static void CopyStream(rgb_matrix::StreamReader *r,
   }
 }
 
+// Size of an image of "img_width" x "img_height" scaled to fit into
+// "target_width" x "target_height". With "fill_width" or "fill_height", it
+// fills that side instead, to scroll along the other one.
+static void FitSize(int img_width, int img_height,
+                    int target_width, int target_height,
+                    bool fill_width, bool fill_height,
+                    int *width, int *height) {
+  const float width_fraction = (float)target_width / img_width;
+  const float height_fraction = (float)target_height / img_height;
+  float fraction;
+  if (fill_width && fill_height) {
+    // Scrolling diagonally. Fill as much as we can get in available space.
+    // Largest scale fraction determines that.
+    fraction = std::max(width_fraction, height_fraction);
+  } else if (fill_height) {
+    // Horizontal scrolling: Make things fit in vertical space.
+    fraction = height_fraction;
+  } else if (fill_width) {
+    // dito, vertical. Make things fit in horizontal space.
+    fraction = width_fraction;
+  } else {
+    fraction = std::min(width_fraction, height_fraction);
+  }
+  *width = std::max(1, (int) roundf(fraction * img_width));
+  *height = std::max(1, (int) roundf(fraction * img_height));
+}
+
+// The frames of an image, rendered for the canvas one at a time.
+class ImageFrames {
+public:
+  virtual ~ImageFrames() {}
+
+  // Render the next frame into "rgb". Returns false after the last one.
+  virtual bool Next(std::vector<uint8_t> *rgb, int64_t *delay_us) = 0;
+};
+
+// Formats the library decodes itself.
+class DecodedFrames : public ImageFrames {
+public:
+  DecodedFrames(rgb_matrix::ImageDecoder *decoder,
+                const LoadSettings &settings)
+    : decoder_(decoder), settings_(settings) {
+    FitSize(decoder->width(), decoder->height(),
+            settings.width, settings.height,
+            settings.fill_width, settings.fill_height, &width_, &height_);
+    if (width_ != decoder->width() || height_ != decoder->height())
+      scaled_.resize(4 * width_ * height_);
+  }
+  virtual ~DecodedFrames() { delete decoder_; }
+
+  virtual bool Next(std::vector<uint8_t> *rgb, int64_t *delay_us) {
+    if (!decoder_->NextFrame(delay_us))
+      return false;
+    const uint8_t *frame = decoder_->rgba();
+    if (!scaled_.empty()) {
+      rgb_matrix::ScaleRGBA(frame, decoder_->width(), decoder_->height(),
+                            &scaled_[0], width_, height_);
+      frame = &scaled_[0];
+    }
+    PlaceImage(frame, width_, height_, settings_.do_center,
+               settings_.width, settings_.height, rgb);
+    return true;
+  }
+
+private:
+  rgb_matrix::ImageDecoder *const decoder_;
+  const LoadSettings &settings_;
+  int width_, height_;
+  std::vector<uint8_t> scaled_;
+};
+
+#ifdef HAVE_MAGICK
+static pthread_once_t magick_initialized = PTHREAD_ONCE_INIT;
+static void InitializeMagick() { Magick::InitializeMagick(NULL); }
+
 // Load still image or animation.
 // Scale, so that it fits in "width" and "height" and store in "result".
 static bool LoadImageAndScale(const char *filename,
@@ -122,6 +259,9 @@ static bool LoadImageAndScale(const char *filename,
                               bool fill_width, bool fill_height,
                               std::vector<Magick::Image> *result,
                               std::string *err_msg) {
+  // Only started when needed; it takes a while.
+  pthread_once(&magick_initialized, InitializeMagick);
+
   std::vector<Magick::Image> frames;
   try {
     readImages(&frames, filename);
@@ -142,64 +282,400 @@ static bool LoadImageAndScale(const char *filename,
     result->push_back(frames[0]);   // just a single still image.
   }
 
-  const int img_width = (*result)[0].columns();
-  const int img_height = (*result)[0].rows();
-  const float width_fraction = (float)target_width / img_width;
-  const float height_fraction = (float)target_height / img_height;
-  if (fill_width && fill_height) {
-    // Scrolling diagonally. Fill as much as we can get in available space.
-    // Largest scale fraction determines that.
-    const float larger_fraction = (width_fraction > height_fraction)
-      ? width_fraction
-      : height_fraction;
-    target_width = (int) roundf(larger_fraction * img_width);
-    target_height = (int) roundf(larger_fraction * img_height);
+  int width, height;
+  FitSize((*result)[0].columns(), (*result)[0].rows(),
+          target_width, target_height, fill_width, fill_height,
+          &width, &height);
+  for (size_t i = 0; i < result->size(); ++i) {
+    (*result)[i].scale(Magick::Geometry(width, height));
   }
-  else if (fill_height) {
-    // Horizontal scrolling: Make things fit in vertical space.
-    // While the height constraint stays the same, we can expand to full
-    // width as we scroll along that axis.
-    target_width = (int) roundf(height_fraction * img_width);
+
+  return true;
+}
+
+// Everything else GraphicsMagick can read.
+class MagickFrames : public ImageFrames {
+public:
+  MagickFrames(const std::vector<Magick::Image> &images,
+               const LoadSettings &settings)
+    : images_(images), settings_(settings), next_(0) {}
+
+  // The pixels are exported in one go; going through pixelColor() for each
+  // is a lot slower.
+  virtual bool Next(std::vector<uint8_t> *rgb, int64_t *delay_us) {
+    if (next_ == images_.size())
+      return false;
+    Magick::Image &img = images_[next_++];
+    *delay_us = img.animationDelay() * 10000; // unit in 1/100s
+    const int columns = img.columns();
+    const int rows = img.rows();
+    rgba_.resize(4 * columns * rows);
+    img.write(0, 0, columns, rows, "RGBA", Magick::CharPixel, &rgba_[0]);
+    PlaceImage(&rgba_[0], columns, rows, settings_.do_center,
+               settings_.width, settings_.height, rgb);
+    return true;
   }
-  else if (fill_width) {
-    // dito, vertical. Make things fit in horizontal space.
-    target_height = (int) roundf(width_fraction * img_height);
+
+private:
+  std::vector<Magick::Image> images_;
+  const LoadSettings &settings_;
+  size_t next_;
+  std::vector<uint8_t> rgba_;
+};
+#endif
+
+// Open "filename" as image, preferring our own decoders.
+// Returns NULL if it is not an image we can read.
+static ImageFrames *OpenImage(const char *filename,
+                              const LoadSettings &settings,
+                              std::string *err_msg) {
+  rgb_matrix::ImageDecoder *decoder = rgb_matrix::ImageDecoder::Open(filename);
+  if (decoder)
+    return new DecodedFrames(decoder, settings);
+#ifdef HAVE_MAGICK
+  std::vector<Magick::Image> images;
+  if (LoadImageAndScale(filename, settings.width, settings.height,
+                        settings.fill_width, settings.fill_height,
+                        &images, err_msg)) {
+    return new MagickFrames(images, settings);
   }
+#else
+  *err_msg = "Not a PPM, PGM, QOI or GIF image; "
+    "other formats need GraphicsMagick";
+#endif
+  return NULL;
+}
 
-  for (size_t i = 0; i < result->size(); ++i) {
-    (*result)[i].scale(Magick::Geometry(target_width, target_height));
+// Load "file" into its content stream: a still image or animation, rendered
+// for the canvas, or one of our streams. If "output" is set, the frames are
+// written there instead (as RGB with "output_rgb").
+// Returns false if the file can't be used.
+static bool LoadFile(FileInfo *file, const LoadSettings &settings,
+                     rgb_matrix::FrameCanvas *scratch,
+                     rgb_matrix::StreamWriter *output, bool output_rgb) {
+  const char *filename = file->filename;
+  ContentCache *const cache = settings.cache;
+  std::string err_msg;
+  const std::string cache_key = cache
+    ? cache->Key(filename, settings.cache_variant) : "";
+  const int cached_fd = cache ? cache->Open(cache_key) : -1;
+  if (cached_fd >= 0) {
+    // Only animations are cached.
+    file->is_multi_frame = true;
+    file->content_stream = rgb_matrix::MmapStreamIO::Create(cached_fd);
+    if (!file->content_stream)
+      file->content_stream = new rgb_matrix::FileStreamIO(cached_fd);
+    return true;
+  }
+
+  ImageFrames *frames = OpenImage(filename, settings, &err_msg);
+  std::vector<uint8_t> rgb, next_rgb;
+  int64_t delay_us, next_delay_us;
+  if (frames && frames->Next(&rgb, &delay_us)) {
+    // One frame is rendered ahead, to know if there are more.
+    bool have_next = frames->Next(&next_rgb, &next_delay_us);
+    file->content_stream = new rgb_matrix::MemStreamIO();
+    file->is_multi_frame = have_next;
+    rgb_matrix::StreamWriter out(file->content_stream);
+    std::string cache_pending;
+    const int cache_fd = file->is_multi_frame && cache
+      ? cache->BeginEntry(cache_key, &cache_pending) : -1;
+    bool cache_written = true;
+    rgb_matrix::StreamIO *cache_io = NULL;
+    rgb_matrix::StreamWriter *cache_writer = NULL;
+    if (cache_fd >= 0) {
+      cache_io = new rgb_matrix::FileStreamIO(cache_fd);
+      cache_writer = new rgb_matrix::StreamWriter(cache_io, 3);
+    }
+    for (;;) {
+      int64_t delay_time_us;
+      if (file->is_multi_frame) {
+        delay_time_us = delay_us;
+      } else {
+        delay_time_us = file->params.wait_ms * 1000;  // single image.
+      }
+      if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
+      const rgb_matrix::ImageView image(rgb_matrix::PIXEL_RGB24, &rgb[0],
+                                        settings.width * 3,
+                                        settings.width, settings.height);
+      StoreInStream(image, delay_time_us, output && output_rgb, scratch,
+                    output ? output : &out);
+      if (cache_writer) {
+        cache_written &= cache_writer->Stream(image, delay_time_us);
+      }
+      if (!have_next) break;
+      rgb.swap(next_rgb);
+      delay_us = next_delay_us;
+      have_next = frames->Next(&next_rgb, &next_delay_us);
+    }
+    delete frames;
+    if (cache_writer) {
+      delete cache_writer;
+      delete cache_io;
+      if (cache_written) {
+        cache->CommitEntry(cache_key, cache_pending);
+      } else {
+        cache->AbortEntry(cache_pending);
+      }
+    }
+    return true;
+  }
+  delete frames;
+
+  // Ok, not an image. Let's see if it is one of our streams.
+  int fd = open(filename, O_RDONLY);
+  if (fd < 0) {
+    fprintf(stderr, "%s skipped: Unable to open (%s; %s)\n",
+            filename, err_msg.c_str(), strerror(errno));
+    return false;
+  }
+  // Memory mapped, frames are displayed straight from the file.
+  file->content_stream = rgb_matrix::MmapStreamIO::Create(fd);
+  if (!file->content_stream)
+    file->content_stream = new rgb_matrix::FileStreamIO(fd);
+  StreamReader reader(file->content_stream);
+  if (!reader.GetNext(scratch, NULL)) {  // header+size not ok
+    fprintf(stderr, "%s skipped: Unable to open (%s; Can't read as image or "
+            "compatible stream)\n", filename, err_msg.c_str());
+    scratch->Clear();
+    delete file->content_stream;
+    file->content_stream = NULL;
+    return false;
+  }
+  file->is_multi_frame = reader.GetNext(scratch, NULL);
+  reader.Rewind();
+  if (output && output_rgb) {
+    fprintf(stderr, "%s: streams can't be written to a portable "
+            "stream; skipped.\n", filename);
+  } else if (output) {
+    CopyStream(&reader, output, scratch);
+  }
+  // The scratch canvas might show a frame of the stream in place; let go of
+  // it, as the stream is unloaded at some point.
+  scratch->Clear();
+  return true;
+}
+
+// Loads files on a few threads, in the order they are going to be shown,
+// so that showing can start as soon as the first one is there. Only a
+// limited number of files is kept loaded.
+class FileLoader {
+public:
+  FileLoader(RGBMatrix *matrix, const LoadSettings &settings, int threads);
+  ~FileLoader();
+
+  // Load the "count" files starting at "pos" in "files", wrapping around.
+  // Replaces what was requested before and is not being loaded yet.
+  void Prefetch(const std::vector<FileInfo*> &files, size_t pos,
+                size_t count);
+
+  // Keep "file" loaded until Release(); with "wait", load it first if
+  // needed. Returns false if the file can't be loaded or, without "wait",
+  // is not loaded yet.
+  bool Acquire(FileInfo *file, bool wait);
+  void Release(FileInfo *file);
+
+private:
+  class Worker : public rgb_matrix::Thread {
+  public:
+    Worker(FileLoader *loader, FrameCanvas *scratch)
+      : loader_(loader), scratch_(scratch) {}
+    virtual void Run() { loader_->Work(scratch_); }
+
+  private:
+    FileLoader *const loader_;
+    FrameCanvas *const scratch_;
+  };
+
+  void Work(FrameCanvas *scratch);
+  void UnloadLeastRecentlyUsed();  // mutex_ held.
+
+  const LoadSettings settings_;
+  Mutex mutex_;
+  pthread_cond_t state_changed_;
+  bool running_;
+  std::deque<FileInfo*> pending_;
+  std::vector<FileInfo*> loaded_;
+  uint64_t use_count_;
+  std::vector<Worker*> workers_;
+};
+
+FileLoader::FileLoader(RGBMatrix *matrix, const LoadSettings &settings,
+                       int threads)
+  : settings_(settings), running_(true), use_count_(0) {
+  pthread_cond_init(&state_changed_, NULL);
+  for (int i = 0; i < threads; ++i) {
+    // Streams of matrix frames need a canvas to render to.
+    Worker *worker = new Worker(this, matrix->CreateFrameCanvas());
+    worker->Start();
+    workers_.push_back(worker);
+  }
+}
+
+FileLoader::~FileLoader() {
+  {
+    MutexLock l(&mutex_);
+    running_ = false;
+    pthread_cond_broadcast(&state_changed_);
+  }
+  for (size_t i = 0; i < workers_.size(); ++i) {
+    delete workers_[i];  // Waits for the file it is loading.
   }
+  pthread_cond_destroy(&state_changed_);
+}
+
+void FileLoader::Prefetch(const std::vector<FileInfo*> &files, size_t pos,
+                          size_t count) {
+  MutexLock l(&mutex_);
+  for (size_t i = 0; i < pending_.size(); ++i) {
+    pending_[i]->state = FileInfo::UNLOADED;
+  }
+  pending_.clear();
+  count = std::min(count, files.size());
+  for (size_t i = 0; i < count; ++i) {
+    FileInfo *file = files[(pos + i) % files.size()];
+    if (file->state == FileInfo::UNLOADED) {
+      file->state = FileInfo::QUEUED;
+      pending_.push_back(file);
+    } else if (file->state == FileInfo::LOADED) {
+      file->last_used = ++use_count_;  // Needed soon, don't unload.
+    }
+  }
+  pthread_cond_broadcast(&state_changed_);
+}
 
+bool FileLoader::Acquire(FileInfo *file, bool wait) {
+  MutexLock l(&mutex_);
+  if (wait && file->state == FileInfo::UNLOADED) {
+    file->state = FileInfo::QUEUED;
+    pending_.push_front(file);
+    pthread_cond_broadcast(&state_changed_);
+  }
+  while (wait && (file->state == FileInfo::QUEUED
+                  || file->state == FileInfo::LOADING)) {
+    mutex_.WaitOn(&state_changed_);
+  }
+  if (file->state != FileInfo::LOADED)
+    return false;
+  ++file->pins;
+  file->last_used = ++use_count_;
   return true;
 }
 
-void DisplayAnimation(const FileInfo *file,
-                      RGBMatrix *matrix, FrameCanvas *offscreen_canvas) {
+void FileLoader::Release(FileInfo *file) {
+  MutexLock l(&mutex_);
+  --file->pins;
+  UnloadLeastRecentlyUsed();
+}
+
+void FileLoader::UnloadLeastRecentlyUsed() {
+  while (loaded_.size() > kMaxLoadedFiles) {
+    size_t oldest = loaded_.size();
+    for (size_t i = 0; i < loaded_.size(); ++i) {
+      if (loaded_[i]->pins == 0
+          && (oldest == loaded_.size()
+              || loaded_[i]->last_used < loaded_[oldest]->last_used)) {
+        oldest = i;
+      }
+    }
+    if (oldest == loaded_.size())
+      return;  // All of them are in use.
+    // Canvases of the reader might still point to frames of the stream,
+    // but they are off-screen and only ever replaced without being read.
+    FileInfo *file = loaded_[oldest];
+    delete file->content_stream;
+    file->content_stream = NULL;
+    file->state = FileInfo::UNLOADED;
+    loaded_.erase(loaded_.begin() + oldest);
+  }
+}
+
+void FileLoader::Work(FrameCanvas *scratch) {
+  MutexLock l(&mutex_);
+  for (;;) {
+    while (running_ && pending_.empty()) {
+      mutex_.WaitOn(&state_changed_);
+    }
+    if (!running_)
+      return;
+    FileInfo *file = pending_.front();
+    pending_.pop_front();
+    file->state = FileInfo::LOADING;
+
+    mutex_.Unlock();
+    const bool success = LoadFile(file, settings_, scratch, NULL, false);
+    mutex_.Lock();
+
+    if (success) {
+      file->state = FileInfo::LOADED;
+      file->last_used = ++use_count_;
+      loaded_.push_back(file);
+      UnloadLeastRecentlyUsed();
+    } else {
+      file->state = FileInfo::FAILED;
+    }
+    pthread_cond_broadcast(&state_changed_);
+  }
+}
+
+// Position of the file after "pos", or -1 at the end. Going around again,
+// the files are shuffled anew with "shuffle".
+static int NextPosition(int pos, std::vector<FileInfo*> *files,
+                        bool forever, bool shuffle) {
+  if (++pos < (int)files->size())
+    return pos;
+  if (!forever)
+    return -1;
+  if (shuffle) {
+    std::random_shuffle(files->begin(), files->end());
+  }
+  return 0;
+}
+
+// Number of files to load ahead, starting at "pos".
+static size_t LoadAheadCount(int pos, size_t file_count, bool forever) {
+  return std::min(kLoadAheadFiles, forever ? file_count : file_count - pos);
+}
+
+static void EnqueueFile(const FileInfo *file,
+                        rgb_matrix::AsyncStreamReader *reader) {
+  const ImageParams &params = file->params;
+  reader->Enqueue(file->content_stream, params.loops,
+                  params.anim_begin_ms * 1000,
+                  params.anim_end_ms == distant_future
+                  ? UINT64_MAX : params.anim_end_ms * 1000);
+}
+
+// Show the frames of the file that the reader is currently at. Returns
+// whether any of them has been shown; the last one stays on screen.
+bool DisplayAnimation(const FileInfo *file, RGBMatrix *matrix,
+                      rgb_matrix::AsyncStreamReader *reader) {
   const tmillis_t duration_ms = (file->is_multi_frame
                                  ? file->params.anim_duration_ms
                                  : file->params.wait_ms);
-  rgb_matrix::StreamReader reader(file->content_stream);
-  int loops = file->params.loops;
   const tmillis_t end_time_ms = GetTimeInMillis() + duration_ms;
   const tmillis_t override_anim_delay = file->params.anim_delay_ms;
-  for (int k = 0;
-       (loops < 0 || k < loops)
-         && !interrupt_received
-         && GetTimeInMillis() < end_time_ms;
-       ++k) {
+  bool finished = false;
+  bool shown = false;
+  while (!interrupt_received && GetTimeInMillis() <= end_time_ms) {
     uint32_t delay_us = 0;
-    while (!interrupt_received && GetTimeInMillis() <= end_time_ms
-           && reader.GetNext(offscreen_canvas, &delay_us)) {
-      const tmillis_t anim_delay_ms =
-        override_anim_delay >= 0 ? override_anim_delay : delay_us / 1000;
-      const tmillis_t start_wait_ms = GetTimeInMillis();
-      offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas,
-                                             file->params.vsync_multiple);
-      const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;
-      SleepMillis(anim_delay_ms - time_already_spent);
+    FrameCanvas *frame = reader->GetNext(&delay_us);
+    if (frame == NULL) {
+      finished = true;
+      break;
     }
-    reader.Rewind();
+    const tmillis_t anim_delay_ms =
+      override_anim_delay >= 0 ? override_anim_delay : delay_us / 1000;
+    const tmillis_t start_wait_ms = GetTimeInMillis();
+    reader->Release(matrix->SwapOnVSync(frame, file->params.vsync_multiple));
+    shown = true;
+    const tmillis_t time_already_spent = GetTimeInMillis() - start_wait_ms;
+    SleepMillis(anim_delay_ms - time_already_spent);
+  }
+  if (!finished) {
+    reader->SkipCurrent();
   }
+  return shown;
 }
 
 static int usage(const char *progname) {
@@ -209,6 +685,14 @@ static int usage(const char *progname) {
   fprintf(stderr, "Options:\n"
           "\t-O<streamfile>            : Output to stream-file instead of matrix (Don't need to be root).\n"
           "\t-C                        : Center images.\n"
+          "\t-p                        : With -O: write a portable stream of RGB images. It is\n"
+          "\t                            smaller and plays with any GPIO mapping and panel settings.\n"
+          "\t-u                        : With -O: don't compress the frames. Takes a lot more disk,\n"
+          "\t                            but frames are shown straight from the file without copying.\n"
+          "\t-K<cache-dir>             : Cache animations as streams in this directory, so that\n"
+          "\t                            loading them again is quick.\n"
+          "\t-M<megabytes>             : Size limit of the cache; least recently used are removed\n"
+          "\t                            first (default: %d).\n"
 
           "\nThese options affect images FOLLOWING them on the command line,\n"
           "so it is possible to have different options for each image\n"
@@ -221,14 +705,16 @@ static int usage(const char *progname) {
           "\t-D<animation-delay-ms>    : "
           "For animations: override the delay between frames given in the\n"
           "\t                            gif/stream animation with this value. Use -1 to use default value.\n"
+          "\t-b<seconds>               : For animations: start at this time into the animation.\n"
+          "\t-e<seconds>               : For animations: end at this time into the animation. With -b, loop a range.\n"
           "\t-V<vsync-multiple>        : For animation (expert): Only do frame vsync-swaps on multiples of refresh (default: 1)\n"
           "\t                            (Tip: use --led-limit-refresh for stable rate)\n"
 
           "\nOptions affecting display of multiple images:\n"
           "\t-f                        : "
           "Forever cycle through the list of files on the command line.\n"
-          "\t-s                        : If multiple images are given: shuffle.\n"
-          );
+          "\t-s                        : If multiple images are given: shuffle.\n",
+          kDefaultCacheMegabytes);
 
   fprintf(stderr, "\nGeneral LED matrix options:\n");
   rgb_matrix::PrintMatrixFlags(stderr);
@@ -247,8 +733,6 @@ static int usage(const char *progname) {
 }
 
 int main(int argc, char *argv[]) {
-  Magick::InitializeMagick(*argv);
-
   RGBMatrix::Options matrix_options;
   rgb_matrix::RuntimeOptions runtime_opt;
   // If started with 'sudo': make sure to drop privileges to same user
@@ -264,6 +748,10 @@ int main(int argc, char *argv[]) {
   bool do_forever = false;
   bool do_center = false;
   bool do_shuffle = false;
+  bool portable_stream = false;
+  bool uncompressed_stream = false;
+  const char *cache_dir = NULL;
+  int cache_megabytes = kDefaultCacheMegabytes;
 
   // We remember ImageParams for each image, which will change whenever
   // there is a flag modifying them. This map keeps track of filenames
@@ -283,7 +771,7 @@ int main(int argc, char *argv[]) {
   const char *stream_output = NULL;
 
   int opt;
-  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:")) != -1) {
+  while ((opt = getopt(argc, argv, "w:t:l:fr:c:P:LhCR:sO:V:D:b:e:puK:M:")) != -1) {
     switch (opt) {
     case 'w':
       img_param.wait_ms = roundf(atof(optarg) * 1000.0f);
@@ -297,6 +785,12 @@ int main(int argc, char *argv[]) {
     case 'D':
       img_param.anim_delay_ms = atoi(optarg);
       break;
+    case 'b':
+      img_param.anim_begin_ms = roundf(atof(optarg) * 1000.0f);
+      break;
+    case 'e':
+      img_param.anim_end_ms = roundf(atof(optarg) * 1000.0f);
+      break;
     case 'f':
       do_forever = true;
       break;
@@ -306,6 +800,18 @@ int main(int argc, char *argv[]) {
     case 's':
       do_shuffle = true;
       break;
+    case 'p':
+      portable_stream = true;
+      break;
+    case 'u':
+      uncompressed_stream = true;
+      break;
+    case 'K':
+      cache_dir = strdup(optarg);
+      break;
+    case 'M':
+      cache_megabytes = atoi(optarg);
+      break;
     case 'r':
       fprintf(stderr, "Instead of deprecated -r, use --led-rows=%s instead.\n",
               optarg);
@@ -378,77 +884,56 @@ int main(int argc, char *argv[]) {
       return 1;
     }
     stream_io = new rgb_matrix::FileStreamIO(fd);
-    global_stream_writer = new rgb_matrix::StreamWriter(stream_io);
+    global_stream_writer =
+      new rgb_matrix::StreamWriter(stream_io, portable_stream ? 3 : 2,
+                                   !uncompressed_stream);
   }
 
-  const tmillis_t start_load = GetTimeInMillis();
-  fprintf(stderr, "Loading %d files...\n", argc - optind);
-  // Preparing all the images beforehand as the Pi might be too slow to
-  // be quickly switching between these. So preprocess.
+  // Animations are stored as portable streams of the canvas size, so they
+  // only depend on the size and how the image is placed.
+  ContentCache *cache = NULL;
+  char cache_variant[256];
+  if (cache_dir && !stream_output) {
+    cache = ContentCache::Create(cache_dir, cache_megabytes * 1048576LL);
+    if (cache == NULL) perror("Can't use cache directory");
+    snprintf(cache_variant, sizeof(cache_variant),
+             "led-image-viewer %dx%d center=%d fill=%d,%d",
+             matrix->width(), matrix->height(),
+             do_center, fill_width, fill_height);
+  }
+
+  LoadSettings load_settings;
+  load_settings.width = matrix->width();
+  load_settings.height = matrix->height();
+  load_settings.do_center = do_center;
+  load_settings.fill_width = fill_width;
+  load_settings.fill_height = fill_height;
+  load_settings.cache = cache;
+  load_settings.cache_variant = cache ? cache_variant : "";
+
   std::vector<FileInfo*> file_imgs;
   for (int imgarg = optind; imgarg < argc; ++imgarg) {
-    const char *filename = argv[imgarg];
-    FileInfo *file_info = NULL;
-
-    std::string err_msg;
-    std::vector<Magick::Image> image_sequence;
-    if (LoadImageAndScale(filename, matrix->width(), matrix->height(),
-                          fill_width, fill_height, &image_sequence, &err_msg)) {
-      file_info = new FileInfo();
-      file_info->params = filename_params[filename];
-      file_info->content_stream = new rgb_matrix::MemStreamIO();
-      file_info->is_multi_frame = image_sequence.size() > 1;
-      rgb_matrix::StreamWriter out(file_info->content_stream);
-      for (size_t i = 0; i < image_sequence.size(); ++i) {
-        const Magick::Image &img = image_sequence[i];
-        int64_t delay_time_us;
-        if (file_info->is_multi_frame) {
-          delay_time_us = img.animationDelay() * 10000; // unit in 1/100s
-        } else {
-          delay_time_us = file_info->params.wait_ms * 1000;  // single image.
-        }
-        if (delay_time_us <= 0) delay_time_us = 100 * 1000;  // 1/10sec
-        StoreInStream(img, delay_time_us, do_center, offscreen_canvas,
-                      global_stream_writer ? global_stream_writer : &out);
-      }
-    } else {
-      // Ok, not an image. Let's see if it is one of our streams.
-      int fd = open(filename, O_RDONLY);
-      if (fd >= 0) {
-        file_info = new FileInfo();
-        file_info->params = filename_params[filename];
-        file_info->content_stream = new rgb_matrix::FileStreamIO(fd);
-        StreamReader reader(file_info->content_stream);
-        if (reader.GetNext(offscreen_canvas, NULL)) {  // header+size ok
-          file_info->is_multi_frame = reader.GetNext(offscreen_canvas, NULL);
-          reader.Rewind();
-          if (global_stream_writer) {
-            CopyStream(&reader, global_stream_writer, offscreen_canvas);
-          }
-        } else {
-          err_msg += "; Can't read as image or compatible stream";
-          delete file_info->content_stream;
-          delete file_info;
-          file_info = NULL;
-        }
-      }
-      else {
-        perror("Opening file");
-      }
-    }
-
-    if (file_info) {
-      file_imgs.push_back(file_info);
-    } else {
-      fprintf(stderr, "%s skipped: Unable to open (%s)\n",
-              filename, err_msg.c_str());
-    }
+    FileInfo *file_info = new FileInfo();
+    file_info->filename = argv[imgarg];
+    file_info->params = filename_params[argv[imgarg]];
+    file_imgs.push_back(file_info);
   }
 
+  const tmillis_t start_load = GetTimeInMillis();
+  fprintf(stderr, "Loading %d files...\n", filename_count);
+
   if (stream_output) {
+    // The stream is written in order, so one file after another.
+    int written = 0;
+    for (size_t i = 0; i < file_imgs.size(); ++i) {
+      if (LoadFile(file_imgs[i], load_settings, offscreen_canvas,
+                   global_stream_writer, portable_stream)) {
+        ++written;
+      }
+    }
     delete global_stream_writer;
     delete stream_io;
-    if (file_imgs.size()) {
+    if (written) {
       fprintf(stderr, "Done: Output to stream %s; "
               "this can now be opened with led-image-viewer with the exact same panel configuration settings such as rows, chain, parallel and hardware-mapping\n", stream_output);
     }
@@ -461,11 +946,7 @@ int main(int argc, char *argv[]) {
   }
 
   // Some parameter sanity adjustments.
-  if (file_imgs.empty()) {
-    // e.g. if all files could not be interpreted as image.
-    fprintf(stderr, "No image could be loaded.\n");
-    return 1;
-  } else if (file_imgs.size() == 1) {
+  if (file_imgs.size() == 1) {
     // Single image: show forever.
     file_imgs[0]->params.wait_ms = distant_future;
   } else {
@@ -479,20 +960,87 @@ int main(int argc, char *argv[]) {
     }
   }
 
-  fprintf(stderr, "Loading took %.3fs; now: Display.\n",
-          (GetTimeInMillis() - start_load) / 1000.0);
-
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
-  do {
-    if (do_shuffle) {
-      std::random_shuffle(file_imgs.begin(), file_imgs.end());
+  // Files are loaded in the background, a few ahead of the one shown.
+  const long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  FileLoader *loader = new FileLoader(matrix, load_settings,
+                                      cpus > 0 ? cpus : 1);
+
+  // Frames are read ahead in the background, including the start of the
+  // next file while the current one is shown.
+  rgb_matrix::AsyncStreamReader *reader =
+    new rgb_matrix::AsyncStreamReader(matrix, kReadAheadFrames);
+  if (do_shuffle) {
+    std::random_shuffle(file_imgs.begin(), file_imgs.end());
+  }
+
+  // The "current" file is shown, the "next" one already queued in the
+  // reader behind it. "pos" is the position of the file after these.
+  FileInfo *current = NULL;
+  FileInfo *next = NULL;
+  // The file whose last frame is on screen. That frame might be shown in
+  // place from the file's stream, so it stays loaded until another file's
+  // frame replaced it.
+  FileInfo *on_screen = NULL;
+  int pos = 0;
+  size_t failed_in_a_row = 0;
+  bool shown_any = false;
+  while (!interrupt_received) {
+    if (current == NULL) {
+      if (pos < 0) break;
+      FileInfo *file = file_imgs[pos];
+      loader->Prefetch(file_imgs, pos,
+                       LoadAheadCount(pos, file_imgs.size(), do_forever));
+      pos = NextPosition(pos, &file_imgs, do_forever, do_shuffle);
+      if (!loader->Acquire(file, true)) {
+        if (++failed_in_a_row == file_imgs.size())
+          break;  // Nothing can be loaded.
+        continue;
+      }
+      failed_in_a_row = 0;
+      if (!shown_any) {
+        fprintf(stderr, "First file loaded after %.3fs; now: Display.\n",
+                (GetTimeInMillis() - start_load) / 1000.0);
+        shown_any = true;
+      }
+      current = file;
+      EnqueueFile(current, reader);
+    }
+
+    // If the file after this one is loaded already, queue it right away, so
+    // that its first frames are read while this one is shown.
+    if (pos >= 0 && loader->Acquire(file_imgs[pos], false)) {
+      next = file_imgs[pos];
+      EnqueueFile(next, reader);
+      pos = NextPosition(pos, &file_imgs, do_forever, do_shuffle);
     }
-    for (size_t i = 0; i < file_imgs.size() && !interrupt_received; ++i) {
-      DisplayAnimation(file_imgs[i], matrix, offscreen_canvas);
+    if (pos >= 0) {
+      loader->Prefetch(file_imgs, pos,
+                       LoadAheadCount(pos, file_imgs.size(), do_forever));
     }
-  } while (do_forever && !interrupt_received);
+
+    // Once this returns, the reader is done with the stream of "current"
+    // (see SkipCurrent()); it may be unloaded once not on screen anymore.
+    if (DisplayAnimation(current, matrix, reader)) {
+      if (on_screen) loader->Release(on_screen);
+      on_screen = current;
+    } else {
+      loader->Release(current);
+    }
+    current = next;
+    next = NULL;
+  }
+  delete reader;
+  delete loader;
+
+  if (!shown_any && !interrupt_received) {
+    // e.g. if all files could not be interpreted as image.
+    fprintf(stderr, "No image could be loaded.\n");
+    delete matrix;
+    return 1;
+  }
 
   if (interrupt_received) {
     fprintf(stderr, "Caught signal. Exiting.\n");
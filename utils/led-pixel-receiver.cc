@@ -0,0 +1,141 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Shows frames that lighting software sends over the network with DDP,
+// E1.31 (sACN) or Art-Net. See pixel-receiver.h
+
+#include "led-matrix.h"
+#include "pixel-receiver.h"
+
+#include <getopt.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using rgb_matrix::FrameCanvas;
+using rgb_matrix::PixelReceiver;
+using rgb_matrix::RGBMatrix;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Shows frames received over the network.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-P <protocol>      : ddp, e131 or artnet (Default: ddp).\n"
+          "\t-p <port>          : UDP port. Default: standard port of the "
+          "protocol.\n"
+          "\t-u <universe>      : E1.31/Art-Net: Universe of the first pixels.\n"
+          "\t                     (Default: 1 for E1.31, 0 for Art-Net)\n"
+          "\t-c <channels>      : E1.31/Art-Net: Channels used per universe "
+          "(Default: 510).\n"
+          "\t-v                 : Verbose: print statistics on exit.\n");
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  PixelReceiver::Options receiver_options;
+  bool verbose = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "P:p:u:c:v")) != -1) {
+    switch (opt) {
+    case 'P':
+      if (strcasecmp(optarg, "ddp") == 0) {
+        receiver_options.protocol = PixelReceiver::DDP;
+      } else if (strcasecmp(optarg, "e131") == 0
+                 || strcasecmp(optarg, "sacn") == 0) {
+        receiver_options.protocol = PixelReceiver::E131;
+      } else if (strcasecmp(optarg, "artnet") == 0) {
+        receiver_options.protocol = PixelReceiver::ARTNET;
+      } else {
+        fprintf(stderr, "Unknown protocol %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'p':
+      receiver_options.port = atoi(optarg);
+      break;
+    case 'u':
+      receiver_options.first_universe = atoi(optarg);
+      break;
+    case 'c':
+      receiver_options.channels_per_universe = atoi(optarg);
+      break;
+    case 'v':
+      verbose = true;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  PixelReceiver *receiver = PixelReceiver::Create(receiver_options,
+                                                  matrix->width(),
+                                                  matrix->height());
+  if (receiver == NULL) {
+    perror("Setting up receiver");
+    delete matrix;
+    return 1;
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  fprintf(stderr, "Receiving %dx%d pixels; CTRL-C for exit.\n",
+          matrix->width(), matrix->height());
+
+  FrameCanvas *offscreen = matrix->CreateFrameCanvas();
+  uint64_t frames = 0;
+  while (!interrupt_received) {
+    if (!receiver->ReceiveFrame(offscreen, 100))
+      continue;
+    FrameCanvas *shown = offscreen;
+    offscreen = matrix->SwapOnVSync(offscreen);
+    // Senders might only update parts of the display.
+    offscreen->CopyFrom(*shown);
+    ++frames;
+  }
+
+  if (verbose) {
+    fprintf(stderr, "%llu frames; %llu packets, %llu of them ignored.\n",
+            (unsigned long long)frames,
+            (unsigned long long)receiver->packets_received(),
+            (unsigned long long)receiver->packets_ignored());
+  }
+
+  delete receiver;
+  matrix->Clear();
+  delete matrix;
+  return 0;
+}
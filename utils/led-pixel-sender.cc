@@ -0,0 +1,313 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Sends a moving test pattern with DDP, E1.31 (sACN) or Art-Net, as
+// lighting software would. To try led-pixel-receiver without such software,
+// or on the same machine with "localhost". See pixel-receiver.h
+// Doesn't touch the GPIO, so it runs on any machine.
+
+#include <netdb.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <vector>
+
+enum Protocol { DDP, E131, ARTNET };
+
+static const size_t kDDPMaxData = 1440;  // Multiple of 3: whole pixels.
+static const size_t kE131DataOffset = 126;
+static const size_t kE131SyncPacketSize = 49;
+static const size_t kArtNetDataOffset = 18;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+static void WriteBE16(uint8_t *p, uint16_t v) { p[0] = v >> 8; p[1] = v; }
+static void WriteBE32(uint8_t *p, uint32_t v) {
+  WriteBE16(p, v >> 16); WriteBE16(p + 2, v);
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <host>\n", progname);
+  fprintf(stderr, "Sends a test pattern to a pixel receiver.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-P <protocol>      : ddp, e131 or artnet (Default: ddp).\n"
+          "\t-p <port>          : UDP port. Default: standard port of the "
+          "protocol.\n"
+          "\t-s <width>x<height>: Size of the display (Default: 64x32).\n"
+          "\t-u <universe>      : E1.31/Art-Net: Universe of the first pixels.\n"
+          "\t                     (Default: 1 for E1.31, 0 for Art-Net)\n"
+          "\t-c <channels>      : E1.31/Art-Net: Channels used per universe "
+          "(Default: 510).\n"
+          "\t-S                 : E1.31/Art-Net: Send synchronization "
+          "packets.\n"
+          "\t-f <fps>           : Frames per second (Default: 30).\n"
+          "\t-n <frames>        : Stop after this many frames "
+          "(Default: 0, forever).\n");
+  return 1;
+}
+
+// A diagonal rainbow that moves one pixel each frame.
+static void FillPattern(int width, int height, int frame, uint8_t *rgb) {
+  for (int y = 0; y < height; ++y) {
+    for (int x = 0; x < width; ++x, rgb += 3) {
+      const int phase = (x + y + frame) % 48;
+      const int ramp = (phase % 16) * 16;
+      rgb[0] = (phase < 16) ? 255 - ramp : (phase < 32) ? 0 : ramp;
+      rgb[1] = (phase < 16) ? ramp : (phase < 32) ? 255 - ramp : 0;
+      rgb[2] = (phase < 16) ? 0 : (phase < 32) ? ramp : 255 - ramp;
+    }
+  }
+}
+
+class Sender {
+public:
+  Sender(int fd, const struct addrinfo *dest, Protocol protocol,
+         int first_universe, int channels_per_universe, bool sync)
+    : fd_(fd), dest_(dest), protocol_(protocol),
+      first_universe_(first_universe),
+      channels_per_universe_(channels_per_universe), sync_(sync),
+      sequence_(0) {}
+
+  void SendFrame(const uint8_t *rgb, size_t len) {
+    ++sequence_;
+    switch (protocol_) {
+    case DDP:
+      for (size_t offset = 0; offset < len; offset += kDDPMaxData) {
+        const size_t count = std::min(kDDPMaxData, len - offset);
+        SendDDP(offset, rgb + offset, count, offset + count == len);
+      }
+      break;
+    case E131:
+    case ARTNET:
+      for (size_t offset = 0, universe = first_universe_; offset < len;
+           offset += channels_per_universe_, ++universe) {
+        const size_t count = std::min<size_t>(channels_per_universe_,
+                                              len - offset);
+        if (protocol_ == E131)
+          SendE131(universe, rgb + offset, count);
+        else
+          SendArtNet(universe, rgb + offset, count);
+      }
+      if (sync_) SendSync();
+      break;
+    }
+  }
+
+private:
+  void Send(const std::vector<uint8_t> &packet) {
+    if (sendto(fd_, packet.data(), packet.size(), 0,
+               dest_->ai_addr, dest_->ai_addrlen) < 0) {
+      perror("sendto");
+    }
+  }
+
+  void SendDDP(size_t offset, const uint8_t *data, size_t len, bool push) {
+    std::vector<uint8_t> p(10 + len, 0);
+    p[0] = 0x40 | (push ? 0x01 : 0);  // Version 1.
+    p[1] = sequence_ & 0x0f;
+    p[2] = 0x0b;                       // RGB, 8 bit per color.
+    p[3] = 1;                          // Default output device.
+    WriteBE32(&p[4], offset);
+    WriteBE16(&p[8], len);
+    memcpy(&p[10], data, len);
+    Send(p);
+  }
+
+  // Root layer and start of the framing layer of an E1.31 packet, which
+  // already has its final size.
+  static void E131Header(std::vector<uint8_t> *packet, uint32_t root_vector,
+                         uint32_t framing_vector) {
+    static const char kAcnId[12] = {
+      'A', 'S', 'C', '-', 'E', '1', '.', '1', '7', 0, 0, 0 };
+    uint8_t *p = &(*packet)[0];
+    const size_t size = packet->size();
+    WriteBE16(p, 0x0010);
+    memcpy(p + 4, kAcnId, sizeof(kAcnId));
+    WriteBE16(p + 16, 0x7000 | (size - 16));
+    WriteBE32(p + 18, root_vector);
+    memcpy(p + 22, "led-pixel-sendr", 16);  // Component id; any 16 bytes.
+    WriteBE16(p + 38, 0x7000 | (size - 38));
+    WriteBE32(p + 40, framing_vector);
+  }
+
+  void SendE131(int universe, const uint8_t *data, size_t len) {
+    std::vector<uint8_t> p(kE131DataOffset + len, 0);
+    E131Header(&p, 0x04, 0x02);
+    snprintf((char*)&p[44], 64, "led-pixel-sender");
+    p[108] = 100;  // Priority.
+    WriteBE16(&p[109], sync_ ? first_universe_ : 0);
+    p[111] = sequence_;
+    WriteBE16(&p[113], universe);
+    WriteBE16(&p[115], 0x7000 | (p.size() - 115));
+    p[117] = 0x02;
+    p[118] = 0xa1;
+    WriteBE16(&p[121], 1);
+    WriteBE16(&p[123], len + 1);  // Including the start code.
+    memcpy(&p[kE131DataOffset], data, len);
+    Send(p);
+  }
+
+  void SendArtNet(int universe, const uint8_t *data, size_t len) {
+    std::vector<uint8_t> p(kArtNetDataOffset + len + (len & 1), 0);
+    memcpy(&p[0], "Art-Net", 8);
+    p[9] = 0x50;   // OpDmx, little endian.
+    p[11] = 14;    // Protocol version.
+    p[12] = sequence_;
+    p[14] = universe & 0xff;
+    p[15] = (universe >> 8) & 0x7f;
+    WriteBE16(&p[16], p.size() - kArtNetDataOffset);  // Needs to be even.
+    memcpy(&p[kArtNetDataOffset], data, len);
+    Send(p);
+  }
+
+  void SendSync() {
+    if (protocol_ == E131) {
+      std::vector<uint8_t> p(kE131SyncPacketSize, 0);
+      E131Header(&p, 0x08, 0x01);
+      p[44] = sequence_;
+      WriteBE16(&p[45], first_universe_);
+      Send(p);
+    } else {
+      std::vector<uint8_t> p(14, 0);
+      memcpy(&p[0], "Art-Net", 8);
+      p[9] = 0x52;  // OpSync.
+      p[11] = 14;
+      Send(p);
+    }
+  }
+
+  const int fd_;
+  const struct addrinfo *const dest_;
+  const Protocol protocol_;
+  const int first_universe_;
+  const int channels_per_universe_;
+  const bool sync_;
+  uint8_t sequence_;
+};
+
+int main(int argc, char *argv[]) {
+  Protocol protocol = DDP;
+  const char *port = NULL;
+  int width = 64, height = 32;
+  int first_universe = -1;
+  int channels_per_universe = 510;
+  bool sync = false;
+  float fps = 30;
+  int frame_count = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "P:p:s:u:c:Sf:n:")) != -1) {
+    switch (opt) {
+    case 'P':
+      if (strcasecmp(optarg, "ddp") == 0) {
+        protocol = DDP;
+      } else if (strcasecmp(optarg, "e131") == 0
+                 || strcasecmp(optarg, "sacn") == 0) {
+        protocol = E131;
+      } else if (strcasecmp(optarg, "artnet") == 0) {
+        protocol = ARTNET;
+      } else {
+        fprintf(stderr, "Unknown protocol %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'p':
+      port = strdup(optarg);
+      break;
+    case 's':
+      if (sscanf(optarg, "%dx%d", &width, &height) != 2
+          || width <= 0 || height <= 0) {
+        fprintf(stderr, "Invalid size %s\n", optarg);
+        return usage(argv[0]);
+      }
+      break;
+    case 'u':
+      first_universe = atoi(optarg);
+      break;
+    case 'c':
+      channels_per_universe = atoi(optarg);
+      if (channels_per_universe < 1 || channels_per_universe > 512) {
+        fprintf(stderr, "Channels per universe need to be 1 to 512\n");
+        return usage(argv[0]);
+      }
+      break;
+    case 'S':
+      sync = true;
+      break;
+    case 'f':
+      fps = atof(optarg);
+      if (fps <= 0) {
+        fprintf(stderr, "Frames per second need to be positive\n");
+        return usage(argv[0]);
+      }
+      break;
+    case 'n':
+      frame_count = atoi(optarg);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+  if (optind != argc - 1) {
+    fprintf(stderr, "Expected host to send to.\n");
+    return usage(argv[0]);
+  }
+  if (first_universe < 0) first_universe = (protocol == E131) ? 1 : 0;
+  if (port == NULL) {
+    port = (protocol == DDP) ? "4048" : (protocol == E131) ? "5568" : "6454";
+  }
+
+  struct addrinfo hints;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_INET;
+  hints.ai_socktype = SOCK_DGRAM;
+  struct addrinfo *dest = NULL;
+  const int err = getaddrinfo(argv[optind], port, &hints, &dest);
+  if (err != 0) {
+    fprintf(stderr, "%s: %s\n", argv[optind], gai_strerror(err));
+    return 1;
+  }
+  const int fd = socket(dest->ai_family, dest->ai_socktype, 0);
+  if (fd < 0) {
+    perror("socket");
+    return 1;
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  Sender sender(fd, dest, protocol, first_universe, channels_per_universe,
+                sync);
+  std::vector<uint8_t> rgb(3 * width * height);
+  for (int frame = 0; !interrupt_received
+         && (frame_count <= 0 || frame < frame_count); ++frame) {
+    FillPattern(width, height, frame, &rgb[0]);
+    sender.SendFrame(&rgb[0], rgb.size());
+    usleep(1e6 / fps);
+  }
+
+  close(fd);
+  freeaddrinfo(dest);
+  return 0;
+}
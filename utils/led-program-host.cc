@@ -0,0 +1,547 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Loads display programs (see display-program.h) as plugins and takes turns
+// showing them on one matrix. All programs run all the time, each in its own
+// thread; the ones not shown just wait in SwapOnVSync(). So switching to
+// another program only costs swapping in its last frame.
+//
+// Messages written to a FIFO interrupt the current program at its next frame
+// and are shown with a message program, e.g. the scrolling-text-example.
+
+#include "display-program.h"
+#include "thread.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <deque>
+#include <string>
+#include <vector>
+
+using namespace rgb_matrix;
+
+volatile bool interrupt_received = false;
+static void InterruptHandler(int signo) {
+  interrupt_received = true;
+}
+
+// Programs take turns parsing their flags, as getopt() is not reentrant. A
+// turn ends when the program starts to display, or after this time, so that
+// a program that blocks before displaying doesn't hold up all the others.
+static const uint64_t kStartupTurnMs = 1000;
+
+static uint64_t GetMonotonicMillis() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+}
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options] <program> [<program>...]\n", progname);
+  fprintf(stderr, "Takes turns running display program plugins on the matrix.\n"
+          "Each <program> is the path to the plugin followed by its "
+          "arguments, as one\nshell argument, e.g. \"./clock.so -f font.bdf\"\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-t <seconds>       : Time each program is shown (Default: 30).\n"
+          "\t-m <fifo>          : Read messages from this FIFO, one per line.\n"
+          "\t-M <program>       : Program showing a message; gets the message\n"
+          "\t                     as last argument. Needed with -m.\n"
+          "\t                     It should finish once the message is shown.\n"
+          );
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+class ProgramHost;
+
+// A display program plugin, running in its own thread.
+class HostedProgram : public ProgramContext, public Thread {
+public:
+  HostedProgram(ProgramHost *host, DisplayProgramMainFn main_fn,
+                const std::vector<std::string> &args);
+
+  // Run DisplayProgramMain() with "args" in the thread. Called with the
+  // host mutex held; the program must not be running.
+  void Launch(const std::vector<std::string> &args);
+  void Launch() { Launch(args_); }
+
+  bool running() const { return running_; }
+  bool display_started() const { return display_started_; }
+  FrameCanvas *front() const { return front_; }
+
+  virtual void Run();
+
+  // -- ProgramContext
+  virtual bool StartDisplay();
+  virtual FrameCanvas *CreateFrameCanvas();
+  virtual FrameCanvas *SwapOnVSync(FrameCanvas *other,
+                                   unsigned framerate_fraction);
+  virtual bool SetPWMBits(uint8_t value);
+  virtual void SetBrightness(uint8_t brightness);
+  virtual uint8_t brightness() { return front_->brightness(); }
+  virtual bool interrupted();
+  virtual const char *hardware_mapping() const;
+
+protected:
+  virtual Canvas *DrawTarget() const { return front_; }
+
+private:
+  void WaitForStartupTurn();
+  void ReleaseStartup();
+
+  ProgramHost *const host_;
+  const DisplayProgramMainFn main_;
+  std::vector<std::string> args_;
+
+  // Only used by the program thread.
+  FrameCanvas *front_;          // Shown whenever this program is shown.
+
+  // Guarded by the host mutex.
+  std::vector<FrameCanvas*> canvases_;  // All we ever created.
+  std::vector<FrameCanvas*> unused_;    // Not handed out in this run yet.
+  bool running_;
+  bool display_started_;
+};
+
+class ProgramHost {
+public:
+  ProgramHost(RGBMatrix *matrix, const char *hardware_mapping)
+    : matrix_(matrix), hardware_mapping_(hardware_mapping), active_(NULL),
+      starting_(NULL), starting_deadline_ms_(0), stopping_(false) {
+    pthread_cond_init(&changed_, NULL);
+  }
+  ~ProgramHost() {
+    for (size_t i = 0; i < programs_.size(); ++i) delete programs_[i];
+    pthread_cond_destroy(&changed_);
+  }
+
+  void AddProgram(DisplayProgramMainFn main_fn,
+                  const std::vector<std::string> &args) {
+    programs_.push_back(new HostedProgram(this, main_fn, args));
+  }
+  void SetMessageProgram(DisplayProgramMainFn main_fn,
+                         const std::vector<std::string> &args) {
+    message_args_ = args;
+    programs_.push_back(new HostedProgram(this, main_fn, args));
+  }
+  bool has_message_program() const { return !message_args_.empty(); }
+
+  void PostMessage(const std::string &message) {
+    MutexLock l(&mutex_);
+    messages_.push_back(message);
+    pthread_cond_broadcast(&changed_);
+  }
+
+  // Take turns showing the programs for "slice_ms" each until
+  // "*interrupt_received" becomes true.
+  void Run(int slice_ms, volatile bool *interrupt_received);
+
+private:
+  friend class HostedProgram;
+
+  HostedProgram *message_program() {
+    return has_message_program() ? programs_.back() : NULL;
+  }
+  size_t rotation_size() const {
+    return programs_.size() - (has_message_program() ? 1 : 0);
+  }
+  HostedProgram *NextInRotation();
+  void SwitchTo(HostedProgram *program);
+
+  RGBMatrix *const matrix_;
+  const char *const hardware_mapping_;
+  std::vector<HostedProgram*> programs_;  // Message program last.
+  std::vector<std::string> message_args_;
+
+  Mutex mutex_;
+  pthread_cond_t changed_;
+  HostedProgram *active_;    // Program whose front() is on the matrix.
+  HostedProgram *starting_;  // Program whose turn it is to parse its flags.
+  uint64_t starting_deadline_ms_;
+  volatile bool stopping_;   // Read without lock in interrupted()
+  std::deque<std::string> messages_;
+};
+
+HostedProgram::HostedProgram(ProgramHost *host, DisplayProgramMainFn main_fn,
+                             const std::vector<std::string> &args)
+  : host_(host), main_(main_fn), args_(args),
+    front_(host->matrix_->CreateFrameCanvas()),
+    running_(false), display_started_(false) {
+  canvases_.push_back(front_);
+}
+
+void HostedProgram::Launch(const std::vector<std::string> &args) {
+  args_ = args;
+  unused_.clear();
+  for (size_t i = 0; i < canvases_.size(); ++i) {
+    if (canvases_[i] != front_) unused_.push_back(canvases_[i]);
+  }
+  running_ = true;
+  display_started_ = false;
+  Start();
+}
+
+void HostedProgram::Run() {
+  WaitForStartupTurn();
+
+  std::vector<char*> argv;
+  for (size_t i = 0; i < args_.size(); ++i) {
+    argv.push_back(const_cast<char*>(args_[i].c_str()));
+  }
+  argv.push_back(NULL);
+  main_(this, (int)args_.size(), argv.data());
+  ReleaseStartup();
+
+  MutexLock l(&host_->mutex_);
+  running_ = false;
+  pthread_cond_broadcast(&host_->changed_);
+}
+
+void HostedProgram::WaitForStartupTurn() {
+  MutexLock l(&host_->mutex_);
+  for (;;) {
+    const uint64_t now = GetMonotonicMillis();
+    if (host_->starting_ == NULL || now >= host_->starting_deadline_ms_
+        || host_->stopping_) {
+      break;
+    }
+    host_->mutex_.WaitOn(&host_->changed_,
+                         host_->starting_deadline_ms_ - now);
+  }
+  host_->starting_ = this;
+  host_->starting_deadline_ms_ = GetMonotonicMillis() + kStartupTurnMs;
+  optind = 0;  // Fully re-initialize getopt() for this program.
+}
+
+void HostedProgram::ReleaseStartup() {
+  MutexLock l(&host_->mutex_);
+  if (host_->starting_ != this) return;
+  host_->starting_ = NULL;
+  pthread_cond_broadcast(&host_->changed_);
+}
+
+bool HostedProgram::StartDisplay() {
+  ReleaseStartup();
+  MutexLock l(&host_->mutex_);
+  display_started_ = true;
+  return true;
+}
+
+FrameCanvas *HostedProgram::CreateFrameCanvas() {
+  ReleaseStartup();
+  MutexLock l(&host_->mutex_);
+  // The matrix never frees canvases, so re-use the ones of earlier runs.
+  if (!unused_.empty()) {
+    FrameCanvas *result = unused_.back();
+    unused_.pop_back();
+    return result;
+  }
+  FrameCanvas *result = host_->matrix_->CreateFrameCanvas();
+  result->SetPWMBits(front_->pwmbits());
+  result->SetBrightness(front_->brightness());
+  canvases_.push_back(result);
+  return result;
+}
+
+FrameCanvas *HostedProgram::SwapOnVSync(FrameCanvas *other,
+                                        unsigned framerate_fraction) {
+  ReleaseStartup();
+  MutexLock l(&host_->mutex_);
+  while (host_->active_ != this && !host_->stopping_) {
+    host_->mutex_.WaitOn(&host_->changed_);
+  }
+  if (host_->stopping_)
+    return other;
+  // Holding the lock while waiting for the vsync makes the host switch
+  // programs only between frames.
+  FrameCanvas *previous = host_->matrix_->SwapOnVSync(other,
+                                                      framerate_fraction);
+  front_ = other;
+  return previous;
+}
+
+bool HostedProgram::SetPWMBits(uint8_t value) {
+  MutexLock l(&host_->mutex_);
+  for (size_t i = 0; i < canvases_.size(); ++i) {
+    if (!canvases_[i]->SetPWMBits(value)) return false;
+  }
+  return true;
+}
+
+void HostedProgram::SetBrightness(uint8_t brightness) {
+  MutexLock l(&host_->mutex_);
+  for (size_t i = 0; i < canvases_.size(); ++i) {
+    canvases_[i]->SetBrightness(brightness);
+  }
+}
+
+bool HostedProgram::interrupted() {
+  return host_->stopping_;
+}
+
+const char *HostedProgram::hardware_mapping() const {
+  return host_->hardware_mapping_;
+}
+
+HostedProgram *ProgramHost::NextInRotation() {
+  const size_t count = rotation_size();
+  size_t start = 0;
+  for (size_t i = 0; i < count; ++i) {
+    if (programs_[i] == active_) start = i + 1;
+  }
+  for (size_t i = 0; i < count; ++i) {
+    HostedProgram *candidate = programs_[(start + i) % count];
+    if (candidate->running()) return candidate;
+  }
+  return NULL;
+}
+
+void ProgramHost::SwitchTo(HostedProgram *program) {
+  if (program == NULL || program == active_) return;
+  matrix_->SwapOnVSync(program->front());
+  active_ = program;
+  pthread_cond_broadcast(&changed_);
+}
+
+void ProgramHost::Run(int slice_ms, volatile bool *interrupt_received) {
+  MutexLock l(&mutex_);
+  for (size_t i = 0; i < rotation_size(); ++i) {
+    programs_[i]->Launch();
+  }
+  HostedProgram *const message = message_program();
+  HostedProgram *preempted = NULL;  // Program to resume after messages.
+  uint64_t slice_end = GetMonotonicMillis() + slice_ms;
+  SwitchTo(programs_[0]);
+
+  while (!*interrupt_received) {
+    mutex_.WaitOn(&changed_, 50);
+
+    // Restart programs that finished, so that they are ready when it is
+    // their turn again.
+    bool active_finished = false;
+    size_t usable = 0;
+    for (size_t i = 0; i < rotation_size(); ++i) {
+      HostedProgram *program = programs_[i];
+      if (!program->running() && program->display_started()) {
+        program->WaitStopped();
+        program->Launch();
+        active_finished |= (program == active_);
+      }
+      if (program->running()) ++usable;
+    }
+    if (usable == 0) {
+      fprintf(stderr, "None of the programs could be started.\n");
+      break;
+    }
+
+    const bool showing_message = message && message->running();
+    if (message && !showing_message && !messages_.empty()) {
+      message->WaitStopped();
+      std::vector<std::string> args = message_args_;
+      args.push_back(messages_.front());
+      messages_.pop_front();
+      if (active_ != message) {
+        preempted = active_;
+        message->front()->Clear();
+      }
+      message->Launch(args);
+      SwitchTo(message);
+    } else if (!showing_message && active_ == message) {
+      SwitchTo(preempted && preempted->running()
+               ? preempted : NextInRotation());
+      slice_end = GetMonotonicMillis() + slice_ms;
+    } else if (!showing_message
+               && (active_finished || !active_->running()
+                   || GetMonotonicMillis() >= slice_end)) {
+      SwitchTo(NextInRotation());
+      slice_end = GetMonotonicMillis() + slice_ms;
+    }
+  }
+
+  stopping_ = true;
+  pthread_cond_broadcast(&changed_);
+  mutex_.Unlock();
+  for (size_t i = 0; i < programs_.size(); ++i) {
+    programs_[i]->WaitStopped();
+  }
+  mutex_.Lock();
+}
+
+// Reads messages, one per line, from a FIFO.
+class MessageReader : public Thread {
+public:
+  MessageReader(ProgramHost *host, int fd) : host_(host), fd_(fd) {}
+  ~MessageReader() { WaitStopped(); close(fd_); }
+
+  virtual void Run() {
+    std::string line;
+    char buffer[1024];
+    while (!interrupt_received) {
+      struct pollfd p = { fd_, POLLIN, 0 };
+      if (poll(&p, 1, 100) <= 0)
+        continue;
+      const ssize_t r = read(fd_, buffer, sizeof(buffer));
+      if (r < 0 && errno != EINTR && errno != EAGAIN)
+        return;
+      for (ssize_t i = 0; i < r; ++i) {
+        if (buffer[i] != '\n') {
+          line.push_back(buffer[i]);
+          continue;
+        }
+        if (!line.empty()) host_->PostMessage(line);
+        line.clear();
+      }
+    }
+  }
+
+private:
+  ProgramHost *const host_;
+  const int fd_;
+};
+
+// Load the plugin from "spec": the path to it and its arguments, separated
+// by spaces. Returns NULL on failure.
+static DisplayProgramMainFn LoadProgram(const char *spec,
+                                        std::vector<std::string> *args) {
+  const char *const delim = " \t";
+  std::string copy(spec);
+  for (char *s = strtok(&copy[0], delim); s; s = strtok(NULL, delim)) {
+    args->push_back(s);
+  }
+  if (args->empty()) {
+    fprintf(stderr, "Empty program given.\n");
+    return NULL;
+  }
+  // If the same plugin is given twice, both share its global variables.
+  void *handle = dlopen(args->front().c_str(), RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    fprintf(stderr, "%s\n", dlerror());
+    return NULL;
+  }
+  void *symbol = dlsym(handle, DISPLAY_PROGRAM_MAIN_SYMBOL);
+  if (symbol == NULL) {
+    fprintf(stderr, "%s: not a display program: %s\n",
+            args->front().c_str(), dlerror());
+    return NULL;
+  }
+  return reinterpret_cast<DisplayProgramMainFn>(symbol);
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  int slice_seconds = 30;
+  const char *message_fifo = NULL;
+  const char *message_program = NULL;
+  int opt;
+  while ((opt = getopt(argc, argv, "t:m:M:")) != -1) {
+    switch (opt) {
+    case 't':
+      slice_seconds = atoi(optarg);
+      break;
+    case 'm':
+      message_fifo = optarg;
+      break;
+    case 'M':
+      message_program = optarg;
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  if (optind >= argc) {
+    fprintf(stderr, "Expected at least one program.\n");
+    return usage(argv[0]);
+  }
+  if (slice_seconds <= 0) {
+    fprintf(stderr, "The time slice needs to be positive.\n");
+    return usage(argv[0]);
+  }
+  if ((message_fifo == NULL) != (message_program == NULL)) {
+    fprintf(stderr, "-m and -M need to be given together.\n");
+    return usage(argv[0]);
+  }
+
+  // Open the FIFO read-write, so that it doesn't hit end-of-file whenever
+  // a writer closes it.
+  int message_fd = -1;
+  if (message_fifo) {
+    message_fd = open(message_fifo, O_RDWR | O_NONBLOCK);
+    if (message_fd < 0) {
+      perror(message_fifo);
+      return 1;
+    }
+  }
+
+  RGBMatrix *matrix = RGBMatrix::CreateFromOptions(matrix_options,
+                                                   runtime_opt);
+  if (matrix == NULL)
+    return 1;
+
+  // Load the plugins after the matrix dropped privileges.
+  ProgramHost host(matrix, matrix_options.hardware_mapping);
+  for (int i = optind; i < argc; ++i) {
+    std::vector<std::string> args;
+    DisplayProgramMainFn main_fn = LoadProgram(argv[i], &args);
+    if (main_fn == NULL) {
+      delete matrix;
+      return 1;
+    }
+    host.AddProgram(main_fn, args);
+  }
+  if (message_program) {
+    std::vector<std::string> args;
+    DisplayProgramMainFn main_fn = LoadProgram(message_program, &args);
+    if (main_fn == NULL) {
+      delete matrix;
+      return 1;
+    }
+    host.SetMessageProgram(main_fn, args);
+  }
+
+  signal(SIGTERM, InterruptHandler);
+  signal(SIGINT, InterruptHandler);
+
+  MessageReader *reader = NULL;
+  if (message_fd >= 0) {
+    reader = new MessageReader(&host, message_fd);
+    reader->Start();
+  }
+
+  printf("CTRL-C for exit.\n");
+  host.Run(slice_seconds * 1000, &interrupt_received);
+
+  delete reader;
+  matrix->Clear();
+  delete matrix;
+  return 0;
+}
@@ -0,0 +1,100 @@
+// -*- mode: c++; c-basic-offset: 2; indent-tabs-mode: nil; -*-
+//
+// This program is free software; you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation version 2.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://gnu.org/licenses/gpl-2.0.txt>
+
+// Predicts the refresh rate of a panel configuration, and finds the most
+// PWM bits that reach a given refresh rate. See refresh-timing.h
+// Doesn't touch the GPIO, so it runs on any machine.
+
+#include "led-matrix.h"
+#include "refresh-timing.h"
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+using rgb_matrix::RefreshTiming;
+using rgb_matrix::RGBMatrix;
+
+static int usage(const char *progname) {
+  fprintf(stderr, "usage: %s [options]\n", progname);
+  fprintf(stderr, "Estimates the refresh rate of the given matrix options.\n");
+  fprintf(stderr, "Options:\n");
+  fprintf(stderr,
+          "\t-P <model>         : Raspberry Pi model 1..4; 1 is also the "
+          "Zero (Default: 3).\n"
+          "\t-t <hz>            : Find the most --led-pwm-bits that refresh "
+          "at least\n"
+          "\t                     this fast.\n");
+  fprintf(stderr, "\nGeneral LED matrix options:\n");
+  rgb_matrix::PrintMatrixFlags(stderr);
+  return 1;
+}
+
+static void PrintTiming(const RGBMatrix::Options &options,
+                        const RefreshTiming &timing) {
+  printf("--led-pwm-bits=%d --led-pwm-dither-bits=%d --led-pwm-lsb-nanoseconds=%d\n",
+         options.pwm_bits, options.pwm_dither_bits,
+         options.pwm_lsb_nanoseconds);
+  printf("  refresh: %.0fHz (%.0fus per refresh, %.0fus dark clocking in)\n",
+         timing.refresh_hz, timing.frame_us, timing.clock_in_us);
+  printf("  lit:     %.0f%% of the time\n", 100 * timing.lit_fraction);
+}
+
+int main(int argc, char *argv[]) {
+  RGBMatrix::Options matrix_options;
+  rgb_matrix::RuntimeOptions runtime_opt;
+  if (!rgb_matrix::ParseOptionsFromFlags(&argc, &argv,
+                                         &matrix_options, &runtime_opt)) {
+    return usage(argv[0]);
+  }
+
+  int pi_model = 3;
+  double target_hz = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "P:t:")) != -1) {
+    switch (opt) {
+    case 'P':
+      pi_model = atoi(optarg);
+      if (pi_model < 1 || pi_model > 4) {
+        fprintf(stderr, "Pi model needs to be 1 to 4\n");
+        return usage(argv[0]);
+      }
+      break;
+    case 't':
+      target_hz = atof(optarg);
+      break;
+    default:
+      return usage(argv[0]);
+    }
+  }
+
+  const int slowdown = runtime_opt.gpio_slowdown;
+  PrintTiming(matrix_options,
+              rgb_matrix::EstimateRefreshTiming(matrix_options, slowdown,
+                                                pi_model));
+  if (target_hz <= 0)
+    return 0;
+
+  printf("\nFor %.0fHz:\n", target_hz);
+  if (!rgb_matrix::TuneForRefreshRate(&matrix_options, slowdown, pi_model,
+                                      target_hz)) {
+    printf("  Not reachable; try a lower --led-pwm-lsb-nanoseconds, "
+           "--led-slowdown-gpio or a shorter chain.\n");
+    return 1;
+  }
+  PrintTiming(matrix_options,
+              rgb_matrix::EstimateRefreshTiming(matrix_options, slowdown,
+                                                pi_model));
+  return 0;
+}
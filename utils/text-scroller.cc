@@ -222,7 +222,7 @@ int main(int argc, char *argv[]) {
    */
   rgb_matrix::Font *outline_font = NULL;
   if (with_outline) {
-    outline_font = font.CreateOutlineFont();
+    outline_font = font.CreateDerivedFont(rgb_matrix::Font::OUTLINE);
   }
 
   RGBMatrix *canvas = RGBMatrix::CreateFromOptions(matrix_options, runtime_opt);
@@ -262,7 +262,19 @@ int main(int argc, char *argv[]) {
 
   int x = x_orig;
   int y = y_orig;
-  int length = 0;
+
+  // The text only changes when a new line is read, so lay it out once and
+  // only draw the prepared layout in each frame.
+  rgb_matrix::TextLayout text_layout(font, line.c_str(), letter_spacing);
+  rgb_matrix::TextLayout outline_layout;
+  // The outline font, we need to write with a negative (-2) text-spacing,
+  // as we want to have the same letter pitch as the regular text that
+  // we then write on top.
+  if (outline_font)
+    outline_layout.Layout(*outline_font, line.c_str(), letter_spacing - 2);
+
+  // length = holds how many pixels our text takes up
+  int length = text_layout.width();
 
   struct timespec next_frame = {0, 0};
 
@@ -270,6 +282,10 @@ int main(int argc, char *argv[]) {
   while (!interrupt_received && loops != 0) {
     if (input_file && ReadLineOnChange(input_file, &line, &last_change)) {
       x = x_orig;
+      text_layout.Layout(font, line.c_str(), letter_spacing);
+      if (outline_font)
+        outline_layout.Layout(*outline_font, line.c_str(), letter_spacing - 2);
+      length = text_layout.width();
     }
     ++frame_counter;
     offscreen_canvas->Fill(bg_color.r, bg_color.g, bg_color.b);
@@ -278,20 +294,10 @@ int main(int argc, char *argv[]) {
 
     if (draw_on_frame) {
       if (outline_font) {
-        // The outline font, we need to write with a negative (-2) text-spacing,
-        // as we want to have the same letter pitch as the regular text that
-        // we then write on top.
-        rgb_matrix::DrawText(offscreen_canvas, *outline_font,
-                             x - 1, y + font.baseline(),
-                             outline_color, NULL,
-                             line.c_str(), letter_spacing - 2);
+        outline_layout.Draw(offscreen_canvas, x - 1, y + font.baseline(),
+                            outline_color);
       }
-
-      // length = holds how many pixels our text takes up
-      length = rgb_matrix::DrawText(offscreen_canvas, font,
-                                    x, y + font.baseline(),
-                                    color, NULL,
-                                    line.c_str(), letter_spacing);
+      text_layout.Draw(offscreen_canvas, x, y + font.baseline(), color);
     }
 
     x += scroll_direction;
@@ -33,45 +33,293 @@ extern "C" {
 #  include <libavcodec/avcodec.h>
 #  include <libavformat/avformat.h>
 #  include <libavutil/imgutils.h>
+#  include <libavutil/pixdesc.h>
 #  include <libswscale/swscale.h>
 }
 
 #include "../examples-api-use/common.h"
+#include <errno.h>
 #include <fcntl.h>
 #include <getopt.h>
 #include <limits.h>
 #include <signal.h>
 #include <stdio.h>
+#include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <time.h>
 #include <unistd.h>
+#include <algorithm>
+#include <deque>
 #include <thread>
+#include <vector>
 
 #include "led-matrix.h"
+#include "content-cache.h"
 #include "content-streamer.h"
+#include "graphics.h"
+#include "thread.h"
 
+using rgb_matrix::ContentCache;
 using rgb_matrix::FrameCanvas;
+using rgb_matrix::MutexLock;
 using rgb_matrix::RGBMatrix;
 using rgb_matrix::StreamWriter;
 using rgb_matrix::StreamIO;
+using rgb_matrix::StreamReader;
+
+// Decoded frames waiting to be shown.
+static const int kDisplayQueueDepth = 4;
+
+// Skip converting at most this many late frames in a row, so that we still
+// show something if decoding alone is too slow.
+static const int kMaxSkippedInRow = 4;
+
+// Default size limit of the cache of played videos (-K).
+static const int kDefaultCacheMegabytes = 1024;
 
 volatile bool interrupt_received = false;
 static void InterruptHandler(int) {
   interrupt_received = true;
 }
 
-struct LedPixel {
-  uint8_t r, g, b;
+static int64_t GetMonotonicMicros() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Shows decoded frames on the matrix in its own thread, at their
+// presentation time. Meanwhile, the main thread can go on decoding the
+// next frames into a bounded queue.
+//
+// Frames are timed relative to the start of their "segment", a video or
+// one loop of it. A segment starts when the last frame of the previous one
+// ends, so that videos follow each other without a gap or a cut-short
+// frame. A frame is dropped if the next one in the queue is due already.
+class FramePresenter : public rgb_matrix::Thread {
+public:
+  FramePresenter(RGBMatrix *matrix, int vsync_multiple,
+                 bool use_vsync_for_frame_timing)
+    : matrix_(matrix), vsync_multiple_(vsync_multiple),
+      use_vsync_for_frame_timing_(use_vsync_for_frame_timing),
+      running_(true), finishing_(false), segment_(-1), segment_start_us_(0),
+      shown_end_us_(0), visible_until_us_(0),
+      shown_(0), dropped_(0) {
+    pthread_cond_init(&changed_, NULL);
+    for (int i = 0; i < kDisplayQueueDepth + 1; ++i) {
+      free_.push_back(matrix->CreateFrameCanvas());
+    }
+  }
+
+  ~FramePresenter() {
+    Stop();
+    pthread_cond_destroy(&changed_);
+  }
+
+  // Canvas to draw the next frame into. Waits while the queue is full.
+  // Returns NULL once stopped.
+  FrameCanvas *AcquireCanvas() {
+    MutexLock l(&mutex_);
+    while (running_ && free_.empty()) {
+      mutex_.WaitOn(&changed_);
+    }
+    if (!running_) return NULL;
+    FrameCanvas *result = free_.back();
+    free_.pop_back();
+    return result;
+  }
+
+  // Hand back a canvas from AcquireCanvas() that is not going to be shown.
+  void ReturnCanvas(FrameCanvas *canvas) {
+    MutexLock l(&mutex_);
+    free_.push_back(canvas);
+    pthread_cond_broadcast(&changed_);
+  }
+
+  // Queue "canvas" to be shown "time_us" after the start of "segment",
+  // for "duration_us".
+  void Present(FrameCanvas *canvas, int segment, int64_t time_us,
+               int64_t duration_us) {
+    const QueuedFrame frame = { canvas, segment, time_us, duration_us };
+    MutexLock l(&mutex_);
+    queue_.push_back(frame);
+    pthread_cond_broadcast(&changed_);
+  }
+
+  // Returns true if a frame of "segment" ending at "end_time_us" would be
+  // too late to be shown anyway, so it is not worth converting.
+  bool IsLate(int segment, int64_t end_time_us) {
+    if (use_vsync_for_frame_timing_) return false;
+    MutexLock l(&mutex_);
+    return segment == segment_
+      && GetMonotonicMicros() > segment_start_us_ + end_time_us;
+  }
+
+  // Count a frame that the decoder dropped.
+  void CountDropped() {
+    MutexLock l(&mutex_);
+    ++dropped_;
+  }
+
+  // Show the remaining queued frames, the last one for its full duration,
+  // then stop.
+  void Finish() {
+    {
+      MutexLock l(&mutex_);
+      finishing_ = true;
+      pthread_cond_broadcast(&changed_);
+    }
+    WaitStopped();
+  }
+
+  // Stop right away.
+  void Stop() {
+    {
+      MutexLock l(&mutex_);
+      running_ = false;
+      pthread_cond_broadcast(&changed_);
+    }
+    WaitStopped();
+  }
+
+  long shown() const { return shown_; }
+  long dropped() const { return dropped_; }
+
+  virtual void Run() {
+    for (;;) {
+      QueuedFrame frame;
+      int64_t due_us;
+      {
+        MutexLock l(&mutex_);
+        while (running_ && !finishing_ && queue_.empty()) {
+          mutex_.WaitOn(&changed_);
+        }
+        if (!running_) return;
+        if (queue_.empty()) {
+          // Finishing. Don't cut the last frame short by returning to the
+          // caller, which might delete the matrix right away.
+          int64_t now;
+          while (running_
+                 && (now = GetMonotonicMicros()) < visible_until_us_) {
+            mutex_.WaitOn(&changed_, (visible_until_us_ - now + 999) / 1000);
+          }
+          return;
+        }
+        frame = queue_.front();
+        queue_.pop_front();
+        const int64_t now = GetMonotonicMicros();
+        if (frame.segment != segment_) {
+          segment_ = frame.segment;
+          segment_start_us_ = std::max(now, shown_end_us_) - frame.time_us;
+        }
+        if (!use_vsync_for_frame_timing_ && !queue_.empty()
+            && queue_.front().segment == segment_
+            && now >= segment_start_us_ + queue_.front().time_us) {
+          free_.push_back(frame.canvas);
+          ++dropped_;
+          pthread_cond_broadcast(&changed_);
+          continue;
+        }
+        due_us = segment_start_us_ + frame.time_us;
+      }
+
+      if (!use_vsync_for_frame_timing_) {
+        struct timespec due;
+        due.tv_sec = due_us / 1000000;
+        due.tv_nsec = (due_us % 1000000) * 1000;
+        clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &due, NULL);
+      }
+      FrameCanvas *previous = matrix_->SwapOnVSync(frame.canvas,
+                                                   vsync_multiple_);
+      const int64_t visible_us = GetMonotonicMicros();
+      MutexLock l(&mutex_);
+      shown_end_us_ = due_us + frame.duration_us;
+      visible_until_us_ = visible_us + frame.duration_us;
+      free_.push_back(previous);
+      ++shown_;
+      pthread_cond_broadcast(&changed_);
+    }
+  }
+
+private:
+  struct QueuedFrame {
+    FrameCanvas *canvas;
+    int segment;
+    int64_t time_us;
+    int64_t duration_us;
+  };
+
+  RGBMatrix *const matrix_;
+  const int vsync_multiple_;
+  const bool use_vsync_for_frame_timing_;
+
+  rgb_matrix::Mutex mutex_;
+  pthread_cond_t changed_;
+  std::deque<QueuedFrame> queue_;
+  std::vector<FrameCanvas*> free_;
+  bool running_;
+  bool finishing_;
+  int segment_;                // Segment currently shown.
+  int64_t segment_start_us_;   // Monotonic time that segment started.
+  int64_t shown_end_us_;       // Monotonic time the shown frame ends.
+  int64_t visible_until_us_;   // Same, counted from when it was swapped in.
+  long shown_;
+  long dropped_;
 };
-void CopyFrame(AVFrame *pFrame, FrameCanvas *canvas,
-               int offset_x, int offset_y,
-               int width, int height) {
-  for (int y = 0; y < height; ++y) {
-    LedPixel *pix = (LedPixel*) (pFrame->data[0] + y*pFrame->linesize[0]);
-    for (int x = 0; x < width; ++x, ++pix) {
-      canvas->SetPixel(x + offset_x, y + offset_y, pix->r, pix->g, pix->b);
+
+// Play a stream from the cache, each round as a new segment. Returns the
+// number of frames shown.
+static long PlayCachedStream(int fd, FramePresenter *presenter, bool loop,
+                             int *segment) {
+  StreamIO *io = rgb_matrix::MmapStreamIO::Create(fd);
+  if (io == NULL) io = new rgb_matrix::FileStreamIO(fd);
+  StreamReader reader(io);
+  long frames = 0;
+  long frames_this_round;
+  do {
+    reader.Rewind();
+    ++*segment;
+    frames_this_round = 0;
+    int64_t time_us = 0;
+    while (!interrupt_received) {
+      FrameCanvas *canvas = presenter->AcquireCanvas();
+      if (canvas == NULL) break;
+      uint32_t hold_time_us;
+      if (!reader.GetNext(canvas, &hold_time_us)) {
+        presenter->ReturnCanvas(canvas);
+        break;
+      }
+      presenter->Present(canvas, *segment, time_us, hold_time_us);
+      time_us += hold_time_us;
+      ++frames_this_round;
     }
+    frames += frames_this_round;
+  } while (loop && frames_this_round > 0 && !interrupt_received);
+  // All frames are converted into the canvases, so we don't need to wait
+  // for them to be shown.
+  delete io;
+  return frames;
+}
+
+// If the decoded frame can be shown as-is, return its pixel format in
+// "format"; the frame planes then are handed to the canvas without going
+// through swscale. Only possible if no scaling is needed and for video-range
+// formats we can convert ourselves.
+static bool GetDirectPixelFormat(const AVFrame *frame,
+                                 int display_width, int display_height,
+                                 rgb_matrix::PixelFormat *format) {
+  if (frame->width != display_width || frame->height != display_height)
+    return false;
+  if (frame->color_range == AVCOL_RANGE_JPEG)
+    return false;
+  switch (frame->format) {
+  case AV_PIX_FMT_YUV420P: *format = rgb_matrix::PIXEL_YUV420P; return true;
+  case AV_PIX_FMT_NV12:    *format = rgb_matrix::PIXEL_NV12; return true;
+  case AV_PIX_FMT_YUV444P: *format = rgb_matrix::PIXEL_YUV444P; return true;
+  case AV_PIX_FMT_RGB24:   *format = rgb_matrix::PIXEL_RGB24; return true;
+  case AV_PIX_FMT_BGR24:   *format = rgb_matrix::PIXEL_BGR24; return true;
+  default: return false;
   }
 }
 
@@ -86,6 +334,31 @@ void ScaleToFitKeepAscpet(int fit_in_width, int fit_in_height,
   *height = roundf(*height / ratio);
 }
 
+// The largest power-of-two reduction "codec" can decode at that still
+// leaves at least "width" x "height" of the "source_width" x "source_height"
+// video. This is much cheaper than decoding the full picture and then
+// throwing away most of it in the scaler.
+static int ChooseLowres(const AVCodec *codec,
+                        int source_width, int source_height,
+                        int width, int height) {
+  int lowres = 0;
+  while (lowres < codec->max_lowres
+         && (source_width >> (lowres + 1)) >= width
+         && (source_height >> (lowres + 1)) >= height) {
+    ++lowres;
+  }
+  return lowres;
+}
+
+// Format to scale into. The canvas converts YUV itself, so we only let the
+// scaler resize the planes; full resolution chroma as each LED counts.
+static AVPixelFormat ScaledPixelFormat(AVPixelFormat source_format) {
+  const AVPixFmtDescriptor *desc = av_pix_fmt_desc_get(source_format);
+  if (desc && (desc->flags & AV_PIX_FMT_FLAG_RGB))
+    return AV_PIX_FMT_RGB24;
+  return AV_PIX_FMT_YUV444P;
+}
+
 static int usage(const char *progname, const char *msg = NULL) {
   if (msg) {
     fprintf(stderr, "%s\n", msg);
@@ -95,6 +368,8 @@ static int usage(const char *progname, const char *msg = NULL) {
   fprintf(stderr, "Options:\n"
           "\t-F                 : Full screen without black bars; aspect ratio might suffer\n"
           "\t-O<streamfile>     : Output to stream-file instead of matrix (don't need to be root).\n"
+          "\t-p                 : With -O: write a portable stream of RGB images that plays with any\n"
+          "\t                     GPIO mapping and panel settings. All videos need to have the same size.\n"
           "\t-s <count>         : Skip these number of frames in the beginning.\n"
           "\t-c <count>         : Only show this number of frames (excluding skipped frames).\n"
           "\t-V<vsync-multiple> : Instead of native video framerate, playback framerate\n"
@@ -102,29 +377,33 @@ static int usage(const char *progname, const char *msg = NULL) {
           "\t                     this can result in more smooth playback. Choose multiple for desired framerate.\n"
           "\t                     (Tip: use --led-limit-refresh for stable rate)\n"
 	  "\t-T <threads>       : Number of threads used to decode (default 1, max=%d)\n"
+          "\t-D                 : Decode for small output: decode at reduced resolution\n"
+          "\t                     where the codec supports it and skip the deblocking\n"
+          "\t                     filter. Much less CPU for videos larger than the matrix.\n"
+          "\t-K <cache-dir>     : Cache played videos as streams in this directory, so that\n"
+          "\t                     playing them again does not need to decode them.\n"
+          "\t-M <megabytes>     : Size limit of the cache; least recently played are\n"
+          "\t                     removed first (default %d).\n"
           "\t-v                 : verbose; prints video metadata and other info.\n"
           "\t-f                 : Loop forever.\n",
-	  (int)std::thread::hardware_concurrency());
+	  (int)std::thread::hardware_concurrency(), kDefaultCacheMegabytes);
 
   fprintf(stderr, "\nGeneral LED matrix options:\n");
   rgb_matrix::PrintMatrixFlags(stderr);
   return 1;
 }
 
-static void add_nanos(struct timespec *accumulator, long nanoseconds) {
-  accumulator->tv_nsec += nanoseconds;
-  while (accumulator->tv_nsec > 1000000000) {
-    accumulator->tv_nsec -= 1000000000;
-    accumulator->tv_sec += 1;
-  }
-}
-
 // Convert deprecated color formats to new and manually set the color range.
 // YUV has funny ranges (16-235), while the YUVJ are 0-255. SWS prefers to
 // deal with the YUV range, but then requires to set the output range.
 // https://libav.org/documentation/doxygen/master/pixfmt_8h.html#a9a8e335cf3be472042bc9f0cf80cd4c5
-SwsContext *CreateSWSContext(const AVCodecContext *codec_ctx,
-                             int display_width, int display_height) {
+// YUV output is always in video range, which is what the canvas expects.
+// The "previous" context is reused if it does the same scaling, otherwise
+// freed.
+SwsContext *CreateSWSContext(SwsContext *previous,
+                             const AVCodecContext *codec_ctx,
+                             int display_width, int display_height,
+                             AVPixelFormat output_format) {
   AVPixelFormat pix_fmt;
   bool src_range_extended_yuvj = true;
   // Remap deprecated to new pixel format.
@@ -137,13 +416,15 @@ SwsContext *CreateSWSContext(const AVCodecContext *codec_ctx,
     src_range_extended_yuvj = false;
     pix_fmt = codec_ctx->pix_fmt;
   }
-  SwsContext *swsCtx = sws_getContext(codec_ctx->width, codec_ctx->height,
-                                      pix_fmt,
-                                      display_width, display_height,
-                                      AV_PIX_FMT_RGB24, SWS_BILINEAR,
-                                      NULL, NULL, NULL);
-  if (src_range_extended_yuvj) {
-    // Manually set the source range to be extended. Read modify write.
+  SwsContext *swsCtx = sws_getCachedContext(previous,
+                                            codec_ctx->width,
+                                            codec_ctx->height, pix_fmt,
+                                            display_width, display_height,
+                                            output_format, SWS_BILINEAR,
+                                            NULL, NULL, NULL);
+  if (swsCtx) {
+    // Manually set the source range, a reused context might have been
+    // set up for the other one. Read modify write.
     int dontcare[4];
     int src_range, dst_range;
     int brightness, contrast, saturation;
@@ -151,13 +432,241 @@ SwsContext *CreateSWSContext(const AVCodecContext *codec_ctx,
                              (int**)&dontcare, &dst_range, &brightness,
                              &contrast, &saturation);
     const int* coefs = sws_getCoefficients(SWS_CS_DEFAULT);
-    src_range = 1;  // New src range.
+    src_range = src_range_extended_yuvj ? 1 : 0;  // New src range.
+    if (output_format != AV_PIX_FMT_RGB24) dst_range = 0;
     sws_setColorspaceDetails(swsCtx, coefs, src_range, coefs, dst_range,
                              brightness, contrast, saturation);
   }
   return swsCtx;
 }
 
+// How videos are opened.
+struct VideoOptions {
+  int matrix_width;
+  int matrix_height;
+  bool maintain_aspect_ratio;
+  bool decode_for_small_output;
+  unsigned thread_count;
+  unsigned int frame_skip;
+  bool verbose;
+  ContentCache *cache;        // If not NULL, look up videos there first.
+  const char *cache_variant;
+};
+
+// A video opened for decoding; or its stream in the cache.
+struct Video {
+  Video() : filename(NULL), cached_fd(-1), format_context(NULL),
+            codec_context(NULL), stream(NULL), video_stream(-1),
+            frame_wait_nanos(0), display_width(0), display_height(0),
+            packet(NULL), frame(NULL), draining(false), have_frame(false),
+            decode_error(false) {}
+
+  const char *filename;
+  std::string cache_key;
+  int cached_fd;          // If >= 0, play this stream from the cache instead.
+
+  AVFormatContext *format_context;
+  AVCodecContext *codec_context;
+  AVStream *stream;
+  int video_stream;
+  long frame_wait_nanos;  // Time between frames.
+  int display_width;      // Size of the scaled target frame.
+  int display_height;
+
+  AVPacket *packet;
+  AVFrame *frame;         // Decode video into this.
+  bool draining;          // All packets sent, decoder is being drained.
+  bool have_frame;        // "frame" already holds the next frame.
+  bool decode_error;      // Decoding stopped before the end of the video.
+};
+
+static void CloseVideo(Video *video) {
+  if (video == NULL) return;
+  av_packet_free(&video->packet);
+  av_frame_free(&video->frame);
+  avcodec_free_context(&video->codec_context);
+  avformat_close_input(&video->format_context);
+  delete video;
+}
+
+// Decode the next frame of the video into video->frame. Returns false at
+// the end of the video.
+static bool DecodeNextFrame(Video *video) {
+  if (video->have_frame) {
+    video->have_frame = false;
+    return true;
+  }
+  for (;;) {
+    const int result = avcodec_receive_frame(video->codec_context,
+                                             video->frame);
+    if (result == 0) return true;
+    if (result != AVERROR(EAGAIN) && result != AVERROR_EOF) {
+      video->decode_error = true;
+    }
+    if (result != AVERROR(EAGAIN) || video->draining) return false;
+
+    // The decoder needs more input.
+    const int read_result = av_read_frame(video->format_context,
+                                          video->packet);
+    if (read_result != 0) {
+      if (read_result != AVERROR_EOF) video->decode_error = true;
+      video->draining = true;  // ran out of packets from input
+      avcodec_send_packet(video->codec_context, NULL);  // Trigger drain
+      continue;
+    }
+    if (video->packet->stream_index == video->video_stream
+        && avcodec_send_packet(video->codec_context, video->packet) < 0) {
+      video->decode_error = true;
+    }
+    av_packet_unref(video->packet);
+  }
+}
+
+// Skip "skip" frames and decode the first frame to show, so that it is
+// ready to go.
+static void PrerollVideo(Video *video, unsigned int skip) {
+  for (unsigned int i = 0; i <= skip; ++i) {
+    if (!DecodeNextFrame(video)) return;
+  }
+  video->have_frame = true;
+}
+
+static void RewindVideo(Video *video, unsigned int skip) {
+  av_seek_frame(video->format_context, video->video_stream, 0,
+                AVSEEK_FLAG_ANY);
+  avcodec_flush_buffers(video->codec_context);
+  video->draining = false;
+  video->have_frame = false;
+  video->decode_error = false;
+  PrerollVideo(video, skip);
+}
+
+// Open the video and decode its first frame. Returns NULL on error.
+static Video *OpenVideo(const char *filename, const VideoOptions &options) {
+  if (strcmp(filename, "-") == 0) {
+    filename = "/dev/stdin";
+  }
+  Video *video = new Video();
+  video->filename = filename;
+  if (options.cache) {
+    video->cache_key = options.cache->Key(filename, options.cache_variant);
+    video->cached_fd = options.cache->Open(video->cache_key);
+    if (video->cached_fd >= 0) return video;
+  }
+
+  video->format_context = avformat_alloc_context();
+  if (avformat_open_input(&video->format_context, filename, NULL, NULL) != 0) {
+    fprintf(stderr, "%s: Issue opening file\n", filename);
+    CloseVideo(video);
+    return NULL;
+  }
+
+  if (avformat_find_stream_info(video->format_context, NULL) < 0) {
+    fprintf(stderr, "%s: Couldn't find stream information\n", filename);
+    CloseVideo(video);
+    return NULL;
+  }
+
+  if (options.verbose) av_dump_format(video->format_context, 0, filename, 0);
+
+  // Find the first video stream
+  AVCodecParameters *codec_parameters = NULL;
+  const AVCodec *av_codec = NULL;
+  for (int i = 0; i < (int)video->format_context->nb_streams; ++i) {
+    codec_parameters = video->format_context->streams[i]->codecpar;
+    av_codec = avcodec_find_decoder(codec_parameters->codec_id);
+    if (!av_codec) continue;
+    if (codec_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
+      video->video_stream = i;
+      break;
+    }
+  }
+  if (video->video_stream == -1) {
+    fprintf(stderr, "%s: No video stream found\n", filename);
+    CloseVideo(video);
+    return NULL;
+  }
+
+  // Frames per second; calculate wait time between frames.
+  video->stream = video->format_context->streams[video->video_stream];
+  AVRational rate = av_guess_frame_rate(video->format_context, video->stream,
+                                        NULL);
+  video->frame_wait_nanos = 1e9 * rate.den / rate.num;
+  if (options.verbose) fprintf(stderr, "FPS: %f\n", 1.0*rate.num / rate.den);
+
+  AVCodecContext *codec_context = avcodec_alloc_context3(av_codec);
+  video->codec_context = codec_context;
+  if (options.thread_count > 1 &&
+      av_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS &&
+      std::thread::hardware_concurrency() > 1) {
+    codec_context->thread_type = FF_THREAD_FRAME;
+    codec_context->thread_count =
+      std::min(options.thread_count, std::thread::hardware_concurrency());
+  }
+
+  if (avcodec_parameters_to_context(codec_context, codec_parameters) < 0) {
+    CloseVideo(video);
+    return NULL;
+  }
+
+  /*
+   * Size of the scaled target frame to be send to matrix.
+   */
+  int display_width = codec_context->width;
+  int display_height = codec_context->height;
+  if (options.maintain_aspect_ratio) {
+    // Make display fit within canvas.
+    ScaleToFitKeepAscpet(options.matrix_width, options.matrix_height,
+                         &display_width, &display_height);
+  } else {
+    display_width = options.matrix_width;
+    display_height = options.matrix_height;
+  }
+  video->display_width = display_width;
+  video->display_height = display_height;
+
+  if (options.decode_for_small_output) {
+    codec_context->lowres = ChooseLowres(av_codec,
+                                         codec_context->width,
+                                         codec_context->height,
+                                         display_width, display_height);
+    codec_context->skip_loop_filter = AVDISCARD_ALL;
+    codec_context->skip_idct = AVDISCARD_BIDIR;
+    codec_context->flags2 |= AV_CODEC_FLAG2_FAST;
+  }
+
+  if (avcodec_open2(codec_context, av_codec, NULL) < 0) {
+    fprintf(stderr, "%s: Can't open codec\n", filename);
+    CloseVideo(video);
+    return NULL;
+  }
+
+  video->packet = av_packet_alloc();
+  video->frame = av_frame_alloc();
+  PrerollVideo(video, options.frame_skip);
+  return video;
+}
+
+// Opens a video in the background, while the previous one is playing.
+class VideoOpener : public rgb_matrix::Thread {
+public:
+  VideoOpener(const char *filename, const VideoOptions &options)
+    : filename_(filename), options_(options), video_(NULL) {}
+
+  // Wait until the video is opened. Returns it, or NULL on error.
+  Video *Get() {
+    WaitStopped();
+    return video_;
+  }
+
+  virtual void Run() { video_ = OpenVideo(filename_, options_); }
+
+private:
+  const char *const filename_;
+  const VideoOptions options_;
+  Video *video_;
+};
+
 int main(int argc, char *argv[]) {
   RGBMatrix::Options matrix_options;
   rgb_matrix::RuntimeOptions runtime_opt;
@@ -180,14 +689,19 @@ int main(int argc, char *argv[]) {
   bool use_vsync_for_frame_timing = false;
   bool maintain_aspect_ratio = true;
   bool verbose = false;
+  bool portable_stream = false;
+  bool write_error_reported = false;
   bool forever = false;
+  bool decode_for_small_output = false;
+  const char *cache_dir = NULL;
+  int cache_megabytes = kDefaultCacheMegabytes;
   unsigned thread_count = 1;
   int stream_output_fd = -1;
   unsigned int frame_skip = 0;
   int64_t framecount_limit = INT64_MAX;
 
   int opt;
-  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:")) != -1) {
+  while ((opt = getopt(argc, argv, "vO:R:Lfc:s:FV:T:pDK:M:")) != -1) {
     switch (opt) {
     case 'v':
       verbose = true;
@@ -223,6 +737,18 @@ int main(int argc, char *argv[]) {
     case 'F':
       maintain_aspect_ratio = false;
       break;
+    case 'p':
+      portable_stream = true;
+      break;
+    case 'D':
+      decode_for_small_output = true;
+      break;
+    case 'K':
+      cache_dir = optarg;
+      break;
+    case 'M':
+      cache_megabytes = atoi(optarg);
+      break;
     case 'V':
       vsync_multiple = atoi(optarg);
       if (vsync_multiple <= 0)
@@ -248,20 +774,39 @@ int main(int argc, char *argv[]) {
   if (matrix == NULL) {
     return 1;
   }
-  FrameCanvas *offscreen_canvas = matrix->CreateFrameCanvas();
+  FrameCanvas *offscreen_canvas = NULL;  // Only used to write a stream.
 
   long frame_count = 0;
+  int segment = 0;
   StreamIO *stream_io = NULL;
   StreamWriter *stream_writer = NULL;
-  if (stream_output_fd >= 0) {
+  FramePresenter *presenter = NULL;
+  if (stream_output_fd < 0) {
+    presenter = new FramePresenter(matrix, vsync_multiple,
+                                   use_vsync_for_frame_timing);
+    presenter->Start();
+  } else {
+    offscreen_canvas = matrix->CreateFrameCanvas();
     stream_io = new rgb_matrix::FileStreamIO(stream_output_fd);
-    stream_writer = new StreamWriter(stream_io);
+    stream_writer = new StreamWriter(stream_io, portable_stream ? 3 : 2);
     if (forever) {
       fprintf(stderr, "-f (forever) doesn't make sense with -O; disabling\n");
       forever = false;
     }
   }
 
+  // Cached streams depend on everything that changes the frames.
+  ContentCache *cache = NULL;
+  char cache_variant[256];
+  if (cache_dir && presenter) {
+    cache = ContentCache::Create(cache_dir, cache_megabytes * 1048576LL);
+    if (cache == NULL) perror("Can't use cache directory");
+    snprintf(cache_variant, sizeof(cache_variant),
+             "video-viewer %dx%d keep-aspect=%d skip=%u count=%lld small=%d",
+             matrix->width(), matrix->height(), maintain_aspect_ratio,
+             frame_skip, (long long)framecount_limit, decode_for_small_output);
+  }
+
   // If we only have to loop a single video, we can avoid doing the
   // expensive video stream set-up and just repeat in an inner loop.
   const bool one_video_forever = forever && !multiple_videos;
@@ -275,188 +820,253 @@ int main(int argc, char *argv[]) {
   signal(SIGTERM, InterruptHandler);
   signal(SIGINT, InterruptHandler);
 
-  do {
-    for (int m = optind; m < argc && !interrupt_received; ++m) {
-      const char *movie_file = argv[m];
-      if (strcmp(movie_file, "-") == 0) {
-        movie_file = "/dev/stdin";
-      }
+  VideoOptions video_options;
+  video_options.matrix_width = matrix->width();
+  video_options.matrix_height = matrix->height();
+  video_options.maintain_aspect_ratio = maintain_aspect_ratio;
+  video_options.decode_for_small_output = decode_for_small_output;
+  video_options.thread_count = thread_count;
+  video_options.frame_skip = frame_skip;
+  video_options.verbose = verbose;
+  video_options.cache = cache;
+  video_options.cache_variant = cache_variant;
 
-      AVFormatContext *format_context = avformat_alloc_context();
-      if (avformat_open_input(&format_context, movie_file, NULL, NULL) != 0) {
-        perror("Issue opening file: ");
-        return -1;
-      }
+  // Kept from one video to the next; reused if they have the same size.
+  SwsContext *sws_ctx = NULL;
+  AVFrame *scaled_frame = av_frame_alloc();
+  int scaled_width = 0;
+  int scaled_height = 0;
+  AVPixelFormat scaled_format = AV_PIX_FMT_NONE;
 
-      if (avformat_find_stream_info(format_context, NULL) < 0) {
-        fprintf(stderr, "Couldn't find stream information\n");
-        return -1;
-      }
+  // While a video plays, the next one is opened and its first frame decoded
+  // in the background, so that it can start right after the last frame.
+  int next_file = optind;
+  VideoOpener *opener = new VideoOpener(argv[next_file], video_options);
+  opener->Start();
+  int failed_in_row = 0;
+  while (opener && !interrupt_received) {
+    Video *const video = opener->Get();
+    delete opener;
+    opener = NULL;
+    if (++next_file == argc && multiple_video_forever) {
+      next_file = optind;
+    }
+    if (next_file < argc) {
+      opener = new VideoOpener(argv[next_file], video_options);
+      opener->Start();
+    }
 
-      if (verbose) av_dump_format(format_context, 0, movie_file, 0);
-
-      // Find the first video stream
-      int videoStream = -1;
-      AVCodecParameters *codec_parameters = NULL;
-      const AVCodec *av_codec = NULL;
-      for (int i = 0; i < (int)format_context->nb_streams; ++i) {
-        codec_parameters = format_context->streams[i]->codecpar;
-        av_codec = avcodec_find_decoder(codec_parameters->codec_id);
-        if (!av_codec) continue;
-        if (codec_parameters->codec_type == AVMEDIA_TYPE_VIDEO) {
-          videoStream = i;
-          break;
-        }
-      }
-      if (videoStream == -1)
-        return false;
-
-      // Frames per second; calculate wait time between frames.
-      AVStream *const stream = format_context->streams[videoStream];
-      AVRational rate = av_guess_frame_rate(format_context, stream, NULL);
-      const long frame_wait_nanos = 1e9 * rate.den / rate.num;
-      if (verbose) fprintf(stderr, "FPS: %f\n", 1.0*rate.num / rate.den);
-
-      AVCodecContext *codec_context = avcodec_alloc_context3(av_codec);
-      if (thread_count > 1 &&
-          av_codec->capabilities & AV_CODEC_CAP_FRAME_THREADS &&
-          std::thread::hardware_concurrency() > 1) {
-        codec_context->thread_type = FF_THREAD_FRAME;
-        codec_context->thread_count =
-          std::min(thread_count, std::thread::hardware_concurrency());
-      }
+    if (video == NULL) {
+      if (++failed_in_row == argc - optind)
+        break;  // None of them can be played.
+      continue;
+    }
+    failed_in_row = 0;
 
-      if (avcodec_parameters_to_context(codec_context, codec_parameters) < 0)
-        return -1;
-      if (avcodec_open2(codec_context, av_codec, NULL) < 0)
-        return -1;
+    if (video->cached_fd >= 0) {
+      if (verbose) fprintf(stderr, "%s: playing from cache\n", video->filename);
+      frame_count += PlayCachedStream(video->cached_fd, presenter,
+                                      one_video_forever, &segment);
+      CloseVideo(video);
+      continue;
+    }
 
-      /*
-       * Prepare frame to hold the scaled target frame to be send to matrix.
-       */
-      int display_width = codec_context->width;
-      int display_height = codec_context->height;
-      if (maintain_aspect_ratio) {
-        display_width = codec_context->width;
-        display_height = codec_context->height;
-        // Make display fit within canvas.
-        ScaleToFitKeepAscpet(matrix->width(), matrix->height(),
-                             &display_width, &display_height);
-      } else {
-        display_width = matrix->width();
-        display_height = matrix->height();
-      }
-      // Letterbox or pillarbox black bars.
-      const int display_offset_x = (matrix->width() - display_width)/2;
-      const int display_offset_y = (matrix->height() - display_height)/2;
-
-      // The output_frame_ will receive the scaled result.
-      AVFrame *output_frame = av_frame_alloc();
-      if (av_image_alloc(output_frame->data, output_frame->linesize,
-                         display_width, display_height, AV_PIX_FMT_RGB24,
-                         64) < 0) {
+    AVCodecContext *const codec_context = video->codec_context;
+    AVStream *const stream = video->stream;
+    AVFrame *const decode_frame = video->frame;
+    const long frame_wait_nanos = video->frame_wait_nanos;
+    const int display_width = video->display_width;
+    const int display_height = video->display_height;
+    // Letterbox or pillarbox black bars.
+    const int display_offset_x = (matrix->width() - display_width)/2;
+    const int display_offset_y = (matrix->height() - display_height)/2;
+
+    // The scaled_frame will receive the scaled result.
+    const AVPixelFormat format = ScaledPixelFormat(codec_context->pix_fmt);
+    if (display_width != scaled_width || display_height != scaled_height
+        || format != scaled_format) {
+      av_freep(&scaled_frame->data[0]);
+      if (av_image_alloc(scaled_frame->data, scaled_frame->linesize,
+                         display_width, display_height, format, 64) < 0) {
         return -1;
       }
+      scaled_width = display_width;
+      scaled_height = display_height;
+      scaled_format = format;
+    }
 
-      if (verbose) {
-        fprintf(stderr, "Scaling %dx%d -> %dx%d; black border x:%d y:%d\n",
-                codec_context->width, codec_context->height,
-                display_width, display_height,
-                display_offset_x, display_offset_y);
-      }
+    if (verbose) {
+      fprintf(stderr, "Scaling %dx%d (decoded at 1/%d) -> %dx%d; "
+              "black border x:%d y:%d\n",
+              codec_context->width, codec_context->height,
+              1 << codec_context->lowres,
+              display_width, display_height,
+              display_offset_x, display_offset_y);
+    }
 
-      // initialize SWS context for software scaling
-      SwsContext *const sws_ctx = CreateSWSContext(
-        codec_context, display_width, display_height);
-      if (!sws_ctx) {
-        fprintf(stderr, "Trouble doing scaling to %dx%d :(\n",
-                matrix->width(), matrix->height());
-        return 1;
-      }
+    // initialize SWS context for software scaling
+    sws_ctx = CreateSWSContext(sws_ctx, codec_context,
+                               display_width, display_height, scaled_format);
+    if (!sws_ctx) {
+      fprintf(stderr, "Trouble doing scaling to %dx%d :(\n",
+              matrix->width(), matrix->height());
+      return 1;
+    }
 
+    // While playing for the first time, fill the cache.
+    std::string cache_pending;
+    const int cache_fd = cache
+      ? cache->BeginEntry(video->cache_key, &cache_pending) : -1;
+    StreamIO *cache_io = NULL;
+    StreamWriter *cache_writer = NULL;
+    if (cache_fd >= 0) {
+      cache_io = new rgb_matrix::FileStreamIO(cache_fd);
+      cache_writer = new StreamWriter(cache_io, 3);
+    }
 
-      struct timespec next_frame;
+    bool first_round = true;
+    do {
+      if (!first_round) {
+        RewindVideo(video, frame_skip);
+      }
+      first_round = false;
+      int64_t frames_left = framecount_limit;
+      ++segment;
+      int64_t first_pts = AV_NOPTS_VALUE;
+      int64_t frame_time_us = 0;  // Presentation time within segment.
+      int64_t segment_frames = 0;
+      int skipped_in_row = 0;
+      bool cache_complete = true;  // Until frames are missing.
 
-      AVPacket *packet = av_packet_alloc();
-      AVFrame *decode_frame = av_frame_alloc();  // Decode video into this
-      do {
-        int64_t frames_left = framecount_limit;
-        unsigned int frames_to_skip = frame_skip;
-        if (one_video_forever) {
-          av_seek_frame(format_context, videoStream, 0, AVSEEK_FLAG_ANY);
-          avcodec_flush_buffers(codec_context);
+      for (;;) {
+        if (interrupt_received || frames_left <= 0) {
+          cache_complete = false;
+          break;
         }
-        clock_gettime(CLOCK_MONOTONIC, &next_frame);
-
-        int decode_in_flight = 0;
-        bool state_reading = true;
+        if (!DecodeNextFrame(video)) {
+          cache_complete = !video->decode_error;
+          break;
+        }
+        const int64_t pts = decode_frame->best_effort_timestamp;
+        if (pts != AV_NOPTS_VALUE && first_pts == AV_NOPTS_VALUE) {
+          first_pts = pts;
+        }
+        if (pts != AV_NOPTS_VALUE) {
+          const AVRational microseconds = { 1, 1000000 };
+          frame_time_us = av_rescale_q(pts - first_pts, stream->time_base,
+                                       microseconds);
+        } else if (segment_frames > 0) {
+          frame_time_us += frame_wait_nanos / 1000;
+        }
+        ++segment_frames;
 
-        while (!interrupt_received && frames_left > 0) {
-          if (state_reading &&
-              av_read_frame(format_context, packet) != 0) {
-            state_reading = false;  // ran out of packets from input
-          }
+        // Don't bother converting a frame that is too late already;
+        // unless it goes to the cache.
+        if (presenter && !cache_writer &&
+            skipped_in_row < kMaxSkippedInRow &&
+            presenter->IsLate(segment,
+                              frame_time_us + frame_wait_nanos / 1000)) {
+          presenter->CountDropped();
+          ++skipped_in_row;
+          frame_count++;
+          frames_left--;
+          continue;
+        }
+        skipped_in_row = 0;
 
-          if (!state_reading && decode_in_flight == 0)
-            break;  // Decoder fully drained.
+        FrameCanvas *canvas = offscreen_canvas;
+        if (presenter && (canvas = presenter->AcquireCanvas()) == NULL) {
+          cache_complete = false;
+          break;
+        }
 
-          // Is this a packet from the video stream?
-          if (state_reading && packet->stream_index != videoStream) {
-            av_packet_unref(packet);
-            continue;  // Not interested in that.
+        rgb_matrix::PixelFormat direct_format;
+        const bool is_direct = GetDirectPixelFormat(decode_frame,
+                                                    display_width,
+                                                    display_height,
+                                                    &direct_format);
+        if (!is_direct) {
+          // Scale the image; still in YUV for most videos, the canvas
+          // converts it to RGB while copying.
+          sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data,
+                    decode_frame->linesize, 0, codec_context->height,
+                    scaled_frame->data, scaled_frame->linesize);
+        }
+        const rgb_matrix::ImageView image = is_direct
+          ? rgb_matrix::ImageView(direct_format, decode_frame->data,
+                                  decode_frame->linesize,
+                                  display_width, display_height)
+          : rgb_matrix::ImageView(scaled_format == AV_PIX_FMT_RGB24
+                                  ? rgb_matrix::PIXEL_RGB24
+                                  : rgb_matrix::PIXEL_YUV444P,
+                                  scaled_frame->data,
+                                  scaled_frame->linesize,
+                                  display_width, display_height);
+        if (!portable_stream) {
+          rgb_matrix::SetImage(canvas,
+                               display_offset_x, display_offset_y, image);
+        }
+        frame_count++;
+        frames_left--;
+        if (stream_writer) {
+          if (verbose) fprintf(stderr, "%6ld", frame_count);
+          const uint32_t hold_time_us = frame_wait_nanos / 1000;
+          const bool written = portable_stream
+            ? stream_writer->Stream(image, hold_time_us)
+            : stream_writer->Stream(*canvas, hold_time_us);
+          if (!written && !write_error_reported) {
+            fprintf(stderr, "Can't write frame %ld to stream.%s\n",
+                    frame_count, portable_stream
+                    ? " Portable streams need videos of the same size."
+                    : "");
+            write_error_reported = true;
           }
-
-          if (state_reading) {
-            // Decode video frame
-            if (avcodec_send_packet(codec_context, packet) == 0) {
-              ++decode_in_flight;
-            }
-            av_packet_unref(packet);
-          } else {
-            avcodec_send_packet(codec_context, nullptr); // Trigger decode drain
+        } else {
+          if (cache_writer
+              && !cache_writer->Stream(image, frame_wait_nanos / 1000)) {
+            cache_complete = false;
           }
+          presenter->Present(canvas, segment, frame_time_us,
+                             frame_wait_nanos / 1000);
+        }
+      }
 
-          while (decode_in_flight &&
-                 avcodec_receive_frame(codec_context, decode_frame) == 0) {
-            --decode_in_flight;
-
-            if (frames_to_skip) { frames_to_skip--; continue; }
-
-            // Determine absolute end of this frame now so that we don't include
-            // decoding overhead. TODO: skip frames if getting too slow ?
-            add_nanos(&next_frame, frame_wait_nanos);
-
-            // Convert the image from its native format to RGB
-            sws_scale(sws_ctx, (uint8_t const * const *)decode_frame->data,
-                      decode_frame->linesize, 0, codec_context->height,
-                      output_frame->data, output_frame->linesize);
-            CopyFrame(output_frame, offscreen_canvas,
-                      display_offset_x, display_offset_y,
-                      display_width, display_height);
-            frame_count++;
-            frames_left--;
-            if (stream_writer) {
-              if (verbose) fprintf(stderr, "%6ld", frame_count);
-              stream_writer->Stream(*offscreen_canvas, frame_wait_nanos/1000);
-            } else {
-              offscreen_canvas = matrix->SwapOnVSync(offscreen_canvas,
-                                                     vsync_multiple);
-            }
-            if (!stream_writer && !use_vsync_for_frame_timing) {
-              clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &next_frame, NULL);
-            }
+      if (cache_writer) {
+        delete cache_writer;  // Writes the index.
+        delete cache_io;
+        cache_writer = NULL;
+        if (!cache_complete) {
+          // Don't keep a partial video as if it was all of it.
+          cache->AbortEntry(cache_pending);
+        } else if (cache->CommitEntry(video->cache_key, cache_pending)
+                   && one_video_forever) {
+          // No need to decode again for the following rounds.
+          const int fd = cache->Open(video->cache_key);
+          if (fd >= 0) {
+            frame_count += PlayCachedStream(fd, presenter, true, &segment);
+            break;
           }
         }
-      } while (one_video_forever && !interrupt_received);
+      }
+    } while (one_video_forever && !interrupt_received);
 
-      av_packet_free(&packet);
+    CloseVideo(video);
+  }
+  if (opener) {
+    CloseVideo(opener->Get());
+    delete opener;
+  }
+  sws_freeContext(sws_ctx);
+  av_freep(&scaled_frame->data[0]);
+  av_frame_free(&scaled_frame);
 
-      av_frame_free(&output_frame);
-      av_frame_free(&decode_frame);
-      avcodec_close(codec_context);
-      avformat_close_input(&format_context);
+  if (presenter) {
+    if (interrupt_received) {
+      presenter->Stop();
+    } else {
+      presenter->Finish();
     }
-  } while (multiple_video_forever && !interrupt_received);
+  }
 
   if (interrupt_received) {
     // Feedback for Ctrl-C, but most importantly, force a newline
@@ -464,10 +1074,17 @@ int main(int argc, char *argv[]) {
     fprintf(stderr, "Got interrupt. Exiting\n");
   }
 
+  fprintf(stderr, "Total of %ld frames decoded\n", frame_count);
+  if (presenter) {
+    fprintf(stderr, "%ld frames shown, %ld dropped as they were late\n",
+            presenter->shown(), presenter->dropped());
+  }
+
+  delete presenter;
+  delete cache;
   delete matrix;
   delete stream_writer;
   delete stream_io;
-  fprintf(stderr, "Total of %ld frames decoded\n", frame_count);
 
   return 0;
 }